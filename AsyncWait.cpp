@@ -0,0 +1,54 @@
+/* ShadowDuplicator -- a simple VC++ Volume Shadow Copy requestor for backing up
+locked files
+
+Copyright (C) 2021-2023 Peter Upfold.
+
+Licensed under the Apache 2.0 Licence. See the LICENSE file in the project root for details.
+
+This code is **not** production quality. There is certainly plenty of potential for improvement of this code,
+but beyond that, it may even be insecure, destructive or cause you other serious problems. There
+is no warranty.
+*/
+
+#include "AsyncWait.h"
+#include <cstdio>
+
+/// <summary>
+/// Add the time a phase took.
+/// </summary>
+/// <param name="phase">The name of the phase</param>
+/// <param name="milliseconds">How long it took</param>
+void PhaseTimings::Record(const char* phase, double milliseconds)
+{
+    phases.push_back(t_phaseTiming{ phase, milliseconds });
+}
+
+/// <summary>
+/// The phases recorded so far.
+/// </summary>
+const std::vector<t_phaseTiming>& PhaseTimings::Phases(void) const
+{
+    return phases;
+}
+
+/// <summary>
+/// Print a line for each phase, with the time it took.
+/// </summary>
+/// <param name=""></param>
+void PhaseTimings::Print(void) const
+{
+    printf("Time taken by each phase:\n");
+    for (const t_phaseTiming& timing : phases) {
+        printf("    %-28s %10.0f ms\n", timing.phase.c_str(), timing.milliseconds);
+    }
+}
+
+/// <summary>
+/// The time elapsed since a point, for timing a phase.
+/// </summary>
+/// <param name="start">When the phase started</param>
+/// <returns>Milliseconds since start</returns>
+double PhaseTimings::MillisecondsSince(std::chrono::steady_clock::time_point start)
+{
+    return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
@@ -0,0 +1,113 @@
+/* ShadowDuplicator -- a simple VC++ Volume Shadow Copy requestor for backing up
+locked files
+
+Copyright (C) 2021-2023 Peter Upfold.
+
+Licensed under the Apache 2.0 Licence. See the LICENSE file in the project root for details.
+
+This code is **not** production quality. There is certainly plenty of potential for improvement of this code,
+but beyond that, it may even be insecure, destructive or cause you other serious problems. There
+is no warranty.
+*/
+#pragma once
+#include "Platform.h"
+#include <chrono>
+#include <string>
+#include <thread>
+#include <vector>
+
+#ifdef _WIN32
+#include <vss.h>
+#include <vsserror.h>
+#define ASYNC_E_TIMEOUT HRESULT_FROM_WIN32(ERROR_TIMEOUT)
+#else
+// the VSS async status codes, so that AwaitAsync can be driven by a stand-in for IVssAsync
+#define VSS_S_ASYNC_PENDING ((HRESULT)0x00042309L)
+#define VSS_S_ASYNC_FINISHED ((HRESULT)0x0004230AL)
+#define VSS_S_ASYNC_CANCELLED ((HRESULT)0x0004230BL)
+#define ASYNC_E_TIMEOUT ((HRESULT)0x800705B4L)
+#endif
+
+// Each Wait lasts at most this long, so that the spinner keeps turning while a phase is in progress
+#define ASYNC_WAIT_SLICE_MS 250
+
+// If Wait is not supported, the status is polled this often instead
+#define ASYNC_POLL_MS 50
+
+// A phase which has not completed after this long is cancelled
+#define ASYNC_DEFAULT_DEADLINE_MS (10 * 60 * 1000)
+
+// Called between waits while a phase is in progress, for progress display
+typedef void (*t_asyncWaitRoutine)(void* context);
+
+// How long one phase of the run took
+typedef struct phaseTiming {
+    std::string phase;
+    double milliseconds;
+} t_phaseTiming;
+
+/// <summary>
+/// The time taken by each phase of a run, in the order they finished. Used from the main thread only.
+/// </summary>
+class PhaseTimings {
+public:
+    void Record(const char* phase, double milliseconds);
+    const std::vector<t_phaseTiming>& Phases(void) const;
+    void Print(void) const;
+
+    static double MillisecondsSince(std::chrono::steady_clock::time_point start);
+
+private:
+    std::vector<t_phaseTiming> phases;
+};
+
+/// <summary>
+/// Block until an asynchronous operation completes, waking as soon as it does rather than at the next
+/// poll, and record how long it took. Works with IVssAsync or anything else with the same Wait,
+/// QueryStatus and Cancel methods.
+/// </summary>
+/// <param name="async">The operation</param>
+/// <param name="phase">The name of the phase, for the timings</param>
+/// <param name="timings">Optional. Receives the time the phase took.</param>
+/// <param name="deadlineMilliseconds">How long to wait before cancelling the operation</param>
+/// <param name="waitRoutine">Optional. Called between waits while the operation is still in progress.</param>
+/// <param name="context">Passed through to waitRoutine</param>
+/// <returns>S_OK once the operation has finished, VSS_S_ASYNC_CANCELLED if it was cancelled,
+/// ASYNC_E_TIMEOUT if the deadline passed, otherwise the failure of the operation or of QueryStatus</returns>
+template <typename T>
+HRESULT AwaitAsync(T* async, const char* phase, PhaseTimings* timings, DWORD deadlineMilliseconds, t_asyncWaitRoutine waitRoutine, void* context)
+{
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    HRESULT status = VSS_S_ASYNC_PENDING;
+    HRESULT result = S_OK;
+
+    for (;;) {
+        // Wait returns as soon as the operation completes. Should it fail, fall back to polling.
+        if (FAILED(async->Wait(ASYNC_WAIT_SLICE_MS))) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(ASYNC_POLL_MS));
+        }
+
+        result = async->QueryStatus(&status, nullptr);
+        if (FAILED(result) || status != VSS_S_ASYNC_PENDING) {
+            break;
+        }
+
+        if (PhaseTimings::MillisecondsSince(start) >= deadlineMilliseconds) {
+            async->Cancel();
+            result = ASYNC_E_TIMEOUT;
+            break;
+        }
+        if (waitRoutine != nullptr) {
+            waitRoutine(context);
+        }
+    }
+
+    if (timings != nullptr) {
+        timings->Record(phase, PhaseTimings::MillisecondsSince(start));
+    }
+
+    if (FAILED(result)) {
+        return result;
+    }
+    return (status == VSS_S_ASYNC_FINISHED) ? S_OK : status;
+}
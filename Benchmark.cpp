@@ -0,0 +1,1347 @@
+/* ShadowDuplicator -- a simple VC++ Volume Shadow Copy requestor for backing up
+locked files
+
+Copyright (C) 2021-2023 Peter Upfold.
+
+Licensed under the Apache 2.0 Licence. See the LICENSE file in the project root for details.
+
+This code is **not** production quality. There is certainly plenty of potential for improvement of this code,
+but beyond that, it may even be insecure, destructive or cause you other serious problems. There
+is no warranty.
+*/
+
+/*
+A benchmark of the copy engine on its own. Synthetic source trees are generated on local disk from a
+fixed seed, so that every run and every machine copies the same thing, and each is copied with the
+same TreeWalker, CopyWorkerPool and BlockCopyFile as a real backup, with a plain directory standing in
+for the snapshot. No VSS is involved, so it builds and runs wherever the platform layer does.
+*/
+
+#include "Benchmark.h"
+#include "BlockCopy.h"
+#include "ChangeFeed.h"
+#include "CopyEngine.h"
+#include "Manifest.h"
+#include "PathFilter.h"
+#include "PathTable.h"
+#include "TreeWalker.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+
+// the generators write through one buffer of this size
+#define BENCH_WRITE_BUFFER_SIZE (1024 * 1024)
+
+// the filter comparison checks each pattern in turn against at most this many of its paths, as that is so much slower
+#define BENCH_FILTER_REFERENCE_PATHS 100000
+
+static const t_benchCorpus corpora[] = {
+    { "tiny", "many files of up to 4 KiB, 100 to a directory", &GenerateTinyFiles },
+    { "office", "a mixed tree of documents, spreadsheets and images from 1 KiB to 16 MiB", &GenerateOfficeTree },
+    { "vmdisk", "a few 8 GiB sparse virtual disks with scattered extents of data", &GenerateVmDisks },
+    { "deep", "long chains of nested directories with a few small files at each level", &GenerateDeepTree },
+    { "flat", "one directory of many empty files, as an application's cache or mail store can have", &GenerateFlatDirectory },
+};
+
+// words for the compressible half of the office corpus
+static const char* const words[] = {
+    "the", "quarterly", "report", "budget", "meeting", "minutes", "action", "invoice", "customer", "of",
+    "and", "total", "revenue", "forecast", "project", "schedule", "approved", "pending", "review", "a",
+    "department", "staff", "policy", "update", "summary", "figures", "to", "in", "for", "agreed",
+};
+
+// Everything the copy routines need while one corpus is copied
+typedef struct benchRun {
+    BufferPool* bufferPool;
+    t_blockCopyOptions options;
+    std::mutex lock;
+    std::vector<double> latencies;
+    std::atomic<unsigned long long> bytes;
+} t_benchRun;
+
+// Everything the walk routine needs while --changes checks a corpus against the manifest of a previous run
+typedef struct benchIncremental {
+    Manifest* previous;
+    Manifest* current;
+    std::atomic<unsigned long long> checked;
+    std::atomic<unsigned long long> changed;
+} t_benchIncremental;
+
+// The state of ListCorpus while it lists one directory
+typedef struct benchListing {
+    const std::wstring* directory;
+    std::vector<std::wstring> directories; // the subdirectories found, to be listed next
+    unsigned long long entries;
+} t_benchListing;
+
+/// <summary>
+/// Next value from a xorshift64* generator. The same seed always gives the same corpus.
+/// </summary>
+/// <param name="state">The generator state, which must not be zero</param>
+/// <returns>64 pseudo-random bits</returns>
+static unsigned long long NextRandom(unsigned long long* state)
+{
+    unsigned long long x = *state;
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    *state = x;
+    return x * 0x2545F4914F6CDD1DULL;
+}
+
+/// <summary>
+/// A pseudo-random number in the range low..high inclusive.
+/// </summary>
+static unsigned long long RandomBetween(unsigned long long* state, unsigned long long low, unsigned long long high)
+{
+    return low + NextRandom(state) % (high - low + 1);
+}
+
+/// <summary>
+/// Scale a count of files or directories, keeping at least one.
+/// </summary>
+static unsigned long long Scaled(unsigned long long count, double scale)
+{
+    unsigned long long scaled = (unsigned long long)(count * scale + 0.5);
+    return scaled < 1 ? 1 : scaled;
+}
+
+/// <summary>
+/// Fill a buffer with incompressible bytes, like a photo or an archive.
+/// </summary>
+static void FillRandom(unsigned char* buffer, size_t length, unsigned long long* state)
+{
+    size_t i = 0;
+    for (; i + 8 <= length; i += 8) {
+        unsigned long long value = NextRandom(state);
+        memcpy(buffer + i, &value, 8);
+    }
+    for (; i < length; i++) {
+        buffer[i] = (unsigned char)NextRandom(state);
+    }
+}
+
+/// <summary>
+/// Fill a buffer with lines of words, which compress and deduplicate like ordinary documents.
+/// </summary>
+static void FillText(unsigned char* buffer, size_t length, unsigned long long* state)
+{
+    size_t i = 0;
+    while (i < length) {
+        unsigned long long value = NextRandom(state);
+        const char* word = words[value % (sizeof(words) / sizeof(words[0]))];
+        for (; *word != '\0' && i < length; word++) {
+            buffer[i++] = (unsigned char)*word;
+        }
+        if (i < length) {
+            buffer[i++] = (value >> 32) % 12 == 0 ? '\n' : ' ';
+        }
+    }
+}
+
+/// <summary>
+/// Write a file of generated content.
+/// </summary>
+/// <param name="path">The file to create</param>
+/// <param name="size">Its size in bytes</param>
+/// <param name="text">TRUE for compressible text, FALSE for random bytes</param>
+/// <param name="buffer">A buffer of BENCH_WRITE_BUFFER_SIZE bytes to generate the content in</param>
+/// <param name="state">The generator state</param>
+/// <returns>0 on success, or the platform error code upon failure</returns>
+static DWORD WriteGeneratedFile(const std::wstring& path, unsigned long long size, BOOL text, unsigned char* buffer, unsigned long long* state)
+{
+    t_fileHandle handle = INVALID_FILE_HANDLE;
+    DWORD error = PlatformOpenForWrite(path, FALSE, TRUE, &handle);
+    if (error) {
+        return error;
+    }
+
+    for (unsigned long long offset = 0; offset < size && !error; offset += BENCH_WRITE_BUFFER_SIZE) {
+        DWORD length = (DWORD)std::min<unsigned long long>(BENCH_WRITE_BUFFER_SIZE, size - offset);
+        if (text) {
+            FillText(buffer, length, state);
+        }
+        else {
+            FillRandom(buffer, length, state);
+        }
+        error = PlatformWriteAt(handle, offset, buffer, length);
+    }
+
+    PlatformCloseFile(handle);
+    return error;
+}
+
+/// <summary>
+/// Name a generated file or directory from a prefix and a number.
+/// </summary>
+static std::wstring NumberedName(const wchar_t* prefix, unsigned long long number, const wchar_t* extension)
+{
+    wchar_t name[64];
+    swprintf(name, sizeof(name) / sizeof(name[0]), L"%ls%05llu%ls", prefix, number, extension);
+    return name;
+}
+
+/// <summary>
+/// Many tiny files -- the per-file cost of opening, creating and setting metadata dominates.
+/// </summary>
+/// <param name="root">The empty directory to build the corpus in</param>
+/// <param name="scale">Multiplies the number of files, 10000 at scale 1</param>
+/// <returns>0 on success, or the platform error code upon failure</returns>
+DWORD GenerateTinyFiles(const std::wstring& root, double scale)
+{
+    std::vector<unsigned char> buffer(BENCH_WRITE_BUFFER_SIZE);
+    unsigned long long state = 0x74696E79ULL;
+    unsigned long long fileCount = Scaled(10000, scale);
+    std::wstring directory;
+    DWORD error = ERROR_SUCCESS;
+
+    for (unsigned long long i = 0; i < fileCount && !error; i++) {
+        if (i % 100 == 0) {
+            directory = PlatformJoinPath(root, NumberedName(L"dir", i / 100, L""));
+            error = PlatformCreateDirectory(directory);
+            if (error) {
+                break;
+            }
+        }
+        error = WriteGeneratedFile(PlatformJoinPath(directory, NumberedName(L"file", i, L".dat")), RandomBetween(&state, 0, 4096), i % 2 == 0, buffer.data(), &state);
+    }
+    return error;
+}
+
+/// <summary>
+/// A mixed office file share -- mostly small documents, some larger spreadsheets and a few big images
+/// and archives, spread over three levels of folders.
+/// </summary>
+/// <param name="root">The empty directory to build the corpus in</param>
+/// <param name="scale">Multiplies the number of files, 1000 at scale 1</param>
+/// <returns>0 on success, or the platform error code upon failure</returns>
+DWORD GenerateOfficeTree(const std::wstring& root, double scale)
+{
+    static const wchar_t* const textExtensions[] = { L".docx", L".xlsx", L".txt", L".csv" };
+    static const wchar_t* const binaryExtensions[] = { L".jpg", L".pdf", L".zip", L".png" };
+    std::vector<unsigned char> buffer(BENCH_WRITE_BUFFER_SIZE);
+    unsigned long long state = 0x6F6666696365ULL;
+    unsigned long long fileCount = Scaled(1000, scale);
+    std::vector<std::wstring> directories;
+    DWORD error = ERROR_SUCCESS;
+
+    // 6 departments of 5 projects of 4 years -- files go at every level
+    for (unsigned int department = 0; department < 6 && !error; department++) {
+        std::wstring departmentDirectory = PlatformJoinPath(root, NumberedName(L"department", department, L""));
+        error = PlatformCreateDirectory(departmentDirectory);
+        directories.push_back(departmentDirectory);
+        for (unsigned int project = 0; project < 5 && !error; project++) {
+            std::wstring projectDirectory = PlatformJoinPath(departmentDirectory, NumberedName(L"project", project, L""));
+            error = PlatformCreateDirectory(projectDirectory);
+            directories.push_back(projectDirectory);
+            for (unsigned int year = 0; year < 4 && !error; year++) {
+                std::wstring yearDirectory = PlatformJoinPath(projectDirectory, NumberedName(L"year", 2019 + year, L""));
+                error = PlatformCreateDirectory(yearDirectory);
+                directories.push_back(yearDirectory);
+            }
+        }
+    }
+
+    for (unsigned long long i = 0; i < fileCount && !error; i++) {
+        unsigned long long bucket = RandomBetween(&state, 0, 99);
+        unsigned long long size;
+        if (bucket < 70) {
+            size = RandomBetween(&state, 1024, 64 * 1024);
+        }
+        else if (bucket < 95) {
+            size = RandomBetween(&state, 64 * 1024, 1024 * 1024);
+        }
+        else {
+            size = RandomBetween(&state, 1024 * 1024, 16 * 1024 * 1024);
+        }
+
+        BOOL text = RandomBetween(&state, 0, 9) < 6;
+        const wchar_t* extension = text ? textExtensions[i % 4] : binaryExtensions[i % 4];
+        const std::wstring& directory = directories[NextRandom(&state) % directories.size()];
+        error = WriteGeneratedFile(PlatformJoinPath(directory, NumberedName(L"document", i, extension)), size, text, buffer.data(), &state);
+    }
+    return error;
+}
+
+/// <summary>
+/// A few virtual machine disks -- large sparse files in which a boot area, scattered extents and a
+/// footer hold data and everything else is holes.
+/// </summary>
+/// <param name="root">The empty directory to build the corpus in</param>
+/// <param name="scale">Multiplies the number of disks, 4 at scale 1</param>
+/// <returns>0 on success, or the platform error code upon failure. Fails on a file system without sparse files,
+/// rather than writing gigabytes of zeros.</returns>
+DWORD GenerateVmDisks(const std::wstring& root, double scale)
+{
+    const unsigned long long extentSize = 1024 * 1024;
+    std::vector<unsigned char> buffer(BENCH_WRITE_BUFFER_SIZE);
+    unsigned long long state = 0x766D6469736BULL;
+    unsigned long long diskCount = Scaled(4, scale);
+    DWORD error = ERROR_SUCCESS;
+
+    for (unsigned long long i = 0; i < diskCount && !error; i++) {
+        t_fileHandle handle = INVALID_FILE_HANDLE;
+        error = PlatformOpenForWrite(PlatformJoinPath(root, NumberedName(L"disk", i, L".vhdx")), FALSE, TRUE, &handle);
+        if (error) {
+            break;
+        }
+
+        error = PlatformSetSparse(handle);
+        if (!error) {
+            error = PlatformSetFileSize(handle, BENCH_VM_DISK_SIZE);
+        }
+
+        // 4 MiB of boot area, 60 extents anywhere and the footer
+        for (unsigned long long offset = 0; offset < 4 * extentSize && !error; offset += extentSize) {
+            FillRandom(buffer.data(), (size_t)extentSize, &state);
+            error = PlatformWriteAt(handle, offset, buffer.data(), (DWORD)extentSize);
+        }
+        for (unsigned int extent = 0; extent < 60 && !error; extent++) {
+            FillRandom(buffer.data(), (size_t)extentSize, &state);
+            error = PlatformWriteAt(handle, RandomBetween(&state, 4, BENCH_VM_DISK_SIZE / extentSize - 2) * extentSize, buffer.data(), (DWORD)extentSize);
+        }
+        if (!error) {
+            FillRandom(buffer.data(), (size_t)extentSize, &state);
+            error = PlatformWriteAt(handle, BENCH_VM_DISK_SIZE - extentSize, buffer.data(), (DWORD)extentSize);
+        }
+
+        PlatformCloseFile(handle);
+    }
+    return error;
+}
+
+/// <summary>
+/// Long chains of nested directories, which give the tree walker little to share between its threads.
+/// </summary>
+/// <param name="root">The empty directory to build the corpus in</param>
+/// <param name="scale">Multiplies the number of chains, 8 at scale 1, each 40 directories deep</param>
+/// <returns>0 on success, or the platform error code upon failure</returns>
+DWORD GenerateDeepTree(const std::wstring& root, double scale)
+{
+    std::vector<unsigned char> buffer(BENCH_WRITE_BUFFER_SIZE);
+    unsigned long long state = 0x64656570ULL;
+    unsigned long long chainCount = Scaled(8, scale);
+    DWORD error = ERROR_SUCCESS;
+
+    for (unsigned long long chain = 0; chain < chainCount && !error; chain++) {
+        std::wstring directory = root;
+        wchar_t name[16];
+
+        // short names keep the deepest paths well inside MAX_PATH
+        for (unsigned int depth = 0; depth < 40 && !error; depth++) {
+            swprintf(name, sizeof(name) / sizeof(name[0]), depth == 0 ? L"c%llu" : L"d%02llu", depth == 0 ? chain : (unsigned long long)depth);
+            directory = PlatformJoinPath(directory, name);
+            error = PlatformCreateDirectory(directory);
+            for (unsigned int file = 0; file < 4 && !error; file++) {
+                swprintf(name, sizeof(name) / sizeof(name[0]), L"f%u.txt", file);
+                error = WriteGeneratedFile(PlatformJoinPath(directory, name), RandomBetween(&state, 512, 8192), TRUE, buffer.data(), &state);
+            }
+        }
+    }
+    return error;
+}
+
+/// <summary>
+/// Collects the entries of one directory for RemoveTree.
+/// </summary>
+static BOOL CollectEntryRoutine(const t_directoryEntry& entry, void* context)
+{
+    std::vector<std::pair<std::wstring, BOOL>>* entries = (std::vector<std::pair<std::wstring, BOOL>>*)context;
+    entries->emplace_back(entry.name, entry.isDirectory);
+    return TRUE;
+}
+
+/// <summary>
+/// Delete a directory and everything below it.
+/// </summary>
+/// <param name="directory">The directory. It is not an error for it not to exist.</param>
+/// <returns>0 on success, or the platform error code upon failure</returns>
+static DWORD RemoveTree(const std::wstring& directory)
+{
+    std::vector<std::pair<std::wstring, BOOL>> entries;
+
+    if (!PlatformPathExists(directory)) {
+        return ERROR_SUCCESS;
+    }
+
+    DWORD error = PlatformEnumerateDirectory(directory, &CollectEntryRoutine, &entries);
+    for (size_t i = 0; i < entries.size() && !error; i++) {
+        std::wstring path = PlatformJoinPath(directory, entries[i].first);
+        error = entries[i].second ? RemoveTree(path) : PlatformDeletePath(path, FALSE);
+    }
+    if (!error) {
+        error = PlatformDeletePath(directory, TRUE);
+    }
+    return error;
+}
+
+/// <summary>
+/// One huge directory -- listing it costs more than copying its empty files.
+/// </summary>
+/// <param name="root">The empty directory to build the corpus in</param>
+/// <param name="scale">Multiplies the number of files, 100000 at scale 1</param>
+/// <returns>0 on success, or the platform error code upon failure</returns>
+DWORD GenerateFlatDirectory(const std::wstring& root, double scale)
+{
+    unsigned long long fileCount = Scaled(100000, scale);
+    DWORD error = ERROR_SUCCESS;
+
+    for (unsigned long long i = 0; i < fileCount && !error; i++) {
+        t_fileHandle handle = INVALID_FILE_HANDLE;
+        error = PlatformOpenForWrite(PlatformJoinPath(root, NumberedName(L"message", i, L".eml")), FALSE, TRUE, &handle);
+        if (!error) {
+            PlatformCloseFile(handle);
+        }
+    }
+    return error;
+}
+
+/// <summary>
+/// The contents of the marker written beside a complete corpus, which identify how it was generated.
+/// </summary>
+static std::string CorpusMarker(double scale)
+{
+    char marker[64];
+    snprintf(marker, sizeof(marker), "version=%d scale=%.6f\n", BENCH_CORPUS_VERSION, scale);
+    return marker;
+}
+
+/// <summary>
+/// Whether a corpus was generated completely, by this version of the generators and at this scale.
+/// </summary>
+/// <param name="markerPath">The marker file beside the corpus</param>
+/// <param name="scale">The scale wanted</param>
+/// <returns>TRUE if the corpus can be used as it is</returns>
+static BOOL CorpusIsCurrent(const std::wstring& markerPath, double scale)
+{
+    t_fileHandle handle = INVALID_FILE_HANDLE;
+    t_fileInformation information{};
+    std::string expected = CorpusMarker(scale);
+    char marker[64]{};
+    DWORD bytesRead = 0;
+
+    if (PlatformOpenForRead(markerPath, FALSE, &handle)) {
+        return FALSE;
+    }
+    DWORD error = PlatformGetFileInformation(handle, &information);
+    if (!error && information.size == expected.size()) {
+        error = PlatformReadAt(handle, 0, marker, (DWORD)expected.size(), &bytesRead);
+    }
+    PlatformCloseFile(handle);
+
+    return !error && bytesRead == expected.size() && memcmp(marker, expected.data(), expected.size()) == 0;
+}
+
+/// <summary>
+/// Make sure a corpus exists below the working directory, generating it if it is missing, incomplete
+/// or was generated differently.
+/// </summary>
+/// <param name="corpus">The corpus</param>
+/// <param name="root">Where the corpus lives</param>
+/// <param name="scale">The scale wanted</param>
+/// <param name="regenerate">Generate the corpus again even if it is current</param>
+/// <returns>0 on success, or the platform error code upon failure</returns>
+static DWORD PrepareCorpus(const t_benchCorpus& corpus, const std::wstring& root, double scale, BOOL regenerate)
+{
+    std::wstring markerPath = root + BENCH_CORPUS_MARKER_EXTENSION;
+    t_fileHandle handle = INVALID_FILE_HANDLE;
+
+    if (!regenerate && CorpusIsCurrent(markerPath, scale)) {
+        return ERROR_SUCCESS;
+    }
+
+    printf("Generating the %s corpus -- %s...\n", corpus.name, corpus.description);
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+    // the marker goes first so that an interrupted generation is never mistaken for a complete one
+    PlatformDeletePath(markerPath, FALSE);
+    DWORD error = RemoveTree(root);
+    if (!error) {
+        error = PlatformCreateDirectory(root);
+    }
+    if (!error) {
+        error = corpus.generator(root, scale);
+    }
+    if (!error) {
+        std::string marker = CorpusMarker(scale);
+        error = PlatformOpenForWrite(markerPath, FALSE, TRUE, &handle);
+        if (!error) {
+            error = PlatformWriteAt(handle, 0, marker.data(), (DWORD)marker.size());
+            PlatformCloseFile(handle);
+        }
+    }
+
+    if (!error) {
+        printf("Generated in %.1f s.\n", std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+    }
+    return error;
+}
+
+/// <summary>
+/// Copy routine for the worker pool -- copy one file exactly as a backup would and time it.
+/// </summary>
+static DWORD BenchCopyRoutine(const t_copyJob& job, void* context)
+{
+    t_benchRun* run = (t_benchRun*)context;
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+    DWORD error = BlockCopyFile(job.source, job.destination, run->options, *run->bufferPool, nullptr, nullptr, nullptr);
+    if (!error) {
+        double milliseconds = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+        run->bytes += job.size;
+        std::lock_guard<std::mutex> lock(run->lock);
+        run->latencies.push_back(milliseconds);
+    }
+    return error;
+}
+
+/// <summary>
+/// Result routine for the worker pool -- report the files which could not be copied.
+/// </summary>
+static void BenchResultRoutine(const t_copyResult& result, void* context)
+{
+    (void)context;
+    if (result.error) {
+        printf("Failed to copy %s: error %lu\n", PlatformToUtf8(result.job->source).c_str(), (unsigned long)result.error);
+    }
+}
+
+/// <summary>
+/// Walk routine -- pass each file found straight to the worker pool.
+/// </summary>
+static BOOL BenchWalkFileRoutine(t_copyJob& job, const t_directoryEntry& entry, void* context)
+{
+    (void)entry;
+    return ((CopyWorkerPool*)context)->Submit(std::move(job));
+}
+
+/// <summary>
+/// The latency below which a fraction of the files were copied, by the nearest rank.
+/// </summary>
+/// <param name="sorted">Latencies in ascending order</param>
+/// <param name="fraction">0.5 for the median, 0.99 for the 99th percentile</param>
+static double Percentile(const std::vector<double>& sorted, double fraction)
+{
+    if (sorted.empty()) {
+        return 0;
+    }
+    size_t rank = (size_t)(fraction * sorted.size() + 0.999999);
+    return sorted[rank < 1 ? 0 : std::min(rank, sorted.size()) - 1];
+}
+
+/// <summary>
+/// Copy a corpus into an empty destination once, timing the whole copy from the start of the walk to the
+/// last file closed.
+/// </summary>
+/// <param name="source">The corpus</param>
+/// <param name="destination">The destination directory, which is removed and created again first</param>
+/// <param name="threads">Copy and walker threads</param>
+/// <param name="options">How each file is copied</param>
+/// <param name="bufferPool">Buffers for the copy</param>
+/// <param name="result">Receives the timings</param>
+/// <returns>0 on success, or the first error which stopped the walk</returns>
+static DWORD CopyCorpus(const std::wstring& source, const std::wstring& destination, unsigned int threads, const t_blockCopyOptions& options, BufferPool& bufferPool, t_benchResult* result)
+{
+    t_benchRun run;
+    run.bufferPool = &bufferPool;
+    run.options = options;
+    run.bytes = 0;
+
+    DWORD error = RemoveTree(destination);
+    if (!error) {
+        error = PlatformCreateDirectory(destination);
+    }
+    if (error) {
+        return error;
+    }
+
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    CopyWorkerPool copyPool(threads, &BenchCopyRoutine, &BenchResultRoutine, &run, FALSE);
+    TreeWalker walker(threads, &BenchWalkFileRoutine, &copyPool);
+    error = walker.Walk(source, destination);
+    if (error) {
+        copyPool.Cancel();
+    }
+    copyPool.Finish();
+    result->seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    std::sort(run.latencies.begin(), run.latencies.end());
+    result->files = copyPool.CopiedCount();
+    result->failed = copyPool.FailedCount();
+    result->bytes = run.bytes;
+    result->latencyP50 = Percentile(run.latencies, 0.50);
+    result->latencyP90 = Percentile(run.latencies, 0.90);
+    result->latencyP99 = Percentile(run.latencies, 0.99);
+    result->latencyMax = run.latencies.empty() ? 0 : run.latencies.back();
+    return error;
+}
+
+/// <summary>
+/// Print one row of results, either as a table row or as CSV.
+/// </summary>
+static void PrintResult(const char* corpus, const char* run, const t_benchResult& result, BOOL csv)
+{
+    double seconds = result.seconds > 0 ? result.seconds : 1e-9;
+    const char* format = csv ? "%s,%s,%llu,%llu,%.1f,%.3f,%.1f,%.1f,%.3f,%.3f,%.3f,%.3f\n"
+        : "%-8s %-6s %8llu %6llu %10.1f %9.3f %10.1f %8.1f %8.3f %8.3f %8.3f %9.3f\n";
+
+    printf(format, corpus, run, result.files, result.failed, result.bytes / 1e6, result.seconds,
+        result.files / seconds, result.bytes / 1e6 / seconds,
+        result.latencyP50, result.latencyP90, result.latencyP99, result.latencyMax);
+}
+
+/// <summary>
+/// Counts the entries of one directory for ListCorpus, keeping the names of just the subdirectories.
+/// </summary>
+static BOOL CountEntryRoutine(const t_directoryEntry& entry, void* context)
+{
+    t_benchListing* listing = (t_benchListing*)context;
+    listing->entries++;
+    if (entry.isDirectory) {
+        listing->directories.push_back(PlatformJoinPath(*listing->directory, entry.name));
+    }
+    return TRUE;
+}
+
+/// <summary>
+/// List a corpus once on one thread, timing only the enumeration of each directory -- no directories
+/// are created and no files are opened, as they would be by a copy.
+/// </summary>
+/// <param name="source">The corpus</param>
+/// <param name="entries">Receives the number of files and directories listed</param>
+/// <param name="seconds">Receives the time taken</param>
+/// <returns>0 on success, or the error of the first directory which could not be listed</returns>
+static DWORD ListCorpus(const std::wstring& source, unsigned long long* entries, double* seconds)
+{
+    t_benchListing listing;
+    std::vector<std::wstring> pending{ source };
+    DWORD error = ERROR_SUCCESS;
+
+    listing.entries = 0;
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    while (!pending.empty() && !error) {
+        std::wstring directory = std::move(pending.back());
+        pending.pop_back();
+        listing.directory = &directory;
+        listing.directories.clear();
+        error = PlatformEnumerateDirectory(directory, &CountEntryRoutine, &listing);
+        pending.insert(pending.end(), listing.directories.begin(), listing.directories.end());
+    }
+    *seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    *entries = listing.entries;
+    return error;
+}
+
+/// <summary>
+/// Walk routine for --changes -- check each file against the previous manifest as an incremental run does,
+/// counting those it would copy, and record it in this run's manifest. Nothing is copied.
+/// </summary>
+static BOOL BenchIncrementalRoutine(t_copyJob& job, const t_directoryEntry& entry, void* context)
+{
+    t_benchIncremental* incremental = (t_benchIncremental*)context;
+    t_manifestEntry manifestEntry{ job.size, job.lastWriteTime, job.attributes, FALSE, 0 };
+
+    (void)entry;
+    incremental->checked++;
+    if (!incremental->previous->Matches(job.relativePath, manifestEntry)) {
+        incremental->changed++;
+    }
+    incremental->current->Record(job.relativePath, manifestEntry);
+    return TRUE;
+}
+
+/// <summary>
+/// Carry-over routine for --changes -- keep the files the change set does not cover.
+/// </summary>
+static BOOL BenchKeepRoutine(const std::wstring& relativePath, void* context)
+{
+    return !((const ChangeSet*)context)->Covers(relativePath);
+}
+
+/// <summary>
+/// Make the manifest of a corpus look as it would had the corpus changed since -- some files with a different
+/// last write time, and one directory's files missing, as though it had been moved in -- and write a change
+/// log which says so, as a change feed would.
+/// </summary>
+/// <param name="source">The corpus</param>
+/// <param name="manifest">The manifest of a walk of the corpus, which is changed</param>
+/// <param name="count">How many files to change</param>
+/// <param name="logPath">The change log to write, from sequence number 1</param>
+/// <returns>0 on success, or the platform error code upon failure</returns>
+static DWORD WriteBenchChanges(const std::wstring& source, Manifest* manifest, unsigned long long count, const std::wstring& logPath)
+{
+    std::vector<std::pair<std::wstring, t_manifestEntry>> entries;
+    unsigned long long state = 0x5344434847ULL;
+    unsigned long long sequence = 1;
+    std::string log = "ShadowDuplicator change log 1\t1\t1\n";
+    char number[32];
+
+    manifest->Entries(&entries);
+    if (entries.empty()) {
+        return ERROR_SUCCESS;
+    }
+    std::sort(entries.begin(), entries.end(), [](const std::pair<std::wstring, t_manifestEntry>& a, const std::pair<std::wstring, t_manifestEntry>& b) { return a.first < b.first; });
+
+    for (unsigned long long changed = 0; changed < count && changed < entries.size(); changed++) {
+        std::pair<std::wstring, t_manifestEntry>& entry = entries[RandomBetween(&state, 0, entries.size() - 1)];
+        entry.second.lastWriteTime++;
+        manifest->Record(entry.first, entry.second);
+        snprintf(number, sizeof(number), "%llu", sequence++);
+        log += std::string(number) + "\tFM\t" + PlatformToUtf8(PlatformJoinPath(source, entry.first)) + "\n";
+    }
+
+    // the directory of one more file arrives as a whole, so it is walked with everything below it
+    const std::wstring& moved = entries[RandomBetween(&state, 0, entries.size() - 1)].first;
+    size_t separator = moved.find_last_of(PATH_SEPARATOR);
+    if (separator != std::wstring::npos) {
+        std::wstring directory = moved.substr(0, separator + 1);
+        for (const std::pair<std::wstring, t_manifestEntry>& entry : entries) {
+            if (entry.first.compare(0, directory.size(), directory) == 0) {
+                manifest->Remove(entry.first);
+            }
+        }
+        directory.pop_back();
+        snprintf(number, sizeof(number), "%llu", sequence++);
+        log += std::string(number) + "\tDN\t" + PlatformToUtf8(PlatformJoinPath(source, directory)) + "\n";
+    }
+
+    t_fileHandle file = INVALID_FILE_HANDLE;
+    DWORD error = PlatformOpenForWrite(logPath, FALSE, TRUE, &file);
+    if (error) {
+        return error;
+    }
+    error = PlatformWriteAt(file, 0, log.data(), (DWORD)log.size());
+    PlatformCloseFile(file);
+    return error;
+}
+
+/// <summary>
+/// Compare an incremental run which walks the whole of each corpus with one which reads a change feed and
+/// walks only what it names, carrying the rest of the previous manifest over. Both check every file they
+/// find against the previous manifest and copy nothing, so the difference is the walk alone.
+/// </summary>
+/// <param name="corpus">The name of the corpus</param>
+/// <param name="source">The corpus</param>
+/// <param name="iterations">How many times to time each walk</param>
+/// <param name="threads">Walker threads</param>
+/// <param name="count">How many files to change</param>
+/// <param name="keep">Keep the directories the walks created</param>
+/// <param name="csv">Print CSV instead of a table</param>
+/// <returns>0 on success, ERROR_INVALID_DATA if the two walks disagreed, or the first error which stopped a walk</returns>
+static DWORD BenchChanges(const char* corpus, const std::wstring& source, unsigned int iterations, unsigned int threads, unsigned long long count, BOOL keep, BOOL csv)
+{
+    std::wstring destination = source + BENCH_WALK_EXTENSION;
+    std::wstring logPath = source + BENCH_CHANGES_EXTENSION;
+    const char* format = csv ? "%s,%s,%s,%llu,%llu,%llu,%.4f\n" : "%-8s %-6s %-5s %10llu %8llu %10llu %10.4f\n";
+    std::vector<double> times[2];
+    unsigned long long counts[2][3] = {}; // files checked, changed and carried over by the last walk of each kind
+    Manifest previous;
+    size_t expectedCount = 0;
+    DWORD error = ERROR_SUCCESS;
+
+    // the previous run, walked in full, with the corpus then changed behind its back
+    {
+        Manifest empty;
+        t_benchIncremental baseline{ &empty, &previous, { 0 }, { 0 } };
+        error = PlatformCreateDirectory(destination);
+        if (!error) {
+            error = TreeWalker(threads, &BenchIncrementalRoutine, &baseline).Walk(source, destination);
+        }
+        if (!error) {
+            expectedCount = previous.Count();
+            error = WriteBenchChanges(source, &previous, count, logPath);
+        }
+        if (error) {
+            return error;
+        }
+    }
+
+    if (!csv) {
+        printf("%-8s %-6s %-5s %10s %8s %10s %10s\n", "corpus", "run", "walk", "checked", "changed", "carried", "seconds");
+    }
+    for (unsigned int iteration = 1; iteration <= iterations && !error; iteration++) {
+        unsigned long long changed[2] = { 0, 0 };
+        char run[16];
+        snprintf(run, sizeof(run), "%u", iteration);
+
+        for (int feed = 0; feed < 2 && !error; feed++) {
+            Manifest current;
+            t_benchIncremental incremental{ &previous, &current, { 0 }, { 0 } };
+            TreeWalker walker(threads, &BenchIncrementalRoutine, &incremental);
+            size_t carried = 0;
+
+            std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+            if (!feed) {
+                error = walker.Walk(source, destination);
+            }
+            else {
+                ChangeFeed changeFeed;
+                ChangeSet changes(source);
+                error = changeFeed.OpenLog(logPath);
+                if (!error) {
+                    error = changeFeed.Read(t_changePosition{ 1, 1 }, std::wstring(), &changes);
+                }
+                if (!error) {
+                    changes.Finish();
+                    carried = current.CarryOver(previous, &BenchKeepRoutine, &changes);
+                    error = walker.WalkChanges(source, destination, changes.Directories(), changes.Trees());
+                }
+            }
+            double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+            if (error) {
+                break;
+            }
+
+            changed[feed] = incremental.changed;
+            counts[feed][0] = incremental.checked;
+            counts[feed][1] = incremental.changed;
+            counts[feed][2] = carried;
+            times[feed].push_back(seconds);
+            printf(format, corpus, run, feed ? "feed" : "full", incremental.checked.load(), incremental.changed.load(), (unsigned long long)carried, seconds);
+            if (current.Count() != expectedCount) {
+                printf("The %s walk of the %s corpus left %zu files in the manifest instead of %zu.\n", feed ? "feed" : "full", corpus, current.Count(), expectedCount);
+                error = ERROR_INVALID_DATA;
+            }
+        }
+        if (!error && changed[0] != changed[1]) {
+            printf("The full walk of the %s corpus found %llu changed files but the change feed %llu.\n", corpus, changed[0], changed[1]);
+            error = ERROR_INVALID_DATA;
+        }
+    }
+
+    if (!error && iterations > 1) {
+        for (int feed = 0; feed < 2; feed++) {
+            std::sort(times[feed].begin(), times[feed].end());
+            printf(format, corpus, "median", feed ? "feed" : "full", counts[feed][0], counts[feed][1], counts[feed][2], times[feed][times[feed].size() / 2]);
+        }
+    }
+    if (!keep) {
+        RemoveTree(destination);
+    }
+    return error;
+}
+
+/// <summary>
+/// Write the path of one of the files of a long selected files list -- 200 files to a directory, with
+/// every tenth directory on a second volume.
+/// </summary>
+/// <param name="number">The number of the file</param>
+/// <param name="volume">Receives the volume of the file</param>
+/// <param name="path">Receives the full path of the file</param>
+static void BenchSourcePath(unsigned long long number, std::wstring* volume, std::wstring* path)
+{
+    wchar_t text[128];
+    unsigned long long directory = number / 200;
+
+    *volume = directory % 10 == 9 ? L"D:\\" : L"C:\\";
+    swprintf(text, sizeof(text) / sizeof(text[0]), L"%lsShares\\Finance\\Archive\\folder%05llu\\statement%08llu.pdf", volume->c_str(), directory, number);
+    *path = text;
+}
+
+/// <summary>
+/// Compare holding a long list of selected files in the path table with holding it as selected files
+/// mode once did -- three linked lists of volumes, full paths and paths without their volumes, with
+/// a node and a buffer allocated for every entry and MAX_PATH buffers for the first two.
+/// </summary>
+/// <param name="count">The number of paths</param>
+/// <param name="csv">Print the results as CSV</param>
+static void BenchPathTable(unsigned long long count, BOOL csv)
+{
+    typedef struct benchSourceList {
+        wchar_t* source;
+        struct benchSourceList* next;
+    } t_benchSourceList;
+
+    std::wstring volume;
+    std::wstring path;
+    unsigned long long checksum = 0;
+
+    // generating the paths costs the same whichever way they are held, so it is timed on its own to be taken away
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    for (unsigned long long number = 0; number < count; number++) {
+        BenchSourcePath(number, &volume, &path);
+        checksum += path.size();
+    }
+    double generateSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    // the linked lists
+    t_benchSourceList* heads[3] = { nullptr, nullptr, nullptr };
+    t_benchSourceList* tails[3] = { nullptr, nullptr, nullptr };
+    unsigned long long listBytes = 0;
+    start = std::chrono::steady_clock::now();
+    for (unsigned long long number = 0; number < count; number++) {
+        BenchSourcePath(number, &volume, &path);
+        const wchar_t* texts[3] = { volume.c_str(), path.c_str(), path.c_str() + volume.size() };
+        for (int list = 0; list < 3; list++) {
+            size_t characters = list < 2 ? BENCH_MAX_PATH : wcslen(texts[list]) + 1;
+            t_benchSourceList* node = (t_benchSourceList*)calloc(1, sizeof(t_benchSourceList));
+            node->source = (wchar_t*)malloc(characters * sizeof(wchar_t));
+            wcsncpy(node->source, texts[list], characters);
+            listBytes += sizeof(t_benchSourceList) + characters * sizeof(wchar_t);
+            if (tails[list] == nullptr) {
+                heads[list] = node;
+            }
+            else {
+                tails[list]->next = node;
+            }
+            tails[list] = node;
+        }
+    }
+    double listBuildSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count() - generateSeconds;
+
+    start = std::chrono::steady_clock::now();
+    unsigned long long listCharacters = 0;
+    for (t_benchSourceList* drive = heads[0], *tail = heads[2]; drive != nullptr && tail != nullptr; drive = drive->next, tail = tail->next) {
+        listCharacters += wcslen(drive->source) + wcslen(tail->source);
+    }
+    double listWalkSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    for (int list = 0; list < 3; list++) {
+        while (heads[list] != nullptr) {
+            t_benchSourceList* next = heads[list]->next;
+            free(heads[list]->source);
+            free(heads[list]);
+            heads[list] = next;
+        }
+    }
+
+    // the path table
+    PathTable table;
+    start = std::chrono::steady_clock::now();
+    for (unsigned long long number = 0; number < count; number++) {
+        BenchSourcePath(number, &volume, &path);
+        table.Add(volume, path);
+    }
+    double tableBuildSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count() - generateSeconds;
+
+    start = std::chrono::steady_clock::now();
+    unsigned long long tableCharacters = 0;
+    for (size_t index = 0; index < table.Count(); index++) {
+        tableCharacters += table.Volume(table.VolumeOf(index)).size() + wcslen(table.Tail(index));
+    }
+    double tableWalkSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    unsigned long long tableBytes = table.MemoryUsed();
+
+    if (listCharacters != tableCharacters || listCharacters != checksum) {
+        printf("The path table and the linked lists do not hold the same paths.\n");
+    }
+
+    const char* format = csv ? "%s,%llu,%.1f,%.1f,%.3f,%.3f\n" : "%-12s %10llu %10.1f %10.1f %10.3f %10.3f\n";
+    if (!csv) {
+        printf("%-12s %10s %10s %10s %10s %10s\n", "structure", "paths", "MB", "bytes/path", "build s", "walk s");
+    }
+    else {
+        printf("structure,paths,mb,bytes_per_path,build_seconds,walk_seconds\n");
+    }
+    printf(format, "linked-list", count, listBytes / 1e6, count ? (double)listBytes / count : 0.0, listBuildSeconds, listWalkSeconds);
+    printf(format, "path-table", count, tableBytes / 1e6, count ? (double)tableBytes / count : 0.0, tableBuildSeconds, tableWalkSeconds);
+}
+
+/// <summary>
+/// Compare matching paths against a few hundred Include and Exclude patterns compiled into one
+/// automaton with matching them one pattern at a time. The patterns are the sort a file share's
+/// exclusion list collects -- extensions, temporary files, cache directories and old archives.
+/// </summary>
+/// <param name="count">The number of paths</param>
+/// <param name="csv">Print the results as CSV</param>
+static void BenchPathFilter(unsigned long long count, BOOL csv)
+{
+    std::vector<std::wstring> includes{ L"*.pdf", L"*.docx", L"*.xlsx", L"Shares\\Finance\\**" };
+    std::vector<std::wstring> excludes;
+    wchar_t text[128];
+
+    for (const char* word : words) {
+        std::wstring name = PlatformFromUtf8(word);
+        excludes.push_back(L"*." + name);
+        excludes.push_back(L"~" + name + L"*.tmp");
+        excludes.push_back(name + L"_cache\\");
+        excludes.push_back(name + L"-*.log");
+        excludes.push_back(L"Shares\\**\\" + name + L"\\*.bak");
+    }
+    for (unsigned int number = 0; number < 150; number++) {
+        swprintf(text, sizeof(text) / sizeof(text[0]), L"*.x%03u", number);
+        excludes.push_back(text);
+    }
+
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    PathFilter filter;
+    DWORD error = filter.Compile(includes, excludes);
+    double compileSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    if (error) {
+        printf("The patterns could not be compiled (%u).\n", error);
+        return;
+    }
+
+    // paths of 2 to 7 names from the office words, with an extension from the patterns about a third of the time
+    std::vector<std::wstring> paths;
+    unsigned long long state = 0x5D0F11E5ULL;
+    paths.reserve((size_t)count);
+    for (unsigned long long number = 0; number < count; number++) {
+        std::wstring path = NextRandom(&state) % 4 == 0 ? L"Shares\\Finance" : L"Shares\\Office";
+        for (unsigned long long depth = RandomBetween(&state, 1, 5); depth > 0; depth--) {
+            path += L"\\" + PlatformFromUtf8(words[NextRandom(&state) % (sizeof(words) / sizeof(words[0]))]);
+        }
+        switch (NextRandom(&state) % 3) {
+        case 0:
+            swprintf(text, sizeof(text) / sizeof(text[0]), L"\\%s-%llu.x%03llu", PlatformFromUtf8(words[NextRandom(&state) % 30]).c_str(), number, NextRandom(&state) % 300);
+            break;
+        case 1:
+            swprintf(text, sizeof(text) / sizeof(text[0]), L"\\file%llu.%s", number, PlatformFromUtf8(words[NextRandom(&state) % 30]).c_str());
+            break;
+        default:
+            swprintf(text, sizeof(text) / sizeof(text[0]), L"\\document%llu.pdf", number);
+            break;
+        }
+        paths.push_back(path + text);
+    }
+
+    unsigned long long automatonKept = 0;
+    start = std::chrono::steady_clock::now();
+    for (const std::wstring& path : paths) {
+        automatonKept += filter.IncludeFile(path, 0, 0) ? 1 : 0;
+    }
+    double automatonSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    unsigned long long referencePaths = std::min(count, (unsigned long long)BENCH_FILTER_REFERENCE_PATHS);
+    unsigned long long disagreements = 0;
+    start = std::chrono::steady_clock::now();
+    for (unsigned long long index = 0; index < referencePaths; index++) {
+        disagreements += filter.MatchEachPattern(paths[index], FALSE) != filter.Match(paths[index], FALSE) ? 1 : 0;
+    }
+    double referenceSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    if (disagreements > 0) {
+        printf("The automaton and the patterns disagree about %llu paths.\n", disagreements);
+    }
+
+    if (!csv) {
+        printf("%zu patterns compiled to %zu states in %.1f ms. %llu of %llu paths are kept.\n", filter.PatternCount(), filter.StateCount(), compileSeconds * 1000, automatonKept, count);
+        printf("%-16s %10s %10s %14s\n", "matcher", "paths", "seconds", "paths/s");
+    }
+    else {
+        printf("matcher,paths,seconds,paths_per_second\n");
+    }
+    const char* format = csv ? "%s,%llu,%.3f,%.0f\n" : "%-16s %10llu %10.3f %14.0f\n";
+    printf(format, "automaton", count, automatonSeconds, automatonSeconds > 0 ? count / automatonSeconds : 0.0);
+    printf(format, "each-pattern", referencePaths, referenceSeconds, referenceSeconds > 0 ? referencePaths / referenceSeconds : 0.0);
+}
+
+/// <summary>
+/// Parse the arguments, then generate and copy each corpus asked for.
+/// </summary>
+/// <param name="arguments">The command line arguments, without the program name</param>
+/// <returns>One of the BENCH_EXIT_ codes</returns>
+int RunBenchmark(const std::vector<std::wstring>& arguments)
+{
+    std::wstring workDirectory;
+    std::vector<const t_benchCorpus*> selected;
+    double scale = 1.0;
+    unsigned int iterations = BENCH_DEFAULT_ITERATIONS;
+    unsigned int threads = DEFAULT_COPY_THREADS;
+    unsigned int blockSizeKiB = DEFAULT_BLOCK_SIZE_KIB;
+    unsigned int bufferMemoryMiB = DEFAULT_BUFFER_MEMORY_MIB;
+    t_blockCopyOptions options{};
+    t_throttleLimits throttleLimits{};
+    BOOL regenerate = FALSE;
+    BOOL keep = FALSE;
+    BOOL csv = FALSE;
+    BOOL enumerateOnly = FALSE;
+    unsigned long long pathTableCount = 0;
+    unsigned long long filterCount = 0;
+    unsigned long long changeCount = 0;
+    int exitCode = BENCH_EXIT_SUCCESS;
+
+    options.queueDepth = DEFAULT_QUEUE_DEPTH;
+    options.unbuffered = TRUE;
+    options.sparse = TRUE;
+
+    for (const std::wstring& argument : arguments) {
+        const wchar_t* value = argument.c_str() + argument.find(L'=') + 1;
+
+        if (argument == L"-h" || argument == L"--help" || argument == L"-?" || argument == L"--usage") {
+            benchUsage();
+            return BENCH_EXIT_SUCCESS;
+        }
+        else if (argument.compare(0, 7, L"--work=") == 0) {
+            workDirectory = value;
+        }
+        else if (argument.compare(0, 9, L"--corpus=") == 0) {
+            std::string names = PlatformToUtf8(value) + ",";
+            for (size_t start = 0, comma; (comma = names.find(',', start)) != std::string::npos; start = comma + 1) {
+                std::string name = names.substr(start, comma - start);
+                const t_benchCorpus* found = nullptr;
+                for (const t_benchCorpus& corpus : corpora) {
+                    if (name == corpus.name) {
+                        found = &corpus;
+                    }
+                }
+                if (found == nullptr) {
+                    printf("There is no corpus called \"%s\".\n", name.c_str());
+                    return BENCH_EXIT_INVALID_ARGS;
+                }
+                selected.push_back(found);
+            }
+        }
+        else if (argument.compare(0, 8, L"--scale=") == 0) {
+            scale = wcstod(value, nullptr);
+        }
+        else if (argument.compare(0, 13, L"--iterations=") == 0) {
+            iterations = (unsigned int)wcstoul(value, nullptr, 10);
+        }
+        else if (argument.compare(0, 10, L"--threads=") == 0) {
+            threads = (unsigned int)wcstoul(value, nullptr, 10);
+        }
+        else if (argument.compare(0, 13, L"--block-size=") == 0) {
+            blockSizeKiB = (unsigned int)wcstoul(value, nullptr, 10);
+        }
+        else if (argument.compare(0, 14, L"--queue-depth=") == 0) {
+            options.queueDepth = (unsigned int)wcstoul(value, nullptr, 10);
+        }
+        else if (argument.compare(0, 16, L"--buffer-memory=") == 0) {
+            bufferMemoryMiB = (unsigned int)wcstoul(value, nullptr, 10);
+        }
+        else if (argument.compare(0, 13, L"--read-limit=") == 0) {
+            throttleLimits.readMBps = wcstod(value, nullptr);
+        }
+        else if (argument.compare(0, 14, L"--write-limit=") == 0) {
+            throttleLimits.writeMBps = wcstod(value, nullptr);
+        }
+        else if (argument.compare(0, 12, L"--read-iops=") == 0) {
+            throttleLimits.readIops = wcstod(value, nullptr);
+        }
+        else if (argument.compare(0, 13, L"--write-iops=") == 0) {
+            throttleLimits.writeIops = wcstod(value, nullptr);
+        }
+        else if (argument == L"--buffered") {
+            options.unbuffered = FALSE;
+        }
+        else if (argument == L"--no-sparse") {
+            options.sparse = FALSE;
+        }
+        else if (argument == L"--regenerate") {
+            regenerate = TRUE;
+        }
+        else if (argument == L"--keep") {
+            keep = TRUE;
+        }
+        else if (argument == L"--csv") {
+            csv = TRUE;
+        }
+        else if (argument == L"--enumerate") {
+            enumerateOnly = TRUE;
+        }
+        else if (argument.compare(0, 13, L"--path-table=") == 0) {
+            pathTableCount = wcstoull(value, nullptr, 10);
+        }
+        else if (argument.compare(0, 9, L"--filter=") == 0) {
+            filterCount = wcstoull(value, nullptr, 10);
+        }
+        else if (argument.compare(0, 10, L"--changes=") == 0) {
+            changeCount = wcstoull(value, nullptr, 10);
+            if (changeCount == 0) {
+                printf("--changes must change at least 1 file.\n");
+                return BENCH_EXIT_INVALID_ARGS;
+            }
+        }
+        else {
+            printf("Unknown option %s\n", PlatformToUtf8(argument).c_str());
+            benchUsage();
+            return BENCH_EXIT_INVALID_ARGS;
+        }
+    }
+
+    if (pathTableCount > 0) {
+        BenchPathTable(pathTableCount, csv);
+        return BENCH_EXIT_SUCCESS;
+    }
+    if (filterCount > 0) {
+        BenchPathFilter(filterCount, csv);
+        return BENCH_EXIT_SUCCESS;
+    }
+    if (workDirectory.empty()) {
+        printf("A working directory must be given with --work=DIR.\n");
+        benchUsage();
+        return BENCH_EXIT_INVALID_ARGS;
+    }
+    if (!(scale > 0) || iterations < 1 || iterations > BENCH_MAX_ITERATIONS || threads < 1 || threads > MAX_COPY_THREADS
+        || blockSizeKiB < MIN_BLOCK_SIZE_KIB || blockSizeKiB > MAX_BLOCK_SIZE_KIB || options.queueDepth < 1 || options.queueDepth > MAX_QUEUE_DEPTH
+        || bufferMemoryMiB < 1) {
+        printf("An option is out of range. See --help for the limits.\n");
+        return BENCH_EXIT_INVALID_ARGS;
+    }
+    if (selected.empty()) {
+        for (const t_benchCorpus& corpus : corpora) {
+            selected.push_back(&corpus);
+        }
+    }
+
+    DWORD error = PlatformCreateDirectory(workDirectory);
+    if (error) {
+        printf("Unable to create the working directory: error %lu\n", (unsigned long)error);
+        return BENCH_EXIT_FAILED;
+    }
+
+    BufferPool bufferPool(blockSizeKiB * 1024, (unsigned long long)bufferMemoryMiB * 1024 * 1024);
+    IoThrottle throttle(throttleLimits, std::vector<t_throttleWindow>(), std::wstring());
+    if (ThrottleLimitsActive(throttleLimits)) {
+        options.throttle = &throttle;
+    }
+
+    if (csv && changeCount > 0) {
+        printf("corpus,run,walk,checked,changed,carried,seconds\n");
+    }
+    else if (csv) {
+        printf(enumerateOnly ? "corpus,run,entries,seconds,entries_per_second\n" : "corpus,run,files,failed,mb,seconds,files_per_second,mb_per_second,p50_ms,p90_ms,p99_ms,max_ms\n");
+    }
+    else if (changeCount > 0) {
+        printf("%u walker threads, %llu files changed and one directory moved in\n", threads, changeCount);
+    }
+    else if (!enumerateOnly) {
+        printf("%u threads, %u KiB blocks, queue depth %u, %s, %s, scale %g\n", threads, blockSizeKiB, options.queueDepth,
+            options.unbuffered ? "unbuffered" : "buffered", options.sparse ? "sparse" : "dense", scale);
+        if (options.throttle != nullptr) {
+            printf("Throttled to %s\n", ThrottleDescribeLimits(throttleLimits).c_str());
+        }
+    }
+
+    for (const t_benchCorpus* corpus : selected) {
+        std::wstring source = PlatformJoinPath(workDirectory, PlatformFromUtf8(corpus->name));
+        std::wstring destination = source + BENCH_COPY_EXTENSION;
+        std::vector<t_benchResult> results;
+
+        error = PrepareCorpus(*corpus, source, scale, regenerate);
+        if (error) {
+            printf("Unable to generate the %s corpus: error %lu\n", corpus->name, (unsigned long)error);
+            exitCode = BENCH_EXIT_FAILED;
+            continue;
+        }
+
+        if (changeCount > 0) {
+            error = BenchChanges(corpus->name, source, iterations, threads, changeCount, keep, csv);
+            if (error) {
+                printf("The change feed comparison of the %s corpus failed: error %lu\n", corpus->name, (unsigned long)error);
+                exitCode = BENCH_EXIT_FAILED;
+            }
+            continue;
+        }
+
+        if (enumerateOnly) {
+            std::vector<double> times;
+            unsigned long long entries = 0;
+            const char* format = csv ? "%s,%s,%llu,%.4f,%.0f\n" : "%-8s %-6s %10llu %10.4f %14.0f\n";
+            if (!csv) {
+                printf("%-8s %-6s %10s %10s %14s\n", "corpus", "run", "entries", "seconds", "entries/s");
+            }
+            for (unsigned int iteration = 1; iteration <= iterations; iteration++) {
+                double seconds = 0;
+                char run[16];
+                error = ListCorpus(source, &entries, &seconds);
+                if (error) {
+                    printf("Unable to list the %s corpus: error %lu\n", corpus->name, (unsigned long)error);
+                    exitCode = BENCH_EXIT_FAILED;
+                    break;
+                }
+                snprintf(run, sizeof(run), "%u", iteration);
+                printf(format, corpus->name, run, entries, seconds, seconds > 0 ? entries / seconds : 0.0);
+                times.push_back(seconds);
+            }
+            if (times.size() > 1) {
+                std::sort(times.begin(), times.end());
+                double median = times[times.size() / 2];
+                printf(format, corpus->name, "median", entries, median, median > 0 ? entries / median : 0.0);
+            }
+            continue;
+        }
+
+        if (!csv) {
+            printf("%-8s %-6s %8s %6s %10s %9s %10s %8s %8s %8s %8s %9s\n", "corpus", "run", "files", "failed", "MB", "seconds", "files/s", "MB/s", "p50 ms", "p90 ms", "p99 ms", "max ms");
+        }
+
+        for (unsigned int iteration = 1; iteration <= iterations; iteration++) {
+            t_benchResult result{};
+            char run[16];
+
+            error = CopyCorpus(source, destination, threads, options, bufferPool, &result);
+            if (error) {
+                printf("Unable to copy the %s corpus: error %lu\n", corpus->name, (unsigned long)error);
+                exitCode = BENCH_EXIT_FAILED;
+                break;
+            }
+            if (result.failed) {
+                exitCode = BENCH_EXIT_FAILED;
+            }
+            snprintf(run, sizeof(run), "%u", iteration);
+            PrintResult(corpus->name, run, result, csv);
+            results.push_back(result);
+        }
+
+        // the run which took the median time stands for the corpus, as the least disturbed by whatever else the machine was doing
+        if (results.size() > 1) {
+            std::sort(results.begin(), results.end(), [](const t_benchResult& a, const t_benchResult& b) { return a.seconds < b.seconds; });
+            PrintResult(corpus->name, "median", results[results.size() / 2], csv);
+        }
+
+        if (!keep) {
+            RemoveTree(destination);
+        }
+    }
+
+    return exitCode;
+}
+
+/// <summary>
+/// Print the benchmark's usage.
+/// </summary>
+void benchUsage(void)
+{
+    printf("ShadowDuplicatorBench -- Copyright (C) 2021-2023 Peter Upfold\n");
+    printf("Measures the copy engine against synthetic source trees, with a plain directory standing in for the snapshot.\n");
+    printf("\n");
+    printf("Usage: ShadowDuplicatorBench --work=DIR [OPTIONS]\n");
+    printf("\n");
+    printf("Corpora:\n");
+    for (const t_benchCorpus& corpus : corpora) {
+        printf("  %-8s %s\n", corpus.name, corpus.description);
+    }
+    printf("\n");
+    printf("Options:\n");
+    printf("--work=DIR                      Where the corpora are generated, kept between runs, and copied to\n");
+    printf("--corpus=NAME[,NAME...]         Copy only these corpora (default all)\n");
+    printf("--scale=F                       Multiply the number of files in each corpus by F (default 1)\n");
+    printf("--iterations=N                  Copy each corpus N times and report the median as well (default %d)\n", BENCH_DEFAULT_ITERATIONS);
+    printf("--regenerate                    Generate the corpora again even if they are already there\n");
+    printf("--keep                          Keep the last copy of each corpus, as CORPUS%ls\n", BENCH_COPY_EXTENSION);
+    printf("--csv                           Print the results as CSV\n");
+    printf("--enumerate                     Instead of copying, measure listing each corpus's directories, in entries per second\n");
+    printf("--path-table=N                  Instead of copying, measure holding a list of N selected files in the path table\n");
+    printf("--changes=N                     Instead of copying, compare walking each corpus in full with reading a change log of N changed files\n");
+    printf("--filter=N                      Instead of copying, measure matching N paths against a few hundred Include and Exclude patterns\n");
+    printf("--threads=N                     Copy N files at once (default %d, maximum %d)\n", DEFAULT_COPY_THREADS, MAX_COPY_THREADS);
+    printf("--block-size=KIB                Size of each copy block in KiB (default %d)\n", DEFAULT_BLOCK_SIZE_KIB);
+    printf("--queue-depth=N                 Keep N block reads in flight per file (default %d)\n", DEFAULT_QUEUE_DEPTH);
+    printf("--buffer-memory=MIB             Cap on memory for copy buffers across all threads (default %d)\n", DEFAULT_BUFFER_MEMORY_MIB);
+    printf("--read-limit=MB, --write-limit=MB  Throttle reads or writes to MB (10^6 bytes) per second\n");
+    printf("--read-iops=N, --write-iops=N   Throttle reads or writes to N operations per second\n");
+    printf("--buffered                      Copy through the system cache instead of bypassing it\n");
+    printf("--no-sparse                     Read holes and write zeros in full instead of leaving the destination sparse\n");
+}
+
+#ifdef _WIN32
+int wmain(int argc, WCHAR** argv)
+{
+    std::vector<std::wstring> arguments(argv + 1, argv + argc);
+    return RunBenchmark(arguments);
+}
+#else
+int main(int argc, char** argv)
+{
+    std::vector<std::wstring> arguments;
+    for (int i = 1; i < argc; i++) {
+        arguments.push_back(PlatformFromUtf8(argv[i]));
+    }
+    return RunBenchmark(arguments);
+}
+#endif
@@ -0,0 +1,68 @@
+/* ShadowDuplicator -- a simple VC++ Volume Shadow Copy requestor for backing up
+locked files
+
+Copyright (C) 2021-2023 Peter Upfold.
+
+Licensed under the Apache 2.0 Licence. See the LICENSE file in the project root for details.
+
+This code is **not** production quality. There is certainly plenty of potential for improvement of this code,
+but beyond that, it may even be insecure, destructive or cause you other serious problems. There
+is no warranty.
+*/
+#pragma once
+#include "Platform.h"
+#include <string>
+#include <vector>
+
+// bump this whenever a generator changes, so that corpora left behind by an older build are made again
+#define BENCH_CORPUS_VERSION 1
+// written next to each corpus once it is complete
+#define BENCH_CORPUS_MARKER_EXTENSION L".corpus"
+#define BENCH_COPY_EXTENSION L".copy"
+// where --changes walks each corpus to, and the change log it writes beside it
+#define BENCH_WALK_EXTENSION L".walk"
+#define BENCH_CHANGES_EXTENSION L".changes"
+
+// the fixed buffer size selected files mode once gave each source path, for the path table comparison
+#define BENCH_MAX_PATH 260
+
+#define BENCH_DEFAULT_ITERATIONS 3
+#define BENCH_MAX_ITERATIONS 1000
+
+// the logical size of each file in the vmdisk corpus, almost all of which is holes
+#define BENCH_VM_DISK_SIZE (8ULL * 1024 * 1024 * 1024)
+
+// exit codes
+#define BENCH_EXIT_SUCCESS 0
+#define BENCH_EXIT_INVALID_ARGS 1
+#define BENCH_EXIT_FAILED 2
+
+// Builds a corpus below root, which exists and is empty. Counts of files are multiplied by scale.
+typedef DWORD (*t_corpusGenerator)(const std::wstring& root, double scale);
+
+// One of the synthetic trees the copy engine is measured against
+typedef struct benchCorpus {
+    const char* name;
+    const char* description;
+    t_corpusGenerator generator;
+} t_benchCorpus;
+
+// The outcome of copying a corpus once. Latencies are of single files, in milliseconds.
+typedef struct benchResult {
+    unsigned long long files;
+    unsigned long long failed;
+    unsigned long long bytes;
+    double seconds;
+    double latencyP50;
+    double latencyP90;
+    double latencyP99;
+    double latencyMax;
+} t_benchResult;
+
+DWORD GenerateTinyFiles(const std::wstring& root, double scale);
+DWORD GenerateOfficeTree(const std::wstring& root, double scale);
+DWORD GenerateVmDisks(const std::wstring& root, double scale);
+DWORD GenerateDeepTree(const std::wstring& root, double scale);
+DWORD GenerateFlatDirectory(const std::wstring& root, double scale);
+int RunBenchmark(const std::vector<std::wstring>& arguments);
+void benchUsage(void);
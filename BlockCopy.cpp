@@ -0,0 +1,431 @@
+/* ShadowDuplicator -- a simple VC++ Volume Shadow Copy requestor for backing up
+locked files
+
+Copyright (C) 2021-2023 Peter Upfold.
+
+Licensed under the Apache 2.0 Licence. See the LICENSE file in the project root for details.
+
+This code is **not** production quality. There is certainly plenty of potential for improvement of this code,
+but beyond that, it may even be insecure, destructive or cause you other serious problems. There
+is no warranty.
+*/
+
+#include "BlockCopy.h"
+#include "Checksum.h"
+#include <cstring>
+
+#if defined(_M_X64) || defined(__SSE2__)
+#include <emmintrin.h>
+#define BLOCK_ZERO_SSE2
+#endif
+
+/// <summary>
+/// Round a length up to the unbuffered I/O alignment.
+/// </summary>
+static DWORD AlignUp(DWORD length)
+{
+    return (length + (PLATFORM_IO_ALIGNMENT - 1)) & ~(DWORD)(PLATFORM_IO_ALIGNMENT - 1);
+}
+
+/// <summary>
+/// Allocate the pool's buffers up front. If the cap is smaller than one buffer, one buffer is still allocated.
+/// </summary>
+/// <param name="bufferSize">The size of each buffer, a multiple of PLATFORM_IO_ALIGNMENT</param>
+/// <param name="memoryCap">The most memory, in bytes, to allocate across all buffers</param>
+BufferPool::BufferPool(DWORD bufferSize, unsigned long long memoryCap) : bufferSize(bufferSize)
+{
+    unsigned long long count = memoryCap / bufferSize;
+    if (count < 1) {
+        count = 1;
+    }
+
+    for (unsigned long long i = 0; i < count; i++) {
+        void* buffer = PlatformAlignedAlloc(bufferSize);
+        if (buffer == nullptr) {
+            break; // work with what we have -- BufferCount() tells the caller
+        }
+        allBuffers.push_back(buffer);
+    }
+    freeBuffers = allBuffers;
+}
+
+/// <summary>
+/// Free all of the buffers. None may still be in use.
+/// </summary>
+BufferPool::~BufferPool()
+{
+    for (void* buffer : allBuffers) {
+        PlatformAlignedFree(buffer);
+    }
+}
+
+/// <summary>
+/// Take a buffer, waiting until one is released if none are free.
+/// </summary>
+/// <param name=""></param>
+/// <returns>The buffer</returns>
+void* BufferPool::Acquire(void)
+{
+    std::unique_lock<std::mutex> guard(lock);
+    bufferAvailable.wait(guard, [this] { return !freeBuffers.empty(); });
+    void* buffer = freeBuffers.back();
+    freeBuffers.pop_back();
+    return buffer;
+}
+
+/// <summary>
+/// Take a buffer if one is free, without waiting.
+/// </summary>
+/// <param name=""></param>
+/// <returns>The buffer, or nullptr if none are free</returns>
+void* BufferPool::TryAcquire(void)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    if (freeBuffers.empty()) {
+        return nullptr;
+    }
+    void* buffer = freeBuffers.back();
+    freeBuffers.pop_back();
+    return buffer;
+}
+
+/// <summary>
+/// Give a buffer back to the pool.
+/// </summary>
+/// <param name="buffer">A buffer from Acquire or TryAcquire</param>
+void BufferPool::Release(void* buffer)
+{
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        freeBuffers.push_back(buffer);
+    }
+    bufferAvailable.notify_one();
+}
+
+/// <summary>
+/// The size of each buffer in bytes.
+/// </summary>
+DWORD BufferPool::BufferSize(void)
+{
+    return bufferSize;
+}
+
+/// <summary>
+/// The number of buffers which were allocated.
+/// </summary>
+size_t BufferPool::BufferCount(void)
+{
+    return allBuffers.size();
+}
+
+/// <summary>
+/// Whether every byte of a buffer is zero. Stops at the first 64 bytes which are not, so checking data
+/// which is not zero costs almost nothing.
+/// </summary>
+/// <param name="buffer">The data</param>
+/// <param name="length">The length of the data</param>
+/// <returns>TRUE if the buffer is all zeros</returns>
+BOOL BlockIsZero(const void* buffer, size_t length)
+{
+    const unsigned char* bytes = (const unsigned char*)buffer;
+    size_t position = 0;
+
+#ifdef BLOCK_ZERO_SSE2
+    const __m128i zero = _mm_setzero_si128();
+    for (; position + 64 <= length; position += 64) {
+        __m128i low = _mm_or_si128(_mm_loadu_si128((const __m128i*)(bytes + position)), _mm_loadu_si128((const __m128i*)(bytes + position + 16)));
+        __m128i high = _mm_or_si128(_mm_loadu_si128((const __m128i*)(bytes + position + 32)), _mm_loadu_si128((const __m128i*)(bytes + position + 48)));
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_or_si128(low, high), zero)) != 0xFFFF) {
+            return FALSE;
+        }
+    }
+#else
+    for (; position + sizeof(unsigned long long) <= length; position += sizeof(unsigned long long)) {
+        unsigned long long word;
+        memcpy(&word, bytes + position, sizeof(word));
+        if (word != 0) {
+            return FALSE;
+        }
+    }
+#endif
+    for (; position < length; position++) {
+        if (bytes[position] != 0) {
+            return FALSE;
+        }
+    }
+    return TRUE;
+}
+
+/// <summary>
+/// Whether a block of the source lies wholly within a hole. Blocks must be asked about in ascending order.
+/// </summary>
+/// <param name="ranges">The allocated ranges of the source</param>
+/// <param name="rangeIndex">The first range which may still overlap, advanced as blocks are asked about</param>
+/// <param name="offset">The start of the block</param>
+/// <param name="length">The length of the block</param>
+/// <returns>TRUE if no part of the block holds data</returns>
+static BOOL BlockInHole(const std::vector<t_fileRange>& ranges, size_t* rangeIndex, unsigned long long offset, unsigned long long length)
+{
+    while (*rangeIndex < ranges.size() && ranges[*rangeIndex].offset + ranges[*rangeIndex].length <= offset) {
+        (*rangeIndex)++;
+    }
+    return *rangeIndex == ranges.size() || ranges[*rangeIndex].offset >= offset + length;
+}
+
+/// <summary>
+/// Write part of a block. When writing unbuffered, a span which is not a whole number of sectors, which
+/// can only be the end of the file, is padded with zeros and the padding trimmed once the file is complete.
+/// </summary>
+/// <param name="destination">The destination file</param>
+/// <param name="options">Buffering</param>
+/// <param name="offset">Where the span belongs in the destination</param>
+/// <param name="buffer">The span, with room after it in the block buffer for the padding</param>
+/// <param name="length">The length of the span</param>
+/// <returns>0 on success, or the platform error code upon failure</returns>
+static DWORD WriteSpan(t_fileHandle destination, const t_blockCopyOptions& options, unsigned long long offset, void* buffer, DWORD length)
+{
+    if (options.unbuffered && length != AlignUp(length)) {
+        memset((char*)buffer + length, 0, AlignUp(length) - length);
+        length = AlignUp(length);
+    }
+    if (options.throttle != nullptr) {
+        options.throttle->Write(length);
+    }
+    return PlatformWriteAt(destination, offset, buffer, length);
+}
+
+/// <summary>
+/// Write a block to the destination. For a sparse copy, runs of zeros of SPARSE_RUN_SIZE or more are
+/// cleared with PlatformZeroRange instead of being written, once the destination has been marked sparse.
+/// If the destination cannot be sparse, the zeros are written after all.
+/// </summary>
+/// <param name="destination">The destination file</param>
+/// <param name="options">Buffering and sparseness</param>
+/// <param name="offset">Where the block belongs in the destination</param>
+/// <param name="buffer">The block</param>
+/// <param name="length">The length of the data in the block</param>
+/// <param name="hole">The block came from a hole in the source, so is known to be zeros</param>
+/// <param name="sparseState">Whether the destination is sparse, updated when it is first needed</param>
+/// <returns>0 on success, or the platform error code upon failure</returns>
+DWORD WriteBlock(t_fileHandle destination, const t_blockCopyOptions& options, unsigned long long offset, void* buffer, DWORD length, BOOL hole, t_sparseState* sparseState)
+{
+    char* bytes = (char*)buffer;
+    DWORD position = 0;
+
+    if (!options.sparse || *sparseState == SPARSE_UNAVAILABLE) {
+        return WriteSpan(destination, options, offset, buffer, length);
+    }
+
+    while (position < length) {
+        // the next span is as many runs as follow on which are all zero, or all not
+        DWORD end = length;
+        BOOL zero = TRUE;
+        if (!hole) {
+            end = position + ((length - position < SPARSE_RUN_SIZE) ? length - position : SPARSE_RUN_SIZE);
+            zero = BlockIsZero(bytes + position, end - position);
+            while (end < length) {
+                DWORD run = (length - end < SPARSE_RUN_SIZE) ? length - end : SPARSE_RUN_SIZE;
+                if (BlockIsZero(bytes + end, run) != zero) {
+                    break;
+                }
+                end += run;
+            }
+        }
+
+        if (zero && *sparseState == SPARSE_UNTRIED) {
+            *sparseState = PlatformSetSparse(destination) ? SPARSE_UNAVAILABLE : SPARSE_ACTIVE;
+        }
+        if (zero && *sparseState == SPARSE_ACTIVE) {
+            if (PlatformZeroRange(destination, offset + position, end - position) == ERROR_SUCCESS) {
+                position = end;
+                continue;
+            }
+            *sparseState = SPARSE_UNAVAILABLE;
+        }
+
+        DWORD error = WriteSpan(destination, options, offset + position, bytes + position, end - position);
+        if (error) {
+            return error;
+        }
+        position = end;
+    }
+    return ERROR_SUCCESS;
+}
+
+/// <summary>
+/// Move the content of an open source file to an open destination file, keeping up to queueDepth reads
+/// in flight while earlier blocks are written. For a sparse copy, blocks which are holes in the source
+/// are not read, and runs of zeros are left as holes in the destination instead of being written.
+/// </summary>
+/// <param name="source">The source, opened with PlatformOpenForRead</param>
+/// <param name="destination">The destination, opened with PlatformOpenForWrite</param>
+/// <param name="fileSize">The size of the source</param>
+/// <param name="options">Queue depth, buffering and sparseness</param>
+/// <param name="bufferPool">Where the block buffers come from</param>
+/// <param name="checksum">Optional. Receives the CRC32C of the data, computed as each block goes by.</param>
+/// <param name="blockRoutine">Optional. Sees each block in order before it is written, and may skip writing it or stop the copy.</param>
+/// <param name="blockContext">Passed through to blockRoutine</param>
+/// <param name="progressRoutine">Optional. Called after each block is written.</param>
+/// <param name="progressContext">Passed through to progressRoutine</param>
+/// <returns>0 on success, or the platform error code upon failure</returns>
+DWORD CopyBlocks(t_fileHandle source, t_fileHandle destination, unsigned long long fileSize, const t_blockCopyOptions& options, BufferPool& bufferPool, DWORD* checksum, t_blockRoutine blockRoutine, void* blockContext, t_blockCopyProgressRoutine progressRoutine, void* progressContext)
+{
+    if (checksum != nullptr) {
+        *checksum = 0;
+    }
+    return CopyBlocksFrom(source, destination, 0, fileSize, options, bufferPool, checksum, blockRoutine, blockContext, progressRoutine, progressContext);
+}
+
+/// <summary>
+/// As CopyBlocks, but starting part of the way through the file, with everything before startOffset
+/// already in the destination.
+/// </summary>
+/// <param name="source">The source, opened with PlatformOpenForRead</param>
+/// <param name="destination">The destination, opened with PlatformOpenForWrite</param>
+/// <param name="startOffset">Where to start, which must be a multiple of PLATFORM_IO_ALIGNMENT</param>
+/// <param name="fileSize">The size of the source</param>
+/// <param name="options">Queue depth, buffering and sparseness</param>
+/// <param name="bufferPool">Where the block buffers come from</param>
+/// <param name="checksum">Optional. Holds the CRC32C of the data before startOffset, and is carried on over the rest.</param>
+/// <param name="blockRoutine">Optional. Sees each block in order before it is written, and may skip writing it or stop the copy.</param>
+/// <param name="blockContext">Passed through to blockRoutine</param>
+/// <param name="progressRoutine">Optional. Called after each block is written, with the bytes done counting those before startOffset.</param>
+/// <param name="progressContext">Passed through to progressRoutine</param>
+/// <returns>0 on success, or the platform error code upon failure</returns>
+DWORD CopyBlocksFrom(t_fileHandle source, t_fileHandle destination, unsigned long long startOffset, unsigned long long fileSize, const t_blockCopyOptions& options, BufferPool& bufferPool, DWORD* checksum, t_blockRoutine blockRoutine, void* blockContext, t_blockCopyProgressRoutine progressRoutine, void* progressContext)
+{
+    PlatformAsyncReader reader(source, options.queueDepth);
+    DWORD blockSize = bufferPool.BufferSize();
+    unsigned long long readOffset = startOffset;
+    unsigned long long writtenBytes = startOffset;
+    std::vector<t_fileRange> allocatedRanges;
+    size_t rangeIndex = 0;
+    BOOL sourceHoles = FALSE;
+    t_sparseState sparseState = SPARSE_UNTRIED;
+    t_asyncRead read{};
+    DWORD error = ERROR_SUCCESS;
+
+    // a file system which cannot list the allocated ranges is treated as if the file has no holes
+    if (options.sparse && fileSize > blockSize) {
+        sourceHoles = PlatformQueryAllocatedRanges(source, fileSize, &allocatedRanges) == ERROR_SUCCESS;
+    }
+
+    while (writtenBytes < fileSize && !error) {
+        // keep the read queue full. We only wait for a buffer when we have no reads in flight, so a worker
+        // always holds at least one buffer it can finish with and the workers cannot deadlock on the pool.
+        while (readOffset < fileSize && reader.InFlight() < options.queueDepth) {
+            DWORD length = (DWORD)((fileSize - readOffset < blockSize) ? fileSize - readOffset : blockSize);
+            if (sourceHoles && BlockInHole(allocatedRanges, &rangeIndex, readOffset, length)) {
+                break; // not read -- it is handed on as zeros once the blocks before it are done
+            }
+
+            void* buffer = (reader.InFlight() == 0) ? bufferPool.Acquire() : bufferPool.TryAcquire();
+            if (buffer == nullptr) {
+                break;
+            }
+
+            if (options.unbuffered) {
+                length = AlignUp(length);
+            }
+            if (options.throttle != nullptr) {
+                options.throttle->Read(length);
+            }
+            reader.Issue(readOffset, buffer, length);
+            readOffset += blockSize;
+        }
+
+        DWORD expected = 0;
+        BOOL hole = FALSE;
+        if (reader.InFlight() == 0) {
+            // nothing was issued, so the next block is a hole
+            hole = TRUE;
+            expected = (DWORD)((fileSize - readOffset < blockSize) ? fileSize - readOffset : blockSize);
+            read.offset = readOffset;
+            read.buffer = bufferPool.Acquire();
+            read.length = expected;
+            read.bytesRead = expected;
+            read.error = ERROR_SUCCESS;
+            memset(read.buffer, 0, expected);
+            readOffset += blockSize;
+        }
+        else {
+            reader.Complete(&read);
+            expected = (DWORD)((fileSize - read.offset < blockSize) ? fileSize - read.offset : blockSize);
+        }
+
+        error = read.error;
+        if (!error && read.bytesRead < expected) {
+            error = ERROR_HANDLE_EOF; // the source is shorter than it was when we opened it
+        }
+
+        if (!error && checksum != nullptr) {
+            *checksum = hole ? ChecksumUpdateZeros(*checksum, expected) : ChecksumUpdate(*checksum, read.buffer, expected);
+        }
+
+        BOOL writeBlock = TRUE;
+        if (!error && blockRoutine != nullptr) {
+            error = blockRoutine(read.offset, read.buffer, expected, &writeBlock, blockContext);
+        }
+
+        if (!error && writeBlock) {
+            error = WriteBlock(destination, options, read.offset, read.buffer, expected, hole, &sparseState);
+        }
+        bufferPool.Release(read.buffer);
+
+        if (!error) {
+            writtenBytes += expected;
+            if (progressRoutine != nullptr) {
+                progressRoutine(fileSize, writtenBytes, progressContext);
+            }
+        }
+    }
+
+    // after a failure, wait for the reads still in flight and give their buffers back
+    while (reader.InFlight() > 0) {
+        reader.Complete(&read);
+        bufferPool.Release(read.buffer);
+    }
+
+    return error;
+}
+
+/// <summary>
+/// Copy a single file, overwriting the destination, with large aligned blocks and several reads in flight.
+/// The destination receives the source's times and attributes, as with CopyFileEx.
+/// </summary>
+/// <param name="sourcePathFile">The source path, with the snapshot device object already substituted in</param>
+/// <param name="destinationPathFile">The destination path</param>
+/// <param name="options">Queue depth, buffering and sparseness</param>
+/// <param name="bufferPool">Where the block buffers come from. Its buffer size is the block size.</param>
+/// <param name="checksum">Optional. Receives the CRC32C of the source data.</param>
+/// <param name="progressRoutine">Optional. Called after each block is written.</param>
+/// <param name="progressContext">Passed through to progressRoutine</param>
+/// <returns>0 on success, or the platform error code upon failure</returns>
+DWORD BlockCopyFile(const std::wstring& sourcePathFile, const std::wstring& destinationPathFile, const t_blockCopyOptions& options, BufferPool& bufferPool, DWORD* checksum, t_blockCopyProgressRoutine progressRoutine, void* progressContext)
+{
+    t_fileHandle source = INVALID_FILE_HANDLE;
+    t_fileHandle destination = INVALID_FILE_HANDLE;
+    t_fileInformation sourceInformation{};
+    DWORD error = ERROR_SUCCESS;
+
+    error = PlatformOpenForRead(sourcePathFile, options.unbuffered, &source);
+    if (!error) {
+        error = PlatformGetFileInformation(source, &sourceInformation);
+    }
+    if (!error) {
+        error = PlatformOpenForWrite(destinationPathFile, options.unbuffered, TRUE, &destination);
+    }
+    if (!error) {
+        error = CopyBlocks(source, destination, sourceInformation.size, options, bufferPool, checksum, nullptr, nullptr, progressRoutine, progressContext);
+    }
+    if (!error) {
+        error = PlatformSetFileSize(destination, sourceInformation.size);
+    }
+    if (!error) {
+        error = PlatformSetFileInformation(destination, sourceInformation);
+    }
+
+    PlatformCloseFile(destination);
+    PlatformCloseFile(source);
+    return error;
+}
@@ -0,0 +1,83 @@
+/* ShadowDuplicator -- a simple VC++ Volume Shadow Copy requestor for backing up
+locked files
+
+Copyright (C) 2021-2023 Peter Upfold.
+
+Licensed under the Apache 2.0 Licence. See the LICENSE file in the project root for details.
+
+This code is **not** production quality. There is certainly plenty of potential for improvement of this code,
+but beyond that, it may even be insecure, destructive or cause you other serious problems. There
+is no warranty.
+*/
+#pragma once
+#include "Platform.h"
+#include "Throttle.h"
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// block size, queue depth and buffer memory defaults and limits
+#define DEFAULT_BLOCK_SIZE_KIB 1024
+#define MIN_BLOCK_SIZE_KIB 64
+#define MAX_BLOCK_SIZE_KIB (64 * 1024)
+#define DEFAULT_QUEUE_DEPTH 4
+#define MAX_QUEUE_DEPTH 64
+#define DEFAULT_BUFFER_MEMORY_MIB 64
+
+// Zero runs within a block are found in steps of this size, which is the unit in which NTFS frees sparse space
+#define SPARSE_RUN_SIZE (64 * 1024)
+
+// How a file is copied by BlockCopyFile. The block size is the buffer size of the BufferPool.
+// With sparse set, holes in the source are not read and runs of zeros are not written. With a throttle,
+// each read and write waits for its turn under the throttle's limits.
+typedef struct blockCopyOptions {
+    unsigned int queueDepth;
+    BOOL unbuffered;
+    BOOL sparse;
+    IoThrottle* throttle;
+} t_blockCopyOptions;
+
+// Whether the destination of a sparse copy has been marked sparse yet
+typedef enum sparseState {
+    SPARSE_UNTRIED,
+    SPARSE_ACTIVE,
+    SPARSE_UNAVAILABLE
+} t_sparseState;
+
+// Receives progress while a file is copied. Called on the copying thread.
+typedef void (*t_blockCopyProgressRoutine)(unsigned long long totalBytes, unsigned long long transferredBytes, void* context);
+
+// Sees each block after it is read and before it is written, in file order. Set writeBlock to FALSE to
+// leave that part of the destination as it is. Returning an error stops the copy.
+typedef DWORD (*t_blockRoutine)(unsigned long long offset, const void* buffer, DWORD length, BOOL* writeBlock, void* context);
+
+/// <summary>
+/// A fixed number of aligned, reusable buffers of one size, shared by all of the copy workers so that
+/// the memory used for I/O is capped however many files are in flight.
+/// </summary>
+class BufferPool {
+public:
+    BufferPool(DWORD bufferSize, unsigned long long memoryCap);
+    ~BufferPool();
+
+    void* Acquire(void);
+    void* TryAcquire(void);
+    void Release(void* buffer);
+
+    DWORD BufferSize(void);
+    size_t BufferCount(void);
+
+private:
+    DWORD bufferSize;
+    std::vector<void*> allBuffers;
+    std::vector<void*> freeBuffers;
+    std::mutex lock;
+    std::condition_variable bufferAvailable;
+};
+
+BOOL BlockIsZero(const void* buffer, size_t length);
+DWORD WriteBlock(t_fileHandle destination, const t_blockCopyOptions& options, unsigned long long offset, void* buffer, DWORD length, BOOL hole, t_sparseState* sparseState);
+DWORD CopyBlocks(t_fileHandle source, t_fileHandle destination, unsigned long long fileSize, const t_blockCopyOptions& options, BufferPool& bufferPool, DWORD* checksum, t_blockRoutine blockRoutine, void* blockContext, t_blockCopyProgressRoutine progressRoutine, void* progressContext);
+DWORD CopyBlocksFrom(t_fileHandle source, t_fileHandle destination, unsigned long long startOffset, unsigned long long fileSize, const t_blockCopyOptions& options, BufferPool& bufferPool, DWORD* checksum, t_blockRoutine blockRoutine, void* blockContext, t_blockCopyProgressRoutine progressRoutine, void* progressContext);
+DWORD BlockCopyFile(const std::wstring& sourcePathFile, const std::wstring& destinationPathFile, const t_blockCopyOptions& options, BufferPool& bufferPool, DWORD* checksum, t_blockCopyProgressRoutine progressRoutine, void* progressContext);
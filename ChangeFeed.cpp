@@ -0,0 +1,596 @@
+/* ShadowDuplicator -- a simple VC++ Volume Shadow Copy requestor for backing up
+locked files
+
+Copyright (C) 2021-2023 Peter Upfold.
+
+Licensed under the Apache 2.0 Licence. See the LICENSE file in the project root for details.
+
+This code is **not** production quality. There is certainly plenty of potential for improvement of this code,
+but beyond that, it may even be insecure, destructive or cause you other serious problems. There
+is no warranty.
+*/
+
+#include "ChangeFeed.h"
+#include "Manifest.h"
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+/*
+A change log is UTF-8 text. The first line names the log, and each line after it is one change:
+
+    ShadowDuplicator change log 1 <TAB> log ID <TAB> first sequence number
+    sequence number <TAB> change <TAB> path
+
+The log ID is any number other than 0, and must be different whenever the log is started again. The
+first sequence number is that of the first change the log holds, or of the next to be written if it
+holds none, so that a log which drops its oldest changes can say so. Sequence numbers only grow. The
+change is F for a file or D for a directory, then M (modified), C (created), X (deleted), O (renamed,
+this being the old name) or N (renamed, this being the new name). Paths are in full, as the Source of
+a file set is given. A last line with no line ending is taken to be still being written, and is read
+next time.
+
+The position saved beside each manifest is a header line and one line of the feed ID, the next USN or
+sequence number and a CRC32C of the settings the run was made with.
+*/
+
+#define CHANGE_LOG_HEADER "ShadowDuplicator change log 1"
+#define CHANGE_POSITION_HEADER "ShadowDuplicator change position 1"
+
+// how much of a change log we read at a time
+#define CHANGE_LOG_IO_CHUNK (1024 * 1024)
+
+// A directory of the volume whose path has been looked up, while the USN journal is read
+typedef struct journalDirectory {
+    BOOL exists;
+    std::wstring path;
+} t_journalDirectory;
+
+// State for the journal record callback while the USN journal is read
+typedef struct journalReadState {
+    ChangeSet* changes;
+    t_fileHandle volumeHandle;
+    std::unordered_map<unsigned long long, t_journalDirectory> directories;
+    DWORD error;
+} t_journalReadState;
+
+/// <summary>
+/// Whether the start of a path names the same thing as a prefix, as the platform compares paths.
+/// </summary>
+static BOOL PathStartsWith(const std::wstring& path, const std::wstring& prefix)
+{
+    if (path.size() < prefix.size()) {
+        return FALSE;
+    }
+#ifdef _WIN32
+    return _wcsnicmp(path.c_str(), prefix.c_str(), prefix.size()) == 0;
+#else
+    return wcsncmp(path.c_str(), prefix.c_str(), prefix.size()) == 0;
+#endif
+}
+
+/// <summary>
+/// Start an empty change set.
+/// </summary>
+/// <param name="root">The source the changes are wanted for, named as the feed names paths -- relative to its
+/// volume for the USN journal, or in full for a change log</param>
+ChangeSet::ChangeSet(const std::wstring& root) : root(root), changeCount(0)
+{
+}
+
+/// <summary>
+/// Take in one change. The directory which holds the path is to be listed again, and if the path is a
+/// directory which arrived or departed, so is everything below it.
+/// </summary>
+/// <param name="path">The path which changed, named as the feed names paths</param>
+/// <param name="flags">CHANGE_ flags for what happened to it</param>
+/// <returns>TRUE if the path is in the source, FALSE if the change was ignored</returns>
+BOOL ChangeSet::Add(const std::wstring& path, DWORD flags)
+{
+    size_t skip = root.size();
+
+    if (!PathStartsWith(path, root)) {
+        return FALSE;
+    }
+    if (skip > 0 && root.back() != PATH_SEPARATOR && path.size() > skip) {
+        if (path[skip] != PATH_SEPARATOR) {
+            return FALSE; // a sibling whose name starts with the source's
+        }
+        skip++;
+    }
+
+    std::wstring relativePath = path.substr(skip);
+    while (!relativePath.empty() && relativePath.back() == PATH_SEPARATOR) {
+        relativePath.pop_back();
+    }
+    changeCount++;
+
+    BOOL moved = (flags & CHANGE_DIRECTORY) && (flags & (CHANGE_ARRIVED | CHANGE_DEPARTED));
+    if (relativePath.empty()) {
+        if (moved) {
+            treeSet.insert(relativePath); // the source itself came or went -- everything must be walked
+        }
+        return TRUE;
+    }
+
+    size_t separator = relativePath.find_last_of(PATH_SEPARATOR);
+    directorySet.insert(separator == std::wstring::npos ? std::wstring() : relativePath.substr(0, separator));
+    if (moved) {
+        treeSet.insert(relativePath);
+    }
+    return TRUE;
+}
+
+/// <summary>
+/// Settle which directories are listed and which trees are walked, once every change has been added.
+/// A directory or tree inside a tree which is walked anyway is left out.
+/// </summary>
+/// <param name=""></param>
+void ChangeSet::Finish(void)
+{
+    directories.clear();
+    trees.clear();
+    for (const std::wstring& tree : treeSet) {
+        if (!InTree(tree, FALSE)) {
+            trees.push_back(tree);
+        }
+    }
+    for (const std::wstring& directory : directorySet) {
+        if (!InTree(directory, TRUE)) {
+            directories.push_back(directory);
+        }
+    }
+    std::sort(trees.begin(), trees.end());
+    std::sort(directories.begin(), directories.end());
+}
+
+/// <summary>
+/// Whether the whole source must be walked, as the source directory itself arrived or departed.
+/// </summary>
+BOOL ChangeSet::Everything(void) const
+{
+    return treeSet.count(std::wstring()) > 0;
+}
+
+/// <summary>
+/// Whether a file of the last run is in a directory which is to be listed or walked again, and so will be
+/// found again, or not, by that. A file which is not covered is unchanged and can be carried over.
+/// </summary>
+/// <param name="relativePath">The path of the file relative to the source</param>
+/// <returns>TRUE if the file need not be carried over</returns>
+BOOL ChangeSet::Covers(const std::wstring& relativePath) const
+{
+    size_t separator = relativePath.find_last_of(PATH_SEPARATOR);
+    parent.assign(relativePath, 0, separator == std::wstring::npos ? 0 : separator);
+
+    auto found = coveredDirectories.find(parent);
+    if (found != coveredDirectories.end()) {
+        return found->second;
+    }
+
+    BOOL covered = directorySet.count(parent) > 0 || InTree(parent, TRUE);
+    coveredDirectories.emplace(parent, covered);
+    return covered;
+}
+
+/// <summary>
+/// The directories, relative to the source, whose files are to be listed again without going below them. Call Finish first.
+/// </summary>
+const std::vector<std::wstring>& ChangeSet::Directories(void) const
+{
+    return directories;
+}
+
+/// <summary>
+/// The directories, relative to the source, to be walked again with everything below them. Call Finish first.
+/// </summary>
+const std::vector<std::wstring>& ChangeSet::Trees(void) const
+{
+    return trees;
+}
+
+/// <summary>
+/// The number of changes added which were in the source, counting each change to the same path again.
+/// </summary>
+unsigned long long ChangeSet::ChangeCount(void) const
+{
+    return changeCount;
+}
+
+/// <summary>
+/// Whether a directory is below one of the trees to be walked.
+/// </summary>
+/// <param name="relativePath">The directory relative to the source</param>
+/// <param name="includingSelf">Count the directory as in a tree if it is one</param>
+BOOL ChangeSet::InTree(const std::wstring& relativePath, BOOL includingSelf) const
+{
+    if (treeSet.empty()) {
+        return FALSE;
+    }
+    if (relativePath.empty()) {
+        return includingSelf && treeSet.count(relativePath) > 0;
+    }
+    if (treeSet.count(std::wstring()) > 0 || (includingSelf && treeSet.count(relativePath) > 0)) {
+        return TRUE;
+    }
+    for (size_t separator = relativePath.find(PATH_SEPARATOR); separator != std::wstring::npos; separator = relativePath.find(PATH_SEPARATOR, separator + 1)) {
+        if (treeSet.count(relativePath.substr(0, separator)) > 0) {
+            return TRUE;
+        }
+    }
+    return FALSE;
+}
+
+/// <summary>
+/// Start with no feed. Open one with OpenJournal or OpenLog.
+/// </summary>
+ChangeFeed::ChangeFeed() : journal(INVALID_FILE_HANDLE)
+{
+}
+
+ChangeFeed::~ChangeFeed()
+{
+    if (journal != INVALID_FILE_HANDLE) {
+        PlatformCloseFile(journal);
+    }
+}
+
+/// <summary>
+/// Take changes from the USN journal of a volume.
+/// </summary>
+/// <param name="volume">The volume, as from GetVolumePathNameW</param>
+/// <returns>0 on success, ERROR_NOT_SUPPORTED where there is no change journal, or the platform error code upon failure</returns>
+DWORD ChangeFeed::OpenJournal(const std::wstring& volume)
+{
+    return PlatformOpenChangeJournal(volume, &journal);
+}
+
+/// <summary>
+/// Take changes from a change log instead of a journal.
+/// </summary>
+/// <param name="logPath">The change log</param>
+/// <returns>0 on success, or ERROR_FILE_NOT_FOUND if there is no such log</returns>
+DWORD ChangeFeed::OpenLog(const std::wstring& logPath)
+{
+    this->logPath = logPath;
+    return PlatformPathExists(logPath) ? ERROR_SUCCESS : ERROR_FILE_NOT_FOUND;
+}
+
+/// <summary>
+/// Whether the changes come from a USN journal, which names paths relative to their volume, rather than a change log.
+/// </summary>
+BOOL ChangeFeed::IsJournal(void) const
+{
+    return journal != INVALID_FILE_HANDLE;
+}
+
+/// <summary>
+/// Find where the feed has got to, so that the next run can read the changes made from now on. Take this
+/// before the snapshot, so that a change made while the snapshot is taken is read again next time rather
+/// than missed.
+/// </summary>
+/// <param name="position">Receives the position</param>
+/// <returns>0 on success, or the platform error code if the feed cannot be read</returns>
+DWORD ChangeFeed::QueryPosition(t_changePosition* position)
+{
+    if (journal != INVALID_FILE_HANDLE) {
+        t_changeJournalInformation information{};
+        DWORD error = PlatformQueryChangeJournal(journal, &information);
+        if (error) {
+            return error;
+        }
+        position->feedId = information.journalId;
+        position->next = information.nextUsn;
+        return ERROR_SUCCESS;
+    }
+    return ReadLog(nullptr, nullptr, position);
+}
+
+/// <summary>
+/// Read every change from a position up to now into a change set.
+/// </summary>
+/// <param name="since">Where the last run read up to</param>
+/// <param name="snapshotRoot">The root of the snapshot of the journal's volume, where the journal's file references are looked up</param>
+/// <param name="changes">Receives the changes. Call Finish on it afterwards.</param>
+/// <returns>0 on success, ERROR_JOURNAL_ENTRY_DELETED if changes since the position have been lost, as the
+/// journal or log was started again or has dropped them, or the platform error code upon failure</returns>
+DWORD ChangeFeed::Read(const t_changePosition& since, const std::wstring& snapshotRoot, ChangeSet* changes)
+{
+    if (journal != INVALID_FILE_HANDLE) {
+        return ReadJournal(since, snapshotRoot, changes);
+    }
+    t_changePosition end{};
+    return ReadLog(&since, changes, &end);
+}
+
+/// <summary>
+/// Journal record callback for ReadJournal -- look up the path of the record's directory, and add the change.
+/// </summary>
+/// <param name="record">The journal record</param>
+/// <param name="context">The t_journalReadState</param>
+/// <returns>FALSE if a path could not be looked up</returns>
+static BOOL JournalRecordRoutine(const t_changeJournalRecord& record, void* context)
+{
+    t_journalReadState* state = (t_journalReadState*)context;
+
+    auto found = state->directories.find(record.parentReference);
+    if (found == state->directories.end()) {
+        t_journalDirectory directory{};
+        DWORD error = PlatformPathFromFileReference(state->volumeHandle, record.parentReference, &directory.path);
+        if (error && error != ERROR_INVALID_PARAMETER && error != ERROR_FILE_NOT_FOUND && error != ERROR_PATH_NOT_FOUND) {
+            state->error = error;
+            return FALSE;
+        }
+        directory.exists = error == ERROR_SUCCESS;
+        found = state->directories.emplace(record.parentReference, directory).first;
+    }
+
+    // a directory which is not in the snapshot was deleted or moved away, and its own record of that
+    // covers everything that was in it
+    if (!found->second.exists) {
+        return TRUE;
+    }
+
+    DWORD flags = (record.isDirectory ? CHANGE_DIRECTORY : 0) | (record.arrived ? CHANGE_ARRIVED : 0) | (record.departed ? CHANGE_DEPARTED : 0);
+    if (found->second.path.empty()) {
+        state->changes->Add(record.name, flags);
+    }
+    else {
+        state->changes->Add(found->second.path + PATH_SEPARATOR + record.name, flags);
+    }
+    return TRUE;
+}
+
+/// <summary>
+/// Read the USN journal from a position up to now. Each record names its directory by file reference, which
+/// is looked up in the snapshot, once for each directory, so that paths are as the snapshot has them.
+/// </summary>
+DWORD ChangeFeed::ReadJournal(const t_changePosition& since, const std::wstring& snapshotRoot, ChangeSet* changes)
+{
+    t_changeJournalInformation information{};
+    t_journalReadState state;
+
+    DWORD error = PlatformQueryChangeJournal(journal, &information);
+    if (error) {
+        return error;
+    }
+    if (information.journalId != since.feedId || since.next < information.firstUsn || since.next > information.nextUsn) {
+        return ERROR_JOURNAL_ENTRY_DELETED;
+    }
+
+    state.changes = changes;
+    state.error = ERROR_SUCCESS;
+    error = PlatformOpenDirectory(snapshotRoot, &state.volumeHandle);
+    if (error) {
+        return error;
+    }
+    error = PlatformReadChangeJournal(journal, information.journalId, since.next, information.nextUsn, &JournalRecordRoutine, &state);
+    PlatformCloseFile(state.volumeHandle);
+    if (error == ERROR_OPERATION_ABORTED && state.error) {
+        error = state.error;
+    }
+    return error;
+}
+
+/// <summary>
+/// Parse the header line of a change log.
+/// </summary>
+/// <returns>TRUE if the line was well formed</returns>
+static BOOL ParseChangeLogHeader(const std::string& line, unsigned long long* logId, unsigned long long* first)
+{
+    char* next = nullptr;
+    size_t headerLength = strlen(CHANGE_LOG_HEADER);
+
+    if (line.compare(0, headerLength, CHANGE_LOG_HEADER) != 0 || line.size() <= headerLength || line[headerLength] != '\t') {
+        return FALSE;
+    }
+    *logId = strtoull(line.c_str() + headerLength + 1, &next, 10);
+    if (*next != '\t' || *logId == 0) {
+        return FALSE;
+    }
+    *first = strtoull(next + 1, &next, 10);
+    return *next == '\0';
+}
+
+/// <summary>
+/// Parse one change line of a change log.
+/// </summary>
+/// <returns>TRUE if the line was well formed</returns>
+static BOOL ParseChangeLogLine(const std::string& line, unsigned long long* sequence, DWORD* flags, std::wstring* path)
+{
+    char* next = nullptr;
+
+    *sequence = strtoull(line.c_str(), &next, 10);
+    if (next == line.c_str() || next[0] != '\t' || (next[1] != 'F' && next[1] != 'D') || next[2] == '\0' || next[3] != '\t' || next[4] == '\0') {
+        return FALSE;
+    }
+
+    *flags = next[1] == 'D' ? CHANGE_DIRECTORY : 0;
+    switch (next[2]) {
+    case 'M':
+        break;
+    case 'C':
+    case 'N':
+        *flags |= CHANGE_ARRIVED;
+        break;
+    case 'X':
+    case 'O':
+        *flags |= CHANGE_DEPARTED;
+        break;
+    default:
+        return FALSE;
+    }
+
+    *path = PlatformFromUtf8(std::string(next + 4));
+    return TRUE;
+}
+
+/// <summary>
+/// Read a change log, adding each change from a position on to a change set, and find the position at its end.
+/// </summary>
+/// <param name="since">Where the last run read up to, or nullptr to read no changes and just find the end</param>
+/// <param name="changes">Receives the changes, if since is given</param>
+/// <param name="end">Receives the position after the last whole change in the log</param>
+/// <returns>0 on success, ERROR_JOURNAL_ENTRY_DELETED if the log is not the one since was taken from or has dropped
+/// changes after it, ERROR_INVALID_DATA if the log is damaged, or the platform error code upon failure</returns>
+DWORD ChangeFeed::ReadLog(const t_changePosition* since, ChangeSet* changes, t_changePosition* end)
+{
+    t_fileHandle file = INVALID_FILE_HANDLE;
+    std::vector<char> chunk(CHANGE_LOG_IO_CHUNK);
+    std::string line;
+    unsigned long long offset = 0;
+    unsigned long long last = 0;
+    BOOL headerSeen = FALSE;
+    BOOL anyChanges = FALSE;
+    DWORD bytesRead = 0;
+    DWORD error = ERROR_SUCCESS;
+
+    error = PlatformOpenForRead(logPath, FALSE, &file);
+    if (error) {
+        return error;
+    }
+
+    do {
+        error = PlatformReadAt(file, offset, chunk.data(), (DWORD)chunk.size(), &bytesRead);
+        if (error) {
+            break;
+        }
+        offset += bytesRead;
+
+        for (DWORD i = 0; i < bytesRead && !error; i++) {
+            if (chunk[i] != '\n') {
+                line.push_back(chunk[i]);
+                continue;
+            }
+            if (!line.empty() && line.back() == '\r') {
+                line.pop_back();
+            }
+
+            if (!headerSeen) {
+                headerSeen = TRUE;
+                if (!ParseChangeLogHeader(line, &end->feedId, &end->next)) {
+                    error = ERROR_INVALID_DATA;
+                }
+                else if (since != nullptr && (since->feedId != end->feedId || since->next < end->next)) {
+                    error = ERROR_JOURNAL_ENTRY_DELETED;
+                }
+            }
+            else if (!line.empty()) {
+                unsigned long long sequence = 0;
+                DWORD flags = 0;
+                std::wstring path;
+                if (!ParseChangeLogLine(line, &sequence, &flags, &path) || sequence < end->next || (anyChanges && sequence <= last)) {
+                    error = ERROR_INVALID_DATA;
+                }
+                else {
+                    if (since != nullptr && sequence >= since->next) {
+                        changes->Add(path, flags);
+                    }
+                    last = sequence;
+                    anyChanges = TRUE;
+                }
+            }
+            line.clear();
+        }
+    } while (bytesRead > 0 && !error);
+    PlatformCloseFile(file);
+
+    if (!error && !headerSeen) {
+        error = ERROR_INVALID_DATA;
+    }
+    if (error) {
+        return error;
+    }
+
+    if (anyChanges) {
+        end->next = last + 1;
+    }
+    if (since != nullptr && since->next > end->next) {
+        return ERROR_JOURNAL_ENTRY_DELETED; // the log has gone backwards, so cannot be the one since was taken from
+    }
+    return ERROR_SUCCESS;
+}
+
+/// <summary>
+/// The change feed position of a destination is kept beside its manifest, which it belongs with.
+/// </summary>
+/// <param name="destinationDirectory">The destination directory</param>
+/// <returns>The path of the position file</returns>
+std::wstring ChangePositionPathForDestination(const std::wstring& destinationDirectory)
+{
+    std::wstring manifestPath = ManifestPathForDestination(destinationDirectory);
+    return manifestPath.substr(0, manifestPath.size() - wcslen(MANIFEST_EXTENSION)) + CHANGE_POSITION_EXTENSION;
+}
+
+/// <summary>
+/// Read the position the last run read its change feed up to.
+/// </summary>
+/// <param name="positionPath">The position file</param>
+/// <param name="position">Receives the position</param>
+/// <param name="settings">Receives the CRC32C of the settings the last run was made with</param>
+/// <returns>0 on success, ERROR_FILE_NOT_FOUND if no position has been saved, ERROR_INVALID_DATA if it is damaged, or another platform error</returns>
+DWORD LoadChangePosition(const std::wstring& positionPath, t_changePosition* position, DWORD* settings)
+{
+    t_fileHandle file = INVALID_FILE_HANDLE;
+    char text[256]{};
+    DWORD bytesRead = 0;
+    char* next = nullptr;
+
+    DWORD error = PlatformOpenForRead(positionPath, FALSE, &file);
+    if (error) {
+        return error;
+    }
+    error = PlatformReadAt(file, 0, text, sizeof(text) - 1, &bytesRead);
+    PlatformCloseFile(file);
+    if (error) {
+        return error;
+    }
+
+    size_t headerLength = strlen(CHANGE_POSITION_HEADER);
+    if (bytesRead <= headerLength || strncmp(text, CHANGE_POSITION_HEADER "\n", headerLength + 1) != 0) {
+        return ERROR_INVALID_DATA;
+    }
+    position->feedId = strtoull(text + headerLength + 1, &next, 10);
+    if (*next != '\t') {
+        return ERROR_INVALID_DATA;
+    }
+    position->next = strtoull(next + 1, &next, 10);
+    if (*next != '\t') {
+        return ERROR_INVALID_DATA;
+    }
+    *settings = (DWORD)strtoul(next + 1, &next, 16);
+    if (*next != '\n') {
+        return ERROR_INVALID_DATA;
+    }
+    return ERROR_SUCCESS;
+}
+
+/// <summary>
+/// Save the position this run read its change feed up to, for the next run. Save it only once the manifest
+/// it belongs with has been saved -- an older position with a newer manifest only means more is listed
+/// next time, but a newer position with an older manifest would miss changes.
+/// </summary>
+/// <param name="positionPath">The position file, which is replaced in one step</param>
+/// <param name="position">The position</param>
+/// <param name="settings">The CRC32C of the settings the run was made with</param>
+/// <returns>0 on success, or the platform error code upon failure</returns>
+DWORD SaveChangePosition(const std::wstring& positionPath, const t_changePosition& position, DWORD settings)
+{
+    std::wstring temporaryPath = positionPath + L".tmp";
+    t_fileHandle file = INVALID_FILE_HANDLE;
+    char text[256]{};
+
+    int length = snprintf(text, sizeof(text), CHANGE_POSITION_HEADER "\n%llu\t%llu\t%08lx\n", position.feedId, position.next, (unsigned long)settings);
+
+    DWORD error = PlatformOpenForWrite(temporaryPath, FALSE, TRUE, &file);
+    if (error) {
+        return error;
+    }
+    error = PlatformWriteAt(file, 0, text, (DWORD)length);
+    PlatformCloseFile(file);
+    if (!error) {
+        error = PlatformReplaceFile(temporaryPath, positionPath, TRUE);
+    }
+    return error;
+}
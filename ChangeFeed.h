@@ -0,0 +1,96 @@
+/* ShadowDuplicator -- a simple VC++ Volume Shadow Copy requestor for backing up
+locked files
+
+Copyright (C) 2021-2023 Peter Upfold.
+
+Licensed under the Apache 2.0 Licence. See the LICENSE file in the project root for details.
+
+This code is **not** production quality. There is certainly plenty of potential for improvement of this code,
+but beyond that, it may even be insecure, destructive or cause you other serious problems. There
+is no warranty.
+*/
+#pragma once
+#include "Platform.h"
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+// appended to the destination directory to give the path of the change feed position saved with its manifest
+#define CHANGE_POSITION_EXTENSION L".sdchanges"
+
+// what a change record says happened to its path
+#define CHANGE_DIRECTORY 0x1 // the path is a directory
+#define CHANGE_ARRIVED 0x2 // created, or renamed to this path
+#define CHANGE_DEPARTED 0x4 // deleted, or renamed away from this path
+
+// A point in a change feed, from which the next run reads on. The feed ID is different for every journal
+// or change log, so that a position is never read from a feed other than the one it was taken from.
+typedef struct changePosition {
+    unsigned long long feedId; // the USN journal ID, or the ID in the change log's header
+    unsigned long long next; // the USN, or the sequence number, of the first change not yet read
+} t_changePosition;
+
+/// <summary>
+/// The parts of one source tree which a change feed says have changed since the last run. Each
+/// directory which holds a changed file is listed again on its own, and a directory which arrived or
+/// departed is walked again with everything below it. Any other file is as the last run found it.
+/// </summary>
+class ChangeSet {
+public:
+    ChangeSet(const std::wstring& root);
+
+    BOOL Add(const std::wstring& path, DWORD flags);
+    void Finish(void);
+
+    BOOL Everything(void) const;
+    BOOL Covers(const std::wstring& relativePath) const;
+    const std::vector<std::wstring>& Directories(void) const;
+    const std::vector<std::wstring>& Trees(void) const;
+    unsigned long long ChangeCount(void) const;
+
+private:
+    BOOL InTree(const std::wstring& relativePath, BOOL includingSelf) const;
+
+    std::wstring root; // the source, named as the feed names paths
+    unsigned long long changeCount;
+    std::unordered_set<std::wstring> directorySet;
+    std::unordered_set<std::wstring> treeSet;
+
+    // the same, relative to the root, with those inside a tree left out, after Finish
+    std::vector<std::wstring> directories;
+    std::vector<std::wstring> trees;
+
+    // whether the files of each directory asked about are covered, as a manifest asks about each of its files in turn
+    mutable std::unordered_map<std::wstring, BOOL> coveredDirectories;
+    mutable std::wstring parent;
+};
+
+/// <summary>
+/// Where the changes to a source come from. On Windows this is the USN journal of the source's volume,
+/// and anywhere a change log -- a text file of changes which can be written by hand or by another tool,
+/// and replayed -- can stand in for it.
+/// </summary>
+class ChangeFeed {
+public:
+    ChangeFeed();
+    ~ChangeFeed();
+
+    DWORD OpenJournal(const std::wstring& volume);
+    DWORD OpenLog(const std::wstring& logPath);
+    BOOL IsJournal(void) const;
+
+    DWORD QueryPosition(t_changePosition* position);
+    DWORD Read(const t_changePosition& since, const std::wstring& snapshotRoot, ChangeSet* changes);
+
+private:
+    DWORD ReadJournal(const t_changePosition& since, const std::wstring& snapshotRoot, ChangeSet* changes);
+    DWORD ReadLog(const t_changePosition* since, ChangeSet* changes, t_changePosition* end);
+
+    t_fileHandle journal;
+    std::wstring logPath;
+};
+
+std::wstring ChangePositionPathForDestination(const std::wstring& destinationDirectory);
+DWORD LoadChangePosition(const std::wstring& positionPath, t_changePosition* position, DWORD* settings);
+DWORD SaveChangePosition(const std::wstring& positionPath, const t_changePosition& position, DWORD settings);
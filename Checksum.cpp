@@ -0,0 +1,259 @@
+/* ShadowDuplicator -- a simple VC++ Volume Shadow Copy requestor for backing up
+locked files
+
+Copyright (C) 2021-2023 Peter Upfold.
+
+Licensed under the Apache 2.0 Licence. See the LICENSE file in the project root for details.
+
+This code is **not** production quality. There is certainly plenty of potential for improvement of this code,
+but beyond that, it may even be insecure, destructive or cause you other serious problems. There
+is no warranty.
+*/
+
+#include "Checksum.h"
+#include <cstring>
+#include <vector>
+
+/*
+File checksums are CRC32C (the Castagnoli polynomial, as used by iSCSI, ext4 and SMB), which x86
+processors since Nehalem compute with the SSE4.2 CRC32 instruction at several GB/s. Elsewhere a
+slicing-by-8 table version is used. Both give the same answer, and ChecksumUpdate picks the fastest
+the processor supports. Checksums chain -- start with 0 and pass the result of each block to the next.
+*/
+
+#define CRC32C_POLYNOMIAL 0x82F63B78 // reversed
+
+#if defined(_M_X64) || defined(__x86_64__) || defined(_M_IX86) || defined(__i386__)
+#define CHECKSUM_X86
+#include <nmmintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#define CHECKSUM_TARGET_SSE42
+#else
+#include <cpuid.h>
+#define CHECKSUM_TARGET_SSE42 __attribute__((target("sse4.2")))
+#endif
+#endif
+
+typedef DWORD (*t_checksumRoutine)(DWORD checksum, const void* data, size_t length);
+
+/// <summary>
+/// The slicing-by-8 tables -- table 0 is the classic byte at a time table, and table k gives the effect
+/// of a byte followed by k zero bytes.
+/// </summary>
+/// <returns>8 tables of 256 entries</returns>
+static const DWORD (*SlicingTables(void))[256]
+{
+    static const std::vector<DWORD> tables = [] {
+        std::vector<DWORD> values(8 * 256);
+        for (DWORD i = 0; i < 256; i++) {
+            DWORD crc = i;
+            for (int bit = 0; bit < 8; bit++) {
+                crc = (crc & 1) ? (crc >> 1) ^ CRC32C_POLYNOMIAL : crc >> 1;
+            }
+            values[i] = crc;
+        }
+        for (DWORD i = 0; i < 256; i++) {
+            for (int table = 1; table < 8; table++) {
+                DWORD previous = values[(table - 1) * 256 + i];
+                values[table * 256 + i] = (previous >> 8) ^ values[previous & 0xFF];
+            }
+        }
+        return values;
+    }();
+    return (const DWORD(*)[256])tables.data();
+}
+
+/// <summary>
+/// CRC32C a table at a time, eight bytes per step. Works on any processor.
+/// </summary>
+/// <param name="checksum">The checksum so far, 0 to start</param>
+/// <param name="data">The data</param>
+/// <param name="length">The length of the data</param>
+/// <returns>The checksum including this data</returns>
+DWORD ChecksumUpdatePortable(DWORD checksum, const void* data, size_t length)
+{
+    const DWORD(*tables)[256] = SlicingTables();
+    const unsigned char* bytes = (const unsigned char*)data;
+    DWORD crc = ~checksum;
+
+    while (length >= 8) {
+        DWORD low;
+        DWORD high;
+        memcpy(&low, bytes, sizeof(low));
+        memcpy(&high, bytes + 4, sizeof(high));
+        low ^= crc;
+        crc = tables[7][low & 0xFF] ^ tables[6][(low >> 8) & 0xFF] ^ tables[5][(low >> 16) & 0xFF] ^ tables[4][low >> 24] ^
+            tables[3][high & 0xFF] ^ tables[2][(high >> 8) & 0xFF] ^ tables[1][(high >> 16) & 0xFF] ^ tables[0][high >> 24];
+        bytes += 8;
+        length -= 8;
+    }
+    while (length > 0) {
+        crc = (crc >> 8) ^ tables[0][(crc ^ *bytes) & 0xFF];
+        bytes++;
+        length--;
+    }
+    return ~crc;
+}
+
+#ifdef CHECKSUM_X86
+/// <summary>
+/// CRC32C with the SSE4.2 CRC32 instruction.
+/// </summary>
+/// <param name="checksum">The checksum so far, 0 to start</param>
+/// <param name="data">The data</param>
+/// <param name="length">The length of the data</param>
+/// <returns>The checksum including this data</returns>
+CHECKSUM_TARGET_SSE42 static DWORD ChecksumUpdateSse42(DWORD checksum, const void* data, size_t length)
+{
+    const unsigned char* bytes = (const unsigned char*)data;
+    DWORD crc = ~checksum;
+
+#if defined(_M_X64) || defined(__x86_64__)
+    unsigned long long crc64 = crc;
+    while (length >= 8) {
+        unsigned long long value;
+        memcpy(&value, bytes, sizeof(value));
+        crc64 = _mm_crc32_u64(crc64, value);
+        bytes += 8;
+        length -= 8;
+    }
+    crc = (DWORD)crc64;
+#endif
+    while (length >= 4) {
+        unsigned int value;
+        memcpy(&value, bytes, sizeof(value));
+        crc = _mm_crc32_u32(crc, value);
+        bytes += 4;
+        length -= 4;
+    }
+    while (length > 0) {
+        crc = _mm_crc32_u8(crc, *bytes);
+        bytes++;
+        length--;
+    }
+    return ~crc;
+}
+
+/// <summary>
+/// Whether the processor has the SSE4.2 CRC32 instruction.
+/// </summary>
+static BOOL ProcessorHasSse42(void)
+{
+#ifdef _MSC_VER
+    int information[4]{};
+    __cpuid(information, 1);
+    return (information[2] & (1 << 20)) ? TRUE : FALSE;
+#else
+    unsigned int eax = 0, ebx = 0, ecx = 0, edx = 0;
+    if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx)) {
+        return FALSE;
+    }
+    return (ecx & bit_SSE4_2) ? TRUE : FALSE;
+#endif
+}
+#endif
+
+/// <summary>
+/// The fastest checksum routine this processor supports, chosen once.
+/// </summary>
+static t_checksumRoutine SelectedRoutine(void)
+{
+    static const t_checksumRoutine routine = [] {
+#ifdef CHECKSUM_X86
+        if (ProcessorHasSse42()) {
+            return (t_checksumRoutine)&ChecksumUpdateSse42;
+        }
+#endif
+        return (t_checksumRoutine)&ChecksumUpdatePortable;
+    }();
+    return routine;
+}
+
+/// <summary>
+/// Add a block of data to a CRC32C checksum.
+/// </summary>
+/// <param name="checksum">The checksum so far, 0 to start</param>
+/// <param name="data">The data</param>
+/// <param name="length">The length of the data</param>
+/// <returns>The checksum including this data</returns>
+DWORD ChecksumUpdate(DWORD checksum, const void* data, size_t length)
+{
+    return SelectedRoutine()(checksum, data, length);
+}
+
+/// <summary>
+/// Multiply a vector by a matrix over GF(2). Column n of the matrix is the effect on the CRC register of bit n.
+/// </summary>
+static DWORD MatrixTimes(const DWORD* matrix, DWORD vector)
+{
+    DWORD sum = 0;
+    for (; vector != 0; vector >>= 1, matrix++) {
+        if (vector & 1) {
+            sum ^= *matrix;
+        }
+    }
+    return sum;
+}
+
+/// <summary>
+/// Square a 32x32 matrix over GF(2), doubling the number of zero bits whose effect it gives.
+/// </summary>
+static void MatrixSquare(DWORD* square, const DWORD* matrix)
+{
+    for (int n = 0; n < 32; n++) {
+        square[n] = MatrixTimes(matrix, matrix[n]);
+    }
+}
+
+/// <summary>
+/// Add a run of zero bytes to a CRC32C checksum without touching any memory, in time proportional to
+/// the logarithm of the length, as zlib's crc32_combine does. For the holes of sparse files.
+/// </summary>
+/// <param name="checksum">The checksum so far, 0 to start</param>
+/// <param name="length">The number of zero bytes</param>
+/// <returns>The same as ChecksumUpdate over that many zero bytes</returns>
+DWORD ChecksumUpdateZeros(DWORD checksum, unsigned long long length)
+{
+    DWORD even[32]; // the effect of 2^k zero bits, for even k
+    DWORD odd[32];  // and for odd k
+    DWORD crc = ~checksum;
+
+    if (length == 0) {
+        return checksum;
+    }
+
+    // one zero bit, then two and four
+    odd[0] = CRC32C_POLYNOMIAL;
+    for (int n = 1; n < 32; n++) {
+        odd[n] = (DWORD)1 << (n - 1);
+    }
+    MatrixSquare(even, odd);
+    MatrixSquare(odd, even);
+
+    // apply the operator for each set bit of the length, starting from one byte
+    while (length != 0) {
+        MatrixSquare(even, odd);
+        if (length & 1) {
+            crc = MatrixTimes(even, crc);
+        }
+        length >>= 1;
+        if (length == 0) {
+            break;
+        }
+        MatrixSquare(odd, even);
+        if (length & 1) {
+            crc = MatrixTimes(odd, crc);
+        }
+        length >>= 1;
+    }
+    return ~crc;
+}
+
+/// <summary>
+/// Which checksum routine ChecksumUpdate uses on this processor, for the self test and benchmarks.
+/// </summary>
+const char* ChecksumImplementation(void)
+{
+    return (SelectedRoutine() == &ChecksumUpdatePortable) ? "portable" : "SSE4.2";
+}
@@ -0,0 +1,19 @@
+/* ShadowDuplicator -- a simple VC++ Volume Shadow Copy requestor for backing up
+locked files
+
+Copyright (C) 2021-2023 Peter Upfold.
+
+Licensed under the Apache 2.0 Licence. See the LICENSE file in the project root for details.
+
+This code is **not** production quality. There is certainly plenty of potential for improvement of this code,
+but beyond that, it may even be insecure, destructive or cause you other serious problems. There
+is no warranty.
+*/
+#pragma once
+#include "Platform.h"
+#include <cstddef>
+
+DWORD ChecksumUpdate(DWORD checksum, const void* data, size_t length);
+DWORD ChecksumUpdatePortable(DWORD checksum, const void* data, size_t length);
+DWORD ChecksumUpdateZeros(DWORD checksum, unsigned long long length);
+const char* ChecksumImplementation(void);
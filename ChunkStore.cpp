@@ -0,0 +1,704 @@
+/* ShadowDuplicator -- a simple VC++ Volume Shadow Copy requestor for backing up
+locked files
+
+Copyright (C) 2021-2023 Peter Upfold.
+
+Licensed under the Apache 2.0 Licence. See the LICENSE file in the project root for details.
+
+This code is **not** production quality. There is certainly plenty of potential for improvement of this code,
+but beyond that, it may even be insecure, destructive or cause you other serious problems. There
+is no warranty.
+*/
+
+#include "ChunkStore.h"
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+/*
+Each source file is cut into content-defined chunks with FastCDC: a gear rolling hash is run over the
+data and a chunk ends where the low-entropy test on the hash passes, so an insertion early in a file
+only changes the chunks around it rather than shifting every chunk boundary after it. Each chunk is
+named by its BLAKE2b-256 hash and stored once. In place of the destination file we write a recipe:
+
+    ShadowDuplicator recipe 1
+    size <TAB> creation time <TAB> last write time <TAB> attributes
+    chunk hash (hex) <TAB> chunk length
+    ...
+
+Times are in FILETIME units, as everywhere else.
+*/
+
+#define CHUNK_RECIPE_HEADER "ShadowDuplicator recipe 1"
+
+// how much recipe text we buffer before each write or read
+#define CHUNK_RECIPE_IO_CHUNK (1024 * 1024)
+
+// FastCDC normalised chunking -- a harder test before the average size and an easier one after it
+// keeps most chunks close to the average. The masks take the top bits of the gear hash, which are
+// the ones influenced by the most recent 64 bytes.
+#define CHUNK_MASK_HARD (~0ULL << (64 - 18))
+#define CHUNK_MASK_EASY (~0ULL << (64 - 14))
+
+// One chunk of a recipe
+typedef struct recipeChunk {
+    t_chunkHash hash;
+    DWORD length;
+} t_recipeChunk;
+
+// State for the block routine while one file is chunked
+typedef struct chunkerState {
+    ChunkStore* store;
+    IoThrottle* throttle;
+    std::vector<unsigned char> pending;
+    std::vector<t_recipeChunk> chunks;
+    t_chunkStatistics* statistics;
+} t_chunkerState;
+
+/// <summary>
+/// The gear table -- one pseudo-random 64-bit value per byte value. It is generated with SplitMix64 from
+/// a fixed seed, so it is the same on every run and every platform and chunk boundaries stay stable.
+/// </summary>
+/// <returns>The 256 entry table</returns>
+static const unsigned long long* GearTable(void)
+{
+    static const std::vector<unsigned long long> table = [] {
+        std::vector<unsigned long long> values(256);
+        unsigned long long state = 0x5348414457445550ULL; // "SHADWDUP"
+        for (unsigned long long& value : values) {
+            unsigned long long mixed = (state += 0x9E3779B97F4A7C15ULL);
+            mixed = (mixed ^ (mixed >> 30)) * 0xBF58476D1CE4E5B9ULL;
+            mixed = (mixed ^ (mixed >> 27)) * 0x94D049BB133111EBULL;
+            value = mixed ^ (mixed >> 31);
+        }
+        return values;
+    }();
+    return table.data();
+}
+
+/// <summary>
+/// Find where the next chunk ends.
+/// </summary>
+/// <param name="data">The data from the start of the chunk</param>
+/// <param name="length">How much data there is. Unless this is the end of the file, at least CHUNK_MAX_SIZE.</param>
+/// <returns>The length of the chunk</returns>
+static size_t FindChunkEnd(const unsigned char* data, size_t length)
+{
+    const unsigned long long* gear = GearTable();
+    unsigned long long fingerprint = 0;
+    size_t normalSize = CHUNK_AVERAGE_SIZE;
+    size_t i = CHUNK_MIN_SIZE;
+
+    if (length <= CHUNK_MIN_SIZE) {
+        return length;
+    }
+    if (length > CHUNK_MAX_SIZE) {
+        length = CHUNK_MAX_SIZE;
+    }
+    if (normalSize > length) {
+        normalSize = length;
+    }
+
+    // nothing before the minimum size can be a boundary, so the hash starts there
+    for (; i < normalSize; i++) {
+        fingerprint = (fingerprint << 1) + gear[data[i]];
+        if (!(fingerprint & CHUNK_MASK_HARD)) {
+            return i + 1;
+        }
+    }
+    for (; i < length; i++) {
+        fingerprint = (fingerprint << 1) + gear[data[i]];
+        if (!(fingerprint & CHUNK_MASK_EASY)) {
+            return i + 1;
+        }
+    }
+    return length;
+}
+
+// BLAKE2b initialisation vector and message schedule
+static const unsigned long long blake2bIV[8] = {
+    0x6A09E667F3BCC908ULL, 0xBB67AE8584CAA73BULL, 0x3C6EF372FE94F82BULL, 0xA54FF53A5F1D36F1ULL,
+    0x510E527FADE682D1ULL, 0x9B05688C2B3E6C1FULL, 0x1F83D9ABFB41BD6BULL, 0x5BE0CD19137E2179ULL
+};
+
+static const unsigned char blake2bSigma[12][16] = {
+    { 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15 },
+    { 14, 10, 4, 8, 9, 15, 13, 6, 1, 12, 0, 2, 11, 7, 5, 3 },
+    { 11, 8, 12, 0, 5, 2, 15, 13, 10, 14, 3, 6, 7, 1, 9, 4 },
+    { 7, 9, 3, 1, 13, 12, 11, 14, 2, 6, 5, 10, 4, 0, 15, 8 },
+    { 9, 0, 5, 7, 2, 4, 10, 15, 14, 1, 11, 12, 6, 8, 3, 13 },
+    { 2, 12, 6, 10, 0, 11, 8, 3, 4, 13, 7, 5, 15, 14, 1, 9 },
+    { 12, 5, 1, 15, 14, 13, 4, 10, 0, 7, 6, 3, 9, 2, 8, 11 },
+    { 13, 11, 7, 14, 12, 1, 3, 9, 5, 0, 15, 4, 8, 6, 2, 10 },
+    { 6, 15, 14, 9, 11, 3, 0, 8, 12, 2, 13, 7, 1, 4, 10, 5 },
+    { 10, 2, 8, 4, 7, 6, 1, 5, 15, 11, 9, 14, 3, 12, 13, 0 },
+    { 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15 },
+    { 14, 10, 4, 8, 9, 15, 13, 6, 1, 12, 0, 2, 11, 7, 5, 3 }
+};
+
+static inline unsigned long long RotateRight64(unsigned long long value, int bits)
+{
+    return (value >> bits) | (value << (64 - bits));
+}
+
+#define BLAKE2B_G(a, b, c, d, x, y) \
+    a = a + b + (x); d = RotateRight64(d ^ a, 32); \
+    c = c + d; b = RotateRight64(b ^ c, 24); \
+    a = a + b + (y); d = RotateRight64(d ^ a, 16); \
+    c = c + d; b = RotateRight64(b ^ c, 63);
+
+/// <summary>
+/// The BLAKE2b compression function, over one 128 byte block.
+/// </summary>
+/// <param name="state">The chaining value</param>
+/// <param name="block">The block</param>
+/// <param name="counter">The number of bytes hashed so far, including this block</param>
+/// <param name="last">Whether this is the final block</param>
+static void Blake2bCompress(unsigned long long state[8], const unsigned char* block, unsigned long long counter, BOOL last)
+{
+    unsigned long long m[16];
+    unsigned long long v[16];
+
+    memcpy(m, block, sizeof(m));
+    for (int i = 0; i < 8; i++) {
+        v[i] = state[i];
+        v[i + 8] = blake2bIV[i];
+    }
+    v[12] ^= counter;
+    if (last) {
+        v[14] = ~v[14];
+    }
+
+    for (int round = 0; round < 12; round++) {
+        const unsigned char* s = blake2bSigma[round];
+        BLAKE2B_G(v[0], v[4], v[8], v[12], m[s[0]], m[s[1]]);
+        BLAKE2B_G(v[1], v[5], v[9], v[13], m[s[2]], m[s[3]]);
+        BLAKE2B_G(v[2], v[6], v[10], v[14], m[s[4]], m[s[5]]);
+        BLAKE2B_G(v[3], v[7], v[11], v[15], m[s[6]], m[s[7]]);
+        BLAKE2B_G(v[0], v[5], v[10], v[15], m[s[8]], m[s[9]]);
+        BLAKE2B_G(v[1], v[6], v[11], v[12], m[s[10]], m[s[11]]);
+        BLAKE2B_G(v[2], v[7], v[8], v[13], m[s[12]], m[s[13]]);
+        BLAKE2B_G(v[3], v[4], v[9], v[14], m[s[14]], m[s[15]]);
+    }
+
+    for (int i = 0; i < 8; i++) {
+        state[i] ^= v[i] ^ v[i + 8];
+    }
+}
+
+/// <summary>
+/// Hash a chunk with BLAKE2b-256. A chunk is never larger than CHUNK_MAX_SIZE, so the 64-bit byte
+/// counter is all we need of the 128-bit one.
+/// </summary>
+/// <param name="data">The chunk</param>
+/// <param name="length">The length of the chunk in bytes</param>
+/// <param name="hash">Receives the hash</param>
+void ChunkHashData(const void* data, size_t length, t_chunkHash* hash)
+{
+    const unsigned char* bytes = (const unsigned char*)data;
+    unsigned long long state[8];
+    unsigned char lastBlock[128]{};
+    size_t offset = 0;
+
+    memcpy(state, blake2bIV, sizeof(state));
+    state[0] ^= 0x01010000 ^ CHUNK_HASH_SIZE; // no key, 32 byte digest
+
+    while (length - offset > 128) {
+        Blake2bCompress(state, bytes + offset, offset + 128, FALSE);
+        offset += 128;
+    }
+    memcpy(lastBlock, bytes + offset, length - offset);
+    Blake2bCompress(state, lastBlock, length, TRUE);
+
+    memcpy(hash->bytes, state, CHUNK_HASH_SIZE);
+}
+
+/// <summary>
+/// Format a chunk hash as lower case hex, as used for chunk file names and in recipes.
+/// </summary>
+std::string ChunkHashToHex(const t_chunkHash& hash)
+{
+    static const char digits[] = "0123456789abcdef";
+    std::string hex(CHUNK_HASH_SIZE * 2, '0');
+
+    for (int i = 0; i < CHUNK_HASH_SIZE; i++) {
+        hex[i * 2] = digits[hash.bytes[i] >> 4];
+        hex[i * 2 + 1] = digits[hash.bytes[i] & 0xF];
+    }
+    return hex;
+}
+
+/// <summary>
+/// Parse a chunk hash from hex.
+/// </summary>
+/// <returns>TRUE if the text was a well formed hash</returns>
+BOOL ChunkHashFromHex(const std::string& hex, t_chunkHash* hash)
+{
+    if (hex.size() != CHUNK_HASH_SIZE * 2) {
+        return FALSE;
+    }
+    for (int i = 0; i < CHUNK_HASH_SIZE * 2; i++) {
+        char digit = hex[i];
+        int value = (digit >= '0' && digit <= '9') ? digit - '0' : (digit >= 'a' && digit <= 'f') ? digit - 'a' + 10 : -1;
+        if (value < 0) {
+            return FALSE;
+        }
+        hash->bytes[i / 2] = (unsigned char)((i % 2) ? (hash->bytes[i / 2] | value) : (value << 4));
+    }
+    return TRUE;
+}
+
+/// <summary>
+/// Prepare a store. Nothing is touched on disk until Open.
+/// </summary>
+/// <param name="storeDirectory">The directory which holds the chunks</param>
+ChunkStore::ChunkStore(const std::wstring& storeDirectory) : storeDirectory(storeDirectory), temporaryCounter(0)
+{
+}
+
+/// <summary>
+/// Create the store directory and its 256 subdirectories, if they do not exist yet.
+/// </summary>
+/// <param name=""></param>
+/// <returns>0 on success, or the platform error code upon failure</returns>
+DWORD ChunkStore::Open(void)
+{
+    WCHAR name[3]{};
+    DWORD error = PlatformCreateDirectory(storeDirectory);
+
+    for (int i = 0; i < 256 && !error; i++) {
+        swprintf(name, 3, L"%02x", i);
+        error = PlatformCreateDirectory(PlatformJoinPath(storeDirectory, name));
+    }
+    return error;
+}
+
+/// <summary>
+/// The path of the file which holds a chunk.
+/// </summary>
+std::wstring ChunkStore::ChunkPath(const t_chunkHash& hash)
+{
+    std::string hex = ChunkHashToHex(hash);
+    std::wstring wideHex(hex.begin(), hex.end());
+    return PlatformJoinPath(PlatformJoinPath(storeDirectory, wideHex.substr(0, 2)), wideHex);
+}
+
+/// <summary>
+/// Store a chunk, unless the store already has it. A chunk file left by an earlier run is read back and
+/// only kept if it still matches its hash. A new chunk is written under a temporary name, flushed to the
+/// disk and then renamed into place, so a chunk file with its final name is always complete.
+/// </summary>
+/// <param name="hash">The hash of the chunk</param>
+/// <param name="data">The chunk</param>
+/// <param name="length">The length of the chunk</param>
+/// <param name="stored">Receives TRUE if this call wrote the chunk, so that each chunk written is counted once</param>
+/// <returns>0 on success, or the platform error code upon failure</returns>
+DWORD ChunkStore::Put(const t_chunkHash& hash, const void* data, DWORD length, BOOL* stored)
+{
+    std::string key((const char*)hash.bytes, CHUNK_HASH_SIZE);
+    t_fileHandle file = INVALID_FILE_HANDLE;
+    DWORD error = ERROR_SUCCESS;
+
+    *stored = FALSE;
+    {
+        // a thread already storing the same chunk is waited for -- if it failed, this one tries in its place
+        std::unique_lock<std::mutex> guard(lock);
+        chunkSettled.wait(guard, [this, &key] { return pendingChunks.count(key) == 0; });
+        if (knownChunks.count(key)) {
+            return ERROR_SUCCESS;
+        }
+        pendingChunks.insert(key);
+    }
+
+    std::wstring chunkPath = ChunkPath(hash);
+    if (PlatformPathExists(chunkPath)) {
+        std::vector<unsigned char> existing(length);
+        if (Get(hash, existing.data(), length) != ERROR_SUCCESS) {
+            error = ERROR_INVALID_DATA; // damaged, or cut short by a crash -- written again below
+        }
+    }
+    else {
+        error = ERROR_FILE_NOT_FOUND;
+    }
+
+    if (error) {
+        std::wstring temporaryPath = chunkPath + L"." + std::to_wstring(temporaryCounter++) + L".tmp";
+
+        error = PlatformOpenForWrite(temporaryPath, FALSE, TRUE, &file);
+        if (!error) {
+            error = PlatformWriteAt(file, 0, data, length);
+        }
+        if (!error) {
+            error = PlatformFlushFile(file);
+        }
+        PlatformCloseFile(file);
+        if (!error) {
+            error = PlatformReplaceFile(temporaryPath, chunkPath, FALSE);
+        }
+        if (error) {
+            PlatformDeletePath(temporaryPath, FALSE);
+        }
+        *stored = error ? FALSE : TRUE;
+    }
+
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        pendingChunks.erase(key);
+        if (!error) {
+            knownChunks.insert(key);
+        }
+    }
+    chunkSettled.notify_all();
+    return error;
+}
+
+/// <summary>
+/// Read a chunk back from the store, checking that its content still matches its hash.
+/// </summary>
+/// <param name="hash">The hash of the chunk</param>
+/// <param name="data">Receives the chunk</param>
+/// <param name="length">The length of the chunk, from the recipe</param>
+/// <returns>0 on success, ERROR_INVALID_DATA if the chunk is damaged, or another platform error</returns>
+DWORD ChunkStore::Get(const t_chunkHash& hash, void* data, DWORD length)
+{
+    t_fileHandle file = INVALID_FILE_HANDLE;
+    t_fileInformation information{};
+    t_chunkHash foundHash{};
+    DWORD bytesRead = 0;
+    DWORD error = ERROR_SUCCESS;
+
+    error = PlatformOpenForRead(ChunkPath(hash), FALSE, &file);
+    if (error) {
+        return error;
+    }
+    error = PlatformGetFileInformation(file, &information);
+    if (!error && information.size != length) {
+        error = ERROR_INVALID_DATA;
+    }
+    if (!error) {
+        error = PlatformReadAt(file, 0, data, length, &bytesRead);
+    }
+    if (!error && bytesRead != length) {
+        error = ERROR_INVALID_DATA;
+    }
+    PlatformCloseFile(file);
+
+    if (!error) {
+        ChunkHashData(data, length, &foundHash);
+        if (memcmp(foundHash.bytes, hash.bytes, CHUNK_HASH_SIZE) != 0) {
+            error = ERROR_INVALID_DATA;
+        }
+    }
+    return error;
+}
+
+/// <summary>
+/// Hash one chunk, store it and add it to the recipe.
+/// </summary>
+/// <param name="state">The chunker state</param>
+/// <param name="data">The chunk</param>
+/// <param name="length">The length of the chunk</param>
+/// <returns>0 on success, or the platform error code upon failure</returns>
+static DWORD EmitChunk(t_chunkerState* state, const unsigned char* data, size_t length)
+{
+    t_recipeChunk chunk{};
+    BOOL stored = FALSE;
+
+    ChunkHashData(data, length, &chunk.hash);
+    chunk.length = (DWORD)length;
+
+    DWORD error = state->store->Put(chunk.hash, data, chunk.length, &stored);
+    if (error) {
+        return error;
+    }
+
+    state->chunks.push_back(chunk);
+    state->statistics->chunks++;
+    state->statistics->bytes += length;
+    if (stored) {
+        // the store decides whether a chunk is new, so a new chunk's write is paid for once it is made
+        if (state->throttle != nullptr) {
+            state->throttle->Write(chunk.length);
+        }
+        state->statistics->chunksStored++;
+        state->statistics->bytesStored += length;
+    }
+    return ERROR_SUCCESS;
+}
+
+/// <summary>
+/// Block routine for a chunked copy -- cut every whole chunk we can out of the data so far. Whatever
+/// is left, always less than CHUNK_MAX_SIZE, waits for the next block.
+/// </summary>
+/// <param name="offset">The offset of the block in the file</param>
+/// <param name="buffer">The block</param>
+/// <param name="length">The length of the block</param>
+/// <param name="writeBlock">Always set to FALSE -- nothing is written to a destination file</param>
+/// <param name="context">The t_chunkerState</param>
+/// <returns>0 on success, or the error storing a chunk</returns>
+static DWORD ChunkBlockRoutine(unsigned long long offset, const void* buffer, DWORD length, BOOL* writeBlock, void* context)
+{
+    t_chunkerState* state = (t_chunkerState*)context;
+    size_t start = 0;
+    DWORD error = ERROR_SUCCESS;
+
+    (void)offset; // the blocks come in order, so the chunker only needs their contents
+    *writeBlock = FALSE;
+    state->pending.insert(state->pending.end(), (const unsigned char*)buffer, (const unsigned char*)buffer + length);
+
+    while (state->pending.size() - start >= CHUNK_MAX_SIZE && !error) {
+        size_t chunkLength = FindChunkEnd(&state->pending[start], state->pending.size() - start);
+        error = EmitChunk(state, &state->pending[start], chunkLength);
+        start += chunkLength;
+    }
+
+    // one move of the remainder per block, rather than one per chunk
+    state->pending.erase(state->pending.begin(), state->pending.begin() + start);
+    return error;
+}
+
+/// <summary>
+/// Write a recipe. It is written alongside and then renamed over any previous recipe for the file.
+/// </summary>
+/// <param name="recipePath">The recipe file</param>
+/// <param name="information">The size, times and attributes of the source file</param>
+/// <param name="chunks">The chunks of the file, in order</param>
+/// <returns>0 on success, or the platform error code upon failure</returns>
+static DWORD SaveRecipe(const std::wstring& recipePath, const t_fileInformation& information, const std::vector<t_recipeChunk>& chunks)
+{
+    std::wstring temporaryPath = recipePath + L".tmp";
+    t_fileHandle file = INVALID_FILE_HANDLE;
+    std::string text;
+    unsigned long long offset = 0;
+    char line[128]{};
+    DWORD error = ERROR_SUCCESS;
+
+    error = PlatformOpenForWrite(temporaryPath, FALSE, TRUE, &file);
+    if (error) {
+        return error;
+    }
+
+    text.reserve(CHUNK_RECIPE_IO_CHUNK + 4096);
+    snprintf(line, sizeof(line), CHUNK_RECIPE_HEADER "\n%llu\t%llu\t%llu\t%lu\n", information.size, information.creationTime, information.lastWriteTime, (unsigned long)information.attributes);
+    text.append(line);
+
+    for (size_t i = 0; i < chunks.size() && !error; i++) {
+        snprintf(line, sizeof(line), "%s\t%lu\n", ChunkHashToHex(chunks[i].hash).c_str(), (unsigned long)chunks[i].length);
+        text.append(line);
+
+        if (text.size() >= CHUNK_RECIPE_IO_CHUNK) {
+            error = PlatformWriteAt(file, offset, text.data(), (DWORD)text.size());
+            offset += text.size();
+            text.clear();
+        }
+    }
+    if (!error && !text.empty()) {
+        error = PlatformWriteAt(file, offset, text.data(), (DWORD)text.size());
+    }
+
+    PlatformCloseFile(file);
+    if (!error) {
+        error = PlatformReplaceFile(temporaryPath, recipePath, FALSE);
+    }
+    return error;
+}
+
+/// <summary>
+/// Read a recipe.
+/// </summary>
+/// <param name="recipePath">The recipe file</param>
+/// <param name="information">Receives the size, times and attributes of the file</param>
+/// <param name="chunks">Receives the chunks of the file, in order</param>
+/// <returns>0 on success, ERROR_INVALID_DATA if the recipe is damaged, or another platform error</returns>
+static DWORD LoadRecipe(const std::wstring& recipePath, t_fileInformation* information, std::vector<t_recipeChunk>& chunks)
+{
+    t_fileHandle file = INVALID_FILE_HANDLE;
+    std::vector<char> buffer(CHUNK_RECIPE_IO_CHUNK);
+    std::string line;
+    unsigned long long offset = 0;
+    unsigned long long lineNumber = 0;
+    unsigned long long chunkBytes = 0;
+    DWORD bytesRead = 0;
+    DWORD error = ERROR_SUCCESS;
+
+    chunks.clear();
+    error = PlatformOpenForRead(recipePath, FALSE, &file);
+    if (error) {
+        return error;
+    }
+
+    do {
+        error = PlatformReadAt(file, offset, buffer.data(), (DWORD)buffer.size(), &bytesRead);
+        if (error) {
+            break;
+        }
+        offset += bytesRead;
+
+        for (DWORD i = 0; i < bytesRead && !error; i++) {
+            if (buffer[i] != '\n') {
+                line.push_back(buffer[i]);
+                continue;
+            }
+
+            if (lineNumber == 0) {
+                if (line != CHUNK_RECIPE_HEADER) {
+                    error = ERROR_INVALID_DATA;
+                }
+            }
+            else if (lineNumber == 1) {
+                unsigned long attributes = 0;
+                if (sscanf(line.c_str(), "%llu\t%llu\t%llu\t%lu", &information->size, &information->creationTime, &information->lastWriteTime, &attributes) != 4) {
+                    error = ERROR_INVALID_DATA;
+                }
+                information->attributes = (DWORD)attributes;
+            }
+            else {
+                t_recipeChunk chunk{};
+                size_t tab = line.find('\t');
+                char* end = nullptr;
+                if (tab == std::string::npos || !ChunkHashFromHex(line.substr(0, tab), &chunk.hash)) {
+                    error = ERROR_INVALID_DATA;
+                }
+                else {
+                    chunk.length = (DWORD)strtoul(line.c_str() + tab + 1, &end, 10);
+                    if (*end != '\0' || chunk.length == 0 || chunk.length > CHUNK_MAX_SIZE) {
+                        error = ERROR_INVALID_DATA;
+                    }
+                    chunkBytes += chunk.length;
+                    chunks.push_back(chunk);
+                }
+            }
+            lineNumber++;
+            line.clear();
+        }
+    } while (bytesRead > 0 && !error);
+
+    if (!error && (lineNumber < 2 || !line.empty() || chunkBytes != information->size)) {
+        error = ERROR_INVALID_DATA; // truncated, or the chunks do not add up to the file
+    }
+
+    PlatformCloseFile(file);
+    return error;
+}
+
+/// <summary>
+/// Copy a file into a chunk store. The source is read in large blocks as for BlockCopyFile, cut into
+/// content-defined chunks, and each chunk the store does not already have is written to it. A recipe
+/// listing the file's chunks is written in place of the destination file.
+/// </summary>
+/// <param name="sourcePathFile">The source path, with the snapshot device object already substituted in</param>
+/// <param name="recipePath">Where the recipe goes</param>
+/// <param name="options">Queue depth and buffering of the source reads</param>
+/// <param name="bufferPool">Where the block buffers come from</param>
+/// <param name="store">The chunk store, already opened</param>
+/// <param name="statistics">Receives the number of chunks and bytes in the file and newly stored</param>
+/// <param name="checksum">Optional. Receives the CRC32C of the source data.</param>
+/// <param name="progressRoutine">Optional. Called after each block is handled.</param>
+/// <param name="progressContext">Passed through to progressRoutine</param>
+/// <returns>0 on success, or the platform error code upon failure</returns>
+DWORD ChunkCopyFile(const std::wstring& sourcePathFile, const std::wstring& recipePath, const t_blockCopyOptions& options, BufferPool& bufferPool, ChunkStore& store, t_chunkStatistics* statistics, DWORD* checksum, t_blockCopyProgressRoutine progressRoutine, void* progressContext)
+{
+    t_fileHandle source = INVALID_FILE_HANDLE;
+    t_fileInformation sourceInformation{};
+    t_chunkerState state{};
+    DWORD error = ERROR_SUCCESS;
+
+    *statistics = t_chunkStatistics{};
+    state.store = &store;
+    state.throttle = options.throttle;
+    state.statistics = statistics;
+    state.pending.reserve(CHUNK_MAX_SIZE + bufferPool.BufferSize());
+
+    error = PlatformOpenForRead(sourcePathFile, options.unbuffered, &source);
+    if (!error) {
+        error = PlatformGetFileInformation(source, &sourceInformation);
+    }
+    if (!error) {
+        state.chunks.reserve((size_t)(sourceInformation.size / CHUNK_AVERAGE_SIZE) + 1);
+        error = CopyBlocks(source, INVALID_FILE_HANDLE, sourceInformation.size, options, bufferPool, checksum, &ChunkBlockRoutine, &state, progressRoutine, progressContext);
+    }
+
+    // the end of the file ends the last chunk, wherever it falls
+    size_t start = 0;
+    while (!error && start < state.pending.size()) {
+        size_t chunkLength = FindChunkEnd(&state.pending[start], state.pending.size() - start);
+        error = EmitChunk(&state, &state.pending[start], chunkLength);
+        start += chunkLength;
+    }
+
+    PlatformCloseFile(source);
+
+    if (!error) {
+        error = SaveRecipe(recipePath, sourceInformation, state.chunks);
+    }
+    return error;
+}
+
+/// <summary>
+/// Find the chunk store a recipe belongs to -- the nearest CHUNK_STORE_DIRECTORY in the recipe's
+/// directory or any directory above it.
+/// </summary>
+/// <param name="recipePath">The recipe file</param>
+/// <returns>The store directory, or an empty string if there is none</returns>
+std::wstring ChunkStoreForRecipe(const std::wstring& recipePath)
+{
+    std::wstring directory = recipePath;
+
+    for (;;) {
+        size_t separator = directory.find_last_of(PATH_SEPARATOR);
+        if (separator == std::wstring::npos) {
+            return std::wstring();
+        }
+        directory.resize(separator);
+
+        std::wstring storeDirectory = PlatformJoinPath(directory.empty() ? std::wstring(1, PATH_SEPARATOR) : directory, CHUNK_STORE_DIRECTORY);
+        if (PlatformPathExists(storeDirectory)) {
+            return storeDirectory;
+        }
+    }
+}
+
+/// <summary>
+/// Rebuild a file from its recipe and the chunk store, checking each chunk against its hash. The file
+/// gets back the times and attributes recorded in the recipe.
+/// </summary>
+/// <param name="recipePath">The recipe file</param>
+/// <param name="destinationPathFile">The file to write</param>
+/// <returns>0 on success, ERROR_PATH_NOT_FOUND if there is no chunk store above the recipe, ERROR_INVALID_DATA if the recipe or a chunk is damaged, or another platform error</returns>
+DWORD ChunkRestoreFile(const std::wstring& recipePath, const std::wstring& destinationPathFile)
+{
+    t_fileHandle destination = INVALID_FILE_HANDLE;
+    t_fileInformation information{};
+    std::vector<t_recipeChunk> chunks;
+    std::vector<unsigned char> buffer(CHUNK_MAX_SIZE);
+    unsigned long long offset = 0;
+    DWORD error = ERROR_SUCCESS;
+
+    std::wstring storeDirectory = ChunkStoreForRecipe(recipePath);
+    if (storeDirectory.empty()) {
+        return ERROR_PATH_NOT_FOUND;
+    }
+    ChunkStore store(storeDirectory);
+
+    error = LoadRecipe(recipePath, &information, chunks);
+    if (!error) {
+        error = PlatformOpenForWrite(destinationPathFile, FALSE, TRUE, &destination);
+    }
+    for (size_t i = 0; i < chunks.size() && !error; i++) {
+        error = store.Get(chunks[i].hash, buffer.data(), chunks[i].length);
+        if (!error) {
+            error = PlatformWriteAt(destination, offset, buffer.data(), chunks[i].length);
+        }
+        offset += chunks[i].length;
+    }
+    if (!error) {
+        error = PlatformSetFileSize(destination, information.size);
+    }
+    if (!error) {
+        error = PlatformSetFileInformation(destination, information);
+    }
+
+    PlatformCloseFile(destination);
+    return error;
+}
@@ -0,0 +1,78 @@
+/* ShadowDuplicator -- a simple VC++ Volume Shadow Copy requestor for backing up
+locked files
+
+Copyright (C) 2021-2023 Peter Upfold.
+
+Licensed under the Apache 2.0 Licence. See the LICENSE file in the project root for details.
+
+This code is **not** production quality. There is certainly plenty of potential for improvement of this code,
+but beyond that, it may even be insecure, destructive or cause you other serious problems. There
+is no warranty.
+*/
+#pragma once
+#include "Platform.h"
+#include "BlockCopy.h"
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <unordered_set>
+
+// the chunk store directory, inside the destination directory
+#define CHUNK_STORE_DIRECTORY L".sdchunks"
+
+// appended to a destination file to give the path of the recipe written in its place
+#define CHUNK_RECIPE_EXTENSION L".sdrecipe"
+
+// content-defined chunk sizes. Chunks are cut where the rolling hash says, but never outside these limits.
+#define CHUNK_MIN_SIZE (16 * 1024)
+#define CHUNK_AVERAGE_SIZE (64 * 1024)
+#define CHUNK_MAX_SIZE (256 * 1024)
+
+// the strong hash which names each chunk -- BLAKE2b-256
+#define CHUNK_HASH_SIZE 32
+
+typedef struct chunkHash {
+    unsigned char bytes[CHUNK_HASH_SIZE];
+} t_chunkHash;
+
+// What one file's chunking did to the store
+typedef struct chunkStatistics {
+    unsigned long long chunks;
+    unsigned long long bytes;
+    unsigned long long chunksStored;
+    unsigned long long bytesStored;
+} t_chunkStatistics;
+
+/// <summary>
+/// A directory of chunks, each stored once in a file named by the hash of its content, in one of 256
+/// subdirectories by the first byte of the hash. Put may be called from any number of threads at once,
+/// and only one of them checks or writes any one chunk.
+/// </summary>
+class ChunkStore {
+public:
+    ChunkStore(const std::wstring& storeDirectory);
+
+    DWORD Open(void);
+    DWORD Put(const t_chunkHash& hash, const void* data, DWORD length, BOOL* stored);
+    DWORD Get(const t_chunkHash& hash, void* data, DWORD length);
+    std::wstring ChunkPath(const t_chunkHash& hash);
+
+private:
+    std::wstring storeDirectory;
+
+    // hashes known to be in the store, so each is only looked for on disk once
+    std::unordered_set<std::string> knownChunks;
+    // hashes which one thread is checking or writing, which any other thread storing them waits for
+    std::unordered_set<std::string> pendingChunks;
+    std::mutex lock;
+    std::condition_variable chunkSettled;
+    std::atomic<unsigned long long> temporaryCounter;
+};
+
+void ChunkHashData(const void* data, size_t length, t_chunkHash* hash);
+std::string ChunkHashToHex(const t_chunkHash& hash);
+BOOL ChunkHashFromHex(const std::string& hex, t_chunkHash* hash);
+DWORD ChunkCopyFile(const std::wstring& sourcePathFile, const std::wstring& recipePath, const t_blockCopyOptions& options, BufferPool& bufferPool, ChunkStore& store, t_chunkStatistics* statistics, DWORD* checksum, t_blockCopyProgressRoutine progressRoutine, void* progressContext);
+DWORD ChunkRestoreFile(const std::wstring& recipePath, const std::wstring& destinationPathFile);
+std::wstring ChunkStoreForRecipe(const std::wstring& recipePath);
@@ -0,0 +1,754 @@
+/* ShadowDuplicator -- a simple VC++ Volume Shadow Copy requestor for backing up
+locked files
+
+Copyright (C) 2021-2023 Peter Upfold.
+
+Licensed under the Apache 2.0 Licence. See the LICENSE file in the project root for details.
+
+This code is **not** production quality. There is certainly plenty of potential for improvement of this code,
+but beyond that, it may even be insecure, destructive or cause you other serious problems. There
+is no warranty.
+*/
+
+#include "Compression.h"
+#include <cmath>
+#include <cstring>
+
+/*
+A compressed copy is written as <file>.sdz:
+
+    header (t_compressedHeader)
+    frames, one per block of the source, each compressed or stored as it is
+    frame index (one t_compressedFrameEntry per frame)
+    trailer (t_compressedTrailer), which gives the position of the index
+
+Every frame but the last holds exactly frameSize bytes of the source, so the frame holding any offset
+is found from the index without decompressing anything before it. Frames are compressed with the LZ4
+block format, which is simple enough to carry here and fast enough not to hold up the copy.
+*/
+
+#define COMPRESSED_MAGIC "SDZFILE1"
+#define COMPRESSED_INDEX_MAGIC "SDZINDEX"
+
+// frame flags
+#define FRAME_COMPRESSED 0x1
+
+// LZ4 block format limits
+#define LZ4_MIN_MATCH 4
+#define LZ4_LAST_LITERALS 5
+#define LZ4_MATCH_FIND_LIMIT 12
+#define LZ4_MAX_OFFSET 65535
+#define LZ4_HASH_BITS 14
+
+// how often, in bytes, the compressibility check samples a block, and how much it takes each time
+#define SAMPLE_STRIDE 16384
+#define SAMPLE_LENGTH 512
+
+// above this many bits of entropy per byte, a sample is taken to be compressed or encrypted already
+#define INCOMPRESSIBLE_ENTROPY_BITS 7.5
+
+typedef struct compressedHeader {
+    char magic[8];
+    DWORD frameSize;
+    DWORD reserved;
+    unsigned long long size;
+    unsigned long long creationTime;
+    unsigned long long lastWriteTime;
+    DWORD attributes;
+    DWORD reserved2;
+} t_compressedHeader;
+
+typedef struct compressedFrameEntry {
+    unsigned long long offset;
+    DWORD storedLength;
+    DWORD flags;
+} t_compressedFrameEntry;
+
+typedef struct compressedTrailer {
+    unsigned long long frameCount;
+    unsigned long long indexOffset;
+    char magic[8];
+} t_compressedTrailer;
+
+// State for the block routine while one file is compressed
+typedef struct compressState {
+    CompressionWorkers* workers;
+    t_fileHandle destination;
+    IoThrottle* throttle;
+    std::vector<t_compressionFrame> frames;
+    unsigned long long submitted;
+    unsigned long long written;
+    unsigned long long outputOffset;
+    std::vector<t_compressedFrameEntry> index;
+    t_compressionStatistics* statistics;
+} t_compressState;
+
+/// <summary>
+/// The most an LZ4 block can grow to, for data which does not compress at all.
+/// </summary>
+size_t CompressionBound(size_t length)
+{
+    return length + length / 255 + 16;
+}
+
+static inline DWORD ReadDword(const unsigned char* bytes)
+{
+    DWORD value;
+    memcpy(&value, bytes, sizeof(value));
+    return value;
+}
+
+static inline DWORD HashSequence(DWORD sequence)
+{
+    return (sequence * 2654435761U) >> (32 - LZ4_HASH_BITS);
+}
+
+/// <summary>
+/// Write an LZ4 length which did not fit in its token nibble.
+/// </summary>
+static inline unsigned char* WriteLength(unsigned char* output, size_t length)
+{
+    while (length >= 255) {
+        *output++ = 255;
+        length -= 255;
+    }
+    *output++ = (unsigned char)length;
+    return output;
+}
+
+/// <summary>
+/// Compress a frame into the LZ4 block format.
+/// </summary>
+/// <param name="input">The data</param>
+/// <param name="inputLength">The length of the data</param>
+/// <param name="output">Receives the compressed data</param>
+/// <param name="outputCapacity">The size of output. Compression stops and fails if it would be exceeded.</param>
+/// <param name="hashTable">Scratch space of (1 &lt;&lt; LZ4_HASH_BITS) DWORDs</param>
+/// <returns>The compressed length, or 0 if the output would not fit</returns>
+size_t CompressFrame(const void* input, size_t inputLength, void* output, size_t outputCapacity, DWORD* hashTable)
+{
+    const unsigned char* base = (const unsigned char*)input;
+    const unsigned char* ip = base;
+    const unsigned char* anchor = base;
+    const unsigned char* end = base + inputLength;
+    const unsigned char* matchLimit = end - LZ4_LAST_LITERALS;
+    const unsigned char* findLimit = end - LZ4_MATCH_FIND_LIMIT;
+    unsigned char* op = (unsigned char*)output;
+    unsigned char* outputEnd = op + outputCapacity;
+
+    memset(hashTable, 0, sizeof(DWORD) << LZ4_HASH_BITS);
+
+    if (inputLength > LZ4_MATCH_FIND_LIMIT) {
+        unsigned int searchCount = 1 << 6;
+        ip++;
+
+        while (ip < findLimit) {
+            DWORD sequence = ReadDword(ip);
+            DWORD hash = HashSequence(sequence);
+            const unsigned char* reference = base + hashTable[hash];
+            hashTable[hash] = (DWORD)(ip - base);
+
+            if (reference >= ip || ip - reference > LZ4_MAX_OFFSET || ReadDword(reference) != sequence) {
+                // the longer we go without a match, the bigger the steps -- incompressible data goes by quickly
+                ip += searchCount++ >> 6;
+                continue;
+            }
+            searchCount = 1 << 6;
+
+            while (ip > anchor && reference > base && ip[-1] == reference[-1]) {
+                ip--;
+                reference--;
+            }
+
+            const unsigned char* matchEnd = ip + LZ4_MIN_MATCH;
+            const unsigned char* referenceEnd = reference + LZ4_MIN_MATCH;
+            while (matchEnd < matchLimit && *matchEnd == *referenceEnd) {
+                matchEnd++;
+                referenceEnd++;
+            }
+
+            size_t literalLength = ip - anchor;
+            size_t matchLength = matchEnd - ip - LZ4_MIN_MATCH;
+            if (op + 1 + literalLength / 255 + 1 + literalLength + 2 + matchLength / 255 + 1 > outputEnd) {
+                return 0;
+            }
+
+            unsigned char* token = op++;
+            *token = (unsigned char)((literalLength >= 15 ? 15 : literalLength) << 4);
+            if (literalLength >= 15) {
+                op = WriteLength(op, literalLength - 15);
+            }
+            memcpy(op, anchor, literalLength);
+            op += literalLength;
+
+            size_t offset = ip - reference;
+            *op++ = (unsigned char)(offset & 0xFF);
+            *op++ = (unsigned char)(offset >> 8);
+
+            *token |= (unsigned char)(matchLength >= 15 ? 15 : matchLength);
+            if (matchLength >= 15) {
+                op = WriteLength(op, matchLength - 15);
+            }
+
+            ip = matchEnd;
+            anchor = ip;
+        }
+    }
+
+    // the block always ends with literals
+    size_t literalLength = end - anchor;
+    if (op + 1 + literalLength / 255 + 1 + literalLength > outputEnd) {
+        return 0;
+    }
+    *op++ = (unsigned char)((literalLength >= 15 ? 15 : literalLength) << 4);
+    if (literalLength >= 15) {
+        op = WriteLength(op, literalLength - 15);
+    }
+    memcpy(op, anchor, literalLength);
+    op += literalLength;
+
+    return op - (unsigned char*)output;
+}
+
+/// <summary>
+/// Decompress an LZ4 block, checking every length and offset against the buffers.
+/// </summary>
+/// <param name="input">The compressed data</param>
+/// <param name="inputLength">The length of the compressed data</param>
+/// <param name="output">Receives the data</param>
+/// <param name="outputLength">The exact length the data must decompress to</param>
+/// <returns>TRUE if the block was well formed and decompressed to exactly outputLength bytes</returns>
+BOOL DecompressFrame(const void* input, size_t inputLength, void* output, size_t outputLength)
+{
+    const unsigned char* ip = (const unsigned char*)input;
+    const unsigned char* inputEnd = ip + inputLength;
+    unsigned char* base = (unsigned char*)output;
+    unsigned char* op = base;
+    unsigned char* outputEnd = base + outputLength;
+
+    while (ip < inputEnd) {
+        unsigned char token = *ip++;
+        size_t length = token >> 4;
+        unsigned char more = 0;
+
+        if (length == 15) {
+            do {
+                if (ip >= inputEnd) {
+                    return FALSE;
+                }
+                more = *ip++;
+                length += more;
+            } while (more == 255);
+        }
+        if ((size_t)(inputEnd - ip) < length || (size_t)(outputEnd - op) < length) {
+            return FALSE;
+        }
+        memcpy(op, ip, length);
+        ip += length;
+        op += length;
+
+        if (ip == inputEnd) {
+            break; // the last sequence has no match
+        }
+
+        if (inputEnd - ip < 2) {
+            return FALSE;
+        }
+        size_t offset = ip[0] | ((size_t)ip[1] << 8);
+        ip += 2;
+        if (offset == 0 || offset > (size_t)(op - base)) {
+            return FALSE;
+        }
+
+        length = token & 0xF;
+        if (length == 15) {
+            do {
+                if (ip >= inputEnd) {
+                    return FALSE;
+                }
+                more = *ip++;
+                length += more;
+            } while (more == 255);
+        }
+        length += LZ4_MIN_MATCH;
+        if ((size_t)(outputEnd - op) < length) {
+            return FALSE;
+        }
+
+        // byte by byte, as the match may overlap what it is copying
+        const unsigned char* match = op - offset;
+        for (size_t i = 0; i < length; i++) {
+            op[i] = match[i];
+        }
+        op += length;
+    }
+
+    return op == outputEnd;
+}
+
+/// <summary>
+/// Estimate whether a block is worth compressing, from the byte entropy of small samples spread
+/// through it. Media, archives and encrypted data come out close to 8 bits per byte.
+/// </summary>
+/// <param name="data">The block</param>
+/// <param name="length">The length of the block</param>
+/// <returns>TRUE if compressing the block would be a waste of time</returns>
+BOOL CompressionLooksIncompressible(const void* data, size_t length)
+{
+    const unsigned char* bytes = (const unsigned char*)data;
+    unsigned int counts[256]{};
+    size_t sampled = 0;
+    double entropy = 0;
+
+    for (size_t offset = 0; offset < length; offset += SAMPLE_STRIDE) {
+        size_t sampleLength = (length - offset < SAMPLE_LENGTH) ? length - offset : SAMPLE_LENGTH;
+        for (size_t i = 0; i < sampleLength; i++) {
+            counts[bytes[offset + i]]++;
+        }
+        sampled += sampleLength;
+    }
+    if (sampled < SAMPLE_LENGTH) {
+        return FALSE; // too little to judge -- just try it
+    }
+
+    for (unsigned int count : counts) {
+        if (count > 0) {
+            double probability = (double)count / sampled;
+            entropy -= probability * log2(probability);
+        }
+    }
+    return entropy > INCOMPRESSIBLE_ENTROPY_BITS;
+}
+
+/// <summary>
+/// Start the worker threads.
+/// </summary>
+/// <param name="threadCount">Number of threads, at least 1</param>
+CompressionWorkers::CompressionWorkers(unsigned int threadCount) : stopping(false)
+{
+    if (threadCount < 1) {
+        threadCount = 1;
+    }
+    for (unsigned int i = 0; i < threadCount; i++) {
+        threads.emplace_back(&CompressionWorkers::WorkerMain, this);
+    }
+}
+
+/// <summary>
+/// Stop the worker threads. No frames may still be in flight.
+/// </summary>
+CompressionWorkers::~CompressionWorkers()
+{
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        stopping = true;
+    }
+    frameQueued.notify_all();
+    for (std::thread& thread : threads) {
+        thread.join();
+    }
+}
+
+/// <summary>
+/// Queue a frame. Its input and inputLength must be set, and its buffers must stay put until Wait returns.
+/// </summary>
+/// <param name="frame">The frame</param>
+void CompressionWorkers::Submit(t_compressionFrame* frame)
+{
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        frame->done = FALSE;
+        frame->error = ERROR_SUCCESS;
+        queue.push_back(frame);
+    }
+    frameQueued.notify_one();
+}
+
+/// <summary>
+/// Wait until a frame has been compressed or decompressed.
+/// </summary>
+/// <param name="frame">A frame passed to Submit</param>
+void CompressionWorkers::Wait(t_compressionFrame* frame)
+{
+    std::unique_lock<std::mutex> guard(lock);
+    frameDone.wait(guard, [frame] { return frame->done != FALSE; });
+}
+
+/// <summary>
+/// The number of worker threads.
+/// </summary>
+unsigned int CompressionWorkers::ThreadCount(void)
+{
+    return (unsigned int)threads.size();
+}
+
+/// <summary>
+/// Worker thread body -- take frames off the queue and compress or decompress them.
+/// </summary>
+void CompressionWorkers::WorkerMain(void)
+{
+    std::vector<DWORD> hashTable((size_t)1 << LZ4_HASH_BITS);
+
+    for (;;) {
+        t_compressionFrame* frame = nullptr;
+        {
+            std::unique_lock<std::mutex> guard(lock);
+            frameQueued.wait(guard, [this] { return stopping || !queue.empty(); });
+            if (queue.empty()) {
+                return;
+            }
+            frame = queue.front();
+            queue.pop_front();
+        }
+
+        if (frame->decompress) {
+            if (!DecompressFrame(frame->input.data(), frame->inputLength, frame->output.data(), frame->outputLength)) {
+                frame->error = ERROR_INVALID_DATA;
+            }
+        }
+        else {
+            frame->compressed = FALSE;
+            frame->outputLength = 0;
+            if (!CompressionLooksIncompressible(frame->input.data(), frame->inputLength)) {
+                // anything which does not come out smaller is stored as it is
+                size_t length = CompressFrame(frame->input.data(), frame->inputLength, frame->output.data(), frame->inputLength - 1, hashTable.data());
+                if (length > 0) {
+                    frame->compressed = TRUE;
+                    frame->outputLength = (DWORD)length;
+                }
+            }
+        }
+
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            frame->done = TRUE;
+        }
+        frameDone.notify_all();
+    }
+}
+
+/// <summary>
+/// Wait for the oldest frame in flight and append it to the compressed file.
+/// </summary>
+/// <param name="state">The compression state</param>
+/// <returns>0 on success, or the platform error code upon failure</returns>
+static DWORD WriteNextFrame(t_compressState* state)
+{
+    t_compressionFrame* frame = &state->frames[state->written % state->frames.size()];
+    t_compressedFrameEntry entry{};
+
+    state->workers->Wait(frame);
+    state->written++;
+
+    entry.offset = state->outputOffset;
+    entry.storedLength = frame->compressed ? frame->outputLength : frame->inputLength;
+    entry.flags = frame->compressed ? FRAME_COMPRESSED : 0;
+
+    if (state->throttle != nullptr) {
+        state->throttle->Write(entry.storedLength);
+    }
+    DWORD error = PlatformWriteAt(state->destination, entry.offset, frame->compressed ? frame->output.data() : frame->input.data(), entry.storedLength);
+    if (error) {
+        return error;
+    }
+
+    state->index.push_back(entry);
+    state->outputOffset += entry.storedLength;
+    state->statistics->frames++;
+    state->statistics->bytesIn += frame->inputLength;
+    state->statistics->bytesOut += entry.storedLength;
+    if (!frame->compressed) {
+        state->statistics->framesStored++;
+    }
+    return ERROR_SUCCESS;
+}
+
+/// <summary>
+/// Block routine for a compressed copy -- hand each block to the compression workers as a frame, and
+/// write out the oldest frame first if they are all in use.
+/// </summary>
+/// <param name="offset">The offset of the block in the file</param>
+/// <param name="buffer">The block</param>
+/// <param name="length">The length of the block</param>
+/// <param name="writeBlock">Always set to FALSE -- frames are written by WriteNextFrame</param>
+/// <param name="context">The t_compressState</param>
+/// <returns>0 on success, or the error writing a frame</returns>
+static DWORD CompressBlockRoutine(unsigned long long offset, const void* buffer, DWORD length, BOOL* writeBlock, void* context)
+{
+    t_compressState* state = (t_compressState*)context;
+    DWORD error = ERROR_SUCCESS;
+
+    (void)offset; // frames are written one after another, in the order the blocks come in
+    *writeBlock = FALSE;
+    if (state->submitted - state->written == state->frames.size()) {
+        error = WriteNextFrame(state);
+        if (error) {
+            return error;
+        }
+    }
+
+    t_compressionFrame* frame = &state->frames[state->submitted % state->frames.size()];
+    memcpy(frame->input.data(), buffer, length);
+    frame->inputLength = length;
+    state->workers->Submit(frame);
+    state->submitted++;
+    return ERROR_SUCCESS;
+}
+
+/// <summary>
+/// Copy a file to a compressed copy of it. Blocks are read as for BlockCopyFile and compressed as
+/// independent frames on all of the compression workers, then written in order followed by the
+/// frame index. The compressed copy gets the source's times and attributes.
+/// </summary>
+/// <param name="sourcePathFile">The source path, with the snapshot device object already substituted in</param>
+/// <param name="compressedPathFile">The compressed file to write</param>
+/// <param name="options">Queue depth and buffering of the source reads</param>
+/// <param name="bufferPool">Where the block buffers come from. Its buffer size is the frame size.</param>
+/// <param name="workers">The compression workers</param>
+/// <param name="statistics">Receives the number of frames and bytes before and after compression</param>
+/// <param name="checksum">Optional. Receives the CRC32C of the source data.</param>
+/// <param name="progressRoutine">Optional. Called after each block is handled.</param>
+/// <param name="progressContext">Passed through to progressRoutine</param>
+/// <returns>0 on success, or the platform error code upon failure</returns>
+DWORD CompressCopyFile(const std::wstring& sourcePathFile, const std::wstring& compressedPathFile, const t_blockCopyOptions& options, BufferPool& bufferPool, CompressionWorkers& workers, t_compressionStatistics* statistics, DWORD* checksum, t_blockCopyProgressRoutine progressRoutine, void* progressContext)
+{
+    t_fileHandle source = INVALID_FILE_HANDLE;
+    t_fileInformation sourceInformation{};
+    t_compressedHeader header{};
+    t_compressedTrailer trailer{};
+    t_compressState state{};
+    DWORD frameSize = bufferPool.BufferSize();
+    DWORD error = ERROR_SUCCESS;
+
+    *statistics = t_compressionStatistics{};
+    state.workers = &workers;
+    state.destination = INVALID_FILE_HANDLE;
+    state.throttle = options.throttle;
+    state.statistics = statistics;
+    state.outputOffset = sizeof(header);
+
+    error = PlatformOpenForRead(sourcePathFile, options.unbuffered, &source);
+    if (!error) {
+        error = PlatformGetFileInformation(source, &sourceInformation);
+    }
+    if (!error) {
+        // compressed frames are of any length, so the compressed file is always written through the cache
+        error = PlatformOpenForWrite(compressedPathFile, FALSE, TRUE, &state.destination);
+    }
+    if (!error) {
+        // enough frames in flight to keep every worker busy on this file alone
+        unsigned long long frameCount = (sourceInformation.size + frameSize - 1) / frameSize;
+        size_t inFlight = workers.ThreadCount() + 1;
+        if (inFlight > frameCount) {
+            inFlight = (size_t)frameCount;
+        }
+        state.frames.resize(inFlight);
+        for (t_compressionFrame& frame : state.frames) {
+            frame.decompress = FALSE;
+            frame.input.resize(frameSize);
+            frame.output.resize(frameSize);
+        }
+        state.index.reserve((size_t)frameCount);
+
+        error = CopyBlocks(source, INVALID_FILE_HANDLE, sourceInformation.size, options, bufferPool, checksum, &CompressBlockRoutine, &state, progressRoutine, progressContext);
+    }
+
+    // write the frames still in flight, or after a failure just wait for them
+    while (state.written < state.submitted) {
+        if (error) {
+            workers.Wait(&state.frames[state.written++ % state.frames.size()]);
+        }
+        else {
+            error = WriteNextFrame(&state);
+        }
+    }
+
+    if (!error) {
+        trailer.frameCount = state.index.size();
+        trailer.indexOffset = state.outputOffset;
+        memcpy(trailer.magic, COMPRESSED_INDEX_MAGIC, sizeof(trailer.magic));
+        if (!state.index.empty()) {
+            error = PlatformWriteAt(state.destination, state.outputOffset, state.index.data(), (DWORD)(state.index.size() * sizeof(t_compressedFrameEntry)));
+        }
+    }
+    if (!error) {
+        error = PlatformWriteAt(state.destination, trailer.indexOffset + state.index.size() * sizeof(t_compressedFrameEntry), &trailer, sizeof(trailer));
+    }
+    if (!error) {
+        memcpy(header.magic, COMPRESSED_MAGIC, sizeof(header.magic));
+        header.frameSize = frameSize;
+        header.size = sourceInformation.size;
+        header.creationTime = sourceInformation.creationTime;
+        header.lastWriteTime = sourceInformation.lastWriteTime;
+        header.attributes = sourceInformation.attributes;
+        error = PlatformWriteAt(state.destination, 0, &header, sizeof(header));
+    }
+    if (!error) {
+        // the compressed copy carries the source's times and attributes, as a plain copy would
+        t_fileInformation compressedInformation = sourceInformation;
+        compressedInformation.size = trailer.indexOffset + state.index.size() * sizeof(t_compressedFrameEntry) + sizeof(trailer);
+        error = PlatformSetFileInformation(state.destination, compressedInformation);
+    }
+
+    PlatformCloseFile(state.destination);
+    PlatformCloseFile(source);
+    return error;
+}
+
+/// <summary>
+/// Read and check the header and frame index of a compressed file.
+/// </summary>
+/// <param name="file">The compressed file</param>
+/// <param name="header">Receives the header</param>
+/// <param name="index">Receives the frame index</param>
+/// <returns>0 on success, ERROR_INVALID_DATA if the file is not a well formed compressed file, or another platform error</returns>
+static DWORD ReadFrameIndex(t_fileHandle file, t_compressedHeader* header, std::vector<t_compressedFrameEntry>& index)
+{
+    t_fileInformation information{};
+    t_compressedTrailer trailer{};
+    DWORD bytesRead = 0;
+    DWORD error = PlatformGetFileInformation(file, &information);
+
+    if (!error && information.size < sizeof(*header) + sizeof(trailer)) {
+        error = ERROR_INVALID_DATA;
+    }
+    if (!error) {
+        error = PlatformReadAt(file, 0, header, sizeof(*header), &bytesRead);
+    }
+    if (!error && (bytesRead != sizeof(*header) || memcmp(header->magic, COMPRESSED_MAGIC, sizeof(header->magic)) != 0 || header->frameSize == 0)) {
+        error = ERROR_INVALID_DATA;
+    }
+    if (!error) {
+        error = PlatformReadAt(file, information.size - sizeof(trailer), &trailer, sizeof(trailer), &bytesRead);
+    }
+    if (!error && (bytesRead != sizeof(trailer) || memcmp(trailer.magic, COMPRESSED_INDEX_MAGIC, sizeof(trailer.magic)) != 0 ||
+        trailer.frameCount != (header->size + header->frameSize - 1) / header->frameSize ||
+        trailer.indexOffset + trailer.frameCount * sizeof(t_compressedFrameEntry) + sizeof(trailer) != information.size)) {
+        error = ERROR_INVALID_DATA;
+    }
+    if (error) {
+        return error;
+    }
+
+    index.resize((size_t)trailer.frameCount);
+    if (!index.empty()) {
+        DWORD length = (DWORD)(index.size() * sizeof(t_compressedFrameEntry));
+        error = PlatformReadAt(file, trailer.indexOffset, index.data(), length, &bytesRead);
+        if (!error && bytesRead != length) {
+            error = ERROR_INVALID_DATA;
+        }
+    }
+
+    // every frame must lie between the header and the index, and only the last may be short
+    unsigned long long expectedOffset = sizeof(*header);
+    for (size_t i = 0; i < index.size() && !error; i++) {
+        unsigned long long frameLength = (i + 1 < index.size()) ? header->frameSize : header->size - (unsigned long long)i * header->frameSize;
+        if (index[i].offset != expectedOffset || index[i].storedLength > header->frameSize ||
+            (!(index[i].flags & FRAME_COMPRESSED) && index[i].storedLength != frameLength)) {
+            error = ERROR_INVALID_DATA;
+        }
+        expectedOffset += index[i].storedLength;
+    }
+    if (!error && expectedOffset != trailer.indexOffset) {
+        error = ERROR_INVALID_DATA;
+    }
+    return error;
+}
+
+/// <summary>
+/// Rebuild a file from its compressed copy, decompressing its frames on all of the compression workers.
+/// The file gets back the times and attributes of the original.
+/// </summary>
+/// <param name="compressedPathFile">The compressed file</param>
+/// <param name="destinationPathFile">The file to write</param>
+/// <param name="workers">The compression workers</param>
+/// <returns>0 on success, ERROR_INVALID_DATA if the compressed file is damaged, or another platform error</returns>
+DWORD DecompressFile(const std::wstring& compressedPathFile, const std::wstring& destinationPathFile, CompressionWorkers& workers)
+{
+    t_fileHandle source = INVALID_FILE_HANDLE;
+    t_fileHandle destination = INVALID_FILE_HANDLE;
+    t_compressedHeader header{};
+    std::vector<t_compressedFrameEntry> index;
+    std::vector<t_compressionFrame> frames(workers.ThreadCount() + 1);
+    size_t submitted = 0;
+    size_t written = 0;
+    DWORD bytesRead = 0;
+    DWORD error = ERROR_SUCCESS;
+
+    error = PlatformOpenForRead(compressedPathFile, FALSE, &source);
+    if (!error) {
+        error = ReadFrameIndex(source, &header, index);
+    }
+    if (!error) {
+        error = PlatformOpenForWrite(destinationPathFile, FALSE, TRUE, &destination);
+    }
+    if (!error) {
+        for (t_compressionFrame& frame : frames) {
+            frame.decompress = TRUE;
+            frame.input.resize(header.frameSize);
+            frame.output.resize(header.frameSize);
+        }
+    }
+
+    while (!error && written < index.size()) {
+        // read ahead until every frame buffer is in use, then write out the oldest
+        if (submitted < index.size() && submitted - written < frames.size()) {
+            t_compressionFrame* frame = &frames[submitted % frames.size()];
+            const t_compressedFrameEntry& entry = index[submitted];
+            DWORD frameLength = (DWORD)((submitted + 1 < index.size()) ? header.frameSize : header.size - (unsigned long long)submitted * header.frameSize);
+
+            error = PlatformReadAt(source, entry.offset, frame->input.data(), entry.storedLength, &bytesRead);
+            if (!error && bytesRead != entry.storedLength) {
+                error = ERROR_INVALID_DATA;
+            }
+            if (error) {
+                break;
+            }
+
+            if (entry.flags & FRAME_COMPRESSED) {
+                frame->inputLength = entry.storedLength;
+                frame->outputLength = frameLength;
+                frame->compressed = TRUE;
+                workers.Submit(frame);
+            }
+            else {
+                frame->inputLength = frameLength;
+                frame->compressed = FALSE;
+                frame->error = ERROR_SUCCESS;
+                frame->done = TRUE;
+            }
+            submitted++;
+            continue;
+        }
+
+        t_compressionFrame* frame = &frames[written % frames.size()];
+        workers.Wait(frame);
+        error = frame->error;
+        if (!error) {
+            error = PlatformWriteAt(destination, (unsigned long long)written * header.frameSize,
+                frame->compressed ? frame->output.data() : frame->input.data(), frame->compressed ? frame->outputLength : frame->inputLength);
+        }
+        written++;
+    }
+
+    // after a failure, the workers must be finished with our frames before they go
+    while (written < submitted) {
+        workers.Wait(&frames[written++ % frames.size()]);
+    }
+
+    if (!error) {
+        error = PlatformSetFileSize(destination, header.size);
+    }
+    if (!error) {
+        t_fileInformation information{};
+        information.size = header.size;
+        information.creationTime = header.creationTime;
+        information.lastWriteTime = header.lastWriteTime;
+        information.attributes = header.attributes;
+        error = PlatformSetFileInformation(destination, information);
+    }
+
+    PlatformCloseFile(destination);
+    PlatformCloseFile(source);
+    return error;
+}
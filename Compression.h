@@ -0,0 +1,75 @@
+/* ShadowDuplicator -- a simple VC++ Volume Shadow Copy requestor for backing up
+locked files
+
+Copyright (C) 2021-2023 Peter Upfold.
+
+Licensed under the Apache 2.0 Licence. See the LICENSE file in the project root for details.
+
+This code is **not** production quality. There is certainly plenty of potential for improvement of this code,
+but beyond that, it may even be insecure, destructive or cause you other serious problems. There
+is no warranty.
+*/
+#pragma once
+#include "Platform.h"
+#include "BlockCopy.h"
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// appended to a destination file to give the path of its compressed copy
+#define COMPRESSED_EXTENSION L".sdz"
+
+// One frame on its way through the compression workers. Frames are compressed or decompressed
+// independently of each other, so any number can be in flight at once.
+typedef struct compressionFrame {
+    BOOL decompress;
+    std::vector<unsigned char> input;
+    DWORD inputLength;
+    std::vector<unsigned char> output;
+    DWORD outputLength;
+    BOOL compressed;
+    BOOL done;
+    DWORD error;
+} t_compressionFrame;
+
+// What compressing one file did
+typedef struct compressionStatistics {
+    unsigned long long frames;
+    unsigned long long framesStored;
+    unsigned long long bytesIn;
+    unsigned long long bytesOut;
+} t_compressionStatistics;
+
+/// <summary>
+/// A pool of threads which compress and decompress frames, shared by all of the copy workers so that
+/// even a single large file is compressed on every core.
+/// </summary>
+class CompressionWorkers {
+public:
+    CompressionWorkers(unsigned int threadCount);
+    ~CompressionWorkers();
+
+    void Submit(t_compressionFrame* frame);
+    void Wait(t_compressionFrame* frame);
+    unsigned int ThreadCount(void);
+
+private:
+    void WorkerMain(void);
+
+    std::vector<std::thread> threads;
+    std::deque<t_compressionFrame*> queue;
+    std::mutex lock;
+    std::condition_variable frameQueued;
+    std::condition_variable frameDone;
+    bool stopping;
+};
+
+size_t CompressionBound(size_t length);
+size_t CompressFrame(const void* input, size_t inputLength, void* output, size_t outputCapacity, DWORD* hashTable);
+BOOL DecompressFrame(const void* input, size_t inputLength, void* output, size_t outputLength);
+BOOL CompressionLooksIncompressible(const void* data, size_t length);
+DWORD CompressCopyFile(const std::wstring& sourcePathFile, const std::wstring& compressedPathFile, const t_blockCopyOptions& options, BufferPool& bufferPool, CompressionWorkers& workers, t_compressionStatistics* statistics, DWORD* checksum, t_blockCopyProgressRoutine progressRoutine, void* progressContext);
+DWORD DecompressFile(const std::wstring& compressedPathFile, const std::wstring& destinationPathFile, CompressionWorkers& workers);
@@ -0,0 +1,184 @@
+/* ShadowDuplicator -- a simple VC++ Volume Shadow Copy requestor for backing up
+locked files
+
+Copyright (C) 2021-2023 Peter Upfold.
+
+Licensed under the Apache 2.0 Licence. See the LICENSE file in the project root for details.
+
+This code is **not** production quality. There is certainly plenty of potential for improvement of this code,
+but beyond that, it may even be insecure, destructive or cause you other serious problems. There
+is no warranty.
+*/
+
+#include "CopyEngine.h"
+
+/// <summary>
+/// Start the worker threads. Jobs may be submitted as soon as the constructor returns.
+/// </summary>
+/// <param name="threadCount">Number of copy worker threads, clamped to 1..MAX_COPY_THREADS</param>
+/// <param name="copyRoutine">Performs the copy for each job</param>
+/// <param name="resultRoutine">Optional. Receives each result as the job completes</param>
+/// <param name="context">Passed through to both routines</param>
+/// <param name="stopOnFailure">If TRUE, the first failed job cancels all jobs which have not yet started</param>
+CopyWorkerPool::CopyWorkerPool(unsigned int threadCount, t_copyRoutine copyRoutine, t_resultRoutine resultRoutine, void* context, BOOL stopOnFailure)
+    : peakQueueDepth(0), copyRoutine(copyRoutine), resultRoutine(resultRoutine), context(context), stopOnFailure(stopOnFailure),
+    closed(FALSE), cancelled(FALSE), copiedCount(0), failedCount(0), lastError(ERROR_SUCCESS)
+{
+    if (threadCount < 1) {
+        threadCount = 1;
+    }
+    if (threadCount > MAX_COPY_THREADS) {
+        threadCount = MAX_COPY_THREADS;
+    }
+    queueCapacity = (size_t)threadCount * COPY_QUEUE_JOBS_PER_THREAD;
+
+    workers.reserve(threadCount);
+    for (unsigned int i = 0; i < threadCount; i++) {
+        workers.emplace_back(&CopyWorkerPool::WorkerMain, this);
+    }
+}
+
+/// <summary>
+/// Ensure the workers are joined if Finish was never called.
+/// </summary>
+CopyWorkerPool::~CopyWorkerPool()
+{
+    Cancel();
+    Finish();
+}
+
+/// <summary>
+/// Queue a copy job. Blocks while the queue is full, so that the producer cannot run arbitrarily far
+/// ahead of the copy workers.
+/// </summary>
+/// <param name="job">The job to queue</param>
+/// <returns>TRUE if the job was queued, FALSE if the pool has been cancelled or finished</returns>
+BOOL CopyWorkerPool::Submit(t_copyJob job)
+{
+    std::unique_lock<std::mutex> lock(queueLock);
+    spaceAvailable.wait(lock, [this] { return queue.size() < queueCapacity || cancelled || closed; });
+    if (cancelled || closed) {
+        return FALSE;
+    }
+    queue.push_back(std::move(job));
+    if (queue.size() > peakQueueDepth) {
+        peakQueueDepth = queue.size();
+    }
+    jobAvailable.notify_one();
+    return TRUE;
+}
+
+/// <summary>
+/// Stop accepting jobs, wait for the queued jobs to drain and join the workers.
+/// </summary>
+/// <param name=""></param>
+/// <returns>0 if every job succeeded, otherwise the error of the last job that failed</returns>
+DWORD CopyWorkerPool::Finish(void)
+{
+    {
+        std::lock_guard<std::mutex> lock(queueLock);
+        closed = TRUE;
+    }
+    jobAvailable.notify_all();
+    spaceAvailable.notify_all();
+
+    for (std::thread& worker : workers) {
+        if (worker.joinable()) {
+            worker.join();
+        }
+    }
+    workers.clear();
+
+    std::lock_guard<std::mutex> lock(queueLock);
+    if (lastError == ERROR_SUCCESS && cancelled && failedCount == 0 && !queue.empty()) {
+        // cancelled from outside with work outstanding -- do not report success
+        lastError = ERROR_OPERATION_ABORTED;
+    }
+    queue.clear();
+    return lastError;
+}
+
+/// <summary>
+/// Discard any jobs which have not yet started. Jobs already in progress will complete.
+/// </summary>
+/// <param name=""></param>
+void CopyWorkerPool::Cancel(void)
+{
+    {
+        std::lock_guard<std::mutex> lock(queueLock);
+        cancelled = TRUE;
+    }
+    jobAvailable.notify_all();
+    spaceAvailable.notify_all();
+}
+
+/// <summary>
+/// Number of jobs which have completed successfully so far.
+/// </summary>
+unsigned long long CopyWorkerPool::CopiedCount(void)
+{
+    std::lock_guard<std::mutex> lock(queueLock);
+    return copiedCount;
+}
+
+/// <summary>
+/// Number of jobs which have failed so far.
+/// </summary>
+unsigned long long CopyWorkerPool::FailedCount(void)
+{
+    std::lock_guard<std::mutex> lock(queueLock);
+    return failedCount;
+}
+
+/// <summary>
+/// The most jobs which have been waiting in the queue at once. At the queue's capacity, the copy workers
+/// were the bottleneck; well below it, finding the files was.
+/// </summary>
+size_t CopyWorkerPool::PeakQueueDepth(void)
+{
+    std::lock_guard<std::mutex> lock(queueLock);
+    return peakQueueDepth;
+}
+
+/// <summary>
+/// Worker thread body -- pull jobs until the queue is closed and empty, or the pool is cancelled.
+/// </summary>
+/// <param name=""></param>
+void CopyWorkerPool::WorkerMain(void)
+{
+    for (;;) {
+        t_copyJob job;
+        {
+            std::unique_lock<std::mutex> lock(queueLock);
+            jobAvailable.wait(lock, [this] { return !queue.empty() || closed || cancelled; });
+            if (cancelled || queue.empty()) {
+                return;
+            }
+            job = std::move(queue.front());
+            queue.pop_front();
+        }
+        spaceAvailable.notify_one();
+
+        t_copyResult result{};
+        result.job = &job;
+        result.error = copyRoutine(job, context);
+
+        if (resultRoutine != nullptr) {
+            resultRoutine(result, context);
+        }
+
+        std::lock_guard<std::mutex> lock(queueLock);
+        if (result.error) {
+            failedCount++;
+            lastError = result.error;
+            if (stopOnFailure) {
+                cancelled = TRUE;
+                jobAvailable.notify_all();
+                spaceAvailable.notify_all();
+            }
+        }
+        else {
+            copiedCount++;
+        }
+    }
+}
@@ -0,0 +1,87 @@
+/* ShadowDuplicator -- a simple VC++ Volume Shadow Copy requestor for backing up
+locked files
+
+Copyright (C) 2021-2023 Peter Upfold.
+
+Licensed under the Apache 2.0 Licence. See the LICENSE file in the project root for details.
+
+This code is **not** production quality. There is certainly plenty of potential for improvement of this code,
+but beyond that, it may even be insecure, destructive or cause you other serious problems. There
+is no warranty.
+*/
+#pragma once
+#include "Platform.h"
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#define DEFAULT_COPY_THREADS 4
+#define MAX_COPY_THREADS 64
+
+// how many queued jobs we allow per worker before Submit blocks the producer
+#define COPY_QUEUE_JOBS_PER_THREAD 4
+
+// A single file to be copied, with the source metadata found when it was enumerated
+typedef struct copyJob {
+    std::wstring source;
+    std::wstring destination;
+    std::wstring relativePath; // the destination path relative to the destination directory
+    unsigned long long size;
+    unsigned long long lastWriteTime;
+    DWORD attributes;
+    unsigned int fileSet; // the index of the run's file set which the job belongs to
+} t_copyJob;
+
+// The outcome of a single copy job
+typedef struct copyResult {
+    const t_copyJob* job;
+    DWORD error;
+} t_copyResult;
+
+// Performs the copy for one job. Called concurrently from the worker threads.
+typedef DWORD (*t_copyRoutine)(const t_copyJob& job, void* context);
+
+// Receives each result as a job completes. Called concurrently from the worker threads.
+typedef void (*t_resultRoutine)(const t_copyResult& result, void* context);
+
+/// <summary>
+/// A bounded pool of worker threads which pull copy jobs from a queue.
+/// </summary>
+class CopyWorkerPool {
+public:
+    CopyWorkerPool(unsigned int threadCount, t_copyRoutine copyRoutine, t_resultRoutine resultRoutine, void* context, BOOL stopOnFailure);
+    ~CopyWorkerPool();
+
+    BOOL Submit(t_copyJob job);
+    DWORD Finish(void);
+    void Cancel(void);
+
+    unsigned long long CopiedCount(void);
+    unsigned long long FailedCount(void);
+    size_t PeakQueueDepth(void);
+
+private:
+    void WorkerMain(void);
+
+    std::vector<std::thread> workers;
+    std::deque<t_copyJob> queue;
+    std::mutex queueLock;
+    std::condition_variable jobAvailable;
+    std::condition_variable spaceAvailable;
+    size_t queueCapacity;
+    size_t peakQueueDepth;
+
+    t_copyRoutine copyRoutine;
+    t_resultRoutine resultRoutine;
+    void* context;
+    BOOL stopOnFailure;
+
+    BOOL closed;
+    BOOL cancelled;
+    unsigned long long copiedCount;
+    unsigned long long failedCount;
+    DWORD lastError;
+};
@@ -0,0 +1,343 @@
+/* ShadowDuplicator -- a simple VC++ Volume Shadow Copy requestor for backing up
+locked files
+
+Copyright (C) 2021-2023 Peter Upfold.
+
+Licensed under the Apache 2.0 Licence. See the LICENSE file in the project root for details.
+
+This code is **not** production quality. There is certainly plenty of potential for improvement of this code,
+but beyond that, it may even be insecure, destructive or cause you other serious problems. There
+is no warranty.
+*/
+
+#include "Delta.h"
+#include <cstring>
+#include <vector>
+
+/*
+A delta copy hashes every block of the source as it passes through CopyBlocks and only writes the blocks
+whose hash differs from the one recorded for the same block of the destination last time. The hashes
+live in a sidecar file next to the destination file:
+
+    header (t_deltaSidecarHeader), then one 64-bit hash per block, in native byte order
+
+The header records the destination's size and last write time as we left them, so that a destination
+changed by anything else since is detected and rewritten in full.
+*/
+
+#define DELTA_SIDECAR_MAGIC "SDBLOCK1"
+
+// how many hashes we read from a sidecar at once
+#define DELTA_SIDECAR_READ_HASHES (1024 * 1024)
+
+typedef struct deltaSidecarHeader {
+    char magic[8];
+    DWORD blockSize;
+    DWORD reserved;
+    unsigned long long fileSize;
+    unsigned long long lastWriteTime;
+    unsigned long long blockCount;
+} t_deltaSidecarHeader;
+
+// State for the block routine during one delta copy
+typedef struct deltaState {
+    DWORD blockSize;
+    const std::vector<unsigned long long>* previousHashes;
+    std::vector<unsigned long long> hashes;
+    t_deltaStatistics* statistics;
+} t_deltaState;
+
+// XXH64 constants
+#define PRIME64_1 0x9E3779B185EBCA87ULL
+#define PRIME64_2 0xC2B2AE3D27D4EB4FULL
+#define PRIME64_3 0x165667B19E3779F9ULL
+#define PRIME64_4 0x85EBCA77C2B2AE63ULL
+#define PRIME64_5 0x27D4EB2F165667C5ULL
+
+static inline unsigned long long RotateLeft64(unsigned long long value, int bits)
+{
+    return (value << bits) | (value >> (64 - bits));
+}
+
+static inline unsigned long long Read64(const unsigned char* bytes)
+{
+    unsigned long long value;
+    memcpy(&value, bytes, sizeof(value));
+    return value;
+}
+
+static inline unsigned long long Read32(const unsigned char* bytes)
+{
+    DWORD value;
+    memcpy(&value, bytes, sizeof(value));
+    return value;
+}
+
+static inline unsigned long long HashRound(unsigned long long accumulator, unsigned long long input)
+{
+    accumulator += input * PRIME64_2;
+    accumulator = RotateLeft64(accumulator, 31);
+    return accumulator * PRIME64_1;
+}
+
+static inline unsigned long long HashMerge(unsigned long long hash, unsigned long long accumulator)
+{
+    hash ^= HashRound(0, accumulator);
+    return hash * PRIME64_1 + PRIME64_4;
+}
+
+/// <summary>
+/// Hash one block with XXH64 (seed 0). It runs at several GB/s, so hashing does not slow down a copy
+/// which is waiting on the disk anyway.
+/// </summary>
+/// <param name="buffer">The data</param>
+/// <param name="length">The length of the data in bytes</param>
+/// <returns>The hash</returns>
+unsigned long long DeltaHashBlock(const void* buffer, size_t length)
+{
+    const unsigned char* bytes = (const unsigned char*)buffer;
+    const unsigned char* end = bytes + length;
+    unsigned long long hash;
+
+    if (length >= 32) {
+        unsigned long long v1 = PRIME64_1 + PRIME64_2;
+        unsigned long long v2 = PRIME64_2;
+        unsigned long long v3 = 0;
+        unsigned long long v4 = 0 - PRIME64_1;
+
+        do {
+            v1 = HashRound(v1, Read64(bytes));
+            v2 = HashRound(v2, Read64(bytes + 8));
+            v3 = HashRound(v3, Read64(bytes + 16));
+            v4 = HashRound(v4, Read64(bytes + 24));
+            bytes += 32;
+        } while (bytes + 32 <= end);
+
+        hash = RotateLeft64(v1, 1) + RotateLeft64(v2, 7) + RotateLeft64(v3, 12) + RotateLeft64(v4, 18);
+        hash = HashMerge(hash, v1);
+        hash = HashMerge(hash, v2);
+        hash = HashMerge(hash, v3);
+        hash = HashMerge(hash, v4);
+    }
+    else {
+        hash = PRIME64_5;
+    }
+
+    hash += length;
+
+    while (bytes + 8 <= end) {
+        hash ^= HashRound(0, Read64(bytes));
+        hash = RotateLeft64(hash, 27) * PRIME64_1 + PRIME64_4;
+        bytes += 8;
+    }
+    if (bytes + 4 <= end) {
+        hash ^= Read32(bytes) * PRIME64_1;
+        hash = RotateLeft64(hash, 23) * PRIME64_2 + PRIME64_3;
+        bytes += 4;
+    }
+    while (bytes < end) {
+        hash ^= (*bytes) * PRIME64_5;
+        hash = RotateLeft64(hash, 11) * PRIME64_1;
+        bytes++;
+    }
+
+    hash ^= hash >> 33;
+    hash *= PRIME64_2;
+    hash ^= hash >> 29;
+    hash *= PRIME64_3;
+    hash ^= hash >> 32;
+    return hash;
+}
+
+/// <summary>
+/// Read the block hashes recorded for a destination file, if they still describe it.
+/// </summary>
+/// <param name="sidecarPath">The sidecar file</param>
+/// <param name="blockSize">The block size of this copy -- hashes of a different block size are no use</param>
+/// <param name="destinationInformation">The destination file as it is now</param>
+/// <param name="hashes">Receives the hashes, or is left empty if there are none we can trust</param>
+static void LoadSidecar(const std::wstring& sidecarPath, DWORD blockSize, const t_fileInformation& destinationInformation, std::vector<unsigned long long>& hashes)
+{
+    t_fileHandle file = INVALID_FILE_HANDLE;
+    t_deltaSidecarHeader header{};
+    unsigned long long offset = 0;
+    DWORD bytesRead = 0;
+    DWORD error = ERROR_SUCCESS;
+
+    hashes.clear();
+
+    if (PlatformOpenForRead(sidecarPath, FALSE, &file)) {
+        return; // no sidecar -- the first delta copy of this file
+    }
+
+    error = PlatformReadAt(file, 0, &header, sizeof(header), &bytesRead);
+    if (error || bytesRead != sizeof(header) || memcmp(header.magic, DELTA_SIDECAR_MAGIC, sizeof(header.magic)) != 0 ||
+        header.blockSize != blockSize || header.fileSize != destinationInformation.size ||
+        header.lastWriteTime != destinationInformation.lastWriteTime ||
+        header.blockCount != (header.fileSize + blockSize - 1) / blockSize) {
+        PlatformCloseFile(file);
+        return;
+    }
+
+    hashes.resize(header.blockCount);
+    offset = sizeof(header);
+    for (unsigned long long index = 0; index < header.blockCount && !error; ) {
+        unsigned long long count = header.blockCount - index;
+        if (count > DELTA_SIDECAR_READ_HASHES) {
+            count = DELTA_SIDECAR_READ_HASHES;
+        }
+
+        DWORD length = (DWORD)(count * sizeof(unsigned long long));
+        error = PlatformReadAt(file, offset, &hashes[index], length, &bytesRead);
+        if (!error && bytesRead != length) {
+            error = ERROR_HANDLE_EOF;
+        }
+        offset += length;
+        index += count;
+    }
+
+    if (error) {
+        hashes.clear(); // truncated or unreadable -- rewrite the whole file
+    }
+    PlatformCloseFile(file);
+}
+
+/// <summary>
+/// Write the block hashes for a destination file. The sidecar is written alongside and then renamed over
+/// the previous one.
+/// </summary>
+/// <param name="sidecarPath">The sidecar file</param>
+/// <param name="blockSize">The block size the hashes were made with</param>
+/// <param name="destinationInformation">The destination file as we have left it</param>
+/// <param name="hashes">One hash per block</param>
+/// <returns>0 on success, or the platform error code upon failure</returns>
+static DWORD SaveSidecar(const std::wstring& sidecarPath, DWORD blockSize, const t_fileInformation& destinationInformation, const std::vector<unsigned long long>& hashes)
+{
+    std::wstring temporaryPath = sidecarPath + L".tmp";
+    t_fileHandle file = INVALID_FILE_HANDLE;
+    t_deltaSidecarHeader header{};
+    unsigned long long offset = 0;
+    DWORD error = ERROR_SUCCESS;
+
+    memcpy(header.magic, DELTA_SIDECAR_MAGIC, sizeof(header.magic));
+    header.blockSize = blockSize;
+    header.fileSize = destinationInformation.size;
+    header.lastWriteTime = destinationInformation.lastWriteTime;
+    header.blockCount = hashes.size();
+
+    error = PlatformOpenForWrite(temporaryPath, FALSE, TRUE, &file);
+    if (error) {
+        return error;
+    }
+
+    error = PlatformWriteAt(file, 0, &header, sizeof(header));
+    offset = sizeof(header);
+    for (size_t index = 0; index < hashes.size() && !error; ) {
+        size_t count = hashes.size() - index;
+        if (count > DELTA_SIDECAR_READ_HASHES) {
+            count = DELTA_SIDECAR_READ_HASHES;
+        }
+
+        DWORD length = (DWORD)(count * sizeof(unsigned long long));
+        error = PlatformWriteAt(file, offset, &hashes[index], length);
+        offset += length;
+        index += count;
+    }
+
+    PlatformCloseFile(file);
+    if (!error) {
+        error = PlatformReplaceFile(temporaryPath, sidecarPath, TRUE);
+    }
+    return error;
+}
+
+/// <summary>
+/// Block routine for a delta copy -- hash the block and write it only if it differs from last time.
+/// </summary>
+/// <param name="offset">The offset of the block in the file</param>
+/// <param name="buffer">The block</param>
+/// <param name="length">The length of the block, short only for the last</param>
+/// <param name="writeBlock">Set to FALSE if the block is unchanged</param>
+/// <param name="context">The t_deltaState</param>
+/// <returns>0 -- hashing cannot fail</returns>
+static DWORD DeltaBlockRoutine(unsigned long long offset, const void* buffer, DWORD length, BOOL* writeBlock, void* context)
+{
+    t_deltaState* state = (t_deltaState*)context;
+    unsigned long long index = offset / state->blockSize;
+    unsigned long long hash = DeltaHashBlock(buffer, length);
+
+    state->hashes.push_back(hash); // blocks arrive in file order
+    state->statistics->blocks++;
+    state->statistics->bytes += length;
+
+    if (index < state->previousHashes->size() && (*state->previousHashes)[index] == hash) {
+        *writeBlock = FALSE;
+        return ERROR_SUCCESS;
+    }
+
+    state->statistics->blocksWritten++;
+    state->statistics->bytesWritten += length;
+    return ERROR_SUCCESS;
+}
+
+/// <summary>
+/// Bring an existing destination file up to date with the source by rewriting, in place, only the blocks
+/// which have changed since the last delta copy. Without usable hashes from a previous run every block
+/// is written. The block hash sidecar is updated only once the copy has succeeded.
+/// </summary>
+/// <param name="sourcePathFile">The source path, with the snapshot device object already substituted in</param>
+/// <param name="destinationPathFile">The destination path</param>
+/// <param name="options">Queue depth and buffering</param>
+/// <param name="bufferPool">Where the block buffers come from. Its buffer size is the block size.</param>
+/// <param name="statistics">Receives the number of blocks and bytes written</param>
+/// <param name="checksum">Optional. Receives the CRC32C of the source data.</param>
+/// <param name="progressRoutine">Optional. Called after each block is handled.</param>
+/// <param name="progressContext">Passed through to progressRoutine</param>
+/// <returns>0 on success, or the platform error code upon failure</returns>
+DWORD DeltaCopyFile(const std::wstring& sourcePathFile, const std::wstring& destinationPathFile, const t_blockCopyOptions& options, BufferPool& bufferPool, t_deltaStatistics* statistics, DWORD* checksum, t_blockCopyProgressRoutine progressRoutine, void* progressContext)
+{
+    std::wstring sidecarPath = destinationPathFile + DELTA_SIDECAR_EXTENSION;
+    t_fileHandle source = INVALID_FILE_HANDLE;
+    t_fileHandle destination = INVALID_FILE_HANDLE;
+    t_fileInformation sourceInformation{};
+    t_fileInformation destinationInformation{};
+    std::vector<unsigned long long> previousHashes;
+    t_deltaState state{};
+    DWORD error = ERROR_SUCCESS;
+
+    *statistics = t_deltaStatistics{};
+    state.blockSize = bufferPool.BufferSize();
+    state.previousHashes = &previousHashes;
+    state.statistics = statistics;
+
+    error = PlatformOpenForRead(sourcePathFile, options.unbuffered, &source);
+    if (!error) {
+        error = PlatformGetFileInformation(source, &sourceInformation);
+    }
+    if (!error) {
+        error = PlatformOpenForWrite(destinationPathFile, options.unbuffered, FALSE, &destination);
+    }
+    if (!error) {
+        error = PlatformGetFileInformation(destination, &destinationInformation);
+    }
+    if (!error) {
+        LoadSidecar(sidecarPath, state.blockSize, destinationInformation, previousHashes);
+        state.hashes.reserve((size_t)((sourceInformation.size + state.blockSize - 1) / state.blockSize));
+        error = CopyBlocks(source, destination, sourceInformation.size, options, bufferPool, checksum, &DeltaBlockRoutine, &state, progressRoutine, progressContext);
+    }
+    if (!error) {
+        error = PlatformSetFileSize(destination, sourceInformation.size);
+    }
+    if (!error) {
+        error = PlatformSetFileInformation(destination, sourceInformation);
+    }
+
+    PlatformCloseFile(destination);
+    PlatformCloseFile(source);
+
+    if (!error) {
+        // the destination now has the source's size and last write time, which is what the next run will find
+        error = SaveSidecar(sidecarPath, state.blockSize, sourceInformation, state.hashes);
+    }
+    return error;
+}
@@ -0,0 +1,29 @@
+/* ShadowDuplicator -- a simple VC++ Volume Shadow Copy requestor for backing up
+locked files
+
+Copyright (C) 2021-2023 Peter Upfold.
+
+Licensed under the Apache 2.0 Licence. See the LICENSE file in the project root for details.
+
+This code is **not** production quality. There is certainly plenty of potential for improvement of this code,
+but beyond that, it may even be insecure, destructive or cause you other serious problems. There
+is no warranty.
+*/
+#pragma once
+#include "Platform.h"
+#include "BlockCopy.h"
+#include <string>
+
+// appended to a destination file to give the path of its block hash sidecar
+#define DELTA_SIDECAR_EXTENSION L".sdblocks"
+
+// What a delta copy actually did to the destination
+typedef struct deltaStatistics {
+    unsigned long long blocks;
+    unsigned long long bytes;
+    unsigned long long blocksWritten;
+    unsigned long long bytesWritten;
+} t_deltaStatistics;
+
+DWORD DeltaCopyFile(const std::wstring& sourcePathFile, const std::wstring& destinationPathFile, const t_blockCopyOptions& options, BufferPool& bufferPool, t_deltaStatistics* statistics, DWORD* checksum, t_blockCopyProgressRoutine progressRoutine, void* progressContext);
+unsigned long long DeltaHashBlock(const void* buffer, size_t length);
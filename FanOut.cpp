@@ -0,0 +1,351 @@
+/* ShadowDuplicator -- a simple VC++ Volume Shadow Copy requestor for backing up
+locked files
+
+Copyright (C) 2021-2023 Peter Upfold.
+
+Licensed under the Apache 2.0 Licence. See the LICENSE file in the project root for details.
+
+This code is **not** production quality. There is certainly plenty of potential for improvement of this code,
+but beyond that, it may even be insecure, destructive or cause you other serious problems. There
+is no warranty.
+*/
+
+#include "FanOut.h"
+#include <algorithm>
+#include <cstring>
+
+/// <summary>
+/// Start the writer threads of each destination.
+/// </summary>
+/// <param name="destinationRoots">The destination directories, which are only kept to be reported against</param>
+/// <param name="threadsPerDestination">Number of writer threads for each destination, at most MAX_FANOUT_WRITERS</param>
+/// <param name="bufferLimit">Bytes of blocks which may be held for all of the destinations together. Each destination may have its share of them queued before the reader waits for it.</param>
+/// <param name="blockSize">The buffer size of the BufferPool which the files will be read with</param>
+FanOutWriter::FanOutWriter(const std::vector<std::wstring>& destinationRoots, unsigned int threadsPerDestination, unsigned long long bufferLimit, DWORD blockSize)
+    : bufferLimit(bufferLimit), blockSize(blockSize)
+{
+    if (threadsPerDestination < 1) {
+        threadsPerDestination = 1;
+    }
+    if (threadsPerDestination > MAX_FANOUT_WRITERS) {
+        threadsPerDestination = MAX_FANOUT_WRITERS;
+    }
+    maxBlocks = (size_t)std::max(1ULL, bufferLimit / blockSize);
+    if (!destinationRoots.empty()) {
+        this->bufferLimit = bufferLimit / destinationRoots.size();
+    }
+    for (const std::wstring& root : destinationRoots) {
+        lanes.emplace_back(new t_fanOutLane());
+        lanes.back()->root = root;
+        lanes.back()->queuedBytes = 0;
+        lanes.back()->statistics = t_fanOutStatistics{};
+        lanes.back()->stopping = false;
+    }
+    for (size_t destination = 0; destination < lanes.size(); destination++) {
+        for (unsigned int i = 0; i < threadsPerDestination; i++) {
+            lanes[destination]->writers.emplace_back(&FanOutWriter::WriterMain, this, destination);
+        }
+    }
+}
+
+/// <summary>
+/// Stop the writer threads. No file may still be being copied.
+/// </summary>
+FanOutWriter::~FanOutWriter()
+{
+    for (std::unique_ptr<t_fanOutLane>& lane : lanes) {
+        {
+            std::lock_guard<std::mutex> guard(lane->lock);
+            lane->stopping = true;
+        }
+        lane->writeQueued.notify_all();
+        for (std::thread& writer : lane->writers) {
+            writer.join();
+        }
+    }
+    for (t_fanOutBlock* block : allBlocks) {
+        PlatformAlignedFree(block->buffer);
+        delete block;
+    }
+}
+
+/// <summary>
+/// Copy one file to every destination, reading the source once. Each block is handed to the writers of
+/// every destination which has not failed for this file, and the reader only waits for a destination
+/// whose queue is full. A destination which fails is left behind while the others carry on.
+/// </summary>
+/// <param name="sourcePathFile">The source file</param>
+/// <param name="destinationPathFiles">The path to write in each destination, in the order of the destination roots</param>
+/// <param name="options">Queue depth, buffering, sparseness and throttle, as for BlockCopyFile</param>
+/// <param name="bufferPool">Supplies the buffers which the source is read into</param>
+/// <param name="checksum">If not null, receives the CRC-32 of the source</param>
+/// <param name="errors">Receives the error of each destination, 0 for each one which was written in full</param>
+/// <param name="progressRoutine">Optional, receives progress after each block is read</param>
+/// <param name="progressContext">Passed through to progressRoutine</param>
+/// <returns>0 if every destination was written, otherwise the error reading the source or the error of the first destination which failed</returns>
+DWORD FanOutWriter::CopyFile(const std::wstring& sourcePathFile, const std::vector<std::wstring>& destinationPathFiles, const t_blockCopyOptions& options, BufferPool& bufferPool, DWORD* checksum, std::vector<DWORD>* errors, t_blockCopyProgressRoutine progressRoutine, void* progressContext)
+{
+    t_fileHandle source = INVALID_FILE_HANDLE;
+    t_fileInformation sourceInformation{};
+    t_fanOutFile file;
+    DWORD error = ERROR_SUCCESS;
+
+    file.writer = this;
+    file.options = &options;
+    file.targets.assign(lanes.size(), t_fanOutTarget{ INVALID_FILE_HANDLE, SPARSE_UNTRIED, ERROR_SUCCESS });
+    file.outstanding = 0;
+    errors->assign(lanes.size(), ERROR_SUCCESS);
+
+    error = PlatformOpenForRead(sourcePathFile, options.unbuffered, &source);
+    if (!error) {
+        error = PlatformGetFileInformation(source, &sourceInformation);
+    }
+    if (error) {
+        PlatformCloseFile(source);
+        return error;
+    }
+
+    // a destination which cannot be opened misses this file, but the others are still written
+    for (size_t destination = 0; destination < lanes.size(); destination++) {
+        file.targets[destination].error = PlatformOpenForWrite(destinationPathFiles[destination], options.unbuffered, TRUE, &file.targets[destination].handle);
+    }
+
+    error = CopyBlocks(source, INVALID_FILE_HANDLE, sourceInformation.size, options, bufferPool, checksum, &FanOutWriter::BlockRoutine, &file, progressRoutine, progressContext);
+
+    // every destination must be done with this file's blocks before it can be finished or given up on
+    {
+        std::unique_lock<std::mutex> guard(file.lock);
+        file.writesDone.wait(guard, [&file] { return file.outstanding == 0; });
+    }
+
+    for (size_t destination = 0; destination < lanes.size(); destination++) {
+        t_fanOutTarget& target = file.targets[destination];
+        if (!error && !target.error) {
+            target.error = PlatformSetFileSize(target.handle, sourceInformation.size);
+        }
+        if (!error && !target.error) {
+            target.error = PlatformSetFileInformation(target.handle, sourceInformation);
+        }
+        PlatformCloseFile(target.handle);
+        (*errors)[destination] = target.error;
+
+        std::lock_guard<std::mutex> guard(lanes[destination]->lock);
+        if (target.error) {
+            lanes[destination]->statistics.filesFailed++;
+        }
+        else if (!error) {
+            lanes[destination]->statistics.filesWritten++;
+            lanes[destination]->statistics.bytesWritten += sourceInformation.size;
+        }
+    }
+    PlatformCloseFile(source);
+
+    for (size_t destination = 0; destination < lanes.size() && !error; destination++) {
+        error = (*errors)[destination];
+    }
+    return error;
+}
+
+/// <summary>
+/// The number of destinations.
+/// </summary>
+size_t FanOutWriter::DestinationCount(void)
+{
+    return lanes.size();
+}
+
+/// <summary>
+/// The directory a destination was created with.
+/// </summary>
+/// <param name="destination">The index of the destination</param>
+const std::wstring& FanOutWriter::DestinationRoot(size_t destination)
+{
+    return lanes[destination]->root;
+}
+
+/// <summary>
+/// What has been written to a destination so far.
+/// </summary>
+/// <param name="destination">The index of the destination</param>
+t_fanOutStatistics FanOutWriter::Statistics(size_t destination)
+{
+    std::lock_guard<std::mutex> guard(lanes[destination]->lock);
+    return lanes[destination]->statistics;
+}
+
+/// <summary>
+/// CopyBlocks block routine -- queue the block for every destination instead of writing it to one.
+/// </summary>
+/// <param name="offset">Where the block belongs in the file</param>
+/// <param name="buffer">The block, which belongs to the BufferPool and so is copied before it is queued</param>
+/// <param name="length">The length of the data in the block</param>
+/// <param name="writeBlock">Cleared, since CopyBlocks has no destination of its own</param>
+/// <param name="context">The t_fanOutFile</param>
+/// <returns>0 while any destination is still being written, otherwise the error of the first one</returns>
+DWORD FanOutWriter::BlockRoutine(unsigned long long offset, const void* buffer, DWORD length, BOOL* writeBlock, void* context)
+{
+    t_fanOutFile* file = (t_fanOutFile*)context;
+
+    *writeBlock = FALSE;
+    return file->writer->Queue(file, offset, buffer, length);
+}
+
+/// <summary>
+/// Copy a block into a shared buffer and queue a write of it for each destination which has not failed,
+/// first waiting for room in any destination's queue which is full.
+/// </summary>
+/// <param name="file">The file being copied</param>
+/// <param name="offset">Where the block belongs in the file</param>
+/// <param name="buffer">The block</param>
+/// <param name="length">The length of the data in the block</param>
+/// <returns>0 on success, ERROR_NOT_ENOUGH_MEMORY, or the error of the first destination if all of them have failed</returns>
+DWORD FanOutWriter::Queue(t_fanOutFile* file, unsigned long long offset, const void* buffer, DWORD length)
+{
+    std::vector<size_t> live;
+    DWORD writeLength = length;
+
+    // an unbuffered write is padded out here, once, rather than by each destination's writer in the shared buffer
+    if (file->options->unbuffered) {
+        writeLength = (length + PLATFORM_IO_ALIGNMENT - 1) & ~(DWORD)(PLATFORM_IO_ALIGNMENT - 1);
+    }
+
+    {
+        std::lock_guard<std::mutex> guard(file->lock);
+        for (size_t destination = 0; destination < file->targets.size(); destination++) {
+            if (!file->targets[destination].error) {
+                live.push_back(destination);
+            }
+        }
+    }
+    if (live.empty()) {
+        return file->targets[0].error;
+    }
+
+    t_fanOutBlock* block = AcquireBlock();
+    if (block == nullptr) {
+        return ERROR_NOT_ENOUGH_MEMORY;
+    }
+    memcpy(block->buffer, buffer, length);
+    memset((char*)block->buffer + length, 0, writeLength - length);
+    block->references = (unsigned int)live.size();
+    {
+        std::lock_guard<std::mutex> guard(file->lock);
+        file->outstanding += (unsigned int)live.size();
+    }
+
+    for (size_t destination : live) {
+        t_fanOutLane& lane = *lanes[destination];
+        {
+            // a block larger than the limit is still let through once the queue is empty
+            std::unique_lock<std::mutex> guard(lane.lock);
+            if (lane.queuedBytes > 0 && lane.queuedBytes + writeLength > bufferLimit) {
+                lane.statistics.stalls++;
+                lane.spaceAvailable.wait(guard, [this, &lane, writeLength] { return lane.queuedBytes == 0 || lane.queuedBytes + writeLength <= bufferLimit; });
+            }
+            lane.queue.push_back(t_fanOutWrite{ file, block, offset, writeLength });
+            lane.queuedBytes += writeLength;
+        }
+        lane.writeQueued.notify_one();
+    }
+    return ERROR_SUCCESS;
+}
+
+/// <summary>
+/// Writer thread body -- take writes off one destination's queue and perform them, skipping those of a
+/// file which has already failed at this destination.
+/// </summary>
+/// <param name="destination">The index of the destination this thread writes to</param>
+void FanOutWriter::WriterMain(size_t destination)
+{
+    t_fanOutLane& lane = *lanes[destination];
+
+    for (;;) {
+        t_fanOutWrite write{};
+        {
+            std::unique_lock<std::mutex> guard(lane.lock);
+            lane.writeQueued.wait(guard, [&lane] { return lane.stopping || !lane.queue.empty(); });
+            if (lane.queue.empty()) {
+                return;
+            }
+            write = lane.queue.front();
+            lane.queue.pop_front();
+        }
+
+        t_fanOutFile* file = write.file;
+        t_fanOutTarget& target = file->targets[destination];
+        t_sparseState sparseState = SPARSE_UNTRIED;
+        DWORD error = ERROR_SUCCESS;
+        {
+            std::lock_guard<std::mutex> guard(file->lock);
+            error = target.error;
+            sparseState = target.sparseState;
+        }
+
+        // each writer works on its own copy of the sparse state, and only ever moves the shared one on
+        if (!error) {
+            error = WriteBlock(target.handle, *file->options, write.offset, write.block->buffer, write.length, FALSE, &sparseState);
+        }
+        ReleaseBlock(write.block);
+
+        {
+            std::lock_guard<std::mutex> guard(lane.lock);
+            lane.queuedBytes -= write.length;
+        }
+        lane.spaceAvailable.notify_all();
+
+        // the file belongs to the reader, which may go as soon as the last write is counted off
+        std::lock_guard<std::mutex> guard(file->lock);
+        if (error && !target.error) {
+            target.error = error;
+        }
+        if (sparseState > target.sparseState) {
+            target.sparseState = sparseState;
+        }
+        if (--file->outstanding == 0) {
+            file->writesDone.notify_all();
+        }
+    }
+}
+
+/// <summary>
+/// Take a free block, or allocate another while fewer than the buffer limit allows have been. Once they
+/// all have been, wait for a destination to finish with one.
+/// </summary>
+/// <returns>The block, or nullptr if no memory was available</returns>
+t_fanOutBlock* FanOutWriter::AcquireBlock(void)
+{
+    std::unique_lock<std::mutex> guard(blockLock);
+
+    // every block which is not free is queued at some destination, whose writers will give it back
+    blockAvailable.wait(guard, [this] { return !freeBlocks.empty() || allBlocks.size() < maxBlocks; });
+    if (!freeBlocks.empty()) {
+        t_fanOutBlock* block = freeBlocks.back();
+        freeBlocks.pop_back();
+        return block;
+    }
+
+    void* buffer = PlatformAlignedAlloc(blockSize);
+    if (buffer == nullptr) {
+        return nullptr;
+    }
+    t_fanOutBlock* block = new t_fanOutBlock();
+    block->buffer = buffer;
+    block->references = 0;
+    allBlocks.push_back(block);
+    return block;
+}
+
+/// <summary>
+/// Drop one destination's hold on a block, freeing it for reuse once every destination has written it.
+/// </summary>
+/// <param name="block">The block</param>
+void FanOutWriter::ReleaseBlock(t_fanOutBlock* block)
+{
+    if (--block->references == 0) {
+        {
+            std::lock_guard<std::mutex> guard(blockLock);
+            freeBlocks.push_back(block);
+        }
+        blockAvailable.notify_one();
+    }
+}
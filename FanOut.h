@@ -0,0 +1,119 @@
+/* ShadowDuplicator -- a simple VC++ Volume Shadow Copy requestor for backing up
+locked files
+
+Copyright (C) 2021-2023 Peter Upfold.
+
+Licensed under the Apache 2.0 Licence. See the LICENSE file in the project root for details.
+
+This code is **not** production quality. There is certainly plenty of potential for improvement of this code,
+but beyond that, it may even be insecure, destructive or cause you other serious problems. There
+is no warranty.
+*/
+#pragma once
+#include "Platform.h"
+#include "BlockCopy.h"
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// a file set may be written to at most this many destinations at once
+#define MAX_FANOUT_DESTINATIONS 8
+
+// up to this many MiB of blocks may wait to be written to the destinations of every file set together
+#define DEFAULT_FANOUT_BUFFER_MIB 256
+
+// each destination is written by at most this many threads, however many copy workers feed it
+#define MAX_FANOUT_WRITERS 8
+
+// What has been written to one destination of a fan-out copy
+typedef struct fanOutStatistics {
+    unsigned long long filesWritten;
+    unsigned long long bytesWritten;
+    unsigned long long filesFailed;
+    unsigned long long stalls; // blocks which waited for room in this destination's queue
+} t_fanOutStatistics;
+
+// One destination of a file being copied by FanOutWriter::CopyFile
+typedef struct fanOutTarget {
+    t_fileHandle handle;
+    t_sparseState sparseState;
+    DWORD error; // once set, the rest of the file is not written to this destination
+} t_fanOutTarget;
+
+class FanOutWriter;
+
+// A file being copied by FanOutWriter::CopyFile, shared by the reader and the writers of every destination
+typedef struct fanOutFile {
+    FanOutWriter* writer;
+    const t_blockCopyOptions* options;
+    std::vector<t_fanOutTarget> targets;
+    unsigned int outstanding; // writes queued or being written, across every destination
+    std::mutex lock;
+    std::condition_variable writesDone;
+} t_fanOutFile;
+
+// A block read from the source, shared by the writes of it to each destination
+typedef struct fanOutBlock {
+    void* buffer;
+    std::atomic<unsigned int> references;
+} t_fanOutBlock;
+
+// One block waiting to be written to one destination
+typedef struct fanOutWrite {
+    t_fanOutFile* file;
+    t_fanOutBlock* block;
+    unsigned long long offset;
+    DWORD length;
+} t_fanOutWrite;
+
+/// <summary>
+/// Copies files to several destinations at once, reading each block of the source only once. Every
+/// destination has its own queue and writer threads, so a slow destination does not hold up the
+/// others until its queue is full, and a destination which fails does not stop the rest.
+/// </summary>
+class FanOutWriter {
+public:
+    FanOutWriter(const std::vector<std::wstring>& destinationRoots, unsigned int threadsPerDestination, unsigned long long bufferLimit, DWORD blockSize);
+    ~FanOutWriter();
+
+    DWORD CopyFile(const std::wstring& sourcePathFile, const std::vector<std::wstring>& destinationPathFiles, const t_blockCopyOptions& options, BufferPool& bufferPool, DWORD* checksum, std::vector<DWORD>* errors, t_blockCopyProgressRoutine progressRoutine, void* progressContext);
+
+    size_t DestinationCount(void);
+    const std::wstring& DestinationRoot(size_t destination);
+    t_fanOutStatistics Statistics(size_t destination);
+
+private:
+    // One destination, with its queue of writes and the threads which perform them
+    typedef struct fanOutLane {
+        std::wstring root;
+        std::vector<std::thread> writers;
+        std::deque<t_fanOutWrite> queue;
+        unsigned long long queuedBytes; // queued or being written
+        std::mutex lock;
+        std::condition_variable writeQueued;
+        std::condition_variable spaceAvailable;
+        t_fanOutStatistics statistics;
+        bool stopping;
+    } t_fanOutLane;
+
+    static DWORD BlockRoutine(unsigned long long offset, const void* buffer, DWORD length, BOOL* writeBlock, void* context);
+    DWORD Queue(t_fanOutFile* file, unsigned long long offset, const void* buffer, DWORD length);
+    void WriterMain(size_t destination);
+    t_fanOutBlock* AcquireBlock(void);
+    void ReleaseBlock(t_fanOutBlock* block);
+
+    std::vector<std::unique_ptr<t_fanOutLane>> lanes;
+    unsigned long long bufferLimit;
+    DWORD blockSize;
+
+    std::vector<t_fanOutBlock*> allBlocks;
+    std::vector<t_fanOutBlock*> freeBlocks;
+    size_t maxBlocks;
+    std::mutex blockLock;
+    std::condition_variable blockAvailable;
+};
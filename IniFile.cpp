@@ -0,0 +1,317 @@
+/* ShadowDuplicator -- a simple VC++ Volume Shadow Copy requestor for backing up
+locked files
+
+Copyright (C) 2021-2023 Peter Upfold.
+
+Licensed under the Apache 2.0 Licence. See the LICENSE file in the project root for details.
+
+This code is **not** production quality. There is certainly plenty of potential for improvement of this code,
+but beyond that, it may even be insecure, destructive or cause you other serious problems. There
+is no warranty.
+*/
+
+#include "IniFile.h"
+#include <cstdlib>
+#include <cwctype>
+
+/// <summary>
+/// Whether two section or key names are the same, ignoring case.
+/// </summary>
+/// <param name="first">One name</param>
+/// <param name="second">The other name</param>
+/// <returns>TRUE if they match</returns>
+BOOL IniNameEquals(const std::wstring& first, const std::wstring& second)
+{
+    if (first.size() != second.size()) {
+        return FALSE;
+    }
+    for (size_t i = 0; i < first.size(); i++) {
+        if (towlower(first[i]) != towlower(second[i])) {
+            return FALSE;
+        }
+    }
+    return TRUE;
+}
+
+/// <summary>
+/// Whether a section or key name starts with a prefix, ignoring case.
+/// </summary>
+/// <param name="name">The name</param>
+/// <param name="prefix">The prefix</param>
+/// <returns>TRUE if it does</returns>
+BOOL IniNameHasPrefix(const std::wstring& name, const std::wstring& prefix)
+{
+    return name.size() >= prefix.size() && IniNameEquals(name.substr(0, prefix.size()), prefix);
+}
+
+/// <summary>
+/// Remove white space from both ends of some text.
+/// </summary>
+/// <param name="text">The text</param>
+/// <returns>The text without leading or trailing white space</returns>
+static std::wstring Trim(const std::wstring& text)
+{
+    size_t start = 0;
+    size_t end = text.size();
+
+    while (start < end && iswspace(text[start])) {
+        start++;
+    }
+    while (end > start && iswspace(text[end - 1])) {
+        end--;
+    }
+    return text.substr(start, end - start);
+}
+
+/// <summary>
+/// Whether some bytes are valid UTF-8.
+/// </summary>
+static BOOL IsUtf8(const std::string& bytes)
+{
+    for (size_t i = 0; i < bytes.size();) {
+        unsigned char lead = (unsigned char)bytes[i++];
+        int continuationBytes = lead < 0x80 ? 0 : lead >= 0xF0 && lead < 0xF8 ? 3 : lead >= 0xE0 ? 2 : lead >= 0xC2 ? 1 : -1;
+        if (continuationBytes < 0 || i + continuationBytes > bytes.size()) {
+            return FALSE;
+        }
+        for (; continuationBytes > 0; continuationBytes--) {
+            if (((unsigned char)bytes[i++] & 0xC0) != 0x80) {
+                return FALSE;
+            }
+        }
+    }
+    return TRUE;
+}
+
+/// <summary>
+/// Read and parse an INI file. UTF-16 files with a byte order mark and UTF-8 files are read as such.
+/// Anything else is taken to be in a single byte code page and read as Latin-1, so plain ASCII files
+/// written by any editor read correctly.
+/// </summary>
+/// <param name="path">The INI file</param>
+/// <returns>0 on success, ERROR_INVALID_DATA if the file is too large to be an INI file, or the platform error code upon failure</returns>
+DWORD IniFile::Load(const std::wstring& path)
+{
+    t_fileHandle file = INVALID_FILE_HANDLE;
+    t_fileInformation information{};
+    std::string bytes;
+    std::wstring text;
+    DWORD bytesRead = 0;
+
+    sections.clear();
+
+    DWORD error = PlatformOpenForRead(path, FALSE, &file);
+    if (error) {
+        return error;
+    }
+    error = PlatformGetFileInformation(file, &information);
+    if (!error && information.size > INI_MAX_SIZE) {
+        error = ERROR_INVALID_DATA;
+    }
+    if (!error && information.size > 0) {
+        bytes.resize((size_t)information.size);
+        error = PlatformReadAt(file, 0, &bytes[0], (DWORD)bytes.size(), &bytesRead);
+        bytes.resize(bytesRead);
+    }
+    PlatformCloseFile(file);
+    if (error) {
+        return error;
+    }
+
+    if (bytes.size() >= 2 && (unsigned char)bytes[0] == 0xFF && (unsigned char)bytes[1] == 0xFE) {
+        // UTF-16 little endian with a byte order mark, as Notepad saves "Unicode"
+        for (size_t i = 2; i + 1 < bytes.size(); i += 2) {
+            unsigned int unit = (unsigned char)bytes[i] | ((unsigned char)bytes[i + 1] << 8);
+            if (sizeof(wchar_t) == 4 && unit >= 0xD800 && unit < 0xDC00 && i + 3 < bytes.size()) {
+                unsigned int low = (unsigned char)bytes[i + 2] | ((unsigned char)bytes[i + 3] << 8);
+                if (low >= 0xDC00 && low < 0xE000) {
+                    unit = 0x10000 + ((unit - 0xD800) << 10) + (low - 0xDC00);
+                    i += 2;
+                }
+            }
+            text.push_back((wchar_t)unit);
+        }
+    }
+    else if (IsUtf8(bytes)) {
+        if (bytes.size() >= 3 && bytes.compare(0, 3, "\xEF\xBB\xBF") == 0) {
+            bytes.erase(0, 3);
+        }
+        text = PlatformFromUtf8(bytes);
+    }
+    else {
+        for (char byte : bytes) {
+            text.push_back((wchar_t)(unsigned char)byte);
+        }
+    }
+
+    Parse(text);
+    return ERROR_SUCCESS;
+}
+
+/// <summary>
+/// Parse the text of an INI file, replacing anything parsed before. Lines which are neither a section
+/// heading nor a key and value, and keys before the first section, are ignored.
+/// </summary>
+/// <param name="text">The whole of the file</param>
+void IniFile::Parse(const std::wstring& text)
+{
+    t_iniSection* section = nullptr;
+    size_t lineStart = 0;
+
+    sections.clear();
+    while (lineStart < text.size()) {
+        size_t lineEnd = text.find_first_of(L"\r\n", lineStart);
+        if (lineEnd == std::wstring::npos) {
+            lineEnd = text.size();
+        }
+        std::wstring line = Trim(text.substr(lineStart, lineEnd - lineStart));
+        lineStart = lineEnd + 1;
+
+        if (line.empty() || line[0] == L';' || line[0] == L'#') {
+            continue;
+        }
+
+        if (line[0] == L'[') {
+            size_t close = line.find(L']');
+            std::wstring name = Trim(line.substr(1, close == std::wstring::npos ? std::wstring::npos : close - 1));
+            section = nullptr;
+            for (t_iniSection& existing : sections) {
+                if (IniNameEquals(existing.name, name)) {
+                    section = &existing; // a repeated section carries on the first
+                    break;
+                }
+            }
+            if (section == nullptr) {
+                sections.push_back(t_iniSection{ name, {} });
+                section = &sections.back();
+            }
+            continue;
+        }
+
+        size_t equals = line.find(L'=');
+        if (section == nullptr || equals == std::wstring::npos) {
+            continue;
+        }
+        std::wstring key = Trim(line.substr(0, equals));
+        std::wstring value = Trim(line.substr(equals + 1));
+        if (value.size() >= 2 && (value[0] == L'"' || value[0] == L'\'') && value.back() == value[0]) {
+            value = value.substr(1, value.size() - 2);
+        }
+        section->values.emplace_back(key, value);
+    }
+}
+
+/// <summary>
+/// The names of the sections, in the order they first appear.
+/// </summary>
+std::vector<std::wstring> IniFile::Sections(void) const
+{
+    std::vector<std::wstring> names;
+    for (const t_iniSection& section : sections) {
+        names.push_back(section.name);
+    }
+    return names;
+}
+
+/// <summary>
+/// Find the value of a key.
+/// </summary>
+/// <param name="section">The section name</param>
+/// <param name="key">The key name</param>
+/// <returns>The first value given for the key, or nullptr if the section or key is missing</returns>
+const std::wstring* IniFile::Find(const std::wstring& section, const std::wstring& key) const
+{
+    for (const t_iniSection& candidate : sections) {
+        if (!IniNameEquals(candidate.name, section)) {
+            continue;
+        }
+        for (const std::pair<std::wstring, std::wstring>& value : candidate.values) {
+            if (IniNameEquals(value.first, key)) {
+                return &value.second;
+            }
+        }
+        return nullptr;
+    }
+    return nullptr;
+}
+
+/// <summary>
+/// Whether a section has a key, even with an empty value.
+/// </summary>
+BOOL IniFile::HasKey(const std::wstring& section, const std::wstring& key) const
+{
+    return Find(section, key) != nullptr;
+}
+
+/// <summary>
+/// Get a value as text.
+/// </summary>
+/// <param name="section">The section name</param>
+/// <param name="key">The key name</param>
+/// <param name="defaultValue">Returned if the section or key is missing</param>
+/// <returns>The value</returns>
+std::wstring IniFile::GetString(const std::wstring& section, const std::wstring& key, const std::wstring& defaultValue) const
+{
+    const std::wstring* value = Find(section, key);
+    return value != nullptr ? *value : defaultValue;
+}
+
+/// <summary>
+/// Get every value of a key which is repeated within a section, in file order.
+/// </summary>
+/// <param name="section">The section name</param>
+/// <param name="key">The key name</param>
+/// <returns>The values, empty if the section or key is missing</returns>
+std::vector<std::wstring> IniFile::GetStrings(const std::wstring& section, const std::wstring& key) const
+{
+    std::vector<std::wstring> values;
+
+    for (const t_iniSection& candidate : sections) {
+        if (!IniNameEquals(candidate.name, section)) {
+            continue;
+        }
+        for (const std::pair<std::wstring, std::wstring>& value : candidate.values) {
+            if (IniNameEquals(value.first, key)) {
+                values.push_back(value.second);
+            }
+        }
+        break;
+    }
+    return values;
+}
+
+/// <summary>
+/// Get a value as a whole number. As with GetPrivateProfileInt, anything after the leading digits is ignored.
+/// </summary>
+/// <param name="section">The section name</param>
+/// <param name="key">The key name</param>
+/// <param name="defaultValue">Returned if the section or key is missing, or the value does not start with a number</param>
+/// <returns>The value</returns>
+long IniFile::GetInt(const std::wstring& section, const std::wstring& key, long defaultValue) const
+{
+    const std::wstring* value = Find(section, key);
+    if (value == nullptr) {
+        return defaultValue;
+    }
+    wchar_t* end = nullptr;
+    long number = wcstol(value->c_str(), &end, 10);
+    return end != value->c_str() ? number : defaultValue;
+}
+
+/// <summary>
+/// Get a value as a number which may have a fractional part.
+/// </summary>
+/// <param name="section">The section name</param>
+/// <param name="key">The key name</param>
+/// <param name="defaultValue">Returned if the section or key is missing, or the value does not start with a number</param>
+/// <returns>The value</returns>
+double IniFile::GetDouble(const std::wstring& section, const std::wstring& key, double defaultValue) const
+{
+    const std::wstring* value = Find(section, key);
+    if (value == nullptr) {
+        return defaultValue;
+    }
+    wchar_t* end = nullptr;
+    double number = wcstod(value->c_str(), &end);
+    return end != value->c_str() ? number : defaultValue;
+}
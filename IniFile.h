@@ -0,0 +1,53 @@
+/* ShadowDuplicator -- a simple VC++ Volume Shadow Copy requestor for backing up
+locked files
+
+Copyright (C) 2021-2023 Peter Upfold.
+
+Licensed under the Apache 2.0 Licence. See the LICENSE file in the project root for details.
+
+This code is **not** production quality. There is certainly plenty of potential for improvement of this code,
+but beyond that, it may even be insecure, destructive or cause you other serious problems. There
+is no warranty.
+*/
+#pragma once
+#include "Platform.h"
+#include <string>
+#include <utility>
+#include <vector>
+
+// an INI file larger than this is not a configuration file
+#define INI_MAX_SIZE (1024 * 1024)
+
+/// <summary>
+/// An INI file read once into memory, so that settings can be looked up without going back to the
+/// file for each one. Follows GetPrivateProfileString: section and key names are not case sensitive,
+/// the first of a repeated section or key wins, values are trimmed and lose one pair of surrounding
+/// quotes, and lines starting with ';' or '#' are comments. GetStrings is the exception, for the few
+/// keys which may be given more than once.
+/// </summary>
+class IniFile {
+public:
+    DWORD Load(const std::wstring& path);
+    void Parse(const std::wstring& text);
+
+    std::vector<std::wstring> Sections(void) const;
+    BOOL HasKey(const std::wstring& section, const std::wstring& key) const;
+    std::wstring GetString(const std::wstring& section, const std::wstring& key, const std::wstring& defaultValue) const;
+    std::vector<std::wstring> GetStrings(const std::wstring& section, const std::wstring& key) const;
+    long GetInt(const std::wstring& section, const std::wstring& key, long defaultValue) const;
+    double GetDouble(const std::wstring& section, const std::wstring& key, double defaultValue) const;
+
+private:
+    // One section, with its keys and values in file order
+    typedef struct iniSection {
+        std::wstring name;
+        std::vector<std::pair<std::wstring, std::wstring>> values;
+    } t_iniSection;
+
+    const std::wstring* Find(const std::wstring& section, const std::wstring& key) const;
+
+    std::vector<t_iniSection> sections;
+};
+
+BOOL IniNameEquals(const std::wstring& first, const std::wstring& second);
+BOOL IniNameHasPrefix(const std::wstring& name, const std::wstring& prefix);
@@ -0,0 +1,292 @@
+/* ShadowDuplicator -- a simple VC++ Volume Shadow Copy requestor for backing up
+locked files
+
+Copyright (C) 2021-2023 Peter Upfold.
+
+Licensed under the Apache 2.0 Licence. See the LICENSE file in the project root for details.
+
+This code is **not** production quality. There is certainly plenty of potential for improvement of this code,
+but beyond that, it may even be insecure, destructive or cause you other serious problems. There
+is no warranty.
+*/
+
+#include "Journal.h"
+#include "Checksum.h"
+#include "Delta.h"
+#include <chrono>
+#include <cstring>
+#include <vector>
+
+/*
+A journalled copy keeps a record of the blocks of a large file which are safely in the destination, so
+that a copy which is interrupted -- by a crash, a reboot or the snapshot going away -- can carry on from
+where it stopped rather than starting again. The journal lives next to the destination file:
+
+    header (t_journalHeader), then one t_journalRecord per block, appended in file order
+
+Records are only appended after the destination has been flushed, so every record describes data which
+is on the disk. When a copy starts and finds a journal, each recorded block of the destination is read
+back and hashed, and the copy resumes after the last block which still matches. If the source is not the
+one the journal was written for (a new snapshot of a file which has since changed), the same blocks of
+the source are hashed too, so that only a prefix which is still identical is kept. The journal is
+deleted once the copy is complete.
+*/
+
+#define JOURNAL_MAGIC "SDJRNL01"
+
+// how many records we read from a journal at once
+#define JOURNAL_READ_RECORDS 4096
+
+typedef struct journalHeader {
+    char magic[8];
+    unsigned long long sourceSize;
+    unsigned long long sourceLastWriteTime;
+} t_journalHeader;
+
+typedef struct journalRecord {
+    unsigned long long offset;
+    unsigned long long length;
+    unsigned long long hash;
+} t_journalRecord;
+
+// State for the block routine during one journalled copy
+typedef struct journalState {
+    t_fileHandle destination;
+    t_fileHandle journal;
+    unsigned long long journalEnd;
+    std::vector<t_journalRecord> pending;
+    unsigned long long pendingBytes;
+    std::chrono::steady_clock::time_point lastFlush;
+} t_journalState;
+
+/// <summary>
+/// Make the blocks written so far durable and then record them in the journal.
+/// </summary>
+/// <param name="state">The journalled copy</param>
+/// <returns>0 on success, or the platform error code upon failure</returns>
+static DWORD FlushJournal(t_journalState* state)
+{
+    DWORD error = ERROR_SUCCESS;
+
+    if (state->pending.empty()) {
+        return ERROR_SUCCESS;
+    }
+
+    // the data must reach the disk before the records which vouch for it
+    error = PlatformFlushFile(state->destination);
+    if (!error) {
+        DWORD length = (DWORD)(state->pending.size() * sizeof(t_journalRecord));
+        error = PlatformWriteAt(state->journal, state->journalEnd, state->pending.data(), length);
+        state->journalEnd += length;
+    }
+    if (!error) {
+        error = PlatformFlushFile(state->journal);
+    }
+
+    state->pending.clear();
+    state->pendingBytes = 0;
+    state->lastFlush = std::chrono::steady_clock::now();
+    return error;
+}
+
+/// <summary>
+/// Block routine for a journalled copy -- hash the block for the journal, and bring the journal up to date
+/// with the blocks before it when enough has been written or enough time has passed.
+/// </summary>
+/// <param name="offset">The offset of the block in the file</param>
+/// <param name="buffer">The block</param>
+/// <param name="length">The length of the block, short only for the last</param>
+/// <param name="writeBlock">Left as it is -- every block is written</param>
+/// <param name="context">The t_journalState</param>
+/// <returns>0 on success, or the error flushing the destination or the journal</returns>
+static DWORD JournalBlockRoutine(unsigned long long offset, const void* buffer, DWORD length, BOOL* writeBlock, void* context)
+{
+    t_journalState* state = (t_journalState*)context;
+    DWORD error = ERROR_SUCCESS;
+
+    (void)writeBlock;
+
+    // blocks are written in order before the next is seen, so everything pending has been written
+    if (state->pendingBytes >= JOURNAL_FLUSH_BYTES ||
+        std::chrono::steady_clock::now() - state->lastFlush >= std::chrono::seconds(JOURNAL_FLUSH_SECONDS)) {
+        error = FlushJournal(state);
+    }
+
+    state->pending.push_back({ offset, length, DeltaHashBlock(buffer, length) });
+    state->pendingBytes += length;
+    return error;
+}
+
+/// <summary>
+/// Check the blocks recorded in a journal against the destination, and the source if it has changed,
+/// and find how far the copy can safely resume from.
+/// </summary>
+/// <param name="journal">The open journal, whose header has been read</param>
+/// <param name="header">The journal's header</param>
+/// <param name="sourcePathFile">The source path</param>
+/// <param name="destinationPathFile">The destination path</param>
+/// <param name="sourceInformation">The source as it is now</param>
+/// <param name="bufferPool">Where the buffer for reading back blocks comes from</param>
+/// <param name="recordCount">Receives the number of records which are still good</param>
+/// <param name="checksum">Receives the CRC32C of the data up to the resume offset</param>
+/// <returns>The offset the copy can resume from, or 0 if nothing is usable</returns>
+static unsigned long long VerifyJournal(t_fileHandle journal, const t_journalHeader& header, const std::wstring& sourcePathFile, const std::wstring& destinationPathFile, const t_fileInformation& sourceInformation, BufferPool& bufferPool, unsigned long long* recordCount, DWORD* checksum)
+{
+    BOOL sourceChanged = header.sourceSize != sourceInformation.size || header.sourceLastWriteTime != sourceInformation.lastWriteTime;
+    t_fileHandle source = INVALID_FILE_HANDLE;
+    t_fileHandle destination = INVALID_FILE_HANDLE;
+    std::vector<t_journalRecord> records(JOURNAL_READ_RECORDS);
+    unsigned long long resumeOffset = 0;
+    unsigned long long journalOffset = sizeof(t_journalHeader);
+    DWORD bufferSize = bufferPool.BufferSize();
+    void* buffer = nullptr;
+    BOOL stopped = FALSE;
+
+    *recordCount = 0;
+    *checksum = 0;
+
+    // read back through buffered handles, since a record's length need not be a whole number of sectors
+    if (PlatformOpenForRead(destinationPathFile, FALSE, &destination)) {
+        return 0;
+    }
+    if (sourceChanged && PlatformOpenForRead(sourcePathFile, FALSE, &source)) {
+        PlatformCloseFile(destination);
+        return 0;
+    }
+
+    buffer = bufferPool.Acquire();
+    while (!stopped) {
+        DWORD bytesRead = 0;
+        if (PlatformReadAt(journal, journalOffset, records.data(), (DWORD)(records.size() * sizeof(t_journalRecord)), &bytesRead)) {
+            break;
+        }
+        size_t count = bytesRead / sizeof(t_journalRecord); // a torn record at the end is ignored
+        if (count == 0) {
+            break;
+        }
+        journalOffset += count * sizeof(t_journalRecord);
+
+        for (size_t index = 0; index < count && !stopped; index++) {
+            const t_journalRecord& record = records[index];
+            unsigned long long end = record.offset + record.length;
+
+            // records must follow on from each other, fit the buffer, lie within the source and end on a sector
+            // boundary unless they end the file, so that the copy can go on from where they stop
+            if (record.offset != resumeOffset || record.length == 0 || record.length > bufferSize ||
+                end > sourceInformation.size || (end % PLATFORM_IO_ALIGNMENT != 0 && end != sourceInformation.size)) {
+                stopped = TRUE;
+                break;
+            }
+
+            if (PlatformReadAt(destination, record.offset, buffer, (DWORD)record.length, &bytesRead) ||
+                bytesRead != record.length || DeltaHashBlock(buffer, (size_t)record.length) != record.hash) {
+                stopped = TRUE;
+                break;
+            }
+            DWORD blockChecksum = ChecksumUpdate(*checksum, buffer, (size_t)record.length);
+
+            if (sourceChanged &&
+                (PlatformReadAt(source, record.offset, buffer, (DWORD)record.length, &bytesRead) ||
+                bytesRead != record.length || DeltaHashBlock(buffer, (size_t)record.length) != record.hash)) {
+                stopped = TRUE;
+                break;
+            }
+
+            *checksum = blockChecksum;
+            resumeOffset = end;
+            (*recordCount)++;
+        }
+    }
+    bufferPool.Release(buffer);
+
+    PlatformCloseFile(source);
+    PlatformCloseFile(destination);
+    return resumeOffset;
+}
+
+/// <summary>
+/// Copy a single large file, keeping a journal of the blocks which are safely in the destination. If an
+/// earlier copy of the file was interrupted, the blocks its journal recorded are checked and the copy
+/// carries on after the last good one. The destination receives the source's times and attributes.
+/// </summary>
+/// <param name="sourcePathFile">The source path, with the snapshot device object already substituted in</param>
+/// <param name="destinationPathFile">The destination path</param>
+/// <param name="options">Queue depth, buffering and sparseness</param>
+/// <param name="bufferPool">Where the block buffers come from. Its buffer size is the block size.</param>
+/// <param name="statistics">Receives how much was resumed from an earlier copy</param>
+/// <param name="checksum">Optional. Receives the CRC32C of the source data.</param>
+/// <param name="progressRoutine">Optional. Called after each block is written.</param>
+/// <param name="progressContext">Passed through to progressRoutine</param>
+/// <returns>0 on success, or the platform error code upon failure</returns>
+DWORD JournalCopyFile(const std::wstring& sourcePathFile, const std::wstring& destinationPathFile, const t_blockCopyOptions& options, BufferPool& bufferPool, t_journalStatistics* statistics, DWORD* checksum, t_blockCopyProgressRoutine progressRoutine, void* progressContext)
+{
+    std::wstring journalPath = destinationPathFile + JOURNAL_EXTENSION;
+    t_fileHandle source = INVALID_FILE_HANDLE;
+    t_fileHandle destination = INVALID_FILE_HANDLE;
+    t_fileInformation sourceInformation{};
+    t_journalHeader header{};
+    t_journalState state{};
+    unsigned long long resumeOffset = 0;
+    unsigned long long recordCount = 0;
+    DWORD dataChecksum = 0;
+    DWORD bytesRead = 0;
+    DWORD error = ERROR_SUCCESS;
+
+    *statistics = t_journalStatistics{};
+    state.journal = INVALID_FILE_HANDLE;
+
+    error = PlatformOpenForRead(sourcePathFile, options.unbuffered, &source);
+    if (!error) {
+        error = PlatformGetFileInformation(source, &sourceInformation);
+    }
+    if (!error) {
+        error = PlatformOpenForWrite(journalPath, FALSE, FALSE, &state.journal);
+    }
+    if (!error) {
+        if (PlatformReadAt(state.journal, 0, &header, sizeof(header), &bytesRead) == ERROR_SUCCESS && bytesRead == sizeof(header) &&
+            memcmp(header.magic, JOURNAL_MAGIC, sizeof(header.magic)) == 0) {
+            resumeOffset = VerifyJournal(state.journal, header, sourcePathFile, destinationPathFile, sourceInformation, bufferPool, &recordCount, &dataChecksum);
+        }
+
+        // keep the good records, which now vouch for this source, and drop the rest
+        memcpy(header.magic, JOURNAL_MAGIC, sizeof(header.magic));
+        header.sourceSize = sourceInformation.size;
+        header.sourceLastWriteTime = sourceInformation.lastWriteTime;
+        state.journalEnd = sizeof(header) + recordCount * sizeof(t_journalRecord);
+        error = PlatformSetFileSize(state.journal, state.journalEnd);
+    }
+    if (!error) {
+        error = PlatformWriteAt(state.journal, 0, &header, sizeof(header));
+    }
+    if (!error) {
+        error = PlatformFlushFile(state.journal);
+    }
+    if (!error) {
+        statistics->resumedBytes = resumeOffset;
+        statistics->verifiedRanges = recordCount;
+        error = PlatformOpenForWrite(destinationPathFile, options.unbuffered, resumeOffset == 0, &destination);
+    }
+    if (!error) {
+        state.destination = destination;
+        state.lastFlush = std::chrono::steady_clock::now();
+        error = CopyBlocksFrom(source, destination, resumeOffset, sourceInformation.size, options, bufferPool, &dataChecksum, &JournalBlockRoutine, &state, progressRoutine, progressContext);
+    }
+    if (!error) {
+        error = PlatformSetFileSize(destination, sourceInformation.size);
+    }
+    if (!error) {
+        error = PlatformSetFileInformation(destination, sourceInformation);
+    }
+
+    PlatformCloseFile(destination);
+    PlatformCloseFile(state.journal);
+    PlatformCloseFile(source);
+
+    if (!error) {
+        if (checksum != nullptr) {
+            *checksum = dataChecksum;
+        }
+        error = PlatformDeletePath(journalPath, FALSE);
+    }
+    return error;
+}
@@ -0,0 +1,33 @@
+/* ShadowDuplicator -- a simple VC++ Volume Shadow Copy requestor for backing up
+locked files
+
+Copyright (C) 2021-2023 Peter Upfold.
+
+Licensed under the Apache 2.0 Licence. See the LICENSE file in the project root for details.
+
+This code is **not** production quality. There is certainly plenty of potential for improvement of this code,
+but beyond that, it may even be insecure, destructive or cause you other serious problems. There
+is no warranty.
+*/
+#pragma once
+#include "Platform.h"
+#include "BlockCopy.h"
+#include <string>
+
+// appended to a destination file to give the path of its progress journal
+#define JOURNAL_EXTENSION L".sdjournal"
+
+// files of at least this many MiB are copied with a journal by default. 0 turns journalling off.
+#define DEFAULT_JOURNAL_THRESHOLD_MIB 1024
+
+// the journal is brought up to date whenever this many bytes have been written since it last was, or this long has passed
+#define JOURNAL_FLUSH_BYTES (256ULL * 1024 * 1024)
+#define JOURNAL_FLUSH_SECONDS 30
+
+// How much of a journalled copy was carried over from an earlier, interrupted one
+typedef struct journalStatistics {
+    unsigned long long resumedBytes;
+    unsigned long long verifiedRanges;
+} t_journalStatistics;
+
+DWORD JournalCopyFile(const std::wstring& sourcePathFile, const std::wstring& destinationPathFile, const t_blockCopyOptions& options, BufferPool& bufferPool, t_journalStatistics* statistics, DWORD* checksum, t_blockCopyProgressRoutine progressRoutine, void* progressContext);
@@ -0,0 +1,316 @@
+/* ShadowDuplicator -- a simple VC++ Volume Shadow Copy requestor for backing up
+locked files
+
+Copyright (C) 2021-2023 Peter Upfold.
+
+Licensed under the Apache 2.0 Licence. See the LICENSE file in the project root for details.
+
+This code is **not** production quality. There is certainly plenty of potential for improvement of this code,
+but beyond that, it may even be insecure, destructive or cause you other serious problems. There
+is no warranty.
+*/
+
+#include "Manifest.h"
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+
+/*
+The manifest is UTF-8 text, one file per line after a header line:
+
+    size <TAB> last write time <TAB> attributes <TAB> CRC32C <TAB> relative path
+
+The last write time is in FILETIME units and the attributes are as the platform reported them. The
+CRC32C is eight hex digits, or "-" if it was not computed. Version 1 manifests have no CRC32C column.
+*/
+
+#define MANIFEST_HEADER "ShadowDuplicator manifest 2"
+#define MANIFEST_HEADER_VERSION_1 "ShadowDuplicator manifest 1"
+
+// how much manifest text we buffer before each write or read
+#define MANIFEST_IO_CHUNK (1024 * 1024)
+
+/// <summary>
+/// Parse one manifest line into a path and entry.
+/// </summary>
+/// <param name="line">The line, without its line ending</param>
+/// <param name="hasChecksumColumn">Whether the line is from a manifest new enough to have the CRC32C column</param>
+/// <param name="relativePath">Receives the path</param>
+/// <param name="entry">Receives the metadata</param>
+/// <returns>TRUE if the line was well formed</returns>
+static BOOL ParseManifestLine(const std::string& line, BOOL hasChecksumColumn, std::wstring& relativePath, t_manifestEntry& entry)
+{
+    char* next = nullptr;
+    const char* start = line.c_str();
+
+    entry.size = strtoull(start, &next, 10);
+    if (*next != '\t') {
+        return FALSE;
+    }
+    entry.lastWriteTime = strtoull(next + 1, &next, 10);
+    if (*next != '\t') {
+        return FALSE;
+    }
+    entry.attributes = (DWORD)strtoul(next + 1, &next, 10);
+    if (*next != '\t') {
+        return FALSE;
+    }
+    if (hasChecksumColumn) {
+        if (next[1] == '-') {
+            entry.hasChecksum = FALSE;
+            next += 2;
+        }
+        else {
+            entry.hasChecksum = TRUE;
+            entry.checksum = (DWORD)strtoul(next + 1, &next, 16);
+        }
+        if (*next != '\t') {
+            return FALSE;
+        }
+    }
+    if (next[1] == '\0') {
+        return FALSE;
+    }
+
+    relativePath = PlatformFromUtf8(std::string(next + 1));
+    return TRUE;
+}
+
+/// <summary>
+/// Replace the content of this manifest with a manifest file.
+/// </summary>
+/// <param name="manifestPath">The manifest file</param>
+/// <returns>0 on success, ERROR_FILE_NOT_FOUND if there is no manifest yet, ERROR_INVALID_DATA if it is damaged, or another platform error</returns>
+DWORD Manifest::Load(const std::wstring& manifestPath)
+{
+    t_fileHandle file = INVALID_FILE_HANDLE;
+    std::vector<char> chunk(MANIFEST_IO_CHUNK);
+    std::string line;
+    unsigned long long offset = 0;
+    DWORD bytesRead = 0;
+    BOOL headerSeen = FALSE;
+    BOOL hasChecksumColumn = TRUE;
+    DWORD error = ERROR_SUCCESS;
+
+    std::lock_guard<std::mutex> guard(lock);
+    entries.clear();
+
+    error = PlatformOpenForRead(manifestPath, FALSE, &file);
+    if (error) {
+        return error;
+    }
+
+    do {
+        error = PlatformReadAt(file, offset, chunk.data(), (DWORD)chunk.size(), &bytesRead);
+        if (error) {
+            break;
+        }
+        offset += bytesRead;
+
+        for (DWORD i = 0; i < bytesRead && !error; i++) {
+            if (chunk[i] != '\n') {
+                line.push_back(chunk[i]);
+                continue;
+            }
+
+            if (!headerSeen) {
+                headerSeen = TRUE;
+                if (line == MANIFEST_HEADER_VERSION_1) {
+                    hasChecksumColumn = FALSE;
+                }
+                else if (line != MANIFEST_HEADER) {
+                    error = ERROR_INVALID_DATA;
+                }
+            }
+            else {
+                std::wstring relativePath;
+                t_manifestEntry entry{};
+                if (ParseManifestLine(line, hasChecksumColumn, relativePath, entry)) {
+                    entries[relativePath] = entry;
+                }
+                else {
+                    error = ERROR_INVALID_DATA;
+                }
+            }
+            line.clear();
+        }
+    } while (bytesRead > 0 && !error);
+
+    if (!error && (!headerSeen || !line.empty())) {
+        error = ERROR_INVALID_DATA; // empty, or truncated part way through a line
+    }
+    if (error) {
+        entries.clear();
+    }
+
+    PlatformCloseFile(file);
+    return error;
+}
+
+/// <summary>
+/// Write this manifest to a file. It is written alongside and then renamed over any existing manifest,
+/// so an interrupted save leaves the previous manifest intact.
+/// </summary>
+/// <param name="manifestPath">The manifest file</param>
+/// <returns>0 on success, or the platform error code upon failure</returns>
+DWORD Manifest::Save(const std::wstring& manifestPath)
+{
+    std::wstring temporaryPath = manifestPath + L".tmp";
+    t_fileHandle file = INVALID_FILE_HANDLE;
+    std::string text;
+    unsigned long long offset = 0;
+    char numbers[96]{};
+    DWORD error = ERROR_SUCCESS;
+
+    std::lock_guard<std::mutex> guard(lock);
+
+    error = PlatformOpenForWrite(temporaryPath, FALSE, TRUE, &file);
+    if (error) {
+        return error;
+    }
+
+    text.reserve(MANIFEST_IO_CHUNK + 4096);
+    text.append(MANIFEST_HEADER "\n");
+
+    for (auto iterator = entries.begin(); iterator != entries.end() && !error; ++iterator) {
+        if (iterator->second.hasChecksum) {
+            snprintf(numbers, sizeof(numbers), "%llu\t%llu\t%lu\t%08lx\t", iterator->second.size, iterator->second.lastWriteTime, (unsigned long)iterator->second.attributes, (unsigned long)iterator->second.checksum);
+        }
+        else {
+            snprintf(numbers, sizeof(numbers), "%llu\t%llu\t%lu\t-\t", iterator->second.size, iterator->second.lastWriteTime, (unsigned long)iterator->second.attributes);
+        }
+        text.append(numbers);
+        text.append(PlatformToUtf8(iterator->first));
+        text.push_back('\n');
+
+        if (text.size() >= MANIFEST_IO_CHUNK) {
+            error = PlatformWriteAt(file, offset, text.data(), (DWORD)text.size());
+            offset += text.size();
+            text.clear();
+        }
+    }
+    if (!error && !text.empty()) {
+        error = PlatformWriteAt(file, offset, text.data(), (DWORD)text.size());
+    }
+
+    PlatformCloseFile(file);
+    if (!error) {
+        error = PlatformReplaceFile(temporaryPath, manifestPath, TRUE);
+    }
+    return error;
+}
+
+/// <summary>
+/// Whether the manifest holds a file at this path with exactly this metadata, meaning the source is
+/// unchanged since it was last copied.
+/// </summary>
+/// <param name="relativePath">The path relative to the destination directory</param>
+/// <param name="entry">The source metadata found by this run</param>
+/// <returns>TRUE if the file need not be copied again</returns>
+BOOL Manifest::Matches(const std::wstring& relativePath, const t_manifestEntry& entry) const
+{
+    auto found = entries.find(relativePath);
+    if (found == entries.end()) {
+        return FALSE;
+    }
+    return found->second.size == entry.size && found->second.lastWriteTime == entry.lastWriteTime && found->second.attributes == entry.attributes;
+}
+
+/// <summary>
+/// Get the entry for a file.
+/// </summary>
+/// <param name="relativePath">The path relative to the destination directory</param>
+/// <param name="entry">Receives the entry</param>
+/// <returns>TRUE if the manifest holds the file</returns>
+BOOL Manifest::Lookup(const std::wstring& relativePath, t_manifestEntry* entry) const
+{
+    auto found = entries.find(relativePath);
+    if (found == entries.end()) {
+        return FALSE;
+    }
+    *entry = found->second;
+    return TRUE;
+}
+
+/// <summary>
+/// Record a file as present in the destination with this source metadata.
+/// </summary>
+/// <param name="relativePath">The path relative to the destination directory</param>
+/// <param name="entry">The source metadata</param>
+void Manifest::Record(const std::wstring& relativePath, const t_manifestEntry& entry)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    entries[relativePath] = entry;
+}
+
+/// <summary>
+/// Forget a file, so that the next incremental run copies it again. Safe to call from several threads at once.
+/// </summary>
+/// <param name="relativePath">The path of the file relative to the destination directory</param>
+void Manifest::Remove(const std::wstring& relativePath)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    entries.erase(relativePath);
+}
+
+/// <summary>
+/// The number of files in the manifest.
+/// </summary>
+size_t Manifest::Count(void)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    return entries.size();
+}
+
+/// <summary>
+/// Copy out every path and entry in the manifest, in no particular order.
+/// </summary>
+/// <param name="list">Receives the entries, replacing anything it held</param>
+void Manifest::Entries(std::vector<std::pair<std::wstring, t_manifestEntry>>* list)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    list->assign(entries.begin(), entries.end());
+}
+
+/// <summary>
+/// Record the entries of another manifest which the routine keeps, as they are, without looking at the
+/// files themselves. Used for the files a change feed says are unchanged, so that they are never listed.
+/// </summary>
+/// <param name="previous">The manifest of the previous run, which must be a different manifest</param>
+/// <param name="keepRoutine">Decides which entries are recorded</param>
+/// <param name="context">Passed through to keepRoutine</param>
+/// <returns>The number of entries recorded</returns>
+size_t Manifest::CarryOver(Manifest& previous, t_manifestKeepRoutine keepRoutine, void* context)
+{
+    size_t kept = 0;
+
+    std::lock_guard<std::mutex> previousGuard(previous.lock);
+    std::lock_guard<std::mutex> guard(lock);
+    entries.reserve(entries.size() + previous.entries.size());
+    for (auto iterator = previous.entries.begin(); iterator != previous.entries.end(); ++iterator) {
+        if (keepRoutine(iterator->first, context)) {
+            entries[iterator->first] = iterator->second;
+            kept++;
+        }
+    }
+    return kept;
+}
+
+/// <summary>
+/// The manifest for a destination lives next to it, so that it is not mistaken for a backed up file.
+/// A drive root has nowhere beside it, so its manifest goes inside.
+/// </summary>
+/// <param name="destinationDirectory">The destination directory</param>
+/// <returns>The path of the manifest file</returns>
+std::wstring ManifestPathForDestination(const std::wstring& destinationDirectory)
+{
+    std::wstring directory = destinationDirectory;
+    while (directory.size() > 1 && directory.back() == PATH_SEPARATOR) {
+        directory.pop_back();
+    }
+
+    if (directory.empty() || directory.back() == L':' || directory.back() == PATH_SEPARATOR) {
+        return PlatformJoinPath(directory, L"ShadowDuplicator" MANIFEST_EXTENSION);
+    }
+    return directory + MANIFEST_EXTENSION;
+}
@@ -0,0 +1,58 @@
+/* ShadowDuplicator -- a simple VC++ Volume Shadow Copy requestor for backing up
+locked files
+
+Copyright (C) 2021-2023 Peter Upfold.
+
+Licensed under the Apache 2.0 Licence. See the LICENSE file in the project root for details.
+
+This code is **not** production quality. There is certainly plenty of potential for improvement of this code,
+but beyond that, it may even be insecure, destructive or cause you other serious problems. There
+is no warranty.
+*/
+#pragma once
+#include "Platform.h"
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+// appended to the destination directory to give the path of its manifest
+#define MANIFEST_EXTENSION L".sdmanifest"
+
+// The source metadata recorded for each file copied, and the CRC32C of its content if it was computed
+typedef struct manifestEntry {
+    unsigned long long size;
+    unsigned long long lastWriteTime;
+    DWORD attributes;
+    BOOL hasChecksum;
+    DWORD checksum;
+} t_manifestEntry;
+
+// Decides whether Manifest::CarryOver keeps an entry of the previous manifest. Return TRUE to keep it.
+typedef BOOL (*t_manifestKeepRoutine)(const std::wstring& relativePath, void* context);
+
+/// <summary>
+/// The set of files held in a destination, keyed by their path relative to the destination directory,
+/// with the source metadata each was copied with. Lookups are safe from any number of threads once
+/// loading is complete, and Record may be called from any number of threads at once.
+/// </summary>
+class Manifest {
+public:
+    DWORD Load(const std::wstring& manifestPath);
+    DWORD Save(const std::wstring& manifestPath);
+
+    BOOL Matches(const std::wstring& relativePath, const t_manifestEntry& entry) const;
+    BOOL Lookup(const std::wstring& relativePath, t_manifestEntry* entry) const;
+    void Record(const std::wstring& relativePath, const t_manifestEntry& entry);
+    void Remove(const std::wstring& relativePath);
+    size_t Count(void);
+    void Entries(std::vector<std::pair<std::wstring, t_manifestEntry>>* list);
+    size_t CarryOver(Manifest& previous, t_manifestKeepRoutine keepRoutine, void* context);
+
+private:
+    std::unordered_map<std::wstring, t_manifestEntry> entries;
+    std::mutex lock;
+};
+
+std::wstring ManifestPathForDestination(const std::wstring& destinationDirectory);
@@ -0,0 +1,545 @@
+/* ShadowDuplicator -- a simple VC++ Volume Shadow Copy requestor for backing up
+locked files
+
+Copyright (C) 2021-2023 Peter Upfold.
+
+Licensed under the Apache 2.0 Licence. See the LICENSE file in the project root for details.
+
+This code is **not** production quality. There is certainly plenty of potential for improvement of this code,
+but beyond that, it may even be insecure, destructive or cause you other serious problems. There
+is no warranty.
+*/
+
+#include "ManifestIndex.h"
+#include "Delta.h"
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+
+static_assert(sizeof(t_indexHeader) == 72, "the index header layout is part of the file format");
+static_assert(sizeof(t_indexEntry) == 40, "the index entry layout is part of the file format");
+static_assert(sizeof(t_indexBucket) == 8, "the index bucket layout is part of the file format");
+
+// FILETIME of the POSIX epoch, for stamping and printing times
+#define FILETIME_UNIX_EPOCH 116444736000000000ULL
+#define FILETIME_TICKS_PER_SECOND 10000000ULL
+
+/// <summary>
+/// Round a section offset up to the next 8 byte boundary.
+/// </summary>
+static unsigned long long AlignSection(unsigned long long offset)
+{
+    return (offset + 7) & ~7ULL;
+}
+
+/// <summary>
+/// The hash of a path, which picks its bucket. XXH64, the same as for delta copy blocks.
+/// </summary>
+static unsigned long long IndexHashPath(const char* path, size_t length)
+{
+    return DeltaHashBlock(path, length);
+}
+
+/// <summary>
+/// Convert a path given on the command line into the form the index holds -- UTF-8, with the platform's
+/// separators and without a leading separator.
+/// </summary>
+static std::string IndexQueryPath(const std::wstring& relativePath)
+{
+    std::wstring path = relativePath;
+    std::replace(path.begin(), path.end(), L'/', PATH_SEPARATOR);
+    std::replace(path.begin(), path.end(), L'\\', PATH_SEPARATOR);
+    size_t start = path.find_first_not_of(PATH_SEPARATOR);
+    path.erase(0, start == std::wstring::npos ? path.size() : start);
+    return PlatformToUtf8(path);
+}
+
+/// <summary>
+/// Format a FILETIME as a UTC date and time.
+/// </summary>
+/// <param name="fileTime">100ns intervals since 1601</param>
+/// <param name="text">Receives the text</param>
+/// <param name="length">The size of text, at least 20</param>
+static void FormatFileTime(unsigned long long fileTime, char* text, size_t length)
+{
+    struct tm utc {};
+    time_t seconds = fileTime < FILETIME_UNIX_EPOCH ? 0 : (time_t)((fileTime - FILETIME_UNIX_EPOCH) / FILETIME_TICKS_PER_SECOND);
+#ifdef _WIN32
+    gmtime_s(&utc, &seconds);
+#else
+    gmtime_r(&seconds, &utc);
+#endif
+    strftime(text, length, "%Y-%m-%d %H:%M:%S", &utc);
+}
+
+/// <summary>
+/// Print one file of an index.
+/// </summary>
+static void PrintIndexEntry(const char* mark, const std::string& relativePath, const t_manifestEntry& entry)
+{
+    char lastWrite[32];
+    char checksum[16] = "--------";
+
+    FormatFileTime(entry.lastWriteTime, lastWrite, sizeof(lastWrite));
+    if (entry.hasChecksum) {
+        snprintf(checksum, sizeof(checksum), "%08lx", (unsigned long)entry.checksum);
+    }
+    printf("%s%15llu  %s  %s  %s\n", mark, entry.size, lastWrite, checksum, relativePath.c_str());
+}
+
+ManifestIndex::ManifestIndex()
+    : mapped{}, header(nullptr)
+{
+}
+
+ManifestIndex::~ManifestIndex()
+{
+    Close();
+}
+
+/// <summary>
+/// Map an index file and check that its sections lie within it.
+/// </summary>
+/// <param name="indexPath">The index file</param>
+/// <returns>0 on success, ERROR_INVALID_DATA if it is not an index this version can read, or another platform error</returns>
+DWORD ManifestIndex::Open(const std::wstring& indexPath)
+{
+    Close();
+
+    DWORD error = PlatformMapFile(indexPath, &mapped);
+    if (error) {
+        return error;
+    }
+
+    const t_indexHeader* candidate = (const t_indexHeader*)mapped.data;
+    unsigned long long size = mapped.size;
+    if (size < sizeof(t_indexHeader) || memcmp(candidate->magic, INDEX_MAGIC, sizeof(INDEX_MAGIC)) != 0
+        || candidate->version != INDEX_VERSION || candidate->headerSize != sizeof(t_indexHeader)
+        || candidate->entryCount >= 0xFFFFFFFFULL
+        || candidate->bucketCount == 0 || (candidate->bucketCount & (candidate->bucketCount - 1)) != 0 || candidate->bucketCount <= candidate->entryCount
+        || candidate->entriesOffset % 8 != 0 || candidate->bucketsOffset % 8 != 0
+        || candidate->entriesOffset > size || candidate->entryCount > (size - candidate->entriesOffset) / sizeof(t_indexEntry)
+        || candidate->bucketsOffset > size || candidate->bucketCount > (size - candidate->bucketsOffset) / sizeof(t_indexBucket)
+        || candidate->stringsOffset > size || candidate->stringsSize > size - candidate->stringsOffset) {
+        Close();
+        return ERROR_INVALID_DATA;
+    }
+
+    header = candidate;
+    return ERROR_SUCCESS;
+}
+
+/// <summary>
+/// Unmap the index, if one is open.
+/// </summary>
+void ManifestIndex::Close(void)
+{
+    PlatformUnmapFile(&mapped);
+    header = nullptr;
+}
+
+/// <summary>
+/// The number of files in the index.
+/// </summary>
+unsigned long long ManifestIndex::Count(void) const
+{
+    return header == nullptr ? 0 : header->entryCount;
+}
+
+/// <summary>
+/// When the run which wrote the index finished, in FILETIME units.
+/// </summary>
+unsigned long long ManifestIndex::CreatedTime(void) const
+{
+    return header == nullptr ? 0 : header->createdTime;
+}
+
+/// <summary>
+/// The entry at a position in path order.
+/// </summary>
+const t_indexEntry* ManifestIndex::EntryAt(unsigned long long position) const
+{
+    return (const t_indexEntry*)((const char*)mapped.data + header->entriesOffset) + position;
+}
+
+/// <summary>
+/// Find an entry's path in the string pool, checking that it lies within the pool.
+/// </summary>
+/// <returns>FALSE if the index is damaged</returns>
+BOOL ManifestIndex::PathAt(const t_indexEntry* entry, const char** path, size_t* length) const
+{
+    if (entry->pathOffset > header->stringsSize || entry->pathLength > header->stringsSize - entry->pathOffset) {
+        return FALSE;
+    }
+    *path = (const char*)mapped.data + header->stringsOffset + entry->pathOffset;
+    *length = entry->pathLength;
+    return TRUE;
+}
+
+/// <summary>
+/// Find a file by its exact path, through the hash table.
+/// </summary>
+/// <param name="relativePath">The UTF-8 path relative to the destination directory</param>
+/// <param name="position">Receives the position of the entry, for Entry</param>
+/// <returns>TRUE if the index holds the file</returns>
+BOOL ManifestIndex::Lookup(const std::string& relativePath, unsigned long long* position) const
+{
+    if (header == nullptr) {
+        return FALSE;
+    }
+
+    const t_indexBucket* buckets = (const t_indexBucket*)((const char*)mapped.data + header->bucketsOffset);
+    unsigned long long hash = IndexHashPath(relativePath.data(), relativePath.size());
+    unsigned long long mask = header->bucketCount - 1;
+
+    // linear probing -- the table always has an empty bucket, so this ends, but a damaged one is bounded too
+    for (unsigned long long probe = 0, slot = hash & mask; probe < header->bucketCount; probe++, slot = (slot + 1) & mask) {
+        const t_indexBucket& bucket = buckets[slot];
+        if (bucket.entry == 0 || bucket.entry > header->entryCount) {
+            return FALSE;
+        }
+        if (bucket.hash != (DWORD)(hash >> 32)) {
+            continue;
+        }
+
+        const char* path = nullptr;
+        size_t length = 0;
+        if (PathAt(EntryAt(bucket.entry - 1), &path, &length) && length == relativePath.size() && memcmp(path, relativePath.data(), length) == 0) {
+            *position = bucket.entry - 1;
+            return TRUE;
+        }
+    }
+    return FALSE;
+}
+
+/// <summary>
+/// The position of the first file whose path is not less than prefix, by binary search. The files
+/// below a directory follow on from there, as long as their paths start with the prefix.
+/// </summary>
+/// <param name="prefix">The UTF-8 path or prefix</param>
+/// <returns>A position from 0 to Count()</returns>
+unsigned long long ManifestIndex::LowerBound(const std::string& prefix) const
+{
+    unsigned long long low = 0;
+    unsigned long long high = Count();
+
+    while (low < high) {
+        unsigned long long middle = low + (high - low) / 2;
+        const char* path = nullptr;
+        size_t length = 0;
+        int order = 1;
+
+        if (PathAt(EntryAt(middle), &path, &length)) {
+            order = memcmp(path, prefix.data(), std::min(length, prefix.size()));
+            if (order == 0) {
+                order = length < prefix.size() ? -1 : (length > prefix.size() ? 1 : 0);
+            }
+        }
+        if (order < 0) {
+            low = middle + 1;
+        }
+        else {
+            high = middle;
+        }
+    }
+    return low;
+}
+
+/// <summary>
+/// Read the file at a position in path order.
+/// </summary>
+/// <param name="position">From 0 to Count() - 1</param>
+/// <param name="relativePath">Receives the UTF-8 path</param>
+/// <param name="entry">Receives the metadata</param>
+/// <returns>FALSE if the position is out of range or the entry is damaged</returns>
+BOOL ManifestIndex::Entry(unsigned long long position, std::string* relativePath, t_manifestEntry* entry) const
+{
+    if (position >= Count()) {
+        return FALSE;
+    }
+
+    const t_indexEntry* indexEntry = EntryAt(position);
+    const char* path = nullptr;
+    size_t length = 0;
+    if (!PathAt(indexEntry, &path, &length)) {
+        return FALSE;
+    }
+
+    relativePath->assign(path, length);
+    entry->size = indexEntry->size;
+    entry->lastWriteTime = indexEntry->lastWriteTime;
+    entry->attributes = indexEntry->attributes;
+    entry->hasChecksum = (indexEntry->flags & INDEX_ENTRY_HAS_CHECKSUM) ? TRUE : FALSE;
+    entry->checksum = indexEntry->checksum;
+    return TRUE;
+}
+
+/// <summary>
+/// The index for a destination lives next to its manifest.
+/// </summary>
+/// <param name="destinationDirectory">The destination directory</param>
+/// <returns>The path of the latest index</returns>
+std::wstring IndexPathForDestination(const std::wstring& destinationDirectory)
+{
+    std::wstring manifestPath = ManifestPathForDestination(destinationDirectory);
+    return manifestPath.substr(0, manifestPath.size() - wcslen(MANIFEST_EXTENSION)) + INDEX_EXTENSION;
+}
+
+/// <summary>
+/// Write a manifest out as an index. The index is written alongside, then the earlier generations are
+/// each renamed one older, the oldest being dropped, and the new index is renamed into place.
+/// </summary>
+/// <param name="indexPath">The path of the latest index</param>
+/// <param name="manifest">The files of this run</param>
+/// <param name="generations">How many earlier indexes to keep, as indexPath.1 to indexPath.N</param>
+/// <returns>0 on success, or the platform error code upon failure</returns>
+DWORD WriteManifestIndex(const std::wstring& indexPath, Manifest& manifest, unsigned int generations)
+{
+    std::vector<std::pair<std::wstring, t_manifestEntry>> manifestEntries;
+    std::vector<std::pair<std::string, t_manifestEntry>> files;
+    std::wstring temporaryPath = indexPath + L".tmp";
+    t_indexHeader header{};
+    t_fileHandle file = INVALID_FILE_HANDLE;
+
+    manifest.Entries(&manifestEntries);
+    if (manifestEntries.size() >= 0xFFFFFFFFULL) {
+        return ERROR_INVALID_PARAMETER;
+    }
+    files.reserve(manifestEntries.size());
+    for (const std::pair<std::wstring, t_manifestEntry>& manifestEntry : manifestEntries) {
+        files.emplace_back(PlatformToUtf8(manifestEntry.first), manifestEntry.second);
+    }
+    manifestEntries.clear();
+    std::sort(files.begin(), files.end(), [](const std::pair<std::string, t_manifestEntry>& a, const std::pair<std::string, t_manifestEntry>& b) { return a.first < b.first; });
+
+    std::vector<t_indexEntry> entries(files.size());
+    std::string strings;
+    for (size_t i = 0; i < files.size(); i++) {
+        entries[i].pathOffset = strings.size();
+        entries[i].pathLength = (DWORD)files[i].first.size();
+        entries[i].attributes = files[i].second.attributes;
+        entries[i].size = files[i].second.size;
+        entries[i].lastWriteTime = files[i].second.lastWriteTime;
+        entries[i].checksum = files[i].second.hasChecksum ? files[i].second.checksum : 0;
+        entries[i].flags = files[i].second.hasChecksum ? INDEX_ENTRY_HAS_CHECKSUM : 0;
+        strings.append(files[i].first);
+    }
+
+    // at most half full, so that probes stay short
+    unsigned long long bucketCount = 1;
+    while (bucketCount < 2 * (unsigned long long)files.size() + 1) {
+        bucketCount *= 2;
+    }
+    std::vector<t_indexBucket> buckets((size_t)bucketCount);
+    for (size_t i = 0; i < files.size(); i++) {
+        unsigned long long hash = IndexHashPath(files[i].first.data(), files[i].first.size());
+        unsigned long long slot = hash & (bucketCount - 1);
+        while (buckets[(size_t)slot].entry != 0) {
+            slot = (slot + 1) & (bucketCount - 1);
+        }
+        buckets[(size_t)slot].entry = (DWORD)(i + 1);
+        buckets[(size_t)slot].hash = (DWORD)(hash >> 32);
+    }
+
+    memcpy(header.magic, INDEX_MAGIC, sizeof(INDEX_MAGIC));
+    header.version = INDEX_VERSION;
+    header.headerSize = sizeof(t_indexHeader);
+    header.createdTime = (unsigned long long)time(nullptr) * FILETIME_TICKS_PER_SECOND + FILETIME_UNIX_EPOCH;
+    header.entryCount = entries.size();
+    header.entriesOffset = AlignSection(sizeof(t_indexHeader));
+    header.bucketCount = bucketCount;
+    header.bucketsOffset = AlignSection(header.entriesOffset + entries.size() * sizeof(t_indexEntry));
+    header.stringsOffset = AlignSection(header.bucketsOffset + buckets.size() * sizeof(t_indexBucket));
+    header.stringsSize = strings.size();
+
+    DWORD error = PlatformOpenForWrite(temporaryPath, FALSE, TRUE, &file);
+    if (error) {
+        return error;
+    }
+
+    // each section is written in pieces of at most 64 MiB, the most a single write can take being a DWORD
+    const struct {
+        unsigned long long offset;
+        const char* data;
+        unsigned long long length;
+    } sections[] = {
+        { 0, (const char*)&header, sizeof(header) },
+        { header.entriesOffset, (const char*)entries.data(), entries.size() * sizeof(t_indexEntry) },
+        { header.bucketsOffset, (const char*)buckets.data(), buckets.size() * sizeof(t_indexBucket) },
+        { header.stringsOffset, strings.data(), strings.size() },
+    };
+    for (const auto& section : sections) {
+        for (unsigned long long done = 0; done < section.length && !error; ) {
+            DWORD length = (DWORD)std::min<unsigned long long>(section.length - done, 64 * 1024 * 1024);
+            error = PlatformWriteAt(file, section.offset + done, section.data + done, length);
+            done += length;
+        }
+    }
+    if (!error) {
+        error = PlatformSetFileSize(file, header.stringsOffset + header.stringsSize);
+    }
+    PlatformCloseFile(file);
+    if (error) {
+        PlatformDeletePath(temporaryPath, FALSE);
+        return error;
+    }
+
+    // shift the earlier generations along -- indexPath.N is replaced by indexPath.N-1 and so on
+    for (unsigned int generation = generations; generation > 0 && !error; generation--) {
+        std::wstring older = indexPath + L"." + std::to_wstring(generation);
+        std::wstring newer = generation == 1 ? indexPath : indexPath + L"." + std::to_wstring(generation - 1);
+        if (PlatformPathExists(newer)) {
+            error = PlatformReplaceFile(newer, older, FALSE);
+        }
+    }
+    if (!error) {
+        error = PlatformReplaceFile(temporaryPath, indexPath, TRUE);
+    }
+    return error;
+}
+
+/// <summary>
+/// Open an index for one of the query commands, explaining why if it cannot be.
+/// </summary>
+static DWORD OpenIndexForQuery(ManifestIndex& index, const std::wstring& indexPath)
+{
+    DWORD error = index.Open(indexPath);
+    if (error == ERROR_INVALID_DATA) {
+        printf("\"%s\" is not a ShadowDuplicator index, or is damaged.\n", PlatformToUtf8(indexPath).c_str());
+    }
+    else if (error) {
+        printf("Unable to open the index \"%s\" (error %lu).\n", PlatformToUtf8(indexPath).c_str(), (unsigned long)error);
+    }
+    return error;
+}
+
+/// <summary>
+/// List the files in an index, in path order, or just those below a directory.
+/// </summary>
+/// <param name="indexPath">The index file</param>
+/// <param name="prefix">Only list paths which start with this, or everything if it is empty</param>
+/// <returns>0 on success, or the platform error code upon failure</returns>
+DWORD IndexList(const std::wstring& indexPath, const std::wstring& prefix)
+{
+    ManifestIndex index;
+    std::string pathPrefix = IndexQueryPath(prefix);
+    std::string relativePath;
+    t_manifestEntry entry{};
+    char created[32];
+
+    DWORD error = OpenIndexForQuery(index, indexPath);
+    if (error) {
+        return error;
+    }
+
+    FormatFileTime(index.CreatedTime(), created, sizeof(created));
+    printf("%llu files, indexed %s UTC\n", index.Count(), created);
+    for (unsigned long long position = index.LowerBound(pathPrefix); position < index.Count(); position++) {
+        if (!index.Entry(position, &relativePath, &entry)) {
+            return ERROR_INVALID_DATA;
+        }
+        if (relativePath.compare(0, pathPrefix.size(), pathPrefix) != 0) {
+            break;
+        }
+        PrintIndexEntry("", relativePath, entry);
+    }
+    return ERROR_SUCCESS;
+}
+
+/// <summary>
+/// Look up files in an index by their paths relative to the destination directory.
+/// </summary>
+/// <param name="indexPath">The index file</param>
+/// <param name="relativePaths">The files to look up</param>
+/// <returns>0 if every file was found, ERROR_FILE_NOT_FOUND if any was not, or another platform error</returns>
+DWORD IndexLookup(const std::wstring& indexPath, const std::vector<std::wstring>& relativePaths)
+{
+    ManifestIndex index;
+    std::string relativePath;
+    t_manifestEntry entry{};
+    unsigned long long position = 0;
+
+    DWORD error = OpenIndexForQuery(index, indexPath);
+    if (error) {
+        return error;
+    }
+
+    for (const std::wstring& wantedPath : relativePaths) {
+        std::string queryPath = IndexQueryPath(wantedPath);
+        if (index.Lookup(queryPath, &position) && index.Entry(position, &relativePath, &entry)) {
+            PrintIndexEntry("", relativePath, entry);
+        }
+        else {
+            printf("Not in the index: %s\n", queryPath.c_str());
+            error = ERROR_FILE_NOT_FOUND;
+        }
+    }
+    return error;
+}
+
+/// <summary>
+/// Compare two indexes, typically two generations of the same destination, by merging their path orders.
+/// Files are marked + if added, - if removed and M if their size, last write time or checksum changed.
+/// </summary>
+/// <param name="oldIndexPath">The earlier index</param>
+/// <param name="newIndexPath">The later index</param>
+/// <returns>0 on success, or the platform error code upon failure</returns>
+DWORD IndexDiff(const std::wstring& oldIndexPath, const std::wstring& newIndexPath)
+{
+    ManifestIndex oldIndex;
+    ManifestIndex newIndex;
+    std::string oldPath;
+    std::string newPath;
+    t_manifestEntry oldEntry{};
+    t_manifestEntry newEntry{};
+    unsigned long long oldPosition = 0;
+    unsigned long long newPosition = 0;
+    unsigned long long added = 0;
+    unsigned long long removed = 0;
+    unsigned long long changed = 0;
+    unsigned long long unchanged = 0;
+
+    DWORD error = OpenIndexForQuery(oldIndex, oldIndexPath);
+    if (!error) {
+        error = OpenIndexForQuery(newIndex, newIndexPath);
+    }
+    if (error) {
+        return error;
+    }
+
+    while (oldPosition < oldIndex.Count() || newPosition < newIndex.Count()) {
+        BOOL haveOld = oldPosition < oldIndex.Count();
+        BOOL haveNew = newPosition < newIndex.Count();
+        if ((haveOld && !oldIndex.Entry(oldPosition, &oldPath, &oldEntry)) || (haveNew && !newIndex.Entry(newPosition, &newPath, &newEntry))) {
+            return ERROR_INVALID_DATA;
+        }
+
+        int order = !haveOld ? 1 : (!haveNew ? -1 : oldPath.compare(newPath));
+        if (order < 0) {
+            PrintIndexEntry("- ", oldPath, oldEntry);
+            removed++;
+            oldPosition++;
+        }
+        else if (order > 0) {
+            PrintIndexEntry("+ ", newPath, newEntry);
+            added++;
+            newPosition++;
+        }
+        else {
+            BOOL checksumChanged = oldEntry.hasChecksum && newEntry.hasChecksum && oldEntry.checksum != newEntry.checksum;
+            if (oldEntry.size != newEntry.size || oldEntry.lastWriteTime != newEntry.lastWriteTime || checksumChanged) {
+                PrintIndexEntry("M ", newPath, newEntry);
+                changed++;
+            }
+            else {
+                unchanged++;
+            }
+            oldPosition++;
+            newPosition++;
+        }
+    }
+
+    printf("%llu added, %llu removed, %llu changed, %llu unchanged\n", added, removed, changed, unchanged);
+    return ERROR_SUCCESS;
+}
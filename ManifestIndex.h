@@ -0,0 +1,103 @@
+/* ShadowDuplicator -- a simple VC++ Volume Shadow Copy requestor for backing up
+locked files
+
+Copyright (C) 2021-2023 Peter Upfold.
+
+Licensed under the Apache 2.0 Licence. See the LICENSE file in the project root for details.
+
+This code is **not** production quality. There is certainly plenty of potential for improvement of this code,
+but beyond that, it may even be insecure, destructive or cause you other serious problems. There
+is no warranty.
+*/
+#pragma once
+#include "Platform.h"
+#include "Manifest.h"
+#include <string>
+#include <vector>
+
+// appended to the destination directory to give the path of its index, as for MANIFEST_EXTENSION
+#define INDEX_EXTENSION L".sdindex"
+#define INDEX_MAGIC "SDINDEX"
+#define INDEX_VERSION 1
+
+// how many earlier indexes are kept beside the latest, as .sdindex.1 (the newest) up to .sdindex.N
+#define DEFAULT_INDEX_GENERATIONS 7
+#define MAX_INDEX_GENERATIONS 999
+
+// set in t_indexEntry.flags when the checksum field holds a CRC32C
+#define INDEX_ENTRY_HAS_CHECKSUM 0x1
+
+/*
+The index is a little-endian binary file laid out to be used straight from a read-only mapping:
+
+    header | entries, sorted by path | hash buckets | string pool
+
+Every section starts on an 8 byte boundary. Paths are UTF-8, as in the text manifest, and are kept in
+the string pool without terminators. Entries are sorted by the bytes of their paths, so that a prefix
+is found by binary search and two indexes are compared by merging. The buckets are an open addressed
+hash table over the same paths, at most half full, so that a lookup touches a bucket or two whatever
+the number of files.
+*/
+
+// The first bytes of the file, giving where each section is
+typedef struct indexHeader {
+    char magic[8];
+    DWORD version;
+    DWORD headerSize;
+    unsigned long long createdTime; // FILETIME units, when the run which wrote the index finished
+    unsigned long long entryCount;
+    unsigned long long entriesOffset;
+    unsigned long long bucketCount; // a power of two
+    unsigned long long bucketsOffset;
+    unsigned long long stringsOffset;
+    unsigned long long stringsSize;
+} t_indexHeader;
+
+// One file, with the source metadata and checksum from the manifest
+typedef struct indexEntry {
+    unsigned long long pathOffset; // from the start of the string pool
+    DWORD pathLength;
+    DWORD attributes;
+    unsigned long long size;
+    unsigned long long lastWriteTime;
+    DWORD checksum;
+    DWORD flags;
+} t_indexEntry;
+
+// One slot of the hash table
+typedef struct indexBucket {
+    DWORD entry; // the index of the entry plus one, or 0 if the bucket is empty
+    DWORD hash;  // the top half of the path's hash, so that most mismatches need no string compare
+} t_indexBucket;
+
+/// <summary>
+/// A read-only view of an index file. Opening it maps the file and checks the header, and reads
+/// nothing else, so opening and looking up a path take the same time for ten files as for ten million.
+/// </summary>
+class ManifestIndex {
+public:
+    ManifestIndex();
+    ~ManifestIndex();
+
+    DWORD Open(const std::wstring& indexPath);
+    void Close(void);
+
+    unsigned long long Count(void) const;
+    unsigned long long CreatedTime(void) const;
+    BOOL Lookup(const std::string& relativePath, unsigned long long* position) const;
+    unsigned long long LowerBound(const std::string& prefix) const;
+    BOOL Entry(unsigned long long position, std::string* relativePath, t_manifestEntry* entry) const;
+
+private:
+    const t_indexEntry* EntryAt(unsigned long long position) const;
+    BOOL PathAt(const t_indexEntry* entry, const char** path, size_t* length) const;
+
+    t_mappedFile mapped;
+    const t_indexHeader* header;
+};
+
+std::wstring IndexPathForDestination(const std::wstring& destinationDirectory);
+DWORD WriteManifestIndex(const std::wstring& indexPath, Manifest& manifest, unsigned int generations);
+DWORD IndexList(const std::wstring& indexPath, const std::wstring& prefix);
+DWORD IndexLookup(const std::wstring& indexPath, const std::vector<std::wstring>& relativePaths);
+DWORD IndexDiff(const std::wstring& oldIndexPath, const std::wstring& newIndexPath);
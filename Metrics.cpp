@@ -0,0 +1,232 @@
+/* ShadowDuplicator -- a simple VC++ Volume Shadow Copy requestor for backing up
+locked files
+
+Copyright (C) 2021-2023 Peter Upfold.
+
+Licensed under the Apache 2.0 Licence. See the LICENSE file in the project root for details.
+
+This code is **not** production quality. There is certainly plenty of potential for improvement of this code,
+but beyond that, it may even be insecure, destructive or cause you other serious problems. There
+is no warranty.
+*/
+
+#include "Metrics.h"
+#include <cstdarg>
+#include <cstdio>
+#include <map>
+
+// Written to the file in pieces of this size
+#define METRICS_IO_CHUNK (1024 * 1024)
+
+/// <summary>
+/// Write text to a file in one step, through a temporary file, so that a collector reading the file
+/// never sees half of it.
+/// </summary>
+/// <param name="path">The file to write</param>
+/// <param name="text">The whole content</param>
+/// <returns>0 on success, or the platform error code upon failure</returns>
+static DWORD WriteTextFile(const std::wstring& path, const std::string& text)
+{
+    std::wstring temporaryPath = path + L".tmp";
+    t_fileHandle file = INVALID_FILE_HANDLE;
+    DWORD error = ERROR_SUCCESS;
+
+    error = PlatformOpenForWrite(temporaryPath, FALSE, TRUE, &file);
+    if (error) {
+        return error;
+    }
+    for (size_t offset = 0; offset < text.size() && !error; offset += METRICS_IO_CHUNK) {
+        size_t length = (text.size() - offset < METRICS_IO_CHUNK) ? text.size() - offset : METRICS_IO_CHUNK;
+        error = PlatformWriteAt(file, offset, text.data() + offset, (DWORD)length);
+    }
+    PlatformCloseFile(file);
+
+    if (!error) {
+        error = PlatformReplaceFile(temporaryPath, path, FALSE);
+    }
+    return error;
+}
+
+/// <summary>
+/// Append a string to JSON text as a quoted, escaped JSON string.
+/// </summary>
+/// <param name="text">The JSON being built</param>
+/// <param name="value">UTF-8 text</param>
+static void AppendJsonString(std::string& text, const std::string& value)
+{
+    char escape[8]{};
+
+    text.push_back('"');
+    for (unsigned char character : value) {
+        if (character == '"' || character == '\\') {
+            text.push_back('\\');
+            text.push_back((char)character);
+        }
+        else if (character < 0x20) {
+            snprintf(escape, sizeof(escape), "\\u%04x", character);
+            text.append(escape);
+        }
+        else {
+            text.push_back((char)character);
+        }
+    }
+    text.push_back('"');
+}
+
+/// <summary>
+/// Append printf-style formatted text.
+/// </summary>
+static void AppendFormat(std::string& text, const char* format, ...)
+{
+    char buffer[512]{};
+    va_list arguments;
+
+    va_start(arguments, format);
+    vsnprintf(buffer, sizeof(buffer), format, arguments);
+    va_end(arguments);
+    text.append(buffer);
+}
+
+/// <summary>
+/// Bytes per second, or 0 if no time passed.
+/// </summary>
+static double Throughput(unsigned long long bytes, double milliseconds)
+{
+    return (milliseconds > 0) ? bytes * 1000.0 / milliseconds : 0;
+}
+
+/// <summary>
+/// Record one file. Called concurrently from the copy workers.
+/// </summary>
+/// <param name="relativePath">The file's path relative to the destination</param>
+/// <param name="bytes">The size of the file</param>
+/// <param name="milliseconds">How long the copy took</param>
+/// <param name="error">0 if the copy succeeded, otherwise its error</param>
+void RunMetrics::RecordFile(const std::wstring& relativePath, unsigned long long bytes, double milliseconds, DWORD error)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    files.push_back(t_fileMetric{ relativePath, bytes, milliseconds, error });
+}
+
+/// <summary>
+/// Write the run's totals, phases and every file as a JSON document.
+/// </summary>
+/// <param name="path">The file to write</param>
+/// <param name="summary">The totals of the run</param>
+/// <param name="timings">The time taken by each phase</param>
+/// <returns>0 on success, or the platform error code upon failure</returns>
+DWORD RunMetrics::WriteJson(const std::wstring& path, const t_runSummary& summary, const PhaseTimings& timings)
+{
+    std::string text;
+    std::lock_guard<std::mutex> guard(lock);
+
+    text.append("{\n");
+    AppendFormat(text, "  \"startTime\": %lld,\n", summary.startTime);
+    AppendFormat(text, "  \"seconds\": %.3f,\n", summary.milliseconds / 1000);
+    AppendFormat(text, "  \"exitCode\": %ld,\n", (long)summary.exitCode);
+    AppendFormat(text, "  \"copyThreads\": %u,\n", summary.copyThreads);
+    AppendFormat(text, "  \"filesCopied\": %llu,\n", summary.filesCopied);
+    AppendFormat(text, "  \"filesFailed\": %llu,\n", summary.filesFailed);
+    AppendFormat(text, "  \"filesSkipped\": %llu,\n", summary.filesSkipped);
+    AppendFormat(text, "  \"bytesCopied\": %llu,\n", summary.bytesCopied);
+    AppendFormat(text, "  \"bytesSkipped\": %llu,\n", summary.bytesSkipped);
+    AppendFormat(text, "  \"copySeconds\": %.3f,\n", summary.copyMilliseconds / 1000);
+    AppendFormat(text, "  \"bytesPerSecond\": %.0f,\n", Throughput(summary.bytesCopied, summary.copyMilliseconds));
+    AppendFormat(text, "  \"peakQueueDepth\": %llu,\n", summary.peakQueueDepth);
+
+    text.append("  \"phases\": [");
+    for (size_t i = 0; i < timings.Phases().size(); i++) {
+        text.append(i == 0 ? "\n    { \"phase\": " : ",\n    { \"phase\": ");
+        AppendJsonString(text, timings.Phases()[i].phase);
+        AppendFormat(text, ", \"seconds\": %.3f }", timings.Phases()[i].milliseconds / 1000);
+    }
+    text.append("\n  ],\n");
+
+    text.append("  \"files\": [");
+    for (size_t i = 0; i < files.size(); i++) {
+        text.append(i == 0 ? "\n    { \"path\": " : ",\n    { \"path\": ");
+        AppendJsonString(text, PlatformToUtf8(files[i].relativePath));
+        AppendFormat(text, ", \"bytes\": %llu, \"seconds\": %.3f, \"bytesPerSecond\": %.0f, \"error\": %lu }",
+            files[i].bytes, files[i].milliseconds / 1000, Throughput(files[i].bytes, files[i].milliseconds), (unsigned long)files[i].error);
+    }
+    text.append("\n  ]\n}\n");
+
+    return WriteTextFile(path, text);
+}
+
+/// <summary>
+/// Write the run's totals, phases and a histogram of file copy times in the Prometheus text format,
+/// for the node exporter's textfile collector.
+/// </summary>
+/// <param name="path">The file to write, which should end in .prom</param>
+/// <param name="summary">The totals of the run</param>
+/// <param name="timings">The time taken by each phase</param>
+/// <returns>0 on success, or the platform error code upon failure</returns>
+DWORD RunMetrics::WritePrometheus(const std::wstring& path, const t_runSummary& summary, const PhaseTimings& timings)
+{
+    static const double bucketBounds[] = METRICS_DURATION_BUCKETS;
+    const size_t bucketCount = sizeof(bucketBounds) / sizeof(bucketBounds[0]);
+    std::map<std::string, double> phaseSeconds; // a phase which runs more than once, like GatherWriterStatus, is summed
+    std::vector<unsigned long long> buckets(bucketCount);
+    double fileSeconds = 0;
+    std::string text;
+    std::lock_guard<std::mutex> guard(lock);
+
+    for (const t_phaseTiming& timing : timings.Phases()) {
+        phaseSeconds[timing.phase] += timing.milliseconds / 1000;
+    }
+    for (const t_fileMetric& file : files) {
+        fileSeconds += file.milliseconds / 1000;
+        for (size_t i = 0; i < bucketCount; i++) {
+            if (file.milliseconds / 1000 <= bucketBounds[i]) {
+                buckets[i]++;
+            }
+        }
+    }
+
+    text.append("# HELP shadowduplicator_last_run_timestamp_seconds When the last run started.\n");
+    text.append("# TYPE shadowduplicator_last_run_timestamp_seconds gauge\n");
+    AppendFormat(text, "shadowduplicator_last_run_timestamp_seconds %lld\n", summary.startTime);
+    text.append("# HELP shadowduplicator_last_run_seconds Wall time of the last run.\n");
+    text.append("# TYPE shadowduplicator_last_run_seconds gauge\n");
+    AppendFormat(text, "shadowduplicator_last_run_seconds %.3f\n", summary.milliseconds / 1000);
+    text.append("# HELP shadowduplicator_last_run_exit_code Exit code of the last run, 0 on success.\n");
+    text.append("# TYPE shadowduplicator_last_run_exit_code gauge\n");
+    AppendFormat(text, "shadowduplicator_last_run_exit_code %ld\n", (long)summary.exitCode);
+
+    text.append("# HELP shadowduplicator_phase_seconds Wall time of each phase of the last run.\n");
+    text.append("# TYPE shadowduplicator_phase_seconds gauge\n");
+    for (const auto& phase : phaseSeconds) {
+        AppendFormat(text, "shadowduplicator_phase_seconds{phase=\"%s\"} %.3f\n", phase.first.c_str(), phase.second);
+    }
+
+    text.append("# HELP shadowduplicator_files Files copied, failed and skipped as unchanged by the last run.\n");
+    text.append("# TYPE shadowduplicator_files gauge\n");
+    AppendFormat(text, "shadowduplicator_files{state=\"copied\"} %llu\n", summary.filesCopied);
+    AppendFormat(text, "shadowduplicator_files{state=\"failed\"} %llu\n", summary.filesFailed);
+    AppendFormat(text, "shadowduplicator_files{state=\"skipped\"} %llu\n", summary.filesSkipped);
+    text.append("# HELP shadowduplicator_bytes Bytes copied and skipped as unchanged by the last run.\n");
+    text.append("# TYPE shadowduplicator_bytes gauge\n");
+    AppendFormat(text, "shadowduplicator_bytes{state=\"copied\"} %llu\n", summary.bytesCopied);
+    AppendFormat(text, "shadowduplicator_bytes{state=\"skipped\"} %llu\n", summary.bytesSkipped);
+    text.append("# HELP shadowduplicator_copy_bytes_per_second Bytes copied per second of the copy phase of the last run.\n");
+    text.append("# TYPE shadowduplicator_copy_bytes_per_second gauge\n");
+    AppendFormat(text, "shadowduplicator_copy_bytes_per_second %.0f\n", Throughput(summary.bytesCopied, summary.copyMilliseconds));
+    text.append("# HELP shadowduplicator_copy_threads Copy worker threads used by the last run.\n");
+    text.append("# TYPE shadowduplicator_copy_threads gauge\n");
+    AppendFormat(text, "shadowduplicator_copy_threads %u\n", summary.copyThreads);
+    text.append("# HELP shadowduplicator_peak_queue_depth Most files waiting for a copy worker at once in the last run.\n");
+    text.append("# TYPE shadowduplicator_peak_queue_depth gauge\n");
+    AppendFormat(text, "shadowduplicator_peak_queue_depth %llu\n", summary.peakQueueDepth);
+
+    text.append("# HELP shadowduplicator_file_copy_seconds Time taken to copy each file in the last run.\n");
+    text.append("# TYPE shadowduplicator_file_copy_seconds histogram\n");
+    for (size_t i = 0; i < bucketCount; i++) {
+        AppendFormat(text, "shadowduplicator_file_copy_seconds_bucket{le=\"%g\"} %llu\n", bucketBounds[i], buckets[i]);
+    }
+    AppendFormat(text, "shadowduplicator_file_copy_seconds_bucket{le=\"+Inf\"} %zu\n", files.size());
+    AppendFormat(text, "shadowduplicator_file_copy_seconds_sum %.3f\n", fileSeconds);
+    AppendFormat(text, "shadowduplicator_file_copy_seconds_count %zu\n", files.size());
+
+    return WriteTextFile(path, text);
+}
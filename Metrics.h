@@ -0,0 +1,60 @@
+/* ShadowDuplicator -- a simple VC++ Volume Shadow Copy requestor for backing up
+locked files
+
+Copyright (C) 2021-2023 Peter Upfold.
+
+Licensed under the Apache 2.0 Licence. See the LICENSE file in the project root for details.
+
+This code is **not** production quality. There is certainly plenty of potential for improvement of this code,
+but beyond that, it may even be insecure, destructive or cause you other serious problems. There
+is no warranty.
+*/
+#pragma once
+#include "Platform.h"
+#include "AsyncWait.h"
+#include <mutex>
+#include <string>
+#include <vector>
+
+// Files whose copy took up to this many seconds fall in each bucket of the Prometheus duration histogram
+#define METRICS_DURATION_BUCKETS { 0.01, 0.1, 1, 10, 60, 600 }
+
+// One file copied, or which failed to copy
+typedef struct fileMetric {
+    std::wstring relativePath;
+    unsigned long long bytes;
+    double milliseconds;
+    DWORD error;
+} t_fileMetric;
+
+// The totals of a run, gathered once the copy has finished
+typedef struct runSummary {
+    long long startTime; // seconds since 1970
+    double milliseconds;
+    HRESULT exitCode;
+    unsigned int copyThreads;
+    unsigned long long filesCopied;
+    unsigned long long filesFailed;
+    unsigned long long filesSkipped;
+    unsigned long long bytesCopied;
+    unsigned long long bytesSkipped;
+    unsigned long long peakQueueDepth;
+    double copyMilliseconds;
+} t_runSummary;
+
+/// <summary>
+/// Collects the time and size of each file copied, and at the end of the run writes them, with the
+/// phase timings and totals, as JSON and in the Prometheus text exposition format. The JSON lists
+/// every file; the Prometheus file has only totals and a histogram, to keep its series few.
+/// </summary>
+class RunMetrics {
+public:
+    void RecordFile(const std::wstring& relativePath, unsigned long long bytes, double milliseconds, DWORD error);
+
+    DWORD WriteJson(const std::wstring& path, const t_runSummary& summary, const PhaseTimings& timings);
+    DWORD WritePrometheus(const std::wstring& path, const t_runSummary& summary, const PhaseTimings& timings);
+
+private:
+    std::mutex lock;
+    std::vector<t_fileMetric> files;
+};
@@ -0,0 +1,608 @@
+/* ShadowDuplicator -- a simple VC++ Volume Shadow Copy requestor for backing up
+locked files
+
+Copyright (C) 2021-2023 Peter Upfold.
+
+Licensed under the Apache 2.0 Licence. See the LICENSE file in the project root for details.
+
+This code is **not** production quality. There is certainly plenty of potential for improvement of this code,
+but beyond that, it may even be insecure, destructive or cause you other serious problems. There
+is no warranty.
+*/
+
+#include "PathFilter.h"
+#include <algorithm>
+#include <cwctype>
+#include <unordered_map>
+
+/*
+Patterns are matched against the path of a file or directory relative to the source directory, with
+either separator and without regard to case. * and ? do not cross a separator, and ** as a whole
+name matches any number of directories. A pattern with no separator in it matches a name at any
+depth, like *.tmp; one with a separator is matched from the source directory down. A pattern which
+ends with a separator matches only directories. Whatever a pattern matches, it also matches
+everything below.
+
+Each pattern is a chain of tokens, and every point between two tokens is a position of a
+nondeterministic automaton which runs all of the patterns side by side. Compile turns the sets of
+positions which can be reached into the states of a deterministic automaton, with a transition for
+each class of character, so that matching costs one table lookup per character. The patterns which
+match a name at any depth get an automaton of their own, which starts again at every name, and
+the rest share one which runs over the whole path. Were they compiled together, every state of one
+kind would be paired with every state of the other, and a few hundred patterns could need millions.
+*/
+
+// the character classes which every filter has -- everything not named in a pattern, and the separator
+#define FILTER_OTHER_CLASS 0
+#define FILTER_SEPARATOR_CLASS 1
+
+// marks a position at a **\ token part way through a directory name, which must reach a separator before the pattern carries on
+#define FILTER_INSIDE_NAME 0x80000000U
+
+// the states every compiled filter has
+#define FILTER_DEAD_STATE 0
+#define FILTER_START_STATE 1
+
+/// <summary>
+/// Whether a character is a path separator. Both are accepted whatever the platform.
+/// </summary>
+static BOOL IsSeparator(wchar_t character)
+{
+    return character == L'/' || character == L'\\';
+}
+
+/// <summary>
+/// Fold a character for comparison -- separators to '/', everything else to lower case.
+/// </summary>
+static wchar_t FoldCharacter(wchar_t character)
+{
+    return IsSeparator(character) ? L'/' : (wchar_t)towlower(character);
+}
+
+/// <summary>
+/// Parse one glob into tokens.
+/// </summary>
+/// <param name="text">The pattern as given in the INI file</param>
+/// <param name="match">FILTER_MATCH_INCLUDE or FILTER_MATCH_EXCLUDE</param>
+/// <param name="pattern">Receives the parsed pattern</param>
+/// <returns>FALSE if the pattern is empty</returns>
+static BOOL ParsePattern(const std::wstring& text, unsigned int match, t_filterPattern* pattern)
+{
+    std::wstring glob;
+    BOOL anchored = FALSE;
+
+    size_t start = text.find_first_not_of(L" \t");
+    if (start == std::wstring::npos) {
+        return FALSE;
+    }
+    size_t end = text.find_last_not_of(L" \t");
+    for (size_t i = start; i <= end; i++) {
+        wchar_t character = FoldCharacter(text[i]);
+        if (character == L'/' && !glob.empty() && glob.back() == L'/') {
+            continue;
+        }
+        glob += character;
+    }
+
+    pattern->match = match;
+    pattern->directoryOnly = FALSE;
+    pattern->anyDepth = FALSE;
+    pattern->tokens.clear();
+    while (!glob.empty() && glob.back() == L'/') {
+        glob.pop_back();
+        pattern->directoryOnly = TRUE;
+    }
+    if (glob.compare(0, 2, L"./") == 0) {
+        glob.erase(0, 2);
+        anchored = TRUE;
+    }
+    if (!glob.empty() && glob[0] == L'/') {
+        glob.erase(0, 1);
+        anchored = TRUE;
+    }
+    if (glob.empty()) {
+        return FALSE;
+    }
+
+    // a bare name may be in any directory
+    pattern->anyDepth = !anchored && glob.find(L'/') == std::wstring::npos;
+
+    for (size_t i = 0; i < glob.size(); i++) {
+        if (glob[i] == L'*') {
+            size_t run = i;
+            while (run < glob.size() && glob[run] == L'*') {
+                run++;
+            }
+            BOOL wholeName = (i == 0 || glob[i - 1] == L'/') && (run == glob.size() || glob[run] == L'/');
+            if (run - i >= 2 && wholeName) {
+                if (run == glob.size()) {
+                    pattern->tokens.push_back(t_filterToken{ FILTER_REST, 0 });
+                }
+                else {
+                    pattern->tokens.push_back(t_filterToken{ FILTER_DIRECTORIES, 0 });
+                    run++; // the separator after ** is part of it
+                }
+            }
+            else {
+                pattern->tokens.push_back(t_filterToken{ FILTER_STAR, 0 });
+            }
+            i = run - 1;
+        }
+        else if (glob[i] == L'?') {
+            pattern->tokens.push_back(t_filterToken{ FILTER_ANY, 0 });
+        }
+        else {
+            pattern->tokens.push_back(t_filterToken{ FILTER_LITERAL, glob[i] });
+        }
+    }
+    return TRUE;
+}
+
+// Hashes a set of positions, so that Build can find the state it has already made of the same set
+struct PositionSetHash {
+    size_t operator()(const std::vector<unsigned int>& positions) const
+    {
+        unsigned long long hash = 14695981039346656037ULL;
+        for (unsigned int position : positions) {
+            hash = (hash ^ position) * 1099511628211ULL;
+        }
+        return (size_t)hash;
+    }
+};
+
+/// <summary>
+/// Match a path, or the start of one, against a single pattern by backtracking.
+/// </summary>
+/// <param name="tokens">The pattern</param>
+/// <param name="token">The token to match from</param>
+/// <param name="path">The path</param>
+/// <param name="length">The length of the path, or of the directory at its start which is being matched</param>
+/// <param name="at">The character to match from</param>
+/// <returns>TRUE if the rest of the pattern matches the rest of the path exactly</returns>
+static BOOL GlobMatches(const std::vector<t_filterToken>& tokens, size_t token, const wchar_t* path, size_t length, size_t at)
+{
+    for (; token < tokens.size(); token++) {
+        const t_filterToken& current = tokens[token];
+        switch (current.type) {
+        case FILTER_LITERAL:
+            if (at == length || FoldCharacter(path[at]) != current.character) {
+                return FALSE;
+            }
+            at++;
+            break;
+        case FILTER_ANY:
+            if (at == length || IsSeparator(path[at])) {
+                return FALSE;
+            }
+            at++;
+            break;
+        case FILTER_STAR:
+            for (size_t end = at; ; end++) {
+                if (GlobMatches(tokens, token + 1, path, length, end)) {
+                    return TRUE;
+                }
+                if (end == length || IsSeparator(path[end])) {
+                    return FALSE;
+                }
+            }
+        case FILTER_DIRECTORIES:
+            if (GlobMatches(tokens, token + 1, path, length, at)) {
+                return TRUE;
+            }
+            for (size_t end = at; end < length; end++) {
+                if (IsSeparator(path[end]) && GlobMatches(tokens, token + 1, path, length, end + 1)) {
+                    return TRUE;
+                }
+            }
+            return FALSE;
+        case FILTER_REST:
+            return TRUE;
+        }
+    }
+    return at == length;
+}
+
+/// <summary>
+/// An empty filter, which lets everything through.
+/// </summary>
+PathFilter::PathFilter() : hasIncludes(FALSE), limits{}, classCount(0), asciiClasses{}
+{
+}
+
+/// <summary>
+/// Parse the patterns and compile them into the automata.
+/// </summary>
+/// <param name="includes">If any are given, only files which match one of them are kept</param>
+/// <param name="excludes">Files and directories which match any of these are left out, even if they match an include</param>
+/// <returns>0 on success, or ERROR_NOT_SUPPORTED if the patterns need more than FILTER_MAX_STATES states</returns>
+DWORD PathFilter::Compile(const std::vector<std::wstring>& includes, const std::vector<std::wstring>& excludes)
+{
+    t_filterPattern pattern;
+
+    patterns.clear();
+    for (const std::wstring& include : includes) {
+        if (ParsePattern(include, FILTER_MATCH_INCLUDE, &pattern)) {
+            patterns.push_back(pattern);
+        }
+    }
+    hasIncludes = !patterns.empty();
+    for (const std::wstring& exclude : excludes) {
+        if (ParsePattern(exclude, FILTER_MATCH_EXCLUDE, &pattern)) {
+            patterns.push_back(pattern);
+        }
+    }
+
+    // number the positions, and give each character a pattern names its own class
+    positionPattern.clear();
+    positionToken.clear();
+    classCount = 2;
+    std::fill(std::begin(asciiClasses), std::end(asciiClasses), (unsigned short)FILTER_OTHER_CLASS);
+    asciiClasses[L'/'] = FILTER_SEPARATOR_CLASS;
+    asciiClasses[L'\\'] = FILTER_SEPARATOR_CLASS;
+    otherClasses.clear();
+    for (unsigned int index = 0; index < patterns.size(); index++) {
+        for (unsigned int token = 0; token <= patterns[index].tokens.size(); token++) {
+            positionPattern.push_back(index);
+            positionToken.push_back(token);
+            if (token == patterns[index].tokens.size() || patterns[index].tokens[token].type != FILTER_LITERAL) {
+                continue;
+            }
+            wchar_t character = patterns[index].tokens[token].character;
+            if (character < 128 && asciiClasses[character] == FILTER_OTHER_CLASS) {
+                asciiClasses[character] = (unsigned short)classCount;
+                asciiClasses[towupper(character)] = (unsigned short)classCount;
+                classCount++;
+            }
+            else if (character >= 128 && otherClasses.find(character) == otherClasses.end()) {
+                otherClasses[character] = (unsigned short)classCount++;
+            }
+        }
+    }
+
+    DWORD error = Build(TRUE, &nameAutomaton);
+    if (!error) {
+        error = Build(FALSE, &pathAutomaton);
+    }
+    if (error) {
+        patterns.clear();
+        nameAutomaton = t_filterAutomaton();
+        pathAutomaton = t_filterAutomaton();
+        hasIncludes = FALSE;
+        return error;
+    }
+    return ERROR_SUCCESS;
+}
+
+/// <summary>
+/// Set the size and age limits which files must also meet.
+/// </summary>
+/// <param name="limits">The limits, with 0 for any which do not apply</param>
+void PathFilter::SetLimits(const t_filterLimits& limits)
+{
+    this->limits = limits;
+}
+
+/// <summary>
+/// The size and age limits set on the filter.
+/// </summary>
+const t_filterLimits& PathFilter::Limits(void) const
+{
+    return limits;
+}
+
+/// <summary>
+/// Whether a directory should be walked, which it is unless an exclude pattern matches it.
+/// Include patterns never stop a directory being walked, since files below it may match them.
+/// </summary>
+/// <param name="relativePath">The directory relative to the source directory</param>
+/// <returns>FALSE if the directory and everything below it should be left out</returns>
+BOOL PathFilter::IncludeDirectory(const std::wstring& relativePath) const
+{
+    return (Match(relativePath, TRUE) & FILTER_MATCH_EXCLUDE) == 0;
+}
+
+/// <summary>
+/// Whether a file should be copied -- it is within the limits, matches no exclude pattern, and
+/// matches an include pattern if there are any.
+/// </summary>
+/// <param name="relativePath">The file relative to the source directory</param>
+/// <param name="size">The size of the file</param>
+/// <param name="lastWriteTime">When the file was last written, in FILETIME units</param>
+/// <returns>TRUE if the file should be copied</returns>
+BOOL PathFilter::IncludeFile(const std::wstring& relativePath, unsigned long long size, unsigned long long lastWriteTime) const
+{
+    if ((limits.minSize > 0 && size < limits.minSize) || (limits.maxSize > 0 && size > limits.maxSize)) {
+        return FALSE;
+    }
+    if ((limits.oldestWriteTime > 0 && lastWriteTime < limits.oldestWriteTime) || (limits.newestWriteTime > 0 && lastWriteTime > limits.newestWriteTime)) {
+        return FALSE;
+    }
+
+    unsigned int matched = Match(relativePath, FALSE);
+    if (matched & FILTER_MATCH_EXCLUDE) {
+        return FALSE;
+    }
+    return !hasIncludes || (matched & FILTER_MATCH_INCLUDE) != 0;
+}
+
+/// <summary>
+/// Run the automata over a path. A directory at the start of the path which matches counts as a match
+/// of the whole path.
+/// </summary>
+/// <param name="relativePath">The path relative to the source directory</param>
+/// <param name="directory">Whether the path is of a directory, which directory-only patterns may match</param>
+/// <returns>The FILTER_MATCH_ flags of the patterns which matched</returns>
+unsigned int PathFilter::Match(const std::wstring& relativePath, BOOL directory) const
+{
+    unsigned int matched = 0;
+    unsigned int nameState = FILTER_START_STATE;
+    unsigned int pathState = FILTER_START_STATE;
+
+    if (patterns.empty()) {
+        return 0;
+    }
+    for (wchar_t character : relativePath) {
+        unsigned int characterClass = ClassOf(character);
+        if (characterClass == FILTER_SEPARATOR_CLASS) {
+            unsigned int flags = nameAutomaton.accepting[nameState] | pathAutomaton.accepting[pathState];
+            matched |= (flags | flags >> 2) & 3;
+            nameState = FILTER_START_STATE;
+        }
+        else {
+            nameState = nameAutomaton.transitions[nameState * classCount + characterClass];
+        }
+        pathState = pathAutomaton.transitions[pathState * classCount + characterClass];
+    }
+    unsigned int flags = nameAutomaton.accepting[nameState] | pathAutomaton.accepting[pathState];
+    matched |= flags & 3;
+    if (directory) {
+        matched |= flags >> 2;
+    }
+    return matched;
+}
+
+/// <summary>
+/// Match a path against the patterns one at a time, as a simple matcher would, giving the same answer
+/// as Match far more slowly. Kept so that the automata can be checked and measured against them.
+/// </summary>
+/// <param name="relativePath">The path relative to the source directory</param>
+/// <param name="directory">Whether the path is of a directory</param>
+/// <returns>The FILTER_MATCH_ flags of the patterns which matched</returns>
+unsigned int PathFilter::MatchEachPattern(const std::wstring& relativePath, BOOL directory) const
+{
+    unsigned int matched = 0;
+    const wchar_t* path = relativePath.c_str();
+
+    for (const t_filterPattern& pattern : patterns) {
+        if ((matched & pattern.match) != 0) {
+            continue;
+        }
+        if (pattern.anyDepth) {
+            for (size_t start = 0, end = 0; end <= relativePath.size(); end++) {
+                if (end < relativePath.size() && !IsSeparator(path[end])) {
+                    continue;
+                }
+                if ((end < relativePath.size() || !pattern.directoryOnly || directory) && GlobMatches(pattern.tokens, 0, path + start, end - start, 0)) {
+                    matched |= pattern.match;
+                    break;
+                }
+                start = end + 1;
+            }
+            continue;
+        }
+        for (size_t end = 0; end < relativePath.size(); end++) {
+            if (IsSeparator(path[end]) && GlobMatches(pattern.tokens, 0, path, end, 0)) {
+                matched |= pattern.match;
+                break;
+            }
+        }
+        if ((!pattern.directoryOnly || directory) && GlobMatches(pattern.tokens, 0, path, relativePath.size(), 0)) {
+            matched |= pattern.match;
+        }
+    }
+    return matched;
+}
+
+/// <summary>
+/// The number of patterns compiled, not counting any which were empty.
+/// </summary>
+size_t PathFilter::PatternCount(void) const
+{
+    return patterns.size();
+}
+
+/// <summary>
+/// The number of states in the compiled automata.
+/// </summary>
+size_t PathFilter::StateCount(void) const
+{
+    return nameAutomaton.accepting.size() + pathAutomaton.accepting.size();
+}
+
+/// <summary>
+/// The class of a character, folding case as the patterns were folded.
+/// </summary>
+unsigned int PathFilter::ClassOf(wchar_t character) const
+{
+    if ((unsigned int)character < 128) {
+        return asciiClasses[character];
+    }
+    std::unordered_map<wchar_t, unsigned short>::const_iterator found = otherClasses.find((wchar_t)towlower(character));
+    return found != otherClasses.end() ? found->second : FILTER_OTHER_CLASS;
+}
+
+/// <summary>
+/// Compile one kind of pattern into a deterministic automaton, by subset construction from the positions
+/// at the start of each of those patterns. Only literals move on one class of character and not the
+/// rest, so the positions reached on any other character are found once for each state, and just the
+/// classes which a literal in the state names need sets of their own.
+/// </summary>
+/// <param name="anyDepth">Compile the patterns which match a name at any depth, or else the others</param>
+/// <param name="automaton">Receives the automaton, which has just the dead and start states if there are no such patterns</param>
+/// <returns>0 on success, or ERROR_NOT_SUPPORTED if it would need more than FILTER_MAX_STATES states</returns>
+DWORD PathFilter::Build(BOOL anyDepth, t_filterAutomaton* automaton) const
+{
+    std::unordered_map<std::vector<unsigned int>, unsigned int, PositionSetHash> states;
+    std::vector<std::vector<unsigned int>> sets(2);
+    std::vector<std::vector<unsigned int>> literalNext(classCount);
+    std::vector<unsigned int> literalClasses;
+    std::vector<unsigned int> otherNext;
+    std::vector<unsigned int> separatorNext;
+    std::vector<unsigned int> next;
+
+    for (unsigned int position = 0; position < positionToken.size(); position++) {
+        if (positionToken[position] == 0 && patterns[positionPattern[position]].anyDepth == anyDepth) {
+            sets[FILTER_START_STATE].push_back(position);
+        }
+    }
+    Close(&sets[FILTER_START_STATE]);
+    states[sets[FILTER_DEAD_STATE]] = FILTER_DEAD_STATE;
+    states[sets[FILTER_START_STATE]] = FILTER_START_STATE;
+    automaton->transitions.assign(2 * (size_t)classCount, FILTER_DEAD_STATE);
+    automaton->accepting.assign(2, 0);
+
+    // the state of a set of positions, added if it is new
+    DWORD error = ERROR_SUCCESS;
+    auto stateOf = [&](std::vector<unsigned int>& positions) -> unsigned int {
+        Close(&positions);
+        std::unordered_map<std::vector<unsigned int>, unsigned int, PositionSetHash>::iterator found = states.find(positions);
+        if (found != states.end()) {
+            return found->second;
+        }
+        if (sets.size() >= FILTER_MAX_STATES) {
+            error = ERROR_NOT_SUPPORTED;
+            return FILTER_DEAD_STATE;
+        }
+        unsigned int state = (unsigned int)sets.size();
+        states[positions] = state;
+        sets.push_back(positions);
+        automaton->transitions.resize(sets.size() * classCount, FILTER_DEAD_STATE);
+        automaton->accepting.push_back(0);
+        return state;
+    };
+
+    for (size_t state = FILTER_START_STATE; state < sets.size() && !error; state++) {
+        otherNext.clear();
+        separatorNext.clear();
+        for (unsigned int position : sets[state]) {
+            // part way through a directory name under **\ -- carry on to the separator, then back to the **\ itself
+            if (position & FILTER_INSIDE_NAME) {
+                otherNext.push_back(position);
+                separatorNext.push_back(position & ~FILTER_INSIDE_NAME);
+                continue;
+            }
+
+            const t_filterPattern& owner = patterns[positionPattern[position]];
+            unsigned int token = positionToken[position];
+            if (token == owner.tokens.size()) {
+                automaton->accepting[state] |= owner.directoryOnly ? owner.match << 2 : owner.match;
+                continue;
+            }
+            switch (owner.tokens[token].type) {
+            case FILTER_LITERAL: {
+                unsigned int characterClass = ClassOf(owner.tokens[token].character);
+                if (literalNext[characterClass].empty()) {
+                    literalClasses.push_back(characterClass);
+                }
+                literalNext[characterClass].push_back(position + 1);
+                break;
+            }
+            case FILTER_ANY:
+                otherNext.push_back(position + 1);
+                break;
+            case FILTER_STAR:
+                otherNext.push_back(position);
+                break;
+            case FILTER_DIRECTORIES:
+                otherNext.push_back(position | FILTER_INSIDE_NAME);
+                separatorNext.push_back(position);
+                break;
+            case FILTER_REST:
+                otherNext.push_back(position);
+                separatorNext.push_back(position);
+                break;
+            }
+        }
+
+        // every class goes where a character no literal names goes, then the separator and the literals' classes are put right
+        unsigned int otherState = stateOf(otherNext);
+        for (unsigned int characterClass = 0; characterClass < classCount; characterClass++) {
+            automaton->transitions[state * classCount + characterClass] = otherState;
+        }
+        // stateOf grows the table, so each target state is found before the entry which takes it is looked up
+        if (literalNext[FILTER_SEPARATOR_CLASS].empty()) {
+            unsigned int separatorState = stateOf(separatorNext);
+            automaton->transitions[state * classCount + FILTER_SEPARATOR_CLASS] = separatorState;
+        }
+        for (unsigned int characterClass : literalClasses) {
+            next = characterClass == FILTER_SEPARATOR_CLASS ? separatorNext : otherNext;
+            next.insert(next.end(), literalNext[characterClass].begin(), literalNext[characterClass].end());
+            unsigned int literalState = stateOf(next);
+            automaton->transitions[state * classCount + characterClass] = literalState;
+            literalNext[characterClass].clear();
+        }
+        literalClasses.clear();
+    }
+    return error;
+}
+
+/// <summary>
+/// Add every position which can be reached from the given ones without a character -- past a *, a
+/// **\ or a trailing ** matching nothing -- then sort them, so that equal sets compare equal.
+/// </summary>
+/// <param name="positions">The positions, which are closed in place</param>
+void PathFilter::Close(std::vector<unsigned int>* positions) const
+{
+    for (size_t index = 0; index < positions->size(); index++) {
+        unsigned int position = (*positions)[index];
+        if (position & FILTER_INSIDE_NAME) {
+            continue;
+        }
+        const t_filterPattern& pattern = patterns[positionPattern[position]];
+        unsigned int token = positionToken[position];
+        if (token < pattern.tokens.size() && pattern.tokens[token].type != FILTER_LITERAL && pattern.tokens[token].type != FILTER_ANY) {
+            positions->push_back(position + 1);
+        }
+    }
+    std::sort(positions->begin(), positions->end());
+    positions->erase(std::unique(positions->begin(), positions->end()), positions->end());
+}
+
+/// <summary>
+/// Parse a size with an optional K, M, G or T suffix, which are powers of 1024. A trailing B or iB is ignored.
+/// </summary>
+/// <param name="text">The size, such as 4096, 64K or 2GiB</param>
+/// <param name="size">Receives the size in bytes</param>
+/// <returns>FALSE if the text is not a size</returns>
+BOOL FilterParseSize(const std::wstring& text, unsigned long long* size)
+{
+    wchar_t* end = nullptr;
+    unsigned long long number = wcstoull(text.c_str(), &end, 10);
+
+    if (end == text.c_str()) {
+        return FALSE;
+    }
+    std::wstring suffix(end);
+    suffix.erase(std::remove(suffix.begin(), suffix.end(), L' '), suffix.end());
+    std::transform(suffix.begin(), suffix.end(), suffix.begin(), [](wchar_t character) { return (wchar_t)towupper(character); });
+    if (suffix.size() >= 2 && suffix.compare(suffix.size() - 2, 2, L"IB") == 0) {
+        suffix.erase(suffix.size() - 2);
+    }
+    else if (!suffix.empty() && suffix.back() == L'B') {
+        suffix.pop_back();
+    }
+
+    const wchar_t* units = L"KMGT";
+    if (suffix.empty()) {
+        *size = number;
+        return TRUE;
+    }
+    if (suffix.size() != 1 || wcschr(units, suffix[0]) == nullptr) {
+        return FALSE;
+    }
+    for (const wchar_t* unit = units; *unit != suffix[0]; unit++) {
+        number *= 1024;
+    }
+    *size = number * 1024;
+    return TRUE;
+}
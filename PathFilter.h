@@ -0,0 +1,108 @@
+/* ShadowDuplicator -- a simple VC++ Volume Shadow Copy requestor for backing up
+locked files
+
+Copyright (C) 2021-2023 Peter Upfold.
+
+Licensed under the Apache 2.0 Licence. See the LICENSE file in the project root for details.
+
+This code is **not** production quality. There is certainly plenty of potential for improvement of this code,
+but beyond that, it may even be insecure, destructive or cause you other serious problems. There
+is no warranty.
+*/
+#pragma once
+#include "Platform.h"
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// the compiled automaton may have at most this many states. Ordinary patterns need a few per pattern.
+#define FILTER_MAX_STATES 65536
+
+// how a path matched the patterns
+#define FILTER_MATCH_INCLUDE 1
+#define FILTER_MATCH_EXCLUDE 2
+
+// File size and age limits which apply alongside the patterns. 0 leaves a limit off.
+typedef struct filterLimits {
+    unsigned long long minSize;
+    unsigned long long maxSize;
+    unsigned long long oldestWriteTime; // files last written before this are left out, in FILETIME units
+    unsigned long long newestWriteTime; // files last written after this are left out, in FILETIME units
+} t_filterLimits;
+
+// One element of a compiled glob
+typedef enum filterTokenType {
+    FILTER_LITERAL,     // one character, compared without regard to case
+    FILTER_ANY,         // ? -- any one character other than a separator
+    FILTER_STAR,        // * -- any run of characters within one name
+    FILTER_DIRECTORIES, // **\ -- any number of whole directories, including none
+    FILTER_REST         // ** at the end -- anything at all
+} t_filterTokenType;
+
+typedef struct filterToken {
+    t_filterTokenType type;
+    wchar_t character;
+} t_filterToken;
+
+// One Include or Exclude pattern, parsed
+typedef struct filterPattern {
+    std::vector<t_filterToken> tokens;
+    unsigned int match; // FILTER_MATCH_INCLUDE or FILTER_MATCH_EXCLUDE
+    BOOL directoryOnly; // the pattern ended with a separator, so matches only directories
+    BOOL anyDepth; // the pattern has no separator, so is matched against each name in the path
+} t_filterPattern;
+
+// A deterministic automaton compiled from some of the patterns. State 0 matches nothing more and state 1
+// is the start. Accepting holds the FILTER_MATCH_ flags of the patterns which end in each state, with
+// those of directory-only patterns shifted up by two bits.
+typedef struct filterAutomaton {
+    std::vector<unsigned int> transitions;
+    std::vector<unsigned char> accepting;
+} t_filterAutomaton;
+
+/// <summary>
+/// Include and Exclude glob patterns, compiled together into deterministic automata so that a path is
+/// checked against every pattern in a single pass over its characters, however many patterns there
+/// are. Once compiled, a filter is only read, so any number of threads may use it at once.
+/// </summary>
+class PathFilter {
+public:
+    PathFilter();
+
+    DWORD Compile(const std::vector<std::wstring>& includes, const std::vector<std::wstring>& excludes);
+    void SetLimits(const t_filterLimits& limits);
+    const t_filterLimits& Limits(void) const;
+
+    BOOL IncludeDirectory(const std::wstring& relativePath) const;
+    BOOL IncludeFile(const std::wstring& relativePath, unsigned long long size, unsigned long long lastWriteTime) const;
+
+    unsigned int Match(const std::wstring& relativePath, BOOL directory) const;
+    unsigned int MatchEachPattern(const std::wstring& relativePath, BOOL directory) const;
+
+    size_t PatternCount(void) const;
+    size_t StateCount(void) const;
+
+private:
+    unsigned int ClassOf(wchar_t character) const;
+    DWORD Build(BOOL anyDepth, t_filterAutomaton* automaton) const;
+    void Close(std::vector<unsigned int>* positions) const;
+
+    std::vector<t_filterPattern> patterns;
+    BOOL hasIncludes;
+    t_filterLimits limits;
+
+    // every position in every pattern, numbered in order, with the pattern each belongs to
+    std::vector<unsigned int> positionPattern;
+    std::vector<unsigned int> positionToken;
+
+    // characters are grouped into classes which no pattern tells apart: anything else, the separator, and each literal
+    unsigned int classCount;
+    unsigned short asciiClasses[128];
+    std::unordered_map<wchar_t, unsigned short> otherClasses;
+
+    // the patterns with no separator run on each name from its start, and the rest on the whole path, side by side
+    t_filterAutomaton nameAutomaton;
+    t_filterAutomaton pathAutomaton;
+};
+
+BOOL FilterParseSize(const std::wstring& text, unsigned long long* size);
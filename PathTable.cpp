@@ -0,0 +1,256 @@
+/* ShadowDuplicator -- a simple VC++ Volume Shadow Copy requestor for backing up
+locked files
+
+Copyright (C) 2021-2023 Peter Upfold.
+
+Licensed under the Apache 2.0 Licence. See the LICENSE file in the project root for details.
+
+This code is **not** production quality. There is certainly plenty of potential for improvement of this code,
+but beyond that, it may even be insecure, destructive or cause you other serious problems. There
+is no warranty.
+*/
+
+#include "PathTable.h"
+#include <cstring>
+
+/// <summary>
+/// An empty table. No memory is allocated until the first path is added.
+/// </summary>
+PathTable::PathTable()
+    : blockSize(0), blockUsed(0), arenaChars(0), lastVolume(0)
+{
+}
+
+/// <summary>
+/// Add a path to the end of the table.
+/// </summary>
+/// <param name="volume">The volume holding the path, as from GetVolumePathNameW</param>
+/// <param name="path">The full path, which begins with the volume</param>
+/// <returns>The index of the path in the table</returns>
+size_t PathTable::Add(const std::wstring& volume, const std::wstring& path)
+{
+    size_t prefix = volume.size() <= path.size() ? volume.size() : path.size();
+    t_pathEntry entry{};
+
+    entry.volume = FindVolume(volume);
+    entry.tail = Store(path.c_str() + prefix, path.size() - prefix);
+    entries.push_back(entry);
+    return entries.size() - 1;
+}
+
+/// <summary>
+/// Remove every path and volume and free the arena.
+/// </summary>
+/// <param name=""></param>
+void PathTable::Clear(void)
+{
+    // swapped with empty vectors, so that their capacity is freed too
+    std::vector<std::wstring>().swap(volumes);
+    std::vector<t_pathEntry>().swap(entries);
+    std::vector<std::unique_ptr<WCHAR[]>>().swap(blocks);
+    blockSize = 0;
+    blockUsed = 0;
+    arenaChars = 0;
+    lastVolume = 0;
+}
+
+/// <summary>
+/// Number of paths in the table.
+/// </summary>
+size_t PathTable::Count(void) const
+{
+    return entries.size();
+}
+
+/// <summary>
+/// Number of distinct volumes holding the paths.
+/// </summary>
+unsigned int PathTable::VolumeCount(void) const
+{
+    return (unsigned int)volumes.size();
+}
+
+/// <summary>
+/// A volume, by its index. Volumes are numbered in the order they were first seen.
+/// </summary>
+/// <param name="volume">The volume's index</param>
+/// <returns>The volume path, as it was given to Add</returns>
+const std::wstring& PathTable::Volume(unsigned int volume) const
+{
+    return volumes[volume];
+}
+
+/// <summary>
+/// The index of the volume holding a path.
+/// </summary>
+/// <param name="index">The index of the path</param>
+/// <returns>The volume's index</returns>
+unsigned int PathTable::VolumeOf(size_t index) const
+{
+    return entries[index].volume;
+}
+
+/// <summary>
+/// A path with its volume sliced off, so that it can be joined to the snapshot device object of the volume.
+/// Valid until the table is cleared.
+/// </summary>
+/// <param name="index">The index of the path</param>
+/// <returns>The rest of the path after the volume</returns>
+LPCWSTR PathTable::Tail(size_t index) const
+{
+    return entries[index].tail;
+}
+
+/// <summary>
+/// A path as it was given to Add.
+/// </summary>
+/// <param name="index">The index of the path</param>
+/// <returns>The volume and the tail together</returns>
+std::wstring PathTable::FullPath(size_t index) const
+{
+    return volumes[entries[index].volume] + entries[index].tail;
+}
+
+/// <summary>
+/// Bytes held by the table -- the arena blocks, the entries and the volumes.
+/// </summary>
+size_t PathTable::MemoryUsed(void) const
+{
+    size_t bytes = arenaChars * sizeof(WCHAR) + entries.capacity() * sizeof(t_pathEntry) + blocks.capacity() * sizeof(blocks[0]);
+    for (const std::wstring& volume : volumes) {
+        bytes += (volume.capacity() + 1) * sizeof(WCHAR);
+    }
+    return bytes;
+}
+
+/// <summary>
+/// Find a volume's index, adding it if it is new. Consecutive paths are almost always on the same
+/// volume, so the last one found is tried first.
+/// </summary>
+/// <param name="volume">The volume path</param>
+/// <returns>The volume's index</returns>
+unsigned int PathTable::FindVolume(const std::wstring& volume)
+{
+    if (lastVolume < volumes.size() && volumes[lastVolume] == volume) {
+        return lastVolume;
+    }
+    for (unsigned int i = 0; i < volumes.size(); i++) {
+#ifdef _WIN32
+        if (_wcsicmp(volumes[i].c_str(), volume.c_str()) == 0) {
+#else
+        if (volumes[i] == volume) {
+#endif
+            lastVolume = i;
+            return i;
+        }
+    }
+    volumes.push_back(volume);
+    lastVolume = (unsigned int)volumes.size() - 1;
+    return lastVolume;
+}
+
+/// <summary>
+/// Copy some text into the arena, with a null terminator.
+/// </summary>
+/// <param name="text">The text</param>
+/// <param name="length">The number of characters, not counting any terminator</param>
+/// <returns>The copy, which stays where it is until the table is cleared</returns>
+LPCWSTR PathTable::Store(const WCHAR* text, size_t length)
+{
+    if (blocks.empty() || blockSize - blockUsed < length + 1) {
+        blockSize = length + 1 > PATH_TABLE_BLOCK_CHARS ? length + 1 : PATH_TABLE_BLOCK_CHARS;
+        blocks.emplace_back(new WCHAR[blockSize]);
+        blockUsed = 0;
+        arenaChars += blockSize;
+    }
+
+    WCHAR* stored = blocks.back().get() + blockUsed;
+    memcpy(stored, text, length * sizeof(WCHAR));
+    stored[length] = L'\0';
+    blockUsed += length + 1;
+    return stored;
+}
+
+/// <summary>
+/// Pass one line of a path list to the path routine, without its line ending. Blank lines are skipped.
+/// </summary>
+/// <param name="line">The line as read, in UTF-8</param>
+/// <param name="pathRoutine">Receives the path</param>
+/// <param name="context">Passed through to pathRoutine</param>
+/// <returns>FALSE if the path routine asked to stop</returns>
+static BOOL EmitPathListLine(std::string& line, t_pathListRoutine pathRoutine, void* context)
+{
+    while (!line.empty() && (line.back() == '\r' || line.back() == ' ' || line.back() == '\t')) {
+        line.pop_back();
+    }
+    if (line.empty()) {
+        return TRUE;
+    }
+    return pathRoutine(PlatformFromUtf8(line), context);
+}
+
+/// <summary>
+/// Stream the paths in a list to a routine as they are read, so that the whole list is never held in
+/// memory. Paths are UTF-8, one to a line, or separated by null characters as from find -print0. A
+/// UTF-8 byte order mark at the start is skipped.
+/// </summary>
+/// <param name="listPath">The list file, or "-" for standard input</param>
+/// <param name="pathRoutine">Receives each path</param>
+/// <param name="context">Passed through to pathRoutine</param>
+/// <returns>0 on success, or the platform error code upon failure</returns>
+DWORD ReadPathList(const std::wstring& listPath, t_pathListRoutine pathRoutine, void* context)
+{
+    BOOL standardInput = listPath == L"-";
+    t_fileHandle handle = INVALID_FILE_HANDLE;
+    std::vector<char> buffer(PATH_LIST_READ_SIZE);
+    std::string line;
+    unsigned long long offset = 0;
+    DWORD bytesRead = 0;
+    DWORD error = ERROR_SUCCESS;
+    BOOL stopped = FALSE;
+
+    if (!standardInput) {
+        error = PlatformOpenForRead(listPath, FALSE, &handle);
+        if (error) {
+            return error;
+        }
+    }
+
+    while (!stopped) {
+        error = standardInput ? PlatformReadStandardInput(buffer.data(), (DWORD)buffer.size(), &bytesRead)
+            : PlatformReadAt(handle, offset, buffer.data(), (DWORD)buffer.size(), &bytesRead);
+        if (error || bytesRead == 0) {
+            break;
+        }
+
+        size_t start = 0;
+        if (offset == 0 && bytesRead >= 3 && memcmp(buffer.data(), "\xEF\xBB\xBF", 3) == 0) {
+            start = 3;
+        }
+        offset += bytesRead;
+
+        for (size_t i = start; i < bytesRead; i++) {
+            if (buffer[i] != '\n' && buffer[i] != '\0') {
+                continue;
+            }
+            line.append(buffer.data() + start, i - start);
+            start = i + 1;
+            stopped = !EmitPathListLine(line, pathRoutine, context);
+            line.clear();
+            if (stopped) {
+                break;
+            }
+        }
+        if (!stopped) {
+            line.append(buffer.data() + start, bytesRead - start);
+        }
+    }
+
+    if (!error && !stopped && !line.empty()) {
+        EmitPathListLine(line, pathRoutine, context); // the last line need not end with a line break
+    }
+    if (!standardInput) {
+        PlatformCloseFile(handle);
+    }
+    return error;
+}
@@ -0,0 +1,67 @@
+/* ShadowDuplicator -- a simple VC++ Volume Shadow Copy requestor for backing up
+locked files
+
+Copyright (C) 2021-2023 Peter Upfold.
+
+Licensed under the Apache 2.0 Licence. See the LICENSE file in the project root for details.
+
+This code is **not** production quality. There is certainly plenty of potential for improvement of this code,
+but beyond that, it may even be insecure, destructive or cause you other serious problems. There
+is no warranty.
+*/
+#pragma once
+#include "Platform.h"
+#include <memory>
+#include <string>
+#include <vector>
+
+// Path tails are packed into arena blocks of this many characters. A longer tail gets a block of its own.
+#define PATH_TABLE_BLOCK_CHARS (64 * 1024)
+
+// How much of a path list is read at a time
+#define PATH_LIST_READ_SIZE (64 * 1024)
+
+// Receives each path read from a path list, in the order listed. Return FALSE to stop reading.
+typedef BOOL (*t_pathListRoutine)(const std::wstring& path, void* context);
+
+/// <summary>
+/// The source paths of a run, held as compactly as possible so that a list of millions of files costs
+/// little more than the text of the paths. Each distinct volume is stored once. The rest of each path
+/// is packed into large arena blocks which never move, so a tail can be handed out as a plain pointer,
+/// and each path costs one small fixed-size entry besides its text.
+/// </summary>
+class PathTable {
+public:
+    PathTable();
+
+    size_t Add(const std::wstring& volume, const std::wstring& path);
+    void Clear(void);
+
+    size_t Count(void) const;
+    unsigned int VolumeCount(void) const;
+    const std::wstring& Volume(unsigned int volume) const;
+    unsigned int VolumeOf(size_t index) const;
+    LPCWSTR Tail(size_t index) const;
+    std::wstring FullPath(size_t index) const;
+    size_t MemoryUsed(void) const;
+
+private:
+    // One path -- its volume and the rest of the path in the arena, null terminated
+    typedef struct pathEntry {
+        LPCWSTR tail;
+        unsigned int volume;
+    } t_pathEntry;
+
+    unsigned int FindVolume(const std::wstring& volume);
+    LPCWSTR Store(const WCHAR* text, size_t length);
+
+    std::vector<std::wstring> volumes;
+    std::vector<t_pathEntry> entries;
+    std::vector<std::unique_ptr<WCHAR[]>> blocks;
+    size_t blockSize;
+    size_t blockUsed;
+    size_t arenaChars;
+    unsigned int lastVolume;
+};
+
+DWORD ReadPathList(const std::wstring& listPath, t_pathListRoutine pathRoutine, void* context);
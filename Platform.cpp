@@ -0,0 +1,1874 @@
+/* ShadowDuplicator -- a simple VC++ Volume Shadow Copy requestor for backing up
+locked files
+
+Copyright (C) 2021-2023 Peter Upfold.
+
+Licensed under the Apache 2.0 Licence. See the LICENSE file in the project root for details.
+
+This code is **not** production quality. There is certainly plenty of potential for improvement of this code,
+but beyond that, it may even be insecure, destructive or cause you other serious problems. There
+is no warranty.
+*/
+
+#include "Platform.h"
+#include <chrono>
+#include <thread>
+
+#ifdef _WIN32
+#include <winioctl.h>
+#endif
+
+#ifndef _WIN32
+#include <cstdlib>
+#include <cstring>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <vector>
+#endif
+
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
+
+#ifndef _WIN32
+/// <summary>
+/// Convert a POSIX timespec into FILETIME units, so that times compare the same way on every platform.
+/// </summary>
+/// <param name="time">The POSIX time</param>
+/// <returns>100ns intervals since 1 January 1601</returns>
+static unsigned long long FileTimeFromTimespec(const struct timespec& time)
+{
+    return ((unsigned long long)time.tv_sec + 11644473600ULL) * 10000000ULL + (unsigned long long)time.tv_nsec / 100;
+}
+#endif
+
+#ifdef _WIN32
+/// <summary>
+/// Enumerate a directory with FindFirstFileEx, for the few file systems which cannot answer
+/// GetFileInformationByHandleEx directory queries. The basic information level leaves out the short
+/// name, and a large fetch asks the file system for many entries at a time.
+/// </summary>
+/// <param name="directory">The directory to list, without a trailing separator</param>
+/// <param name="entryRoutine">Receives each entry</param>
+/// <param name="context">Passed through to entryRoutine</param>
+/// <returns>0 on success, or the platform error code if the directory could not be listed</returns>
+static DWORD EnumerateWithFind(const std::wstring& directory, t_directoryEntryRoutine entryRoutine, void* context)
+{
+    WIN32_FIND_DATAW findData{};
+    t_directoryEntry entry{};
+    DWORD error = ERROR_SUCCESS;
+    BOOL stopped = FALSE;
+
+    HANDLE findHandle = FindFirstFileExW(PlatformJoinPath(directory, L"*").c_str(), FindExInfoBasic, &findData, FindExSearchNameMatch, NULL, FIND_FIRST_EX_LARGE_FETCH);
+    if (findHandle == INVALID_HANDLE_VALUE) {
+        return GetLastError();
+    }
+
+    do {
+        if (wcscmp(findData.cFileName, L".") == 0 || wcscmp(findData.cFileName, L"..") == 0) {
+            continue;
+        }
+        if ((findData.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) && (findData.dwFileAttributes & FILE_ATTRIBUTE_REPARSE_POINT)) {
+            continue;
+        }
+
+        entry.name = findData.cFileName;
+        entry.isDirectory = (findData.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) ? TRUE : FALSE;
+        entry.size = ((unsigned long long)findData.nFileSizeHigh << 32) | findData.nFileSizeLow;
+        entry.lastWriteTime = ((unsigned long long)findData.ftLastWriteTime.dwHighDateTime << 32) | findData.ftLastWriteTime.dwLowDateTime;
+        entry.attributes = findData.dwFileAttributes;
+
+        if (!entryRoutine(entry, context)) {
+            stopped = TRUE;
+            break;
+        }
+    } while (FindNextFileW(findHandle, &findData) != 0);
+
+    if (!stopped) {
+        error = GetLastError();
+        if (error == ERROR_NO_MORE_FILES) {
+            error = ERROR_SUCCESS;
+        }
+    }
+    FindClose(findHandle);
+    return error;
+}
+#elif defined(__linux__)
+// One record returned by getdents64, which glibc does not declare before 2.30
+typedef struct linuxDirectoryRecord {
+    uint64_t inode;
+    int64_t offset;
+    unsigned short length;
+    unsigned char type;
+    char name[1];
+} t_linuxDirectoryRecord;
+#endif
+
+/// <summary>
+/// Enumerate the entries of a single directory, not descending into subdirectories. Directories
+/// which are reparse points (junctions, symbolic links) are not reported, so that a walk of the
+/// tree cannot loop.
+///
+/// Entries are read in batches of PLATFORM_ENUMERATION_BUFFER bytes rather than one call per entry.
+/// On Windows each batch carries the size, times and attributes of every entry, so nothing more is
+/// asked of the file system. On Linux getdents64 gives the type of each entry, so only regular files
+/// need a stat for their size and time.
+/// </summary>
+/// <param name="directory">The directory to list, without a trailing separator</param>
+/// <param name="entryRoutine">Receives each entry</param>
+/// <param name="context">Passed through to entryRoutine</param>
+/// <returns>0 on success, or the platform error code if the directory could not be listed</returns>
+DWORD PlatformEnumerateDirectory(const std::wstring& directory, t_directoryEntryRoutine entryRoutine, void* context)
+{
+#ifdef _WIN32
+    t_directoryEntry entry{};
+    std::wstring name;
+    DWORD error = ERROR_SUCCESS;
+
+    HANDLE directoryHandle = CreateFileW(directory.c_str(), FILE_LIST_DIRECTORY, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL, OPEN_EXISTING, FILE_FLAG_BACKUP_SEMANTICS, NULL);
+    if (directoryHandle == INVALID_HANDLE_VALUE) {
+        return GetLastError();
+    }
+
+    // the records hold 64 bit fields, so the buffer is kept 8 byte aligned
+    std::vector<unsigned long long> buffer(PLATFORM_ENUMERATION_BUFFER / sizeof(unsigned long long));
+    FILE_INFO_BY_HANDLE_CLASS informationClass = FileFullDirectoryRestartInfo;
+    for (;;) {
+        if (!GetFileInformationByHandleEx(directoryHandle, informationClass, buffer.data(), PLATFORM_ENUMERATION_BUFFER)) {
+            error = GetLastError();
+            if (error == ERROR_NO_MORE_FILES || (error == ERROR_FILE_NOT_FOUND && informationClass == FileFullDirectoryRestartInfo)) {
+                error = ERROR_SUCCESS;
+            }
+            else if (informationClass == FileFullDirectoryRestartInfo && (error == ERROR_INVALID_PARAMETER || error == ERROR_INVALID_FUNCTION || error == ERROR_NOT_SUPPORTED)) {
+                CloseHandle(directoryHandle);
+                return EnumerateWithFind(directory, entryRoutine, context);
+            }
+            break;
+        }
+        informationClass = FileFullDirectoryInfo;
+
+        const unsigned char* record = (const unsigned char*)buffer.data();
+        for (;;) {
+            const FILE_FULL_DIR_INFO* information = (const FILE_FULL_DIR_INFO*)record;
+            name.assign(information->FileName, information->FileNameLength / sizeof(WCHAR));
+
+            if (name != L"." && name != L".." && !((information->FileAttributes & FILE_ATTRIBUTE_DIRECTORY) && (information->FileAttributes & FILE_ATTRIBUTE_REPARSE_POINT))) {
+                entry.name = name.c_str();
+                entry.isDirectory = (information->FileAttributes & FILE_ATTRIBUTE_DIRECTORY) ? TRUE : FALSE;
+                entry.size = (unsigned long long)information->EndOfFile.QuadPart;
+                entry.lastWriteTime = (unsigned long long)information->LastWriteTime.QuadPart;
+                entry.attributes = information->FileAttributes;
+
+                if (!entryRoutine(entry, context)) {
+                    CloseHandle(directoryHandle);
+                    return ERROR_SUCCESS;
+                }
+            }
+
+            if (information->NextEntryOffset == 0) {
+                break;
+            }
+            record += information->NextEntryOffset;
+        }
+    }
+
+    CloseHandle(directoryHandle);
+    return error;
+#elif defined(__linux__)
+    t_directoryEntry entry{};
+    struct stat entryStat {};
+    DWORD error = ERROR_SUCCESS;
+
+    int directoryHandle = open(PlatformToUtf8(directory).c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (directoryHandle < 0) {
+        return errno;
+    }
+
+    std::vector<unsigned long long> buffer(PLATFORM_ENUMERATION_BUFFER / sizeof(unsigned long long));
+    for (;;) {
+        long length = syscall(SYS_getdents64, directoryHandle, buffer.data(), PLATFORM_ENUMERATION_BUFFER);
+        if (length <= 0) {
+            error = length < 0 ? (DWORD)errno : ERROR_SUCCESS;
+            break;
+        }
+
+        for (long offset = 0; offset < length;) {
+            const t_linuxDirectoryRecord* record = (const t_linuxDirectoryRecord*)((const char*)buffer.data() + offset);
+            offset += record->length;
+            if (strcmp(record->name, ".") == 0 || strcmp(record->name, "..") == 0) {
+                continue;
+            }
+
+            unsigned char type = record->type;
+            if (type == DT_REG || type == DT_UNKNOWN) {
+                if (fstatat(directoryHandle, record->name, &entryStat, AT_SYMLINK_NOFOLLOW) != 0) {
+                    continue; // removed since it was listed
+                }
+                type = S_ISDIR(entryStat.st_mode) ? DT_DIR : S_ISREG(entryStat.st_mode) ? DT_REG : DT_UNKNOWN;
+            }
+            if (type != DT_DIR && type != DT_REG) {
+                continue; // symbolic links, devices and sockets are not backed up
+            }
+
+            // a directory needs no stat, as the walk only descends into it
+            std::wstring name = PlatformFromUtf8(record->name);
+            entry.name = name.c_str();
+            entry.isDirectory = type == DT_DIR ? TRUE : FALSE;
+            entry.size = entry.isDirectory ? 0 : (unsigned long long)entryStat.st_size;
+            entry.lastWriteTime = entry.isDirectory ? 0 : FileTimeFromTimespec(entryStat.st_mtim);
+            entry.attributes = entry.isDirectory ? (DWORD)S_IFDIR : (DWORD)entryStat.st_mode;
+
+            if (!entryRoutine(entry, context)) {
+                close(directoryHandle);
+                return ERROR_SUCCESS;
+            }
+        }
+    }
+
+    close(directoryHandle);
+    return error;
+#else
+    t_directoryEntry entry{};
+    struct stat entryStat {};
+    DWORD error = ERROR_SUCCESS;
+
+    DIR* directoryStream = opendir(PlatformToUtf8(directory).c_str());
+    if (directoryStream == nullptr) {
+        return errno;
+    }
+
+    for (;;) {
+        errno = 0;
+        struct dirent* directoryEntry = readdir(directoryStream);
+        if (directoryEntry == nullptr) {
+            error = (DWORD)errno;
+            break;
+        }
+        if (strcmp(directoryEntry->d_name, ".") == 0 || strcmp(directoryEntry->d_name, "..") == 0) {
+            continue;
+        }
+        if (fstatat(dirfd(directoryStream), directoryEntry->d_name, &entryStat, AT_SYMLINK_NOFOLLOW) != 0) {
+            continue; // removed since it was listed
+        }
+        if (!S_ISDIR(entryStat.st_mode) && !S_ISREG(entryStat.st_mode)) {
+            continue; // symbolic links, devices and sockets are not backed up
+        }
+
+        std::wstring name = PlatformFromUtf8(directoryEntry->d_name);
+        entry.name = name.c_str();
+        entry.isDirectory = S_ISDIR(entryStat.st_mode) ? TRUE : FALSE;
+        entry.size = entry.isDirectory ? 0 : (unsigned long long)entryStat.st_size;
+        entry.lastWriteTime = FileTimeFromTimespec(entryStat.st_mtim);
+        entry.attributes = (DWORD)entryStat.st_mode;
+
+        if (!entryRoutine(entry, context)) {
+            break;
+        }
+    }
+
+    closedir(directoryStream);
+    return error;
+#endif
+}
+
+/// <summary>
+/// Create a directory. It is not an error for the directory to exist already.
+/// </summary>
+/// <param name="directory">The directory to create. Its parent must exist.</param>
+/// <returns>0 on success, or the platform error code upon failure</returns>
+DWORD PlatformCreateDirectory(const std::wstring& directory)
+{
+#ifdef _WIN32
+    if (!CreateDirectoryW(directory.c_str(), NULL)) {
+        DWORD error = GetLastError();
+        if (error != ERROR_ALREADY_EXISTS) {
+            return error;
+        }
+    }
+    return ERROR_SUCCESS;
+#else
+    if (mkdir(PlatformToUtf8(directory).c_str(), 0777) != 0 && errno != EEXIST) {
+        return errno;
+    }
+    return ERROR_SUCCESS;
+#endif
+}
+
+#ifdef _WIN32
+/// <summary>
+/// Combine the two halves of a FILETIME into a single count of 100ns intervals.
+/// </summary>
+static unsigned long long FileTimeToULL(const FILETIME& time)
+{
+    return ((unsigned long long)time.dwHighDateTime << 32) | time.dwLowDateTime;
+}
+
+/// <summary>
+/// Wait for an overlapped operation, which has been started, on a handle opened with FILE_FLAG_OVERLAPPED.
+/// </summary>
+/// <param name="handle">The file handle</param>
+/// <param name="overlapped">The OVERLAPPED passed to ReadFile or WriteFile</param>
+/// <param name="bytesTransferred">Receives the byte count</param>
+/// <returns>0 on success, ERROR_HANDLE_EOF included, otherwise the Win32 error</returns>
+static DWORD AwaitOverlapped(HANDLE handle, OVERLAPPED* overlapped, DWORD* bytesTransferred)
+{
+    *bytesTransferred = 0;
+    if (!GetOverlappedResult(handle, overlapped, bytesTransferred, TRUE)) {
+        DWORD error = GetLastError();
+        return error == ERROR_HANDLE_EOF ? ERROR_SUCCESS : error;
+    }
+    return ERROR_SUCCESS;
+}
+
+/// <summary>
+/// Check whether ReadFile or WriteFile on an overlapped handle has left an operation to wait for.
+/// </summary>
+/// <param name="started">The return value of ReadFile or WriteFile</param>
+/// <param name="error">Receives the error if the operation failed without being queued. The end of the file is not an error.</param>
+/// <returns>TRUE if AwaitOverlapped must be called</returns>
+static BOOL OverlappedStarted(BOOL started, DWORD* error)
+{
+    *error = ERROR_SUCCESS;
+    if (started) {
+        return TRUE;
+    }
+    *error = GetLastError();
+    if (*error == ERROR_IO_PENDING) {
+        *error = ERROR_SUCCESS;
+        return TRUE;
+    }
+    if (*error == ERROR_HANDLE_EOF) {
+        *error = ERROR_SUCCESS;
+    }
+    return FALSE;
+}
+
+/// <summary>
+/// Send a file system control code to a handle opened with FILE_FLAG_OVERLAPPED, waiting for it to complete.
+/// </summary>
+/// <param name="handle">The file handle</param>
+/// <param name="controlCode">The FSCTL_ code</param>
+/// <param name="input">The input buffer, or NULL</param>
+/// <param name="inputLength">The length of the input buffer</param>
+/// <param name="output">The output buffer, or NULL</param>
+/// <param name="outputLength">The length of the output buffer</param>
+/// <param name="bytesReturned">Receives the number of bytes placed in the output buffer</param>
+/// <returns>0 on success, ERROR_MORE_DATA if the output buffer was filled, otherwise the Win32 error</returns>
+static DWORD DeviceControl(HANDLE handle, DWORD controlCode, void* input, DWORD inputLength, void* output, DWORD outputLength, DWORD* bytesReturned)
+{
+    OVERLAPPED overlapped{};
+    DWORD error = ERROR_SUCCESS;
+
+    *bytesReturned = 0;
+    overlapped.hEvent = CreateEventW(NULL, TRUE, FALSE, NULL);
+    if (overlapped.hEvent == NULL) {
+        return GetLastError();
+    }
+
+    if (!DeviceIoControl(handle, controlCode, input, inputLength, output, outputLength, NULL, &overlapped)) {
+        error = GetLastError();
+    }
+    // a full output buffer still completes the operation, so its byte count must be collected as well
+    if (error == ERROR_SUCCESS || error == ERROR_IO_PENDING || error == ERROR_MORE_DATA) {
+        error = GetOverlappedResult(handle, &overlapped, bytesReturned, TRUE) ? ERROR_SUCCESS : GetLastError();
+    }
+    CloseHandle(overlapped.hEvent);
+    return error;
+}
+#endif
+
+/// <summary>
+/// Open an existing file for reading. On Windows the handle is always opened for overlapped I/O.
+/// </summary>
+/// <param name="path">The file to open</param>
+/// <param name="unbuffered">Bypass the system cache. Offsets, lengths and buffers must then be aligned to PLATFORM_IO_ALIGNMENT.</param>
+/// <param name="handle">Receives the open handle</param>
+/// <returns>0 on success, or the platform error code upon failure</returns>
+DWORD PlatformOpenForRead(const std::wstring& path, BOOL unbuffered, t_fileHandle* handle)
+{
+#ifdef _WIN32
+    DWORD flags = FILE_FLAG_OVERLAPPED | (unbuffered ? FILE_FLAG_NO_BUFFERING : FILE_FLAG_SEQUENTIAL_SCAN);
+
+    *handle = CreateFileW(path.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL, OPEN_EXISTING, flags, NULL);
+    if (*handle == INVALID_HANDLE_VALUE) {
+        return GetLastError();
+    }
+    return ERROR_SUCCESS;
+#else
+    std::string nativePath = PlatformToUtf8(path);
+
+    *handle = open(nativePath.c_str(), O_RDONLY | O_CLOEXEC | (unbuffered ? O_DIRECT : 0));
+    if (*handle < 0 && unbuffered && errno == EINVAL) {
+        // not every file system supports O_DIRECT (tmpfs, for one) -- the aligned I/O still works buffered
+        *handle = open(nativePath.c_str(), O_RDONLY | O_CLOEXEC);
+    }
+    if (*handle < 0) {
+        *handle = INVALID_FILE_HANDLE;
+        return errno;
+    }
+    posix_fadvise(*handle, 0, 0, POSIX_FADV_SEQUENTIAL);
+    return ERROR_SUCCESS;
+#endif
+}
+
+/// <summary>
+/// Open a file for writing, creating it if it does not exist. A read-only destination is made writable
+/// first, as the destination is always overwritten.
+/// </summary>
+/// <param name="path">The file to open</param>
+/// <param name="unbuffered">Bypass the system cache. Offsets, lengths and buffers must then be aligned to PLATFORM_IO_ALIGNMENT.</param>
+/// <param name="truncate">Discard any existing content</param>
+/// <param name="handle">Receives the open handle</param>
+/// <returns>0 on success, or the platform error code upon failure</returns>
+DWORD PlatformOpenForWrite(const std::wstring& path, BOOL unbuffered, BOOL truncate, t_fileHandle* handle)
+{
+#ifdef _WIN32
+    DWORD flags = FILE_FLAG_OVERLAPPED | (unbuffered ? FILE_FLAG_NO_BUFFERING : 0);
+    DWORD disposition = truncate ? CREATE_ALWAYS : OPEN_ALWAYS;
+
+    *handle = CreateFileW(path.c_str(), GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ, NULL, disposition, flags, NULL);
+    if (*handle == INVALID_HANDLE_VALUE && GetLastError() == ERROR_ACCESS_DENIED) {
+        // a previous copy of a read-only or hidden source leaves a destination CreateFile refuses to replace
+        if (SetFileAttributesW(path.c_str(), FILE_ATTRIBUTE_NORMAL)) {
+            *handle = CreateFileW(path.c_str(), GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ, NULL, disposition, flags, NULL);
+        }
+        else {
+            SetLastError(ERROR_ACCESS_DENIED);
+        }
+    }
+    if (*handle == INVALID_HANDLE_VALUE) {
+        return GetLastError();
+    }
+    return ERROR_SUCCESS;
+#else
+    std::string nativePath = PlatformToUtf8(path);
+    int flags = O_RDWR | O_CREAT | O_CLOEXEC | (truncate ? O_TRUNC : 0);
+
+    *handle = open(nativePath.c_str(), flags | (unbuffered ? O_DIRECT : 0), 0666);
+    if (*handle < 0 && errno == EACCES) {
+        chmod(nativePath.c_str(), 0600);
+        *handle = open(nativePath.c_str(), flags | (unbuffered ? O_DIRECT : 0), 0666);
+    }
+    if (*handle < 0 && unbuffered && errno == EINVAL) {
+        *handle = open(nativePath.c_str(), flags, 0666);
+    }
+    if (*handle < 0) {
+        *handle = INVALID_FILE_HANDLE;
+        return errno;
+    }
+    return ERROR_SUCCESS;
+#endif
+}
+
+/// <summary>
+/// Get the size, times and attributes of an open file.
+/// </summary>
+/// <param name="handle">The open file</param>
+/// <param name="information">Receives the information</param>
+/// <returns>0 on success, or the platform error code upon failure</returns>
+DWORD PlatformGetFileInformation(t_fileHandle handle, t_fileInformation* information)
+{
+#ifdef _WIN32
+    BY_HANDLE_FILE_INFORMATION handleInformation{};
+
+    if (!GetFileInformationByHandle(handle, &handleInformation)) {
+        return GetLastError();
+    }
+    information->size = ((unsigned long long)handleInformation.nFileSizeHigh << 32) | handleInformation.nFileSizeLow;
+    information->creationTime = FileTimeToULL(handleInformation.ftCreationTime);
+    information->lastWriteTime = FileTimeToULL(handleInformation.ftLastWriteTime);
+    information->attributes = handleInformation.dwFileAttributes;
+    return ERROR_SUCCESS;
+#else
+    struct stat fileStat {};
+
+    if (fstat(handle, &fileStat) != 0) {
+        return errno;
+    }
+    information->size = (unsigned long long)fileStat.st_size;
+    information->creationTime = 0;
+    information->lastWriteTime = FileTimeFromTimespec(fileStat.st_mtim);
+    information->attributes = (DWORD)fileStat.st_mode;
+    return ERROR_SUCCESS;
+#endif
+}
+
+/// <summary>
+/// Apply the times and attributes of another file to an open file, as CopyFileEx does for its destination.
+/// </summary>
+/// <param name="handle">The open destination file</param>
+/// <param name="information">The information from the source file</param>
+/// <returns>0 on success, or the platform error code upon failure</returns>
+DWORD PlatformSetFileInformation(t_fileHandle handle, const t_fileInformation& information)
+{
+#ifdef _WIN32
+    FILE_BASIC_INFO basicInformation{};
+    const DWORD copiedAttributes = FILE_ATTRIBUTE_READONLY | FILE_ATTRIBUTE_HIDDEN | FILE_ATTRIBUTE_SYSTEM | FILE_ATTRIBUTE_ARCHIVE | FILE_ATTRIBUTE_NOT_CONTENT_INDEXED;
+
+    basicInformation.CreationTime.QuadPart = (LONGLONG)information.creationTime;
+    basicInformation.LastWriteTime.QuadPart = (LONGLONG)information.lastWriteTime;
+    basicInformation.FileAttributes = information.attributes & copiedAttributes;
+    if (basicInformation.FileAttributes == 0) {
+        basicInformation.FileAttributes = FILE_ATTRIBUTE_NORMAL;
+    }
+
+    if (!SetFileInformationByHandle(handle, FileBasicInfo, &basicInformation, sizeof(basicInformation))) {
+        return GetLastError();
+    }
+    return ERROR_SUCCESS;
+#else
+    struct timespec times[2] {};
+    unsigned long long unixTime = information.lastWriteTime - 11644473600ULL * 10000000ULL;
+
+    times[0].tv_nsec = UTIME_OMIT;
+    times[1].tv_sec = (time_t)(unixTime / 10000000ULL);
+    times[1].tv_nsec = (long)((unixTime % 10000000ULL) * 100);
+    if (futimens(handle, times) != 0) {
+        return errno;
+    }
+    if (information.attributes != 0 && fchmod(handle, information.attributes & 0777) != 0) {
+        return errno;
+    }
+    return ERROR_SUCCESS;
+#endif
+}
+
+/// <summary>
+/// Read from an offset in a file, waiting for the read to complete.
+/// </summary>
+/// <param name="handle">The open file</param>
+/// <param name="offset">Where to read from</param>
+/// <param name="buffer">Receives the data</param>
+/// <param name="length">How many bytes to read</param>
+/// <param name="bytesRead">Receives the number of bytes read, which is less than length only at the end of the file</param>
+/// <returns>0 on success, or the platform error code upon failure</returns>
+DWORD PlatformReadAt(t_fileHandle handle, unsigned long long offset, void* buffer, DWORD length, DWORD* bytesRead)
+{
+#ifdef _WIN32
+    OVERLAPPED overlapped{};
+    DWORD error = ERROR_SUCCESS;
+
+    overlapped.Offset = (DWORD)offset;
+    overlapped.OffsetHigh = (DWORD)(offset >> 32);
+    overlapped.hEvent = CreateEventW(NULL, TRUE, FALSE, NULL);
+    if (overlapped.hEvent == NULL) {
+        return GetLastError();
+    }
+
+    *bytesRead = 0;
+    if (OverlappedStarted(ReadFile(handle, buffer, length, NULL, &overlapped), &error)) {
+        error = AwaitOverlapped(handle, &overlapped, bytesRead);
+    }
+    CloseHandle(overlapped.hEvent);
+    return error;
+#else
+    *bytesRead = 0;
+    while (*bytesRead < length) {
+        ssize_t result = pread(handle, (char*)buffer + *bytesRead, length - *bytesRead, (off_t)(offset + *bytesRead));
+        if (result < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return errno;
+        }
+        if (result == 0) {
+            break;
+        }
+        *bytesRead += (DWORD)result;
+    }
+    return ERROR_SUCCESS;
+#endif
+}
+
+/// <summary>
+/// Read the next part of standard input, which may be a pipe, a console or a redirected file.
+/// </summary>
+/// <param name="buffer">Receives the data</param>
+/// <param name="length">The most bytes to read</param>
+/// <param name="bytesRead">Receives the number of bytes read, which is 0 only at the end of the input</param>
+/// <returns>0 on success, or the platform error code upon failure</returns>
+DWORD PlatformReadStandardInput(void* buffer, DWORD length, DWORD* bytesRead)
+{
+#ifdef _WIN32
+    *bytesRead = 0;
+    if (!ReadFile(GetStdHandle(STD_INPUT_HANDLE), buffer, length, bytesRead, NULL)) {
+        DWORD error = GetLastError();
+        return error == ERROR_BROKEN_PIPE ? ERROR_SUCCESS : error; // the writing end of the pipe has closed
+    }
+    return ERROR_SUCCESS;
+#else
+    ssize_t result;
+    *bytesRead = 0;
+    do {
+        result = read(STDIN_FILENO, buffer, length);
+    } while (result < 0 && errno == EINTR);
+    if (result < 0) {
+        return errno;
+    }
+    *bytesRead = (DWORD)result;
+    return ERROR_SUCCESS;
+#endif
+}
+
+/// <summary>
+/// Write to an offset in a file, waiting for the write to complete.
+/// </summary>
+/// <param name="handle">The open file</param>
+/// <param name="offset">Where to write</param>
+/// <param name="buffer">The data</param>
+/// <param name="length">How many bytes to write</param>
+/// <returns>0 on success, or the platform error code upon failure</returns>
+DWORD PlatformWriteAt(t_fileHandle handle, unsigned long long offset, const void* buffer, DWORD length)
+{
+#ifdef _WIN32
+    OVERLAPPED overlapped{};
+    DWORD error = ERROR_SUCCESS;
+    DWORD bytesWritten = 0;
+
+    overlapped.Offset = (DWORD)offset;
+    overlapped.OffsetHigh = (DWORD)(offset >> 32);
+    overlapped.hEvent = CreateEventW(NULL, TRUE, FALSE, NULL);
+    if (overlapped.hEvent == NULL) {
+        return GetLastError();
+    }
+
+    if (OverlappedStarted(WriteFile(handle, buffer, length, NULL, &overlapped), &error)) {
+        error = AwaitOverlapped(handle, &overlapped, &bytesWritten);
+    }
+    CloseHandle(overlapped.hEvent);
+    if (!error && bytesWritten != length) {
+        error = ERROR_WRITE_FAULT;
+    }
+    return error;
+#else
+    DWORD written = 0;
+    while (written < length) {
+        ssize_t result = pwrite(handle, (const char*)buffer + written, length - written, (off_t)(offset + written));
+        if (result < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return errno;
+        }
+        written += (DWORD)result;
+    }
+    return ERROR_SUCCESS;
+#endif
+}
+
+/// <summary>
+/// Set the length of an open file, truncating or extending it.
+/// </summary>
+/// <param name="handle">The open file</param>
+/// <param name="size">The new length in bytes</param>
+/// <returns>0 on success, or the platform error code upon failure</returns>
+DWORD PlatformSetFileSize(t_fileHandle handle, unsigned long long size)
+{
+#ifdef _WIN32
+    FILE_END_OF_FILE_INFO endOfFile{};
+    endOfFile.EndOfFile.QuadPart = (LONGLONG)size;
+    if (!SetFileInformationByHandle(handle, FileEndOfFileInfo, &endOfFile, sizeof(endOfFile))) {
+        return GetLastError();
+    }
+    return ERROR_SUCCESS;
+#else
+    if (ftruncate(handle, (off_t)size) != 0) {
+        return errno;
+    }
+    return ERROR_SUCCESS;
+#endif
+}
+
+/// <summary>
+/// Wait until everything written to an open file so far is on the disk.
+/// </summary>
+/// <param name="handle">The open file</param>
+/// <returns>0 on success, or the platform error code upon failure</returns>
+DWORD PlatformFlushFile(t_fileHandle handle)
+{
+#ifdef _WIN32
+    if (!FlushFileBuffers(handle)) {
+        return GetLastError();
+    }
+    return ERROR_SUCCESS;
+#else
+    if (fsync(handle) != 0) {
+        return errno;
+    }
+    return ERROR_SUCCESS;
+#endif
+}
+
+/// <summary>
+/// Find the parts of a file which hold data, so that the holes of a sparse file need not be read.
+/// A file which is not sparse is returned as one range.
+/// </summary>
+/// <param name="handle">The open file</param>
+/// <param name="size">The size of the file</param>
+/// <param name="ranges">Receives the ranges in ascending order. Holes are the gaps between them.</param>
+/// <returns>0 on success, or the platform error code if the file system cannot say</returns>
+DWORD PlatformQueryAllocatedRanges(t_fileHandle handle, unsigned long long size, std::vector<t_fileRange>* ranges)
+{
+    ranges->clear();
+#ifdef _WIN32
+    FILE_ALLOCATED_RANGE_BUFFER query{};
+    FILE_ALLOCATED_RANGE_BUFFER results[64];
+    DWORD error = ERROR_MORE_DATA;
+
+    query.FileOffset.QuadPart = 0;
+    query.Length.QuadPart = (LONGLONG)size;
+    while (error == ERROR_MORE_DATA && query.Length.QuadPart > 0) {
+        DWORD bytesReturned = 0;
+        error = DeviceControl(handle, FSCTL_QUERY_ALLOCATED_RANGES, &query, sizeof(query), results, sizeof(results), &bytesReturned);
+        if (error && error != ERROR_MORE_DATA) {
+            return error;
+        }
+
+        DWORD count = bytesReturned / sizeof(results[0]);
+        if (count == 0) {
+            break;
+        }
+        for (DWORD i = 0; i < count; i++) {
+            ranges->push_back(t_fileRange{ (unsigned long long)results[i].FileOffset.QuadPart, (unsigned long long)results[i].Length.QuadPart });
+        }
+
+        // carry on from the end of the last range returned
+        unsigned long long next = ranges->back().offset + ranges->back().length;
+        query.FileOffset.QuadPart = (LONGLONG)next;
+        query.Length.QuadPart = (LONGLONG)(next < size ? size - next : 0);
+    }
+    return ERROR_SUCCESS;
+#else
+    off_t position = 0;
+    while ((unsigned long long)position < size) {
+        off_t data = lseek(handle, position, SEEK_DATA);
+        if (data < 0) {
+            if (errno == ENXIO) {
+                break; // nothing but a hole from here to the end
+            }
+            return errno;
+        }
+        off_t hole = lseek(handle, data, SEEK_HOLE);
+        if (hole < 0) {
+            return errno;
+        }
+        if ((unsigned long long)hole > size) {
+            hole = (off_t)size;
+        }
+        ranges->push_back(t_fileRange{ (unsigned long long)data, (unsigned long long)(hole - data) });
+        position = hole;
+    }
+    return ERROR_SUCCESS;
+#endif
+}
+
+/// <summary>
+/// Mark a file as sparse, so that ranges cleared with PlatformZeroRange, and ranges never written, take no space.
+/// Elsewhere than Windows, files can have holes without being marked.
+/// </summary>
+/// <param name="handle">A file opened with PlatformOpenForWrite</param>
+/// <returns>0 on success, or the platform error code if the file system does not support sparse files</returns>
+DWORD PlatformSetSparse(t_fileHandle handle)
+{
+#ifdef _WIN32
+    FILE_SET_SPARSE_BUFFER sparse{};
+    DWORD bytesReturned = 0;
+
+    sparse.SetSparse = TRUE;
+    return DeviceControl(handle, FSCTL_SET_SPARSE, &sparse, sizeof(sparse), NULL, 0, &bytesReturned);
+#else
+    (void)handle;
+    return ERROR_SUCCESS;
+#endif
+}
+
+/// <summary>
+/// Make a range of a file read as zeros, giving back its space where the file system allows.
+/// Beyond the end of the file, nothing is changed and the file is not extended.
+/// </summary>
+/// <param name="handle">A file opened with PlatformOpenForWrite</param>
+/// <param name="offset">The start of the range</param>
+/// <param name="length">The length of the range</param>
+/// <returns>0 on success, or the platform error code if the range could not be cleared -- write zeros instead</returns>
+DWORD PlatformZeroRange(t_fileHandle handle, unsigned long long offset, unsigned long long length)
+{
+#ifdef _WIN32
+    FILE_ZERO_DATA_INFORMATION zeroData{};
+    DWORD bytesReturned = 0;
+
+    zeroData.FileOffset.QuadPart = (LONGLONG)offset;
+    zeroData.BeyondFinalZero.QuadPart = (LONGLONG)(offset + length);
+    return DeviceControl(handle, FSCTL_SET_ZERO_DATA, &zeroData, sizeof(zeroData), NULL, 0, &bytesReturned);
+#elif defined(FALLOC_FL_PUNCH_HOLE)
+    if (fallocate(handle, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, (off_t)offset, (off_t)length) != 0) {
+        return errno;
+    }
+    return ERROR_SUCCESS;
+#else
+    (void)handle;
+    (void)offset;
+    (void)length;
+    return ERROR_NOT_SUPPORTED;
+#endif
+}
+
+/// <summary>
+/// Close a file opened by PlatformOpenForRead or PlatformOpenForWrite.
+/// </summary>
+/// <param name="handle">The open file. INVALID_FILE_HANDLE is ignored.</param>
+void PlatformCloseFile(t_fileHandle handle)
+{
+    if (handle == INVALID_FILE_HANDLE) {
+        return;
+    }
+#ifdef _WIN32
+    CloseHandle(handle);
+#else
+    close(handle);
+#endif
+}
+
+/// <summary>
+/// Rename a file over another, replacing it in one step, so that a reader sees either the old file or the new one.
+/// </summary>
+/// <param name="sourcePath">The file to rename, typically a temporary file which has just been written</param>
+/// <param name="destinationPath">The new name. An existing file with this name is replaced.</param>
+/// <param name="writeThrough">Wait until the rename has reached the disk. Costly when renaming many small files.</param>
+/// <returns>0 on success, or the platform error code upon failure</returns>
+DWORD PlatformReplaceFile(const std::wstring& sourcePath, const std::wstring& destinationPath, BOOL writeThrough)
+{
+#ifdef _WIN32
+    if (!MoveFileExW(sourcePath.c_str(), destinationPath.c_str(), MOVEFILE_REPLACE_EXISTING | (writeThrough ? MOVEFILE_WRITE_THROUGH : 0))) {
+        return GetLastError();
+    }
+    return ERROR_SUCCESS;
+#else
+    (void)writeThrough; // rename has no counterpart to MOVEFILE_WRITE_THROUGH
+    if (rename(PlatformToUtf8(sourcePath).c_str(), PlatformToUtf8(destinationPath).c_str()) != 0) {
+        return errno;
+    }
+    return ERROR_SUCCESS;
+#endif
+}
+
+/// <summary>
+/// Delete a file, or a directory which is already empty.
+/// </summary>
+/// <param name="path">The file or directory</param>
+/// <param name="isDirectory">TRUE if path is a directory</param>
+/// <returns>0 on success, or the platform error code upon failure</returns>
+DWORD PlatformDeletePath(const std::wstring& path, BOOL isDirectory)
+{
+#ifdef _WIN32
+    BOOL deleted = isDirectory ? RemoveDirectoryW(path.c_str()) : DeleteFileW(path.c_str());
+    if (!deleted) {
+        return GetLastError();
+    }
+    return ERROR_SUCCESS;
+#else
+    std::string utf8Path = PlatformToUtf8(path);
+    if ((isDirectory ? rmdir(utf8Path.c_str()) : unlink(utf8Path.c_str())) != 0) {
+        return errno;
+    }
+    return ERROR_SUCCESS;
+#endif
+}
+
+/// <summary>
+/// Whether a file or directory exists at a path.
+/// </summary>
+/// <param name="path">The path</param>
+/// <returns>TRUE if something exists there</returns>
+BOOL PlatformPathExists(const std::wstring& path)
+{
+#ifdef _WIN32
+    return GetFileAttributesW(path.c_str()) != INVALID_FILE_ATTRIBUTES;
+#else
+    struct stat pathStat {};
+    return stat(PlatformToUtf8(path).c_str(), &pathStat) == 0;
+#endif
+}
+
+/// <summary>
+/// Open a directory, not to list it but to name the volume it is on, as PlatformPathFromFileReference needs.
+/// </summary>
+/// <param name="directory">The directory, such as the root of a snapshot</param>
+/// <param name="handle">Receives the open handle, to be closed with PlatformCloseFile</param>
+/// <returns>0 on success, or the platform error code upon failure</returns>
+DWORD PlatformOpenDirectory(const std::wstring& directory, t_fileHandle* handle)
+{
+#ifdef _WIN32
+    *handle = CreateFileW(directory.c_str(), FILE_READ_ATTRIBUTES, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL, OPEN_EXISTING, FILE_FLAG_BACKUP_SEMANTICS, NULL);
+    if (*handle == INVALID_HANDLE_VALUE) {
+        return GetLastError();
+    }
+    return ERROR_SUCCESS;
+#else
+    *handle = open(PlatformToUtf8(directory).c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (*handle < 0) {
+        *handle = INVALID_FILE_HANDLE;
+        return errno;
+    }
+    return ERROR_SUCCESS;
+#endif
+}
+
+/// <summary>
+/// Open the change journal of a volume -- on Windows, the NTFS USN journal. Other platforms have no
+/// journal which can be read back like this.
+/// </summary>
+/// <param name="volume">The volume, as from GetVolumePathNameW, which may be a drive or a mounted folder</param>
+/// <param name="journal">Receives a handle to the volume, to be closed with PlatformCloseFile</param>
+/// <returns>0 on success, ERROR_NOT_SUPPORTED where there is no change journal, or the platform error code upon failure</returns>
+DWORD PlatformOpenChangeJournal(const std::wstring& volume, t_fileHandle* journal)
+{
+#ifdef _WIN32
+    WCHAR volumeName[MAX_PATH]{};
+    std::wstring mountPoint = volume;
+
+    *journal = INVALID_FILE_HANDLE;
+    if (mountPoint.empty() || mountPoint.back() != L'\\') {
+        mountPoint.push_back(L'\\');
+    }
+    if (!GetVolumeNameForVolumeMountPointW(mountPoint.c_str(), volumeName, MAX_PATH)) {
+        return GetLastError();
+    }
+
+    // \\?\Volume{GUID}\ is the root directory of the volume -- without the separator it is the volume itself
+    size_t length = wcslen(volumeName);
+    if (length > 0 && volumeName[length - 1] == L'\\') {
+        volumeName[length - 1] = L'\0';
+    }
+    *journal = CreateFileW(volumeName, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_EXISTING, FILE_FLAG_OVERLAPPED, NULL);
+    if (*journal == INVALID_HANDLE_VALUE) {
+        return GetLastError();
+    }
+    return ERROR_SUCCESS;
+#else
+    (void)volume;
+    *journal = INVALID_FILE_HANDLE;
+    return ERROR_NOT_SUPPORTED;
+#endif
+}
+
+/// <summary>
+/// Find which journal a volume has and which USNs it still holds.
+/// </summary>
+/// <param name="journal">A volume opened with PlatformOpenChangeJournal</param>
+/// <param name="information">Receives the journal ID and the range of USNs</param>
+/// <returns>0 on success, ERROR_JOURNAL_NOT_ACTIVE if the volume has no journal, or the platform error code upon failure</returns>
+DWORD PlatformQueryChangeJournal(t_fileHandle journal, t_changeJournalInformation* information)
+{
+#ifdef _WIN32
+    USN_JOURNAL_DATA_V0 data{};
+    DWORD bytesReturned = 0;
+
+    DWORD error = DeviceControl(journal, FSCTL_QUERY_USN_JOURNAL, NULL, 0, &data, sizeof(data), &bytesReturned);
+    if (error) {
+        return error;
+    }
+    information->journalId = data.UsnJournalID;
+    information->firstUsn = (unsigned long long)data.FirstUsn;
+    information->nextUsn = (unsigned long long)data.NextUsn;
+    return ERROR_SUCCESS;
+#else
+    (void)journal;
+    *information = t_changeJournalInformation{};
+    return ERROR_NOT_SUPPORTED;
+#endif
+}
+
+/// <summary>
+/// Read the records of a change journal from one USN up to another, a buffer at a time.
+/// </summary>
+/// <param name="journal">A volume opened with PlatformOpenChangeJournal</param>
+/// <param name="journalId">The journal the USNs belong to, so that a journal created again since is not read in its place</param>
+/// <param name="startUsn">The first USN to read</param>
+/// <param name="endUsn">Records from this USN on are not read</param>
+/// <param name="recordRoutine">Receives each record</param>
+/// <param name="context">Passed through to recordRoutine</param>
+/// <returns>0 on success, ERROR_JOURNAL_ENTRY_DELETED if startUsn has already been dropped from the journal,
+/// ERROR_OPERATION_ABORTED if recordRoutine stopped the read, or the platform error code upon failure</returns>
+DWORD PlatformReadChangeJournal(t_fileHandle journal, unsigned long long journalId, unsigned long long startUsn, unsigned long long endUsn, t_changeJournalRoutine recordRoutine, void* context)
+{
+#ifdef _WIN32
+    READ_USN_JOURNAL_DATA_V0 read{};
+    std::vector<unsigned long long> buffer(PLATFORM_ENUMERATION_BUFFER / sizeof(unsigned long long)); // 8 byte aligned, as the records are
+    t_changeJournalRecord change{};
+
+    read.StartUsn = (USN)startUsn;
+    read.ReasonMask = 0xFFFFFFFF;
+    read.UsnJournalID = journalId;
+    while ((unsigned long long)read.StartUsn < endUsn) {
+        DWORD bytesReturned = 0;
+        DWORD error = DeviceControl(journal, FSCTL_READ_USN_JOURNAL, &read, sizeof(read), buffer.data(), (DWORD)(buffer.size() * sizeof(buffer[0])), &bytesReturned);
+        if (error) {
+            return error;
+        }
+
+        // the buffer starts with the USN to carry on from, followed by as many whole records as fitted
+        const unsigned char* start = (const unsigned char*)buffer.data();
+        if (bytesReturned <= sizeof(USN)) {
+            break; // nothing has been written since
+        }
+        for (DWORD offset = sizeof(USN); offset + sizeof(USN_RECORD_V2) <= bytesReturned; ) {
+            const USN_RECORD_V2* record = (const USN_RECORD_V2*)(start + offset);
+            if (record->RecordLength == 0 || offset + record->RecordLength > bytesReturned) {
+                return ERROR_INVALID_DATA;
+            }
+            if (record->MajorVersion != 2) {
+                return ERROR_NOT_SUPPORTED; // 128 bit file references, as ReFS has
+            }
+            if ((unsigned long long)record->Usn >= endUsn) {
+                return ERROR_SUCCESS;
+            }
+
+            change.usn = (unsigned long long)record->Usn;
+            change.fileReference = record->FileReferenceNumber;
+            change.parentReference = record->ParentFileReferenceNumber;
+            change.name.assign((LPCWSTR)((const unsigned char*)record + record->FileNameOffset), record->FileNameLength / sizeof(WCHAR));
+            change.isDirectory = (record->FileAttributes & FILE_ATTRIBUTE_DIRECTORY) != 0;
+            change.arrived = (record->Reason & (USN_REASON_FILE_CREATE | USN_REASON_RENAME_NEW_NAME)) != 0;
+            change.departed = (record->Reason & (USN_REASON_FILE_DELETE | USN_REASON_RENAME_OLD_NAME)) != 0;
+            if (!recordRoutine(change, context)) {
+                return ERROR_OPERATION_ABORTED;
+            }
+            offset += record->RecordLength;
+        }
+        read.StartUsn = *(const USN*)start;
+    }
+    return ERROR_SUCCESS;
+#else
+    (void)journal;
+    (void)journalId;
+    (void)startUsn;
+    (void)endUsn;
+    (void)recordRoutine;
+    (void)context;
+    return ERROR_NOT_SUPPORTED;
+#endif
+}
+
+/// <summary>
+/// Find the path of a file or directory from its file reference number, as change journal records give.
+/// A snapshot has the same file references as its volume, so a handle to the snapshot finds each path as
+/// it was when the snapshot was taken.
+/// </summary>
+/// <param name="volumeHandle">A directory on the volume or snapshot, opened with PlatformOpenDirectory</param>
+/// <param name="fileReference">The file reference number</param>
+/// <param name="path">Receives the path relative to the root of the volume, without a leading separator, which is empty for the root itself</param>
+/// <returns>0 on success, ERROR_INVALID_PARAMETER or ERROR_FILE_NOT_FOUND if nothing on the volume has that reference, or the platform error code upon failure</returns>
+DWORD PlatformPathFromFileReference(t_fileHandle volumeHandle, unsigned long long fileReference, std::wstring* path)
+{
+#ifdef _WIN32
+    FILE_ID_DESCRIPTOR descriptor{};
+    std::vector<WCHAR> text(MAX_PATH);
+    DWORD error = ERROR_SUCCESS;
+
+    descriptor.dwSize = sizeof(descriptor);
+    descriptor.Type = FileIdType;
+    descriptor.FileId.QuadPart = (LONGLONG)fileReference;
+    HANDLE file = OpenFileById(volumeHandle, &descriptor, FILE_READ_ATTRIBUTES, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL, FILE_FLAG_BACKUP_SEMANTICS);
+    if (file == INVALID_HANDLE_VALUE) {
+        return GetLastError();
+    }
+
+    DWORD length = GetFinalPathNameByHandleW(file, text.data(), (DWORD)text.size(), FILE_NAME_NORMALIZED | VOLUME_NAME_NONE);
+    if (length >= text.size()) {
+        text.resize(length + 1);
+        length = GetFinalPathNameByHandleW(file, text.data(), (DWORD)text.size(), FILE_NAME_NORMALIZED | VOLUME_NAME_NONE);
+    }
+    if (length == 0 || length >= text.size()) {
+        error = length == 0 ? GetLastError() : ERROR_INVALID_DATA;
+    }
+    CloseHandle(file);
+    if (error) {
+        return error;
+    }
+
+    path->assign(text.data(), length);
+    if (!path->empty() && (*path)[0] == L'\\') {
+        path->erase(0, 1);
+    }
+    return ERROR_SUCCESS;
+#else
+    (void)volumeHandle;
+    (void)fileReference;
+    path->clear();
+    return ERROR_NOT_SUPPORTED;
+#endif
+}
+
+/// <summary>
+/// Map a whole file into memory for reading, so that it can be used in place without being read or parsed.
+/// On Windows the file cannot be replaced or deleted until it is unmapped.
+/// </summary>
+/// <param name="path">The file, which must not be empty</param>
+/// <param name="mapped">Receives the mapping, to be released with PlatformUnmapFile</param>
+/// <returns>0 on success, ERROR_INVALID_DATA if the file is empty, or the platform error code upon failure</returns>
+DWORD PlatformMapFile(const std::wstring& path, t_mappedFile* mapped)
+{
+    t_fileHandle handle = INVALID_FILE_HANDLE;
+    t_fileInformation information{};
+
+    *mapped = t_mappedFile{};
+    DWORD error = PlatformOpenForRead(path, FALSE, &handle);
+    if (error) {
+        return error;
+    }
+    error = PlatformGetFileInformation(handle, &information);
+    if (!error && (information.size == 0 || information.size != (size_t)information.size)) {
+        error = ERROR_INVALID_DATA;
+    }
+
+#ifdef _WIN32
+    if (!error) {
+        mapped->mapping = CreateFileMappingW(handle, NULL, PAGE_READONLY, 0, 0, NULL);
+        if (mapped->mapping == NULL) {
+            error = GetLastError();
+        }
+    }
+    if (!error) {
+        mapped->data = MapViewOfFile(mapped->mapping, FILE_MAP_READ, 0, 0, 0);
+        if (mapped->data == NULL) {
+            error = GetLastError();
+            CloseHandle(mapped->mapping);
+            mapped->mapping = NULL;
+        }
+    }
+#else
+    if (!error) {
+        void* data = mmap(nullptr, (size_t)information.size, PROT_READ, MAP_SHARED, handle, 0);
+        if (data == MAP_FAILED) {
+            error = errno;
+        }
+        else {
+            mapped->data = data;
+        }
+    }
+#endif
+
+    PlatformCloseFile(handle);
+    if (!error) {
+        mapped->size = information.size;
+    }
+    return error;
+}
+
+/// <summary>
+/// Release a mapping made by PlatformMapFile. An empty mapping is ignored.
+/// </summary>
+/// <param name="mapped">The mapping, which is emptied</param>
+void PlatformUnmapFile(t_mappedFile* mapped)
+{
+    if (mapped->data == nullptr) {
+        return;
+    }
+#ifdef _WIN32
+    UnmapViewOfFile(mapped->data);
+    CloseHandle(mapped->mapping);
+#else
+    munmap((void*)mapped->data, (size_t)mapped->size);
+#endif
+    *mapped = t_mappedFile{};
+}
+
+/// <summary>
+/// Allocate a buffer aligned to PLATFORM_IO_ALIGNMENT, suitable for unbuffered I/O.
+/// </summary>
+/// <param name="size">The size in bytes</param>
+/// <returns>The buffer, or nullptr if it could not be allocated</returns>
+void* PlatformAlignedAlloc(size_t size)
+{
+#ifdef _WIN32
+    return _aligned_malloc(size, PLATFORM_IO_ALIGNMENT);
+#else
+    void* buffer = nullptr;
+    if (posix_memalign(&buffer, PLATFORM_IO_ALIGNMENT, size) != 0) {
+        return nullptr;
+    }
+    return buffer;
+#endif
+}
+
+/// <summary>
+/// Free a buffer from PlatformAlignedAlloc.
+/// </summary>
+/// <param name="buffer">The buffer</param>
+void PlatformAlignedFree(void* buffer)
+{
+#ifdef _WIN32
+    _aligned_free(buffer);
+#else
+    free(buffer);
+#endif
+}
+
+/// <summary>
+/// Prepare to read from a file with up to queueDepth reads outstanding.
+/// </summary>
+/// <param name="handle">The file, opened with PlatformOpenForRead. It must stay open until the reader is destroyed.</param>
+/// <param name="queueDepth">The most reads which may be in flight at once</param>
+PlatformAsyncReader::PlatformAsyncReader(t_fileHandle handle, unsigned int queueDepth)
+    : handle(handle), queueDepth(queueDepth > 0 ? queueDepth : 1), issued(0), completed(0)
+#ifndef _WIN32
+    , stopping(false)
+#endif
+{
+#ifdef _WIN32
+    overlapped.resize(this->queueDepth);
+    reads.resize(this->queueDepth);
+    pending.resize(this->queueDepth);
+    for (OVERLAPPED& slot : overlapped) {
+        slot.hEvent = CreateEventW(NULL, TRUE, FALSE, NULL);
+    }
+#else
+    reader = std::thread(&PlatformAsyncReader::ReaderMain, this);
+#endif
+}
+
+/// <summary>
+/// Wait for any reads still in flight, so that their buffers are no longer in use.
+/// </summary>
+PlatformAsyncReader::~PlatformAsyncReader()
+{
+    t_asyncRead read{};
+
+#ifdef _WIN32
+    if (InFlight() > 0) {
+        CancelIoEx(handle, NULL);
+    }
+    while (InFlight() > 0) {
+        Complete(&read);
+    }
+    for (OVERLAPPED& slot : overlapped) {
+        if (slot.hEvent != NULL) {
+            CloseHandle(slot.hEvent);
+        }
+    }
+#else
+    while (InFlight() > 0) {
+        Complete(&read);
+    }
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        stopping = true;
+    }
+    requestAvailable.notify_one();
+    reader.join();
+#endif
+}
+
+/// <summary>
+/// Start a read. The buffer must not be touched until Complete has returned this read.
+/// </summary>
+/// <param name="offset">Where to read from</param>
+/// <param name="buffer">Receives the data</param>
+/// <param name="length">How many bytes to read</param>
+/// <returns>0 if the read was started, or ERROR_INVALID_PARAMETER if queueDepth reads are already in flight</returns>
+DWORD PlatformAsyncReader::Issue(unsigned long long offset, void* buffer, DWORD length)
+{
+    if (InFlight() >= queueDepth) {
+        return ERROR_INVALID_PARAMETER;
+    }
+
+    t_asyncRead read{};
+    read.offset = offset;
+    read.buffer = buffer;
+    read.length = length;
+
+#ifdef _WIN32
+    size_t slot = (size_t)(issued % queueDepth);
+    HANDLE event = overlapped[slot].hEvent;
+
+    ZeroMemory(&overlapped[slot], sizeof(OVERLAPPED));
+    overlapped[slot].hEvent = event;
+    overlapped[slot].Offset = (DWORD)offset;
+    overlapped[slot].OffsetHigh = (DWORD)(offset >> 32);
+    ResetEvent(event);
+
+    // if the read failed (or hit the end of the file) without being queued, Complete reports it without waiting
+    pending[slot] = OverlappedStarted(ReadFile(handle, buffer, length, NULL, &overlapped[slot]), &read.error);
+    reads[slot] = read;
+    issued++;
+#else
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        requests.push_back(read);
+        issued++;
+    }
+    requestAvailable.notify_one();
+#endif
+    return ERROR_SUCCESS;
+}
+
+/// <summary>
+/// Wait for the oldest read in flight.
+/// </summary>
+/// <param name="read">Receives the read, with bytesRead and error filled in</param>
+/// <returns>0 if a read was returned, or ERROR_INVALID_PARAMETER if none were in flight. The read's own outcome is in read->error.</returns>
+DWORD PlatformAsyncReader::Complete(t_asyncRead* read)
+{
+    if (InFlight() == 0) {
+        return ERROR_INVALID_PARAMETER;
+    }
+
+#ifdef _WIN32
+    size_t slot = (size_t)(completed % queueDepth);
+
+    if (pending[slot]) {
+        reads[slot].error = AwaitOverlapped(handle, &overlapped[slot], &reads[slot].bytesRead);
+        pending[slot] = FALSE;
+    }
+    *read = reads[slot];
+    completed++;
+#else
+    std::unique_lock<std::mutex> guard(lock);
+    readComplete.wait(guard, [this] { return !results.empty(); });
+    *read = results.front();
+    results.pop_front();
+    completed++;
+#endif
+    return ERROR_SUCCESS;
+}
+
+/// <summary>
+/// The number of reads issued but not yet returned by Complete.
+/// </summary>
+unsigned int PlatformAsyncReader::InFlight(void)
+{
+#ifndef _WIN32
+    std::lock_guard<std::mutex> guard(lock);
+#endif
+    return (unsigned int)(issued - completed);
+}
+
+#ifndef _WIN32
+/// <summary>
+/// Helper thread body -- perform the queued reads in order.
+/// </summary>
+/// <param name=""></param>
+void PlatformAsyncReader::ReaderMain(void)
+{
+    for (;;) {
+        t_asyncRead read{};
+        {
+            std::unique_lock<std::mutex> guard(lock);
+            requestAvailable.wait(guard, [this] { return !requests.empty() || stopping; });
+            if (requests.empty()) {
+                return;
+            }
+            read = requests.front();
+            requests.pop_front();
+        }
+
+        read.error = PlatformReadAt(handle, read.offset, read.buffer, read.length, &read.bytesRead);
+
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            results.push_back(read);
+        }
+        readComplete.notify_one();
+    }
+}
+#endif
+
+/// <summary>
+/// Join a directory and a name with the platform path separator.
+/// </summary>
+/// <param name="directory">The directory, without a trailing separator</param>
+/// <param name="name">The file or directory name to append</param>
+/// <returns>The joined path</returns>
+std::wstring PlatformJoinPath(const std::wstring& directory, const std::wstring& name)
+{
+    std::wstring joined;
+    joined.reserve(directory.size() + name.size() + 1);
+    joined.append(directory);
+    if (!joined.empty() && joined.back() != PATH_SEPARATOR) {
+        joined.push_back(PATH_SEPARATOR);
+    }
+    joined.append(name);
+    return joined;
+}
+
+/// <summary>
+/// The number of logical processors available to this process, or 1 if it cannot be determined.
+/// </summary>
+/// <param name=""></param>
+/// <returns>The count of logical processors</returns>
+unsigned int PlatformProcessorCount(void)
+{
+    unsigned int count = std::thread::hardware_concurrency();
+    return count > 0 ? count : 1;
+}
+
+/// <summary>
+/// Break a time down into local time, safely from any thread.
+/// </summary>
+/// <param name="time">The time</param>
+/// <param name="local">Receives the local time</param>
+void PlatformLocalTime(time_t time, struct tm* local)
+{
+#ifdef _WIN32
+    localtime_s(local, &time);
+#else
+    localtime_r(&time, local);
+#endif
+}
+
+/// <summary>
+/// The current time, in the same units as the times of files.
+/// </summary>
+/// <returns>100ns intervals since 1 January 1601</returns>
+unsigned long long PlatformCurrentFileTime(void)
+{
+#ifdef _WIN32
+    FILETIME now{};
+    GetSystemTimeAsFileTime(&now);
+    return FileTimeToULL(now);
+#else
+    struct timespec now{};
+    clock_gettime(CLOCK_REALTIME, &now);
+    return FileTimeFromTimespec(now);
+#endif
+}
+
+/// <summary>
+/// The directory for temporary files of the current user.
+/// </summary>
+/// <returns>The directory, without a trailing separator</returns>
+std::wstring PlatformTempDirectory(void)
+{
+#ifdef _WIN32
+    wchar_t path[MAX_PATH + 1]{};
+    DWORD length = GetTempPathW(MAX_PATH + 1, path);
+    if (length == 0 || length > MAX_PATH) {
+        return L".";
+    }
+    std::wstring directory(path, length);
+#else
+    const char* tmpdir = getenv("TMPDIR");
+    std::wstring directory = PlatformFromUtf8(tmpdir != nullptr && tmpdir[0] != '\0' ? tmpdir : "/tmp");
+#endif
+    while (directory.size() > 1 && directory.back() == PATH_SEPARATOR) {
+        directory.pop_back();
+    }
+    return directory;
+}
+
+// The longest request a control client may send
+#define CONTROL_MAX_REQUEST 4096
+// How long a control client may take to send its request, and to take each part of the reply, before it is dropped
+#define CONTROL_CLIENT_TIMEOUT_MS 5000
+
+/// <summary>
+/// Where the control channel with a name lives -- a named pipe on Windows, a Unix socket in /tmp elsewhere.
+/// </summary>
+/// <param name="name">The name of the channel</param>
+/// <returns>The path of the pipe or socket</returns>
+static std::wstring ControlPath(const std::wstring& name)
+{
+#ifdef _WIN32
+    return L"\\\\.\\pipe\\" + name;
+#else
+    return L"/tmp/" + name + L".sock";
+#endif
+}
+
+#ifdef _WIN32
+/// <summary>
+/// Read from or write to an overlapped control pipe, giving up on a client which takes too long.
+/// </summary>
+/// <param name="pipe">The pipe, opened for overlapped I/O</param>
+/// <param name="overlapped">The pipe's OVERLAPPED, with a manual reset event</param>
+/// <param name="writing">TRUE to write, FALSE to read</param>
+/// <param name="buffer">The data to write, or the buffer to read into</param>
+/// <param name="length">The number of bytes to transfer</param>
+/// <param name="timeout">How long to wait for the transfer, in milliseconds</param>
+/// <param name="transferred">Receives the number of bytes transferred</param>
+/// <returns>TRUE on success, or FALSE with GetLastError() set, to ERROR_TIMEOUT if the client took too long</returns>
+static BOOL ControlPipeTransfer(HANDLE pipe, OVERLAPPED* overlapped, BOOL writing, void* buffer, DWORD length, DWORD timeout, DWORD* transferred)
+{
+    ResetEvent(overlapped->hEvent);
+    BOOL done = writing ? WriteFile(pipe, buffer, length, NULL, overlapped) : ReadFile(pipe, buffer, length, NULL, overlapped);
+    if (!done && GetLastError() != ERROR_IO_PENDING) {
+        return FALSE;
+    }
+    if (WaitForSingleObject(overlapped->hEvent, timeout) != WAIT_OBJECT_0) {
+        // the transfer must have finished with the OVERLAPPED before it can be used again
+        CancelIoEx(pipe, overlapped);
+        GetOverlappedResult(pipe, overlapped, transferred, TRUE);
+        SetLastError(ERROR_TIMEOUT);
+        return FALSE;
+    }
+    return GetOverlappedResult(pipe, overlapped, transferred, FALSE);
+}
+
+/// <summary>
+/// Cancels the FlushFileBuffers of a control pipe whose client has not taken the reply in time.
+/// </summary>
+static VOID CALLBACK ControlFlushExpired(PVOID pipe, BOOLEAN fired)
+{
+    (void)fired;
+    CancelIoEx((HANDLE)pipe, NULL);
+}
+#endif
+
+/// <summary>
+/// Serve requests on a local control channel, one client at a time, until the control routine asks to stop.
+/// A request is one line of text. The reply is everything sent back before the channel is closed.
+/// On Windows the channel is a named pipe which refuses remote clients and, by default, lets only
+/// administrators and the account serving it write to it. Elsewhere it is a Unix socket which only
+/// the account serving it may connect to. A client which stalls, sending its request or taking the reply,
+/// is dropped after CONTROL_CLIENT_TIMEOUT_MS so the next one can be served.
+/// </summary>
+/// <param name="name">The name of the channel, which must not already be served</param>
+/// <param name="controlRoutine">Answers each request</param>
+/// <param name="context">Passed through to controlRoutine</param>
+/// <returns>0 once the control routine has asked to stop, or the platform error code if the channel could not be served</returns>
+DWORD PlatformServeControl(const std::wstring& name, t_controlRoutine controlRoutine, void* context)
+{
+    BOOL serving = TRUE;
+    std::string reply;
+
+#ifdef _WIN32
+    HANDLE pipe = CreateNamedPipeW(ControlPath(name).c_str(), PIPE_ACCESS_DUPLEX | FILE_FLAG_FIRST_PIPE_INSTANCE | FILE_FLAG_OVERLAPPED,
+        PIPE_TYPE_BYTE | PIPE_READMODE_BYTE | PIPE_WAIT | PIPE_REJECT_REMOTE_CLIENTS, 1, CONTROL_MAX_REQUEST, CONTROL_MAX_REQUEST, 0, NULL);
+    if (pipe == INVALID_HANDLE_VALUE) {
+        return GetLastError();
+    }
+    OVERLAPPED overlapped{};
+    overlapped.hEvent = CreateEventW(NULL, TRUE, FALSE, NULL);
+    if (overlapped.hEvent == NULL) {
+        DWORD error = GetLastError();
+        CloseHandle(pipe);
+        return error;
+    }
+
+    while (serving) {
+        DWORD transferred = 0;
+        if (!ConnectNamedPipe(pipe, &overlapped)) {
+            DWORD error = GetLastError();
+            if (error == ERROR_IO_PENDING) {
+                error = GetOverlappedResult(pipe, &overlapped, &transferred, TRUE) ? ERROR_SUCCESS : GetLastError();
+            }
+            if (error != ERROR_SUCCESS && error != ERROR_PIPE_CONNECTED) {
+                CloseHandle(overlapped.hEvent);
+                CloseHandle(pipe);
+                return error;
+            }
+        }
+
+        // the whole request must arrive in time, however slowly it trickles in
+        std::string request;
+        char received = 0;
+        BOOL stalled = FALSE;
+        ULONGLONG deadline = GetTickCount64() + CONTROL_CLIENT_TIMEOUT_MS;
+        while (request.size() < CONTROL_MAX_REQUEST) {
+            ULONGLONG now = GetTickCount64();
+            if (now >= deadline) {
+                stalled = TRUE;
+                break;
+            }
+            if (!ControlPipeTransfer(pipe, &overlapped, FALSE, &received, 1, (DWORD)(deadline - now), &transferred)) {
+                stalled = GetLastError() == ERROR_TIMEOUT;
+                break;
+            }
+            if (transferred != 1 || received == '\n') {
+                break;
+            }
+            request.push_back(received);
+        }
+        if (stalled) {
+            DisconnectNamedPipe(pipe); // drop it
+            continue;
+        }
+
+        reply.clear();
+        serving = controlRoutine(request, &reply, context);
+        BOOL delivered = TRUE;
+        for (size_t sent = 0; sent < reply.size();) {
+            if (!ControlPipeTransfer(pipe, &overlapped, TRUE, (void*)(reply.data() + sent), (DWORD)(reply.size() - sent), CONTROL_CLIENT_TIMEOUT_MS, &transferred)) {
+                delivered = FALSE;
+                break; // the client has gone, or is not taking the reply
+            }
+            sent += transferred;
+        }
+        if (delivered) {
+            // FlushFileBuffers waits for the client to read the rest of the reply, and cannot be given a timeout
+            HANDLE timer = NULL;
+            if (CreateTimerQueueTimer(&timer, NULL, ControlFlushExpired, pipe, CONTROL_CLIENT_TIMEOUT_MS, 0, WT_EXECUTEONLYONCE)) {
+                FlushFileBuffers(pipe);
+                DeleteTimerQueueTimer(NULL, timer, INVALID_HANDLE_VALUE);
+            }
+        }
+        DisconnectNamedPipe(pipe);
+    }
+    CloseHandle(overlapped.hEvent);
+    CloseHandle(pipe);
+    return ERROR_SUCCESS;
+#else
+    std::string path = PlatformToUtf8(ControlPath(name));
+    struct sockaddr_un address {};
+    if (path.size() >= sizeof(address.sun_path)) {
+        return ENAMETOOLONG;
+    }
+    address.sun_family = AF_UNIX;
+    memcpy(address.sun_path, path.c_str(), path.size() + 1);
+
+    int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listener < 0) {
+        return errno;
+    }
+
+    // a socket of ours left behind by a server which did not stop cleanly is removed, but nothing else in /tmp is
+    struct stat existing {};
+    if (lstat(path.c_str(), &existing) == 0) {
+        if (!S_ISSOCK(existing.st_mode) || existing.st_uid != geteuid()) {
+            close(listener);
+            return EEXIST;
+        }
+        unlink(path.c_str());
+    }
+
+    // only the account serving the channel may connect. The socket is created with that mode by bind, so there is
+    // no moment in which another account could open it. The umask is the whole process's, so anything another
+    // thread creates meanwhile is only made private to the account too.
+    mode_t previousMask = umask(0077);
+    int bound = bind(listener, (struct sockaddr*)&address, sizeof(address));
+    DWORD error = errno;
+    umask(previousMask);
+    if (bound != 0 || listen(listener, 4) != 0) {
+        error = bound != 0 ? error : errno;
+        close(listener);
+        return error;
+    }
+
+    while (serving) {
+        int connection = accept(listener, nullptr, nullptr);
+        if (connection < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            DWORD error = errno;
+            close(listener);
+            unlink(path.c_str());
+            return error;
+        }
+
+        // each read and send gives up after the timeout, and the whole request must arrive in time too,
+        // however slowly it trickles in
+        struct timeval timeout {};
+        timeout.tv_sec = CONTROL_CLIENT_TIMEOUT_MS / 1000;
+        timeout.tv_usec = (CONTROL_CLIENT_TIMEOUT_MS % 1000) * 1000;
+        setsockopt(connection, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        setsockopt(connection, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+        std::string request;
+        char received = 0;
+        BOOL stalled = FALSE;
+        auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(CONTROL_CLIENT_TIMEOUT_MS);
+        while (request.size() < CONTROL_MAX_REQUEST) {
+            ssize_t bytesRead = read(connection, &received, 1);
+            if (bytesRead < 0 && errno == EINTR) {
+                continue;
+            }
+            if ((bytesRead < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) || std::chrono::steady_clock::now() >= deadline) {
+                stalled = TRUE;
+                break;
+            }
+            if (bytesRead != 1 || received == '\n') {
+                break;
+            }
+            request.push_back(received);
+        }
+        if (stalled) {
+            close(connection); // drop it
+            continue;
+        }
+
+        reply.clear();
+        serving = controlRoutine(request, &reply, context);
+        for (size_t sent = 0; sent < reply.size();) {
+            ssize_t bytesWritten = send(connection, reply.data() + sent, reply.size() - sent, MSG_NOSIGNAL);
+            if (bytesWritten <= 0) {
+                break; // the client has gone
+            }
+            sent += (size_t)bytesWritten;
+        }
+        close(connection);
+    }
+    close(listener);
+    unlink(path.c_str());
+    return ERROR_SUCCESS;
+#endif
+}
+
+/// <summary>
+/// Send one request to a control channel served by PlatformServeControl and wait for the whole reply.
+/// </summary>
+/// <param name="name">The name of the channel</param>
+/// <param name="request">The request, without a line ending</param>
+/// <param name="reply">Receives the reply</param>
+/// <returns>0 on success, or the platform error code if the channel could not be reached</returns>
+DWORD PlatformControlRequest(const std::wstring& name, const std::string& request, std::string* reply)
+{
+    std::string line = request + "\n";
+    char buffer[CONTROL_MAX_REQUEST];
+
+    reply->clear();
+#ifdef _WIN32
+    std::wstring path = ControlPath(name);
+    HANDLE pipe = INVALID_HANDLE_VALUE;
+    for (;;) {
+        pipe = CreateFileW(path.c_str(), GENERIC_READ | GENERIC_WRITE, 0, NULL, OPEN_EXISTING, 0, NULL);
+        if (pipe != INVALID_HANDLE_VALUE) {
+            break;
+        }
+        // the one pipe instance is busy with another client -- wait for it to be free
+        if (GetLastError() != ERROR_PIPE_BUSY || !WaitNamedPipeW(path.c_str(), 5000)) {
+            return GetLastError();
+        }
+    }
+
+    DWORD bytesTransferred = 0;
+    if (!WriteFile(pipe, line.data(), (DWORD)line.size(), &bytesTransferred, NULL)) {
+        DWORD error = GetLastError();
+        CloseHandle(pipe);
+        return error;
+    }
+    while (ReadFile(pipe, buffer, sizeof(buffer), &bytesTransferred, NULL) && bytesTransferred > 0) {
+        reply->append(buffer, bytesTransferred);
+    }
+    DWORD error = GetLastError();
+    CloseHandle(pipe);
+    return (error == ERROR_BROKEN_PIPE || error == ERROR_SUCCESS) ? ERROR_SUCCESS : error;
+#else
+    std::string path = PlatformToUtf8(ControlPath(name));
+    struct sockaddr_un address {};
+    if (path.size() >= sizeof(address.sun_path)) {
+        return ENAMETOOLONG;
+    }
+    address.sun_family = AF_UNIX;
+    memcpy(address.sun_path, path.c_str(), path.size() + 1);
+
+    int connection = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (connection < 0) {
+        return errno;
+    }
+    if (connect(connection, (struct sockaddr*)&address, sizeof(address)) != 0 || send(connection, line.data(), line.size(), MSG_NOSIGNAL) != (ssize_t)line.size()) {
+        DWORD error = errno;
+        close(connection);
+        return error;
+    }
+
+    ssize_t bytesRead = 0;
+    while ((bytesRead = read(connection, buffer, sizeof(buffer))) > 0) {
+        reply->append(buffer, (size_t)bytesRead);
+    }
+    DWORD error = bytesRead < 0 ? errno : ERROR_SUCCESS;
+    close(connection);
+    return error;
+#endif
+}
+
+/// <summary>
+/// Convert wide text into UTF-8, for files we write and for paths passed to POSIX file APIs.
+/// </summary>
+/// <param name="text">The wide text</param>
+/// <returns>The UTF-8 encoded text</returns>
+std::string PlatformToUtf8(const std::wstring& text)
+{
+#ifdef _WIN32
+    std::string utf8;
+    if (text.empty()) {
+        return utf8;
+    }
+    int length = WideCharToMultiByte(CP_UTF8, 0, text.data(), (int)text.size(), NULL, 0, NULL, NULL);
+    utf8.resize(length);
+    WideCharToMultiByte(CP_UTF8, 0, text.data(), (int)text.size(), &utf8[0], length, NULL, NULL);
+    return utf8;
+#else
+    std::string utf8;
+    utf8.reserve(text.size());
+    for (wchar_t character : text) {
+        uint32_t codePoint = (uint32_t)character;
+        if (codePoint < 0x80) {
+            utf8.push_back((char)codePoint);
+        }
+        else if (codePoint < 0x800) {
+            utf8.push_back((char)(0xC0 | (codePoint >> 6)));
+            utf8.push_back((char)(0x80 | (codePoint & 0x3F)));
+        }
+        else if (codePoint < 0x10000) {
+            utf8.push_back((char)(0xE0 | (codePoint >> 12)));
+            utf8.push_back((char)(0x80 | ((codePoint >> 6) & 0x3F)));
+            utf8.push_back((char)(0x80 | (codePoint & 0x3F)));
+        }
+        else {
+            utf8.push_back((char)(0xF0 | (codePoint >> 18)));
+            utf8.push_back((char)(0x80 | ((codePoint >> 12) & 0x3F)));
+            utf8.push_back((char)(0x80 | ((codePoint >> 6) & 0x3F)));
+            utf8.push_back((char)(0x80 | (codePoint & 0x3F)));
+        }
+    }
+    return utf8;
+#endif
+}
+
+/// <summary>
+/// Convert UTF-8 text, from a file we wrote or a POSIX file API, into wide text. Invalid sequences become U+FFFD.
+/// </summary>
+/// <param name="utf8">The UTF-8 encoded text</param>
+/// <returns>The wide text</returns>
+std::wstring PlatformFromUtf8(const std::string& utf8)
+{
+#ifdef _WIN32
+    std::wstring text;
+    if (utf8.empty()) {
+        return text;
+    }
+    int length = MultiByteToWideChar(CP_UTF8, 0, utf8.data(), (int)utf8.size(), NULL, 0);
+    text.resize(length);
+    MultiByteToWideChar(CP_UTF8, 0, utf8.data(), (int)utf8.size(), &text[0], length);
+    return text;
+#else
+    std::wstring text;
+    const unsigned char* next = (const unsigned char*)utf8.c_str();
+
+    while (*next) {
+        uint32_t codePoint = *next++;
+        int continuationBytes = 0;
+        if (codePoint >= 0xF0) {
+            codePoint &= 0x07;
+            continuationBytes = 3;
+        }
+        else if (codePoint >= 0xE0) {
+            codePoint &= 0x0F;
+            continuationBytes = 2;
+        }
+        else if (codePoint >= 0xC0) {
+            codePoint &= 0x1F;
+            continuationBytes = 1;
+        }
+        else if (codePoint >= 0x80) {
+            codePoint = 0xFFFD;
+        }
+
+        for (; continuationBytes > 0; continuationBytes--) {
+            if ((*next & 0xC0) != 0x80) {
+                codePoint = 0xFFFD;
+                break;
+            }
+            codePoint = (codePoint << 6) | (*next++ & 0x3F);
+        }
+        text.push_back((wchar_t)codePoint);
+    }
+    return text;
+#endif
+}
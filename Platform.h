@@ -0,0 +1,222 @@
+/* ShadowDuplicator -- a simple VC++ Volume Shadow Copy requestor for backing up
+locked files
+
+Copyright (C) 2021-2023 Peter Upfold.
+
+Licensed under the Apache 2.0 Licence. See the LICENSE file in the project root for details.
+
+This code is **not** production quality. There is certainly plenty of potential for improvement of this code,
+but beyond that, it may even be insecure, destructive or cause you other serious problems. There
+is no warranty.
+*/
+
+/*
+The platform layer is the only place where the copy engine touches the operating system. On Windows it
+is a thin wrapper over the Win32 file APIs. Elsewhere it provides just enough of the Win32 types
+and POSIX equivalents that the engine can be built and driven against a plain directory which stands
+in for the snapshot device object.
+*/
+#pragma once
+
+#ifdef _WIN32
+#include <windows.h>
+#define PATH_SEPARATOR L'\\'
+#else
+#include <cstdint>
+#include <cerrno>
+#include <cwchar>
+
+typedef uint32_t DWORD;
+typedef int32_t HRESULT;
+typedef int BOOL;
+typedef wchar_t WCHAR;
+typedef WCHAR* LPWSTR;
+typedef const WCHAR* LPCWSTR;
+
+#define TRUE 1
+#define FALSE 0
+
+// errno values stand in for Win32 error codes, so that DWORD error returns work the same way
+#define ERROR_SUCCESS 0
+#define ERROR_NOT_ENOUGH_MEMORY ENOMEM
+#define ERROR_OPERATION_ABORTED ECANCELED
+#define ERROR_FILE_NOT_FOUND ENOENT
+#define ERROR_PATH_NOT_FOUND ENOENT
+#define ERROR_INVALID_DATA EBADMSG
+#define ERROR_HANDLE_EOF ENODATA
+#define ERROR_INVALID_PARAMETER EINVAL
+#define ERROR_NOT_SUPPORTED EOPNOTSUPP
+#define ERROR_JOURNAL_ENTRY_DELETED ESTALE
+
+#define S_OK ((HRESULT)0)
+#define E_FAIL ((HRESULT)0x80004005L)
+#define SUCCEEDED(result) ((HRESULT)(result) >= 0)
+#define FAILED(result) ((HRESULT)(result) < 0)
+
+#define PATH_SEPARATOR L'/'
+#endif
+
+#include <ctime>
+#include <string>
+#include <vector>
+
+#ifdef _WIN32
+typedef HANDLE t_fileHandle;
+#define INVALID_FILE_HANDLE INVALID_HANDLE_VALUE
+#else
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+typedef int t_fileHandle;
+#define INVALID_FILE_HANDLE (-1)
+#endif
+
+// Buffers, offsets and lengths for unbuffered I/O must be multiples of this. 4 KiB covers both 512 byte and 4Kn sectors.
+#define PLATFORM_IO_ALIGNMENT 4096
+
+// Directories are listed into a buffer of this size, which holds hundreds of entries from each call to the file system
+#define PLATFORM_ENUMERATION_BUFFER (64 * 1024)
+
+// One entry returned while enumerating a directory. Times are in FILETIME units (100ns since 1601) on every platform.
+// On Linux the size and time of a directory are 0, to save a stat of each.
+typedef struct directoryEntry {
+    LPCWSTR name;
+    BOOL isDirectory;
+    unsigned long long size;
+    unsigned long long lastWriteTime;
+    DWORD attributes;
+} t_directoryEntry;
+
+// Receives each entry of a directory, other than "." and "..". Return FALSE to stop enumerating.
+typedef BOOL (*t_directoryEntryRoutine)(const t_directoryEntry& entry, void* context);
+
+// Size, times and attributes of an open file, in the same units as t_directoryEntry
+typedef struct fileInformation {
+    unsigned long long size;
+    unsigned long long creationTime;
+    unsigned long long lastWriteTime;
+    DWORD attributes;
+} t_fileInformation;
+
+// The state of a volume's change journal. Each change is given a USN which is higher than the last, and
+// the journal holds the changes from firstUsn up to nextUsn, dropping the oldest as it fills.
+typedef struct changeJournalInformation {
+    unsigned long long journalId; // different every time the journal is created, so that its USNs start afresh
+    unsigned long long firstUsn;
+    unsigned long long nextUsn;
+} t_changeJournalInformation;
+
+// One record of a change journal -- something happened to the file or directory called name in the directory parentReference
+typedef struct changeJournalRecord {
+    unsigned long long usn;
+    unsigned long long fileReference;
+    unsigned long long parentReference;
+    std::wstring name;
+    BOOL isDirectory;
+    BOOL arrived; // created, or renamed to this name
+    BOOL departed; // deleted, or renamed away from this name
+} t_changeJournalRecord;
+
+// Receives each record read from a change journal, in USN order. Return FALSE to stop reading.
+typedef BOOL (*t_changeJournalRoutine)(const t_changeJournalRecord& record, void* context);
+
+// A range of a file which holds data. The rest of a sparse file is holes, which read as zeros.
+typedef struct fileRange {
+    unsigned long long offset;
+    unsigned long long length;
+} t_fileRange;
+
+// A whole file mapped read-only into memory by PlatformMapFile
+typedef struct mappedFile {
+    const void* data;
+    unsigned long long size;
+#ifdef _WIN32
+    HANDLE mapping;
+#endif
+} t_mappedFile;
+
+// Answers one request from a control client, which is sent the reply. Return FALSE to stop serving once it has been sent.
+typedef BOOL (*t_controlRoutine)(const std::string& request, std::string* reply, void* context);
+
+// One read issued through a PlatformAsyncReader
+typedef struct asyncRead {
+    unsigned long long offset;
+    void* buffer;
+    DWORD length;
+    DWORD bytesRead;
+    DWORD error;
+} t_asyncRead;
+
+/// <summary>
+/// Keeps several reads of one file in flight at once and hands them back in the order they were issued.
+/// Windows uses overlapped I/O. Elsewhere a helper thread performs the reads, so that they still overlap
+/// with whatever the caller is doing with the blocks already returned.
+/// </summary>
+class PlatformAsyncReader {
+public:
+    PlatformAsyncReader(t_fileHandle handle, unsigned int queueDepth);
+    ~PlatformAsyncReader();
+
+    DWORD Issue(unsigned long long offset, void* buffer, DWORD length);
+    DWORD Complete(t_asyncRead* read);
+    unsigned int InFlight(void);
+
+private:
+    t_fileHandle handle;
+    unsigned int queueDepth;
+    unsigned long long issued;
+    unsigned long long completed;
+#ifdef _WIN32
+    std::vector<OVERLAPPED> overlapped;
+    std::vector<t_asyncRead> reads;
+    std::vector<BOOL> pending;
+#else
+    void ReaderMain(void);
+
+    std::thread reader;
+    std::mutex lock;
+    std::condition_variable requestAvailable;
+    std::condition_variable readComplete;
+    std::deque<t_asyncRead> requests;
+    std::deque<t_asyncRead> results;
+    bool stopping;
+#endif
+};
+
+DWORD PlatformEnumerateDirectory(const std::wstring& directory, t_directoryEntryRoutine entryRoutine, void* context);
+DWORD PlatformCreateDirectory(const std::wstring& directory);
+DWORD PlatformOpenForRead(const std::wstring& path, BOOL unbuffered, t_fileHandle* handle);
+DWORD PlatformOpenForWrite(const std::wstring& path, BOOL unbuffered, BOOL truncate, t_fileHandle* handle);
+DWORD PlatformGetFileInformation(t_fileHandle handle, t_fileInformation* information);
+DWORD PlatformSetFileInformation(t_fileHandle handle, const t_fileInformation& information);
+DWORD PlatformReadAt(t_fileHandle handle, unsigned long long offset, void* buffer, DWORD length, DWORD* bytesRead);
+DWORD PlatformReadStandardInput(void* buffer, DWORD length, DWORD* bytesRead);
+DWORD PlatformWriteAt(t_fileHandle handle, unsigned long long offset, const void* buffer, DWORD length);
+DWORD PlatformSetFileSize(t_fileHandle handle, unsigned long long size);
+DWORD PlatformFlushFile(t_fileHandle handle);
+DWORD PlatformQueryAllocatedRanges(t_fileHandle handle, unsigned long long size, std::vector<t_fileRange>* ranges);
+DWORD PlatformSetSparse(t_fileHandle handle);
+DWORD PlatformZeroRange(t_fileHandle handle, unsigned long long offset, unsigned long long length);
+void PlatformCloseFile(t_fileHandle handle);
+DWORD PlatformReplaceFile(const std::wstring& sourcePath, const std::wstring& destinationPath, BOOL writeThrough);
+DWORD PlatformDeletePath(const std::wstring& path, BOOL isDirectory);
+BOOL PlatformPathExists(const std::wstring& path);
+DWORD PlatformOpenDirectory(const std::wstring& directory, t_fileHandle* handle);
+DWORD PlatformOpenChangeJournal(const std::wstring& volume, t_fileHandle* journal);
+DWORD PlatformQueryChangeJournal(t_fileHandle journal, t_changeJournalInformation* information);
+DWORD PlatformReadChangeJournal(t_fileHandle journal, unsigned long long journalId, unsigned long long startUsn, unsigned long long endUsn, t_changeJournalRoutine recordRoutine, void* context);
+DWORD PlatformPathFromFileReference(t_fileHandle volumeHandle, unsigned long long fileReference, std::wstring* path);
+DWORD PlatformMapFile(const std::wstring& path, t_mappedFile* mapped);
+void PlatformUnmapFile(t_mappedFile* mapped);
+void* PlatformAlignedAlloc(size_t size);
+void PlatformAlignedFree(void* buffer);
+std::wstring PlatformJoinPath(const std::wstring& directory, const std::wstring& name);
+unsigned int PlatformProcessorCount(void);
+void PlatformLocalTime(time_t time, struct tm* local);
+unsigned long long PlatformCurrentFileTime(void);
+std::wstring PlatformTempDirectory(void);
+DWORD PlatformServeControl(const std::wstring& name, t_controlRoutine controlRoutine, void* context);
+DWORD PlatformControlRequest(const std::wstring& name, const std::string& request, std::string* reply);
+std::string PlatformToUtf8(const std::wstring& text);
+std::wstring PlatformFromUtf8(const std::string& utf8);
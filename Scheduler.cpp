@@ -0,0 +1,430 @@
+/* ShadowDuplicator -- a simple VC++ Volume Shadow Copy requestor for backing up
+locked files
+
+Copyright (C) 2021-2023 Peter Upfold.
+
+Licensed under the Apache 2.0 Licence. See the LICENSE file in the project root for details.
+
+This code is **not** production quality. There is certainly plenty of potential for improvement of this code,
+but beyond that, it may even be insecure, destructive or cause you other serious problems. There
+is no warranty.
+*/
+
+#include "Scheduler.h"
+#include <cctype>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+
+/// <summary>
+/// Parse one field of a cron schedule -- a comma separated list of *, N or N-M, each optionally
+/// followed by /STEP -- into a bit set of the values it matches.
+/// </summary>
+/// <param name="field">The field</param>
+/// <param name="minimum">The smallest value the field may hold</param>
+/// <param name="maximum">The largest value the field may hold</param>
+/// <param name="bits">Receives the bit set, with bit N set if the field matches N</param>
+/// <returns>TRUE if the field was understood</returns>
+static BOOL CronParseField(const std::string& field, unsigned int minimum, unsigned int maximum, unsigned long long* bits)
+{
+    const char* next = field.c_str();
+
+    *bits = 0;
+    for (;;) {
+        unsigned long first = minimum;
+        unsigned long last = maximum;
+        unsigned long step = 1;
+        char* end = nullptr;
+
+        if (*next == '*') {
+            next++;
+        }
+        else {
+            if (!isdigit((unsigned char)*next)) {
+                return FALSE;
+            }
+            first = strtoul(next, &end, 10);
+            next = end;
+            last = first;
+            if (*next == '-') {
+                if (!isdigit((unsigned char)next[1])) {
+                    return FALSE;
+                }
+                last = strtoul(next + 1, &end, 10);
+                next = end;
+            }
+            else if (*next == '/') {
+                last = maximum; // N/STEP runs from N to the end of the range
+            }
+        }
+        if (*next == '/') {
+            if (!isdigit((unsigned char)next[1])) {
+                return FALSE;
+            }
+            step = strtoul(next + 1, &end, 10);
+            next = end;
+        }
+
+        if (first < minimum || last > maximum || first > last || step == 0) {
+            return FALSE;
+        }
+        for (unsigned long value = first; value <= last; value += step) {
+            *bits |= 1ULL << value;
+        }
+
+        if (*next == '\0') {
+            return TRUE;
+        }
+        if (*next != ',') {
+            return FALSE;
+        }
+        next++;
+    }
+}
+
+/// <summary>
+/// Parse a schedule in crontab form, for example "0 * * * *" for every hour on the hour or "30 1 * * 1-5"
+/// for 01:30 each weekday. Names of months and days are not understood. @hourly, @daily, @weekly,
+/// @monthly and @yearly are.
+/// </summary>
+/// <param name="text">The schedule</param>
+/// <param name="schedule">Receives the schedule</param>
+/// <returns>TRUE if the schedule was understood</returns>
+BOOL CronParse(const std::string& text, t_cronSchedule* schedule)
+{
+    static const char* const shorthands[][2] = {
+        { "@hourly", "0 * * * *" },
+        { "@daily", "0 0 * * *" },
+        { "@midnight", "0 0 * * *" },
+        { "@weekly", "0 0 * * 0" },
+        { "@monthly", "0 0 1 * *" },
+        { "@yearly", "0 0 1 1 *" },
+        { "@annually", "0 0 1 1 *" },
+    };
+    std::vector<std::string> fields;
+    std::string field;
+    unsigned long long bits = 0;
+
+    for (size_t i = 0; i <= text.size(); i++) {
+        if (i == text.size() || isspace((unsigned char)text[i])) {
+            if (!field.empty()) {
+                fields.push_back(field);
+                field.clear();
+            }
+        }
+        else {
+            field.push_back(text[i]);
+        }
+    }
+
+    if (fields.size() == 1) {
+        for (const auto& shorthand : shorthands) {
+            if (fields[0] == shorthand[0]) {
+                return CronParse(shorthand[1], schedule);
+            }
+        }
+        return FALSE;
+    }
+    if (fields.size() != 5) {
+        return FALSE;
+    }
+
+    *schedule = t_cronSchedule{};
+    if (!CronParseField(fields[0], 0, 59, &schedule->minutes)) {
+        return FALSE;
+    }
+    if (!CronParseField(fields[1], 0, 23, &bits)) {
+        return FALSE;
+    }
+    schedule->hours = (unsigned int)bits;
+    if (!CronParseField(fields[2], 1, 31, &bits)) {
+        return FALSE;
+    }
+    schedule->days = (unsigned int)bits;
+    if (!CronParseField(fields[3], 1, 12, &bits)) {
+        return FALSE;
+    }
+    schedule->months = (unsigned int)bits;
+    if (!CronParseField(fields[4], 0, 7, &bits)) {
+        return FALSE;
+    }
+    schedule->weekdays = (unsigned int)((bits | (bits >> 7)) & 0x7F); // 7 is Sunday too
+
+    // as in cron, a job with both days of the month and days of the week runs on either
+    schedule->daysRestricted = fields[2][0] != '*';
+    schedule->weekdaysRestricted = fields[4][0] != '*';
+    return TRUE;
+}
+
+/// <summary>
+/// Whether a schedule is due in a minute.
+/// </summary>
+/// <param name="schedule">The schedule</param>
+/// <param name="localTime">The minute, in local time</param>
+/// <returns>TRUE if the schedule matches that minute</returns>
+BOOL CronMatches(const t_cronSchedule& schedule, const struct tm& localTime)
+{
+    if (!(schedule.minutes & (1ULL << localTime.tm_min)) || !(schedule.hours & (1U << localTime.tm_hour)) || !(schedule.months & (1U << (localTime.tm_mon + 1)))) {
+        return FALSE;
+    }
+
+    BOOL dayMatches = (schedule.days & (1U << localTime.tm_mday)) != 0;
+    BOOL weekdayMatches = (schedule.weekdays & (1U << localTime.tm_wday)) != 0;
+    if (schedule.daysRestricted && schedule.weekdaysRestricted) {
+        return dayMatches || weekdayMatches;
+    }
+    return dayMatches && weekdayMatches;
+}
+
+/// <summary>
+/// Find the next minute a schedule is due, looking up to a year ahead.
+/// </summary>
+/// <param name="schedule">The schedule</param>
+/// <param name="after">Look for minutes after this time</param>
+/// <returns>The start of the minute, or 0 if the schedule is not due in the next year</returns>
+time_t CronNextRun(const t_cronSchedule& schedule, time_t after)
+{
+    for (time_t minute = (after / 60 + 1) * 60, end = after + 366 * 24 * 60 * 60; minute <= end; minute += 60) {
+        struct tm local {};
+        PlatformLocalTime(minute, &local);
+        if (CronMatches(schedule, local)) {
+            return minute;
+        }
+    }
+    return 0;
+}
+
+/// <summary>
+/// Format a time as local time for the status.
+/// </summary>
+/// <param name="time">The time</param>
+/// <returns>The time as YYYY-MM-DD HH:MM:SS</returns>
+static std::string FormatLocalTime(time_t time)
+{
+    struct tm local {};
+    char text[32]{};
+
+    PlatformLocalTime(time, &local);
+    strftime(text, sizeof(text), "%Y-%m-%d %H:%M:%S", &local);
+    return text;
+}
+
+/// <summary>
+/// Prepare a scheduler with no jobs. Nothing runs until Run is called.
+/// </summary>
+/// <param name="jobRoutine">Runs each job</param>
+/// <param name="context">Passed through to jobRoutine</param>
+JobScheduler::JobScheduler(t_jobRoutine jobRoutine, void* context)
+    : jobRoutine(jobRoutine), context(context), stopping(false)
+{
+}
+
+JobScheduler::~JobScheduler()
+{
+    Stop();
+    if (clock.joinable()) {
+        clock.join();
+    }
+}
+
+/// <summary>
+/// Add a job. Jobs must all be added before Run is called.
+/// </summary>
+/// <param name="name">The name the job is triggered and reported by</param>
+/// <param name="config">What the job routine needs to run the job -- for a backup, its INI file</param>
+/// <param name="schedule">When the job runs, as for CronParse</param>
+/// <returns>FALSE if the schedule was not understood or there is already a job with this name</returns>
+BOOL JobScheduler::AddJob(const std::wstring& name, const std::wstring& config, const std::string& schedule)
+{
+    t_scheduledJob job{};
+
+    if (!CronParse(schedule, &job.schedule)) {
+        return FALSE;
+    }
+
+    std::lock_guard<std::mutex> guard(lock);
+    for (const t_scheduledJob& existing : jobs) {
+        if (existing.name == name) {
+            return FALSE;
+        }
+    }
+    job.name = name;
+    job.config = config;
+    job.scheduleText = schedule;
+    jobs.push_back(job);
+    return TRUE;
+}
+
+/// <summary>
+/// The number of jobs added.
+/// </summary>
+size_t JobScheduler::JobCount(void)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    return jobs.size();
+}
+
+/// <summary>
+/// Queue a job to run as soon as the jobs ahead of it have run. Does nothing if it is already queued.
+/// </summary>
+/// <param name="name">The name of the job</param>
+/// <returns>FALSE if there is no such job or the scheduler is stopping</returns>
+BOOL JobScheduler::Trigger(const std::wstring& name)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    if (stopping) {
+        return FALSE;
+    }
+    for (size_t i = 0; i < jobs.size(); i++) {
+        if (jobs[i].name == name) {
+            Enqueue(i);
+            return TRUE;
+        }
+    }
+    return FALSE;
+}
+
+/// <summary>
+/// Queue a job unless it is already queued. Called with the lock held.
+/// </summary>
+/// <param name="index">The index of the job</param>
+void JobScheduler::Enqueue(size_t index)
+{
+    if (jobs[index].queued) {
+        return;
+    }
+    jobs[index].queued = TRUE;
+    queue.push_back(index);
+    wake.notify_all();
+}
+
+/// <summary>
+/// Start the clock and run jobs as they are triggered, one at a time, until Stop is called. Returns
+/// once the job running when Stop was called has finished.
+/// </summary>
+void JobScheduler::Run(void)
+{
+    clock = std::thread(&JobScheduler::ClockMain, this);
+
+    std::unique_lock<std::mutex> guard(lock);
+    while (!stopping) {
+        if (queue.empty()) {
+            wake.wait(guard);
+            continue;
+        }
+
+        t_scheduledJob& job = jobs[queue.front()];
+        queue.pop_front();
+        job.queued = FALSE;
+        job.running = TRUE;
+        job.lastStart = time(nullptr);
+        t_scheduledJob running = job;
+
+        // the job runs without the lock, so that it can be triggered again and the status read meanwhile
+        guard.unlock();
+        std::string timings;
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        HRESULT result = jobRoutine(running, &timings, context);
+        double milliseconds = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+        guard.lock();
+
+        job.running = FALSE;
+        job.runs++;
+        if (result != S_OK) {
+            job.failures++;
+        }
+        job.lastMilliseconds = milliseconds;
+        job.lastResult = result;
+        job.lastTimings = timings;
+    }
+    guard.unlock();
+
+    clock.join();
+}
+
+/// <summary>
+/// Stop the scheduler. Jobs still queued are dropped. A job already running runs to the end.
+/// May be called from any thread, including from the job routine.
+/// </summary>
+void JobScheduler::Stop(void)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    stopping = true;
+    for (size_t index : queue) {
+        jobs[index].queued = FALSE;
+    }
+    queue.clear();
+    wake.notify_all();
+}
+
+/// <summary>
+/// Clock thread body -- trigger each job whose schedule matches a minute which has begun since the last look.
+/// </summary>
+void JobScheduler::ClockMain(void)
+{
+    std::unique_lock<std::mutex> guard(lock);
+    long long lastMinute = (long long)(time(nullptr) / 60);
+
+    while (!stopping) {
+        wake.wait_for(guard, std::chrono::milliseconds(SCHEDULER_CLOCK_INTERVAL_MS));
+
+        long long minute = (long long)(time(nullptr) / 60);
+        if (minute - lastMinute > SCHEDULER_MAX_CATCH_UP_MINUTES) {
+            lastMinute = minute - 1;
+        }
+        for (long long due = lastMinute + 1; due <= minute && !stopping; due++) {
+            struct tm local {};
+            PlatformLocalTime((time_t)(due * 60), &local);
+            for (size_t i = 0; i < jobs.size(); i++) {
+                if (CronMatches(jobs[i].schedule, local)) {
+                    Enqueue(i);
+                }
+            }
+        }
+        lastMinute = minute; // if the clock went back, the minutes it repeats are due again
+    }
+}
+
+/// <summary>
+/// Describe each job -- whether it is running or queued, when it runs next, and how its last run went.
+/// </summary>
+/// <returns>Lines of text, a few for each job</returns>
+std::string JobScheduler::Status(void)
+{
+    std::vector<t_scheduledJob> snapshot;
+    std::string status;
+    char line[512];
+    time_t now = time(nullptr);
+
+    // the next run of a schedule which rarely matches can take a long search, which must not hold up the clock or the jobs
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        snapshot = jobs;
+    }
+
+    for (const t_scheduledJob& job : snapshot) {
+        const char* state = job.running ? (job.queued ? "running, queued to run again" : "running") : (job.queued ? "queued" : "idle");
+        snprintf(line, sizeof(line), "%s: %s, %llu runs, %llu failed\n", PlatformToUtf8(job.name).c_str(), state, job.runs, job.failures);
+        status += line;
+
+        time_t next = CronNextRun(job.schedule, now);
+        snprintf(line, sizeof(line), "  schedule \"%s\", next run %s\n", job.scheduleText.c_str(), next ? FormatLocalTime(next).c_str() : "not within a year");
+        status += line;
+
+        if (job.runs > 0) {
+            snprintf(line, sizeof(line), "  last run started %s, took %.1f s, result 0x%x\n", FormatLocalTime(job.lastStart).c_str(), job.lastMilliseconds / 1000.0, (unsigned int)job.lastResult);
+            status += line;
+            if (!job.lastTimings.empty()) {
+                status += "  " + job.lastTimings + "\n";
+            }
+        }
+        else if (job.running) {
+            snprintf(line, sizeof(line), "  started %s\n", FormatLocalTime(job.lastStart).c_str());
+            status += line;
+        }
+    }
+    if (snapshot.empty()) {
+        status = "No jobs.\n";
+    }
+    return status;
+}
@@ -0,0 +1,93 @@
+/* ShadowDuplicator -- a simple VC++ Volume Shadow Copy requestor for backing up
+locked files
+
+Copyright (C) 2021-2023 Peter Upfold.
+
+Licensed under the Apache 2.0 Licence. See the LICENSE file in the project root for details.
+
+This code is **not** production quality. There is certainly plenty of potential for improvement of this code,
+but beyond that, it may even be insecure, destructive or cause you other serious problems. There
+is no warranty.
+*/
+#pragma once
+#include "Platform.h"
+#include <condition_variable>
+#include <ctime>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// how often the clock thread looks for schedules which have come due
+#define SCHEDULER_CLOCK_INTERVAL_MS 1000
+// after a gap longer than this, such as the machine sleeping, missed minutes are not caught up
+#define SCHEDULER_MAX_CATCH_UP_MINUTES 60
+
+// When a job runs, as the five fields of a crontab line: minute, hour, day of the month, month and day of
+// the week. Each field is a bit set of the values it matches. Sunday is day 0.
+typedef struct cronSchedule {
+    unsigned long long minutes;
+    unsigned int hours;
+    unsigned int days;
+    unsigned int months;
+    unsigned int weekdays;
+    BOOL daysRestricted;
+    BOOL weekdaysRestricted;
+} t_cronSchedule;
+
+// A job the scheduler runs, and what happened the last time it ran
+typedef struct scheduledJob {
+    std::wstring name;
+    std::wstring config;
+    std::string scheduleText;
+    t_cronSchedule schedule;
+    BOOL queued;
+    BOOL running;
+    unsigned long long runs;
+    unsigned long long failures;
+    time_t lastStart;
+    double lastMilliseconds;
+    HRESULT lastResult;
+    std::string lastTimings;
+} t_scheduledJob;
+
+// Runs one job to completion on the scheduler's thread. Fill in timings with a line describing how long each phase took.
+typedef HRESULT (*t_jobRoutine)(const t_scheduledJob& job, std::string* timings, void* context);
+
+/// <summary>
+/// Runs jobs one at a time, in the order they were triggered, on the thread which calls Run. A clock
+/// thread triggers jobs as their schedules come due and anything may trigger one by name. A trigger
+/// which arrives while a job is running is queued, and a job already queued is not queued twice.
+/// </summary>
+class JobScheduler {
+public:
+    JobScheduler(t_jobRoutine jobRoutine, void* context);
+    ~JobScheduler();
+
+    BOOL AddJob(const std::wstring& name, const std::wstring& config, const std::string& schedule);
+    size_t JobCount(void);
+    BOOL Trigger(const std::wstring& name);
+    void Run(void);
+    void Stop(void);
+    std::string Status(void);
+
+private:
+    void ClockMain(void);
+    void Enqueue(size_t index);
+
+    t_jobRoutine jobRoutine;
+    void* context;
+
+    std::mutex lock;
+    std::condition_variable wake;
+    std::vector<t_scheduledJob> jobs;
+    std::deque<size_t> queue;
+    bool stopping;
+
+    std::thread clock;
+};
+
+BOOL CronParse(const std::string& text, t_cronSchedule* schedule);
+BOOL CronMatches(const t_cronSchedule& schedule, const struct tm& localTime);
+time_t CronNextRun(const t_cronSchedule& schedule, time_t after);
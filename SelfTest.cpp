@@ -0,0 +1,949 @@
+/* ShadowDuplicator -- a simple VC++ Volume Shadow Copy requestor for backing up
+locked files
+
+Copyright (C) 2021-2023 Peter Upfold.
+
+Licensed under the Apache 2.0 Licence. See the LICENSE file in the project root for details.
+
+This code is **not** production quality. There is certainly plenty of potential for improvement of this code,
+but beyond that, it may even be insecure, destructive or cause you other serious problems. There
+is no warranty.
+*/
+
+#include "SelfTest.h"
+#include "AsyncWait.h"
+#include "BlockCopy.h"
+#include "ChangeFeed.h"
+#include "Checksum.h"
+#include "ChunkStore.h"
+#include "Compression.h"
+#include "Delta.h"
+#include "IniFile.h"
+#include "Journal.h"
+#include "Manifest.h"
+#include "ManifestIndex.h"
+#include "PathFilter.h"
+#include "PathTable.h"
+#include "Scheduler.h"
+#include "Throttle.h"
+#include "Verify.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstddef>
+#include <cstdio>
+#include <cstring>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/*
+Known answers for the checksum, hash and compression code, and checks of the other portable modules.
+They run the same on Windows and elsewhere. Only the journal and index checks touch the disk, in files
+of their own in the temporary directory which are removed afterwards.
+*/
+
+/// <summary>
+/// Print the outcome of one check.
+/// </summary>
+/// <param name="name">What was checked</param>
+/// <param name="passed">Whether it gave the right answer</param>
+/// <returns>1 if the check failed, otherwise 0, for counting failures</returns>
+static unsigned int Check(const char* name, BOOL passed)
+{
+    printf("%-56s %s\n", name, passed ? "ok" : "FAILED");
+    return passed ? 0 : 1;
+}
+
+/// <summary>
+/// Fill a buffer with a repeatable pseudo-random pattern.
+/// </summary>
+static void FillPattern(std::vector<unsigned char>& buffer, unsigned int seed)
+{
+    for (unsigned char& byte : buffer) {
+        seed = seed * 1103515245 + 12345;
+        byte = (unsigned char)(seed >> 16);
+    }
+}
+
+/// <summary>
+/// CRC32C against the test vectors of RFC 3720 appendix B.4, and the accelerated routine against the portable one.
+/// </summary>
+static unsigned int TestChecksums(void)
+{
+    unsigned char zeros[32]{};
+    unsigned char ones[32];
+    unsigned char ascending[32];
+    unsigned char descending[32];
+    unsigned int failures = 0;
+
+    memset(ones, 0xFF, sizeof(ones));
+    for (int i = 0; i < 32; i++) {
+        ascending[i] = (unsigned char)i;
+        descending[i] = (unsigned char)(31 - i);
+    }
+
+    printf("CRC32C implementation: %s\n", ChecksumImplementation());
+    failures += Check("CRC32C of \"123456789\"", ChecksumUpdate(0, "123456789", 9) == 0xE3069283);
+    failures += Check("CRC32C of 32 zero bytes", ChecksumUpdate(0, zeros, sizeof(zeros)) == 0x8A9136AA);
+    failures += Check("CRC32C of 32 0xFF bytes", ChecksumUpdate(0, ones, sizeof(ones)) == 0x62A8AB43);
+    failures += Check("CRC32C of 32 ascending bytes", ChecksumUpdate(0, ascending, sizeof(ascending)) == 0x46DD794E);
+    failures += Check("CRC32C of 32 descending bytes", ChecksumUpdate(0, descending, sizeof(descending)) == 0x113FDB5C);
+    failures += Check("CRC32C portable of \"123456789\"", ChecksumUpdatePortable(0, "123456789", 9) == 0xE3069283);
+
+    // every length and alignment near the edges of the 8 byte steps, and chaining across a split
+    std::vector<unsigned char> data(4096 + 64);
+    FillPattern(data, 1);
+    BOOL agree = TRUE;
+    for (size_t offset = 0; offset < 16; offset++) {
+        for (size_t length = 0; length < 80; length++) {
+            agree = agree && ChecksumUpdate(0, &data[offset], length) == ChecksumUpdatePortable(0, &data[offset], length);
+        }
+    }
+    agree = agree && ChecksumUpdate(ChecksumUpdate(0, data.data(), 1001), &data[1001], 3000) == ChecksumUpdatePortable(0, data.data(), 4001);
+    failures += Check("CRC32C accelerated matches portable", agree);
+
+    std::vector<unsigned char> zeroData(70000);
+    agree = TRUE;
+    for (size_t length : { 0, 1, 2, 3, 7, 8, 31, 32, 255, 4096, 65536, 69999 }) {
+        agree = agree && ChecksumUpdateZeros(0x12345678, length) == ChecksumUpdate(0x12345678, zeroData.data(), length);
+    }
+    failures += Check("CRC32C of zero runs matches the data", agree);
+    return failures;
+}
+
+/// <summary>
+/// XXH64 and BLAKE2b-256 against their reference implementations.
+/// </summary>
+static unsigned int TestHashes(void)
+{
+    const char* sentence = "Nobody inspects the spammish repetition";
+    t_chunkHash hash{};
+    unsigned int failures = 0;
+
+    failures += Check("XXH64 of \"\"", DeltaHashBlock("", 0) == 0xEF46DB3751D8E999ULL);
+    failures += Check("XXH64 of \"abc\"", DeltaHashBlock("abc", 3) == 0x44BC2CF5AD770999ULL);
+    failures += Check("XXH64 of a 39 byte sentence", DeltaHashBlock(sentence, strlen(sentence)) == 0xFBCEA83C8A378BF1ULL);
+
+    ChunkHashData("", 0, &hash);
+    failures += Check("BLAKE2b-256 of \"\"", ChunkHashToHex(hash) == "0e5751c026e543b2e8ab2eb06099daa1d1e5df47778f7787faab45cdf12fe3a8");
+    ChunkHashData("abc", 3, &hash);
+    failures += Check("BLAKE2b-256 of \"abc\"", ChunkHashToHex(hash) == "bddd813c634239723171ef3fee98579b94964e3bb1cb3e427262c8c068d52319");
+    std::string block(128, 'y');
+    ChunkHashData(block.data(), block.size(), &hash);
+    failures += Check("BLAKE2b-256 of exactly one block", ChunkHashToHex(hash) == "344a3b5dec41f412c454eb8e0a96c5ff9d31c94fed2bd73d4eea9bc92524993d");
+    return failures;
+}
+
+/// <summary>
+/// LZ4 frames round trip, and incompressible data is recognised.
+/// </summary>
+static unsigned int TestCompression(void)
+{
+    std::vector<unsigned char> text(256 * 1024);
+    std::vector<unsigned char> noise(256 * 1024);
+    std::vector<unsigned char> compressed(CompressionBound(text.size()));
+    std::vector<unsigned char> decompressed(text.size());
+    std::vector<DWORD> hashTable(1 << 14);
+    unsigned int failures = 0;
+
+    // text-like data -- a small vocabulary of repeated words
+    static const char* words[] = { "shadow ", "copy ", "volume ", "backup ", "writer ", "snapshot ", "file ", "the " };
+    unsigned int seed = 7;
+    for (size_t i = 0; i < text.size(); ) {
+        seed = seed * 1103515245 + 12345;
+        const char* word = words[(seed >> 16) % 8];
+        for (size_t j = 0; word[j] != '\0' && i < text.size(); j++) {
+            text[i++] = (unsigned char)word[j];
+        }
+    }
+    FillPattern(noise, 3);
+
+    size_t length = CompressFrame(text.data(), text.size(), compressed.data(), compressed.size(), hashTable.data());
+    failures += Check("LZ4 compresses repetitive data", length > 0 && length < text.size() / 2);
+    failures += Check("LZ4 round trip of repetitive data", DecompressFrame(compressed.data(), length, decompressed.data(), decompressed.size()) && decompressed == text);
+
+    length = CompressFrame(noise.data(), noise.size(), compressed.data(), compressed.size(), hashTable.data());
+    failures += Check("LZ4 round trip of random data", length > 0 && DecompressFrame(compressed.data(), length, decompressed.data(), decompressed.size()) && decompressed == noise);
+    failures += Check("LZ4 gives up on random data with no room to grow", CompressFrame(noise.data(), noise.size(), compressed.data(), noise.size() - 1, hashTable.data()) == 0);
+
+    BOOL shortFrames = TRUE;
+    for (size_t shortLength = 0; shortLength < 40; shortLength++) {
+        length = CompressFrame(text.data(), shortLength, compressed.data(), compressed.size(), hashTable.data());
+        shortFrames = shortFrames && DecompressFrame(compressed.data(), length, decompressed.data(), shortLength) && memcmp(decompressed.data(), text.data(), shortLength) == 0;
+    }
+    failures += Check("LZ4 round trip of frames shorter than 40 bytes", shortFrames);
+
+    length = CompressFrame(text.data(), text.size(), compressed.data(), compressed.size(), hashTable.data());
+    failures += Check("LZ4 rejects a truncated frame", !DecompressFrame(compressed.data(), length - 1, decompressed.data(), decompressed.size()));
+
+    failures += Check("Random data is judged incompressible", CompressionLooksIncompressible(noise.data(), noise.size()));
+    failures += Check("Text is judged compressible", !CompressionLooksIncompressible(text.data(), text.size()));
+    return failures;
+}
+
+/// <summary>
+/// Zero detection against a byte by byte scan, with one stray byte at every position near the edges of the 64 byte steps.
+/// </summary>
+static unsigned int TestZeroDetection(void)
+{
+    std::vector<unsigned char> data(512);
+    unsigned int failures = 0;
+
+    failures += Check("Zero detection of an empty buffer", BlockIsZero(data.data(), 0));
+    failures += Check("Zero detection of a zero buffer", BlockIsZero(data.data(), data.size()));
+
+    BOOL agree = TRUE;
+    for (size_t offset = 0; offset < 16; offset++) {
+        for (size_t length = 1; length < 200; length++) {
+            for (size_t stray = 0; stray < length; stray++) {
+                data[offset + stray] = 0x80;
+                agree = agree && !BlockIsZero(&data[offset], length);
+                data[offset + stray] = 0;
+            }
+            agree = agree && BlockIsZero(&data[offset], length);
+        }
+    }
+    failures += Check("Zero detection finds a single non-zero byte", agree);
+    return failures;
+}
+
+/// <summary>
+/// A stand-in for IVssAsync which completes with a chosen status after a chosen time.
+/// </summary>
+class ScriptedAsync {
+public:
+    ScriptedAsync(unsigned int latencyMilliseconds, HRESULT outcome, BOOL supportsWait)
+        : completion(std::chrono::steady_clock::now() + std::chrono::milliseconds(latencyMilliseconds)),
+        outcome(outcome), supportsWait(supportsWait), cancelled(FALSE)
+    {
+    }
+
+    HRESULT Wait(DWORD milliseconds)
+    {
+        if (!supportsWait) {
+            return E_FAIL;
+        }
+        std::chrono::steady_clock::time_point timeout = std::chrono::steady_clock::now() + std::chrono::milliseconds(milliseconds);
+        std::this_thread::sleep_until(timeout < completion ? timeout : completion);
+        return S_OK;
+    }
+
+    HRESULT QueryStatus(HRESULT* status, int* reserved)
+    {
+        (void)reserved;
+        if (cancelled) {
+            *status = VSS_S_ASYNC_CANCELLED;
+        }
+        else {
+            *status = (std::chrono::steady_clock::now() >= completion) ? outcome : VSS_S_ASYNC_PENDING;
+        }
+        return S_OK;
+    }
+
+    HRESULT Cancel(void)
+    {
+        cancelled = TRUE;
+        return S_OK;
+    }
+
+    BOOL Cancelled(void)
+    {
+        return cancelled;
+    }
+
+private:
+    std::chrono::steady_clock::time_point completion;
+    HRESULT outcome;
+    BOOL supportsWait;
+    BOOL cancelled;
+};
+
+/// <summary>
+/// AwaitAsync against scripted operations -- it must notice completion promptly, pass on failures and cancel at the deadline.
+/// </summary>
+static unsigned int TestAsyncWait(void)
+{
+    const double slack = 200; // well under the 500 ms the old polling loops slept for
+    PhaseTimings timings;
+    unsigned int failures = 0;
+
+    ScriptedAsync finishes(120, VSS_S_ASYNC_FINISHED, TRUE);
+    failures += Check("Async wait returns when the operation finishes", AwaitAsync(&finishes, "finishes", &timings, 10000, nullptr, nullptr) == S_OK);
+    failures += Check("Async wait wakes promptly on completion", timings.Phases().back().milliseconds < 120 + slack);
+
+    ScriptedAsync polled(120, VSS_S_ASYNC_FINISHED, FALSE);
+    failures += Check("Async wait polls when Wait is not supported", AwaitAsync(&polled, "polled", &timings, 10000, nullptr, nullptr) == S_OK);
+    failures += Check("Async polling notices completion promptly", timings.Phases().back().milliseconds < 120 + slack);
+
+    ScriptedAsync fails(50, E_FAIL, TRUE);
+    failures += Check("Async wait passes on the failure of the operation", AwaitAsync(&fails, "fails", &timings, 10000, nullptr, nullptr) == E_FAIL);
+
+    ScriptedAsync cancelled(50, VSS_S_ASYNC_CANCELLED, TRUE);
+    failures += Check("Async wait reports cancellation", AwaitAsync(&cancelled, "cancelled", &timings, 10000, nullptr, nullptr) == VSS_S_ASYNC_CANCELLED);
+
+    ScriptedAsync hangs(60 * 60 * 1000, VSS_S_ASYNC_FINISHED, TRUE);
+    failures += Check("Async wait gives up at the deadline", AwaitAsync(&hangs, "hangs", &timings, 300, nullptr, nullptr) == ASYNC_E_TIMEOUT && hangs.Cancelled());
+
+    failures += Check("Async wait records every phase", timings.Phases().size() == 5);
+    return failures;
+}
+
+/// <summary>
+/// Have several threads push requests of one size through a throttle until a total is reached, as copy
+/// workers do, and time it.
+/// </summary>
+/// <param name="throttle">The throttle</param>
+/// <param name="write">Throttle as writes rather than reads</param>
+/// <param name="requestSize">The size of each request</param>
+/// <param name="requests">How many requests in all</param>
+/// <returns>How long the requests took in seconds</returns>
+static double TimeThrottledRequests(IoThrottle& throttle, BOOL write, DWORD requestSize, unsigned int requests)
+{
+    std::atomic<int> remaining((int)requests);
+    std::vector<std::thread> threads;
+
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    for (int i = 0; i < 8; i++) {
+        threads.emplace_back([&] {
+            while (remaining.fetch_sub(1) > 0) {
+                if (write) {
+                    throttle.Write(requestSize);
+                }
+                else {
+                    throttle.Read(requestSize);
+                }
+            }
+        });
+    }
+    for (std::thread& thread : threads) {
+        thread.join();
+    }
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+/// <summary>
+/// The throttle must hold many threads to within a few percent of its byte and operation limits, let
+/// waiting threads go promptly when a limit is lifted, and read schedules correctly.
+/// </summary>
+static unsigned int TestThrottle(void)
+{
+    std::vector<t_throttleWindow> schedule;
+    t_throttleLimits limits{};
+    unsigned int failures = 0;
+
+    // the first request goes at once and each later one waits its turn, so the last starts after all but one have been paid for
+    limits.readMBps = 40;
+    IoThrottle byteThrottle(limits, schedule, std::wstring());
+    double seconds = TimeThrottledRequests(byteThrottle, FALSE, 64 * 1024, 366);
+    double expected = 365 * 64 * 1024 / 40e6;
+    printf("Throttled reads took %.3f s for an expected %.3f s\n", seconds, expected);
+    failures += Check("Throttle holds 8 threads to a byte rate within 3%", fabs(seconds / expected - 1) < 0.03);
+
+    limits = t_throttleLimits{};
+    limits.writeIops = 2000;
+    IoThrottle operationThrottle(limits, schedule, std::wstring());
+    seconds = TimeThrottledRequests(operationThrottle, TRUE, 4096, 1201);
+    expected = 1200 / 2000.0;
+    printf("Throttled writes took %.3f s for an expected %.3f s\n", seconds, expected);
+    failures += Check("Throttle holds 8 threads to an IOPS limit within 3%", fabs(seconds / expected - 1) < 0.03);
+
+    // the first read leaves four seconds of debt, which the second waits behind until the limit is lifted
+    limits = t_throttleLimits{};
+    limits.readMBps = 1;
+    IoThrottle liftedThrottle(limits, schedule, std::wstring());
+    liftedThrottle.Read(4000000);
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    std::thread waiter([&] { liftedThrottle.Read(1); });
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    liftedThrottle.SetLimits(t_throttleLimits{});
+    waiter.join();
+    failures += Check("Lifting a limit releases waiting threads promptly", std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count() < 0.4);
+
+    BOOL parsed = ThrottleParseSchedule("07:00-19:00 read=20 write=20; 19:00-07:00 read=200 WriteIOPS=500", &schedule);
+    t_throttleLimits base{};
+    base.readMBps = 1000;
+    failures += Check("Throttle schedule parses", parsed && schedule.size() == 2);
+    failures += Check("Throttle schedule finds a daytime window", parsed && ThrottleLimitsAt(schedule, base, 8 * 60).readMBps == 20 && ThrottleLimitsAt(schedule, base, 8 * 60).writeMBps == 20);
+    failures += Check("Throttle schedule finds a window past midnight", parsed && ThrottleLimitsAt(schedule, base, 3 * 60).readMBps == 200 && ThrottleLimitsAt(schedule, base, 23 * 60).writeIops == 500);
+    failures += Check("Throttle schedule rejects a bad time", !ThrottleParseSchedule("07:00-25:00 read=20", &schedule));
+    failures += Check("Throttle limits reject an unknown key", !ThrottleParseLimits("read=20 speed=9", &limits));
+    failures += Check("Throttle limits parse with commas", ThrottleParseLimits("read=5,writeiops=10", &limits) && limits.readMBps == 5 && limits.writeIops == 10 && limits.writeMBps == 0);
+    return failures;
+}
+
+// What the stand-in job routine saw while the scheduler ran it
+typedef struct schedulerTestState {
+    JobScheduler* scheduler;
+    std::mutex lock;
+    std::vector<std::wstring> order;
+    int running;
+    int mostRunning;
+} t_schedulerTestState;
+
+/// <summary>
+/// Stand-in for a backup. The first run triggers more jobs while it is still running, and the third
+/// run stops the scheduler.
+/// </summary>
+static HRESULT SchedulerTestJob(const t_scheduledJob& job, std::string* timings, void* context)
+{
+    t_schedulerTestState* state = (t_schedulerTestState*)context;
+    size_t runs = 0;
+    {
+        std::lock_guard<std::mutex> guard(state->lock);
+        state->order.push_back(job.name);
+        runs = state->order.size();
+        state->running++;
+        state->mostRunning = std::max(state->mostRunning, state->running);
+    }
+
+    if (runs == 1) {
+        state->scheduler->Trigger(L"a");
+        state->scheduler->Trigger(L"a");
+        state->scheduler->Trigger(L"b");
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    if (runs == 3) {
+        state->scheduler->Stop();
+    }
+
+    std::lock_guard<std::mutex> guard(state->lock);
+    state->running--;
+    *timings = "stand-in";
+    return S_OK;
+}
+
+/// <summary>
+/// Cron schedules must match the minutes cron would run them, and the scheduler must run one job at a
+/// time, queueing triggers which arrive meanwhile without queueing a job twice.
+/// </summary>
+static unsigned int TestScheduler(void)
+{
+    t_cronSchedule schedule{};
+    unsigned int failures = 0;
+
+    // Wednesday 2026-10-14 09:30 and Sunday 2026-10-18 09:30
+    struct tm wednesday {};
+    wednesday.tm_min = 30;
+    wednesday.tm_hour = 9;
+    wednesday.tm_mday = 14;
+    wednesday.tm_mon = 9;
+    wednesday.tm_wday = 3;
+    struct tm sunday = wednesday;
+    sunday.tm_mday = 18;
+    sunday.tm_wday = 0;
+
+    BOOL parsed = CronParse("*/15 9-17 * * 1-5", &schedule);
+    failures += Check("Cron schedule parses", parsed);
+    failures += Check("Cron schedule matches a weekday", parsed && CronMatches(schedule, wednesday) && !CronMatches(schedule, sunday));
+    wednesday.tm_min = 31;
+    failures += Check("Cron schedule steps through the minutes", parsed && !CronMatches(schedule, wednesday));
+    wednesday.tm_min = 30;
+    parsed = CronParse("30 9 18 * 3", &schedule);
+    failures += Check("Cron schedule runs on either day field", parsed && CronMatches(schedule, wednesday) && CronMatches(schedule, sunday));
+    parsed = CronParse("30 9 * * 7", &schedule);
+    failures += Check("Cron schedule takes 7 as Sunday", parsed && CronMatches(schedule, sunday) && !CronMatches(schedule, wednesday));
+    failures += Check("Cron schedule takes @daily", CronParse("@daily", &schedule) && schedule.minutes == 1 && schedule.hours == 1);
+    failures += Check("Cron schedule rejects a bad field", !CronParse("60 * * * *", &schedule) && !CronParse("0 * * *", &schedule) && !CronParse("0 5-1 * * *", &schedule));
+
+    t_schedulerTestState state{};
+    JobScheduler scheduler(&SchedulerTestJob, &state);
+    state.scheduler = &scheduler;
+    scheduler.AddJob(L"a", L"", "@yearly");
+    scheduler.AddJob(L"b", L"", "@yearly");
+    failures += Check("Scheduler refuses a second job of the same name", !scheduler.AddJob(L"a", L"", "@daily"));
+    scheduler.Trigger(L"a");
+    scheduler.Run();
+    failures += Check("Scheduler runs one job at a time", state.mostRunning == 1);
+    failures += Check("Scheduler queues triggers in order, once each", state.order == std::vector<std::wstring>{ L"a", L"a", L"b" });
+    failures += Check("Scheduler reports each job's runs", scheduler.Status().find("a: idle, 2 runs, 0 failed") != std::string::npos);
+    return failures;
+}
+
+/// <summary>
+/// The INI parser must read settings as GetPrivateProfileString would.
+/// </summary>
+static unsigned int TestIniFile(void)
+{
+    IniFile ini;
+    unsigned int failures = 0;
+
+    ini.Parse(L"; a comment\r\n[Options]\r\nThreads = 8\r\nReadLimit=12.5\r\n\r\n"
+        L"[FileSet.Documents]\nSource = \"C:\\Users\\Public\\Documents\"\nDestination=H:\\Documents\n# another comment\nsource = C:\\Ignored\n"
+        L"[fileset.projects]\nSource=D:\\Projects\nDestination=H:\\Projects\ndestination = I:\\Projects\n[FILESET.DOCUMENTS]\nDestination=H:\\Ignored\nIncremental=1\n");
+
+    std::vector<std::wstring> sections = ini.Sections();
+    failures += Check("INI sections are read in order, once each", sections == std::vector<std::wstring>{ L"Options", L"FileSet.Documents", L"fileset.projects" });
+    failures += Check("INI names are not case sensitive", ini.GetString(L"FILESET.PROJECTS", L"SOURCE", L"") == L"D:\\Projects");
+    failures += Check("INI values lose their quotes", ini.GetString(L"FileSet.Documents", L"Source", L"") == L"C:\\Users\\Public\\Documents");
+    failures += Check("INI keeps the first of a repeated key", ini.GetString(L"FileSet.Documents", L"Destination", L"") == L"H:\\Documents");
+    failures += Check("INI gives every value of a repeated key", ini.GetStrings(L"FileSet.Projects", L"Destination") == std::vector<std::wstring>{ L"H:\\Projects", L"I:\\Projects" });
+    failures += Check("INI repeated sections carry on the first", ini.GetInt(L"FileSet.Documents", L"Incremental", 0) == 1);
+    failures += Check("INI numbers are read", ini.GetInt(L"Options", L"Threads", 0) == 8 && ini.GetDouble(L"Options", L"ReadLimit", 0) == 12.5);
+    failures += Check("INI missing keys take the default", ini.GetInt(L"Options", L"QueueDepth", 4) == 4 && !ini.HasKey(L"Nothing", L"Threads"));
+    return failures;
+}
+
+/// <summary>
+/// Check that the path table stores each volume once, slices the volume off each path, and keeps
+/// paths longer than MAX_PATH or than an arena block intact and in place.
+/// </summary>
+/// <param name=""></param>
+/// <returns>The number of checks which failed</returns>
+static unsigned int TestPathTable(void)
+{
+    PathTable table;
+    unsigned int failures = 0;
+    std::wstring longPath = L"D:\\" + std::wstring(PATH_TABLE_BLOCK_CHARS + 100, L'x');
+
+    table.Add(L"C:\\", L"C:\\Data\\one.mdb");
+    table.Add(L"D:\\", L"D:\\two.txt");
+    LPCWSTR firstTail = table.Tail(0);
+    for (unsigned int i = 0; i < 1000; i++) {
+        table.Add(L"C:\\", L"C:\\Data\\" + std::wstring(300, L'a') + std::to_wstring(i));
+    }
+    table.Add(L"D:\\", longPath);
+
+    failures += Check("Path table keeps every path in order", table.Count() == 1003 && table.FullPath(0) == L"C:\\Data\\one.mdb" && table.FullPath(1001) == L"C:\\Data\\" + std::wstring(300, L'a') + L"999");
+    failures += Check("Path table stores each volume once", table.VolumeCount() == 2 && table.VolumeOf(1) == 1 && table.VolumeOf(1000) == 0 && table.Volume(1) == L"D:\\");
+    failures += Check("Path table slices off the volume", wcscmp(table.Tail(1), L"two.txt") == 0);
+    failures += Check("Path table tails do not move as it grows", table.Tail(0) == firstTail && wcscmp(firstTail, L"Data\\one.mdb") == 0);
+    failures += Check("Path table holds a path longer than a block", table.FullPath(1002) == longPath);
+    table.Clear();
+    failures += Check("Path table empties", table.Count() == 0 && table.VolumeCount() == 0 && table.MemoryUsed() == 0);
+    return failures;
+}
+
+/// <summary>
+/// Include and Exclude patterns -- the known cases of each kind of pattern, and the compiled automaton
+/// agreeing with matching each pattern in turn over many random patterns and paths.
+/// </summary>
+/// <param name=""></param>
+/// <returns>The number of checks which failed</returns>
+static unsigned int TestPathFilter(void)
+{
+    PathFilter filter;
+    unsigned int failures = 0;
+
+    filter.Compile({ L"*.docx", L"Reports\\**\\*.pdf" }, { L"~$*", L"node_modules\\", L"/Temp", L"Cache/**/*.tmp" });
+    failures += Check("Filter bare names match at any depth", filter.IncludeFile(L"a.docx", 1, 1) && filter.IncludeFile(L"x\\y\\B.DOCX", 1, 1) && !filter.IncludeFile(L"a.doc", 1, 1));
+    failures += Check("Filter ** matches any number of directories", filter.IncludeFile(L"Reports\\q.pdf", 1, 1) && filter.IncludeFile(L"reports/2023/q1/q.pdf", 1, 1) && !filter.IncludeFile(L"Old\\Reports\\q.pdf", 1, 1));
+    failures += Check("Filter exclude wins over include", !filter.IncludeFile(L"x\\~$a.docx", 1, 1));
+    failures += Check("Filter prunes an excluded directory", !filter.IncludeDirectory(L"web\\node_modules") && filter.IncludeDirectory(L"web\\node_modules2") && !filter.IncludeFile(L"web\\node_modules\\a.docx", 1, 1));
+    failures += Check("Filter directory patterns skip files", filter.IncludeFile(L"node_modules.docx", 1, 1) && (filter.Match(L"node_modules", FALSE) & FILTER_MATCH_EXCLUDE) == 0);
+    failures += Check("Filter anchored patterns match from the top", !filter.IncludeDirectory(L"Temp") && filter.IncludeDirectory(L"x\\Temp"));
+    failures += Check("Filter includes never prune a directory", filter.IncludeDirectory(L"Music") && filter.IncludeDirectory(L"Cache\\a"));
+    PathFilter single;
+    single.Compile({}, { L"/a*b" });
+    failures += Check("Filter * stays within one name", single.Match(L"axyb", FALSE) == FILTER_MATCH_EXCLUDE && single.Match(L"ab\\c", FALSE) == FILTER_MATCH_EXCLUDE && single.Match(L"a\\b", FALSE) == 0);
+
+    t_filterLimits limits{ 100, 1000, 5000, 9000 };
+    filter.SetLimits(limits);
+    failures += Check("Filter size and age limits", filter.IncludeFile(L"a.docx", 100, 5000) && filter.IncludeFile(L"a.docx", 1000, 9000) && !filter.IncludeFile(L"a.docx", 99, 6000)
+        && !filter.IncludeFile(L"a.docx", 1001, 6000) && !filter.IncludeFile(L"a.docx", 500, 4999) && !filter.IncludeFile(L"a.docx", 500, 9001));
+
+    unsigned long long size = 0;
+    failures += Check("Filter sizes parse with suffixes", FilterParseSize(L"4096", &size) && size == 4096 && FilterParseSize(L"64K", &size) && size == 65536
+        && FilterParseSize(L"2GiB", &size) && size == 2ULL << 30 && !FilterParseSize(L"12Q", &size) && !FilterParseSize(L"M", &size));
+
+    // random patterns over a small alphabet, so that they overlap and match often
+    unsigned int seed = 12345;
+    auto next = [&seed](unsigned int range) { seed = seed * 1103515245 + 12345; return (seed >> 16) % range; };
+    const wchar_t* patternParts[] = { L"a", L"b", L"A", L".", L"?", L"*", L"\\", L"**\\", L"**" };
+    const wchar_t* pathParts[] = { L"a", L"b", L"B", L".", L"\\", L"/" };
+    BOOL agree = TRUE;
+    for (unsigned int round = 0; round < 200 && agree; round++) {
+        std::vector<std::wstring> lists[2];
+        for (std::vector<std::wstring>& list : lists) {
+            for (unsigned int count = next(4); count > 0; count--) {
+                std::wstring pattern;
+                for (unsigned int length = 1 + next(6); length > 0; length--) {
+                    pattern += patternParts[next(9)];
+                }
+                list.push_back(pattern);
+            }
+        }
+        agree = filter.Compile(lists[0], lists[1]) == ERROR_SUCCESS;
+        for (unsigned int path = 0; path < 200 && agree; path++) {
+            std::wstring relativePath = L"a";
+            for (unsigned int length = next(10); length > 0; length--) {
+                relativePath += pathParts[next(6)];
+            }
+            agree = filter.Match(relativePath, FALSE) == filter.MatchEachPattern(relativePath, FALSE) && filter.Match(relativePath, TRUE) == filter.MatchEachPattern(relativePath, TRUE);
+        }
+    }
+    failures += Check("Filter automaton agrees with each pattern", agree);
+    return failures;
+}
+
+/// <summary>
+/// Manifest carry-over routine for TestChangeSet -- keep the files the change set does not cover.
+/// </summary>
+static BOOL KeepUncoveredRoutine(const std::wstring& relativePath, void* context)
+{
+    return !((const ChangeSet*)context)->Covers(relativePath);
+}
+
+/// <summary>
+/// Change sets -- which directories are listed again and which trees walked again for a set of changes,
+/// and which files of the last run are carried over without being looked at.
+/// </summary>
+/// <param name=""></param>
+/// <returns>The number of checks which failed</returns>
+static unsigned int TestChangeSet(void)
+{
+    // the paths are written with / and given the platform's separator
+    auto native = [](std::wstring path) { std::replace(path.begin(), path.end(), L'/', PATH_SEPARATOR); return path; };
+    unsigned int failures = 0;
+
+    ChangeSet changes(native(L"C:/Data"));
+    changes.Add(native(L"C:/Data/Docs/a.txt"), 0);
+    changes.Add(native(L"C:/Data/Docs/b.txt"), CHANGE_ARRIVED);
+    changes.Add(native(L"C:/Data/top.txt"), CHANGE_DEPARTED);
+    changes.Add(native(L"C:/Data/Old"), CHANGE_DIRECTORY | CHANGE_DEPARTED);
+    changes.Add(native(L"C:/Data/Old/x/y.txt"), 0);
+    changes.Add(native(L"C:/Data/New"), CHANGE_DIRECTORY | CHANGE_ARRIVED);
+    changes.Add(native(L"C:/Data/New/Inner"), CHANGE_DIRECTORY | CHANGE_ARRIVED);
+    changes.Add(native(L"C:/Data/Docs"), CHANGE_DIRECTORY);
+    BOOL outside = !changes.Add(native(L"C:/Database/z.txt"), 0) && !changes.Add(native(L"D:/Data/z.txt"), 0);
+    changes.Finish();
+
+    failures += Check("Change set ignores paths outside the source", outside && changes.ChangeCount() == 8 && !changes.Everything());
+    failures += Check("Change set lists the directories of changed files", changes.Directories() == std::vector<std::wstring>{ L"", L"Docs" });
+    failures += Check("Change set walks directories which came or went", changes.Trees() == std::vector<std::wstring>{ L"New", L"Old" });
+    failures += Check("Change set covers files in listed and walked directories", changes.Covers(L"top2.txt") && changes.Covers(native(L"Docs/c.txt")) && changes.Covers(native(L"Old/x/y/z.txt")));
+    failures += Check("Change set leaves other files to carry over", !changes.Covers(native(L"Docs/Sub/d.txt")) && !changes.Covers(native(L"Other/e.txt")) && !changes.Covers(native(L"Other/f.txt")));
+
+    Manifest previous;
+    Manifest current;
+    t_manifestEntry entry{ 1, 2, 3, FALSE, 0 };
+    for (const wchar_t* path : { L"top.txt", L"Docs/c.txt", L"Docs/Sub/d.txt", L"Old/x/y.txt", L"Other/e.txt" }) {
+        previous.Record(native(path), entry);
+    }
+    size_t carried = current.CarryOver(previous, &KeepUncoveredRoutine, &changes);
+    failures += Check("Manifest carries over the files not covered", carried == 2 && current.Lookup(native(L"Docs/Sub/d.txt"), &entry) && !current.Lookup(native(L"Docs/c.txt"), &entry));
+
+    ChangeSet volume(L"");
+    ChangeSet whole(native(L"C:/Data"));
+    volume.Add(native(L"a/b.txt"), 0);
+    whole.Add(native(L"C:/Data/"), CHANGE_DIRECTORY | CHANGE_ARRIVED);
+    volume.Finish();
+    whole.Finish();
+    failures += Check("Change set of a volume root or a moved source", volume.Directories() == std::vector<std::wstring>{ L"a" } && !volume.Everything() && whole.Everything());
+    return failures;
+}
+
+/// <summary>
+/// Block comparison for --verify -- identical blocks match, and a block which differs reports exactly
+/// the first and last bytes which differ, wherever they fall against the 8 byte steps of the scan.
+/// </summary>
+/// <param name=""></param>
+/// <returns>The number of checks which failed</returns>
+static unsigned int TestVerifyCompare(void)
+{
+    std::vector<unsigned char> source(4096);
+    std::vector<unsigned char> destination;
+    unsigned int failures = 0;
+    size_t first = 0;
+    size_t last = 0;
+
+    FillPattern(source, 19);
+    destination = source;
+    failures += Check("Verify compare matches identical blocks", VerifyCompareBlock(source.data(), destination.data(), source.size(), &first, &last));
+
+    BOOL exact = TRUE;
+    for (size_t length = 1; length < 40 && exact; length++) {
+        for (size_t low = 0; low < length; low++) {
+            for (size_t high = low; high < length; high++) {
+                destination = source;
+                destination[low] ^= 0x01;
+                destination[high] ^= 0x10;
+                exact = exact && !VerifyCompareBlock(source.data(), destination.data(), length, &first, &last) && first == low && last == high;
+            }
+        }
+    }
+    failures += Check("Verify compare finds the first and last differing bytes", exact);
+
+    destination = source;
+    destination[1000] ^= 0xFF;
+    destination[3000] ^= 0xFF;
+    failures += Check("Verify compare spans a whole block", !VerifyCompareBlock(source.data(), destination.data(), source.size(), &first, &last) && first == 1000 && last == 3000);
+    return failures;
+}
+
+/// <summary>
+/// Write a whole file, replacing anything already there.
+/// </summary>
+/// <param name="path">The file</param>
+/// <param name="data">What it is to hold</param>
+/// <returns>0 on success, or the platform error code upon failure</returns>
+static DWORD WriteTestFile(const std::wstring& path, const std::vector<unsigned char>& data)
+{
+    t_fileHandle handle = INVALID_FILE_HANDLE;
+    DWORD error = PlatformOpenForWrite(path, FALSE, TRUE, &handle);
+    if (!error && !data.empty()) {
+        error = PlatformWriteAt(handle, 0, data.data(), (DWORD)data.size());
+    }
+    PlatformCloseFile(handle);
+    return error;
+}
+
+/// <summary>
+/// Read a whole file.
+/// </summary>
+/// <param name="path">The file</param>
+/// <param name="data">Receives what it holds, or nothing if it could not be read</param>
+/// <param name="information">Optional. Receives its size and times.</param>
+static void ReadTestFile(const std::wstring& path, std::vector<unsigned char>* data, t_fileInformation* information)
+{
+    t_fileHandle handle = INVALID_FILE_HANDLE;
+    t_fileInformation fileInformation{};
+    DWORD bytesRead = 0;
+
+    data->clear();
+    if (PlatformOpenForRead(path, FALSE, &handle) == ERROR_SUCCESS && PlatformGetFileInformation(handle, &fileInformation) == ERROR_SUCCESS) {
+        data->resize((size_t)fileInformation.size);
+        if (data->empty() || PlatformReadAt(handle, 0, data->data(), (DWORD)data->size(), &bytesRead) != ERROR_SUCCESS || bytesRead != data->size()) {
+            data->clear();
+        }
+    }
+    PlatformCloseFile(handle);
+    if (information != nullptr) {
+        *information = fileInformation;
+    }
+}
+
+// One record of a journal as TestJournal writes it -- the layout is that of Journal.cpp
+typedef struct testJournalRecord {
+    unsigned long long offset;
+    unsigned long long length;
+    unsigned long long hash;
+} t_testJournalRecord;
+
+/// <summary>
+/// Write the journal an interrupted copy would have left: the header, the records, and then the first few
+/// bytes of one more record, as though the copy stopped while appending it.
+/// </summary>
+/// <param name="path">The journal</param>
+/// <param name="sourceSize">The size of the source the journal is for</param>
+/// <param name="sourceLastWriteTime">The time the source was last written</param>
+/// <param name="records">The blocks to record</param>
+/// <returns>0 on success, or the platform error code upon failure</returns>
+static DWORD WriteTestJournal(const std::wstring& path, unsigned long long sourceSize, unsigned long long sourceLastWriteTime, const std::vector<t_testJournalRecord>& records)
+{
+    unsigned long long header[3] = { 0, sourceSize, sourceLastWriteTime };
+    std::vector<unsigned char> journal(sizeof(header) + (records.size() + 1) * sizeof(t_testJournalRecord) - 5, 0xCC);
+
+    memcpy(header, "SDJRNL01", 8);
+    memcpy(journal.data(), header, sizeof(header));
+    if (!records.empty()) {
+        memcpy(journal.data() + sizeof(header), records.data(), records.size() * sizeof(t_testJournalRecord));
+    }
+    return WriteTestFile(path, journal);
+}
+
+/// <summary>
+/// Journalled copies which resume -- a copy interrupted part of the way through carries on after the
+/// blocks its journal vouches for, checking them against the destination, and against the source too
+/// when the source has changed, and gives the checksum of the whole file.
+/// </summary>
+/// <param name=""></param>
+/// <returns>The number of checks which failed</returns>
+static unsigned int TestJournal(void)
+{
+    const DWORD blockSize = 64 * 1024;
+    std::wstring sourcePath = PlatformJoinPath(PlatformTempDirectory(), L"sdselftest-journal-source");
+    std::wstring destinationPath = PlatformJoinPath(PlatformTempDirectory(), L"sdselftest-journal-destination");
+    std::wstring journalPath = destinationPath + JOURNAL_EXTENSION;
+    BufferPool bufferPool(blockSize, 4 * blockSize);
+    t_blockCopyOptions options{};
+    t_journalStatistics statistics{};
+    t_fileInformation sourceInformation{};
+    std::vector<unsigned char> source(4 * blockSize + 1000);
+    std::vector<unsigned char> destination;
+    std::vector<unsigned char> copied;
+    unsigned int failures = 0;
+    DWORD checksum = 0;
+
+    options.queueDepth = 2;
+    options.unbuffered = FALSE;
+    options.sparse = FALSE;
+
+    // the first goodBlocks blocks reached the destination before the copy stopped, the rest of it is whatever was there before
+    auto interrupted = [&](size_t goodBlocks) {
+        destination.assign(source.begin(), source.begin() + goodBlocks * blockSize);
+        destination.resize(source.size() / 2, 0xEE);
+        return WriteTestFile(destinationPath, destination);
+    };
+    auto record = [&](size_t block) {
+        return t_testJournalRecord{ block * blockSize, blockSize, DeltaHashBlock(&destination[block * blockSize], blockSize) };
+    };
+
+    FillPattern(source, 23);
+    BOOL prepared = WriteTestFile(sourcePath, source) == ERROR_SUCCESS;
+    ReadTestFile(sourcePath, &copied, &sourceInformation);
+    prepared = prepared && copied == source && interrupted(2) == ERROR_SUCCESS &&
+        WriteTestJournal(journalPath, sourceInformation.size, sourceInformation.lastWriteTime, { record(0), record(1) }) == ERROR_SUCCESS;
+    failures += Check("Journal test files can be written", prepared);
+
+    DWORD error = JournalCopyFile(sourcePath, destinationPath, options, bufferPool, &statistics, &checksum, nullptr, nullptr);
+    ReadTestFile(destinationPath, &copied, nullptr);
+    failures += Check("Journal resumes after the records, dropping a torn one", !error && statistics.resumedBytes == 2 * blockSize && statistics.verifiedRanges == 2 && copied == source);
+    failures += Check("Journal carries the checksum of the resumed blocks on", checksum == ChecksumUpdate(0, source.data(), source.size()));
+    failures += Check("Journal is removed once the copy is complete", !PlatformPathExists(journalPath));
+
+    // a gap in the records, or a record which does not end on a sector boundary, is as far as the copy can trust
+    interrupted(3);
+    WriteTestJournal(journalPath, sourceInformation.size, sourceInformation.lastWriteTime, { record(0), record(2) });
+    error = JournalCopyFile(sourcePath, destinationPath, options, bufferPool, &statistics, &checksum, nullptr, nullptr);
+    ReadTestFile(destinationPath, &copied, nullptr);
+    failures += Check("Journal stops at a gap in the records", !error && statistics.resumedBytes == blockSize && statistics.verifiedRanges == 1 && copied == source);
+
+    interrupted(1);
+    WriteTestJournal(journalPath, sourceInformation.size, sourceInformation.lastWriteTime, { t_testJournalRecord{ 0, 1000, DeltaHashBlock(destination.data(), 1000) } });
+    error = JournalCopyFile(sourcePath, destinationPath, options, bufferPool, &statistics, &checksum, nullptr, nullptr);
+    ReadTestFile(destinationPath, &copied, nullptr);
+    failures += Check("Journal ignores a record off a sector boundary", !error && statistics.resumedBytes == 0 && copied == source);
+
+    interrupted(2);
+    destination[blockSize + 7] ^= 0xFF;
+    WriteTestFile(destinationPath, destination);
+    destination[blockSize + 7] ^= 0xFF;
+    WriteTestJournal(journalPath, sourceInformation.size, sourceInformation.lastWriteTime, { record(0), record(1) });
+    error = JournalCopyFile(sourcePath, destinationPath, options, bufferPool, &statistics, &checksum, nullptr, nullptr);
+    ReadTestFile(destinationPath, &copied, nullptr);
+    failures += Check("Journal drops a block the destination no longer holds", !error && statistics.resumedBytes == blockSize && copied == source);
+
+    // a new snapshot of the source in which the second block has changed -- only the first is still good
+    interrupted(3);
+    WriteTestJournal(journalPath, sourceInformation.size, sourceInformation.lastWriteTime - 1, { record(0), record(1), record(2) });
+    source[blockSize + 100] ^= 0xFF;
+    WriteTestFile(sourcePath, source);
+    error = JournalCopyFile(sourcePath, destinationPath, options, bufferPool, &statistics, &checksum, nullptr, nullptr);
+    ReadTestFile(destinationPath, &copied, nullptr);
+    failures += Check("Journal hashes a changed source again", !error && statistics.resumedBytes == blockSize && statistics.verifiedRanges == 1 && copied == source);
+    failures += Check("Journal checksum covers the changed source", checksum == ChecksumUpdate(0, source.data(), source.size()));
+
+    PlatformDeletePath(sourcePath, FALSE);
+    PlatformDeletePath(destinationPath, FALSE);
+    PlatformDeletePath(journalPath, FALSE);
+    return failures;
+}
+
+/// <summary>
+/// Manifest indexes -- every file is found by its exact path and nothing else is, a prefix finds the run
+/// of files below a directory, and an index which is cut short or damaged is refused when it is opened.
+/// </summary>
+/// <param name=""></param>
+/// <returns>The number of checks which failed</returns>
+static unsigned int TestManifestIndex(void)
+{
+    // the paths are written with / and given the platform's separator, as the index holds them
+    auto native = [](std::wstring path) { std::replace(path.begin(), path.end(), L'/', PATH_SEPARATOR); return path; };
+    std::wstring indexPath = PlatformJoinPath(PlatformTempDirectory(), L"sdselftest.sdindex");
+    std::wstring damagedPath = indexPath + L".damaged";
+    std::vector<std::wstring> paths{ L"top.txt", L"Docs/a.txt", L"Docs/b.txt", L"Docs/r\u00E9sum\u00E9.txt", L"Docs/Sub/c.txt", L"Docsx/d.txt" };
+    Manifest manifest;
+    ManifestIndex index;
+    unsigned int failures = 0;
+
+    for (unsigned int i = 0; i < 500; i++) {
+        paths.push_back(L"Tree/" + std::to_wstring(i % 7) + L"/file" + std::to_wstring(i) + L".dat");
+    }
+    for (size_t i = 0; i < paths.size(); i++) {
+        paths[i] = native(paths[i]);
+        manifest.Record(paths[i], t_manifestEntry{ i * 1000, 132000000000000000ULL + i, 0x20, (i % 2) ? TRUE : FALSE, (DWORD)i * 7 });
+    }
+
+    BOOL opened = WriteManifestIndex(indexPath, manifest, 0) == ERROR_SUCCESS && index.Open(indexPath) == ERROR_SUCCESS;
+    failures += Check("Index is written and opened", opened && index.Count() == paths.size());
+
+    BOOL found = opened;
+    for (size_t i = 0; i < paths.size() && found; i++) {
+        unsigned long long position = 0;
+        std::string relativePath;
+        t_manifestEntry entry{};
+        found = index.Lookup(PlatformToUtf8(paths[i]), &position) && index.Entry(position, &relativePath, &entry) && relativePath == PlatformToUtf8(paths[i])
+            && entry.size == i * 1000 && entry.lastWriteTime == 132000000000000000ULL + i && entry.attributes == 0x20
+            && entry.hasChecksum == ((i % 2) ? TRUE : FALSE) && entry.checksum == ((i % 2) ? (DWORD)i * 7 : 0);
+    }
+    failures += Check("Index lookup finds every file with its metadata", found);
+
+    unsigned long long position = 0;
+    BOOL missed = TRUE;
+    for (const wchar_t* path : { L"", L"Docs", L"Docs/", L"Docs/a.tx", L"Docs/a.txt2", L"Docs/Sub", L"Tree/1/file7.dat", L"nothing.txt" }) {
+        missed = missed && !index.Lookup(PlatformToUtf8(native(path)), &position);
+    }
+    failures += Check("Index lookup misses directories and near misses", missed);
+
+    // the files below Docs are together, and Docsx is not among them
+    std::string docs = PlatformToUtf8(native(L"Docs/"));
+    unsigned long long first = index.LowerBound(docs);
+    unsigned long long last = first;
+    std::string relativePath;
+    t_manifestEntry entry{};
+    while (index.Entry(last, &relativePath, &entry) && relativePath.compare(0, docs.size(), docs) == 0) {
+        last++;
+    }
+    BOOL exact = index.Lookup(PlatformToUtf8(paths[4]), &position) && index.LowerBound(PlatformToUtf8(paths[4])) == position;
+    failures += Check("Index lower bound finds the files below a prefix", last - first == 4 && exact);
+    failures += Check("Index lower bound of the ends", index.LowerBound("") == 0 && index.LowerBound("~") == index.Count());
+    index.Close();
+
+    std::vector<unsigned char> intact;
+    std::vector<unsigned char> damaged;
+    ReadTestFile(indexPath, &intact, nullptr);
+    const t_indexHeader* header = (const t_indexHeader*)intact.data();
+    BOOL refused = intact.size() > sizeof(t_indexHeader);
+    if (refused) {
+        damaged.assign(intact.begin(), intact.begin() + sizeof(t_indexHeader) / 2);
+        refused = refused && WriteTestFile(damagedPath, damaged) == ERROR_SUCCESS && index.Open(damagedPath) == ERROR_INVALID_DATA;
+        damaged.assign(intact.begin(), intact.begin() + (size_t)header->stringsOffset + 1);
+        refused = refused && WriteTestFile(damagedPath, damaged) == ERROR_SUCCESS && index.Open(damagedPath) == ERROR_INVALID_DATA;
+        damaged = intact;
+        damaged[offsetof(t_indexHeader, magic)] ^= 0xFF;
+        refused = refused && WriteTestFile(damagedPath, damaged) == ERROR_SUCCESS && index.Open(damagedPath) == ERROR_INVALID_DATA;
+        damaged = intact;
+        damaged[offsetof(t_indexHeader, bucketCount)] ^= 0x01;
+        refused = refused && WriteTestFile(damagedPath, damaged) == ERROR_SUCCESS && index.Open(damagedPath) == ERROR_INVALID_DATA;
+        damaged = intact;
+        damaged[offsetof(t_indexHeader, entryCount) + 2] ^= 0x01;
+        refused = refused && WriteTestFile(damagedPath, damaged) == ERROR_SUCCESS && index.Open(damagedPath) == ERROR_INVALID_DATA;
+        refused = refused && WriteTestFile(damagedPath, intact) == ERROR_SUCCESS && index.Open(damagedPath) == ERROR_SUCCESS;
+    }
+    failures += Check("Index with a cut short or damaged header is refused", refused);
+    index.Close();
+
+    PlatformDeletePath(indexPath, FALSE);
+    PlatformDeletePath(damagedPath, FALSE);
+    return failures;
+}
+
+/// <summary>
+/// Run every known answer test, printing each result.
+/// </summary>
+/// <param name=""></param>
+/// <returns>The number of checks which failed</returns>
+unsigned int RunSelfTests(void)
+{
+    unsigned int failures = 0;
+
+    failures += TestChecksums();
+    failures += TestHashes();
+    failures += TestCompression();
+    failures += TestZeroDetection();
+    failures += TestAsyncWait();
+    failures += TestThrottle();
+    failures += TestScheduler();
+    failures += TestIniFile();
+    failures += TestPathTable();
+    failures += TestPathFilter();
+    failures += TestChangeSet();
+    failures += TestVerifyCompare();
+    failures += TestJournal();
+    failures += TestManifestIndex();
+
+    printf("%u check%s failed.\n", failures, failures == 1 ? "" : "s");
+    return failures;
+}
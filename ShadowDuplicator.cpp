@@ -12,6 +12,8 @@ is no warranty.
 
 
 #include <iostream>
+#include <algorithm>
+#include <ctime>
 #include <windows.h>
 #include <winerror.h>
 #include <vss.h>
@@ -25,12 +27,6 @@ is no warranty.
 
 #define SDVERSION L"v0.7"
 
-// A linked list of source drives or source paths
-typedef struct sourceList {
-    LPWSTR source;
-    struct sourceList *next;
-} t_sourceList;
-
 /// <summary>
 /// The backup components VSS object.
 /// </summary>
@@ -47,9 +43,14 @@ IVssAsync* vssAsync = nullptr;
 VSS_ID* snapshotSetId = nullptr;
 
 /// <summary>
-/// The GUID of a snapshot within the set.
+/// Head of the volumes in the snapshot set, one for each distinct volume holding a source.
+/// </summary>
+t_snapshotVolume* snapshotVolumes = nullptr;
+
+/// <summary>
+/// The number of volumes in the snapshot set.
 /// </summary>
-VSS_ID* snapshotId = nullptr;
+unsigned int snapshotVolumeCount = 0;
 
 
 /// <summary>
@@ -76,6 +77,18 @@ BOOL comInitialized = FALSE;
 /// </summary>
 BOOL shouldAbortBackupOnBail = FALSE;
 
+/// <summary>
+/// Whether we are running as a resident service, with each backup a job run by the scheduler. bail then
+/// unwinds to the scheduler instead of exiting, if it is called on the thread which runs the jobs.
+/// </summary>
+BOOL serviceMode = FALSE;
+std::thread::id serviceThreadId;
+
+/// <summary>
+/// The copy workers, while they are running, so that bail can stop them before freeing what they use.
+/// </summary>
+CopyWorkerPool* activeCopyPool = nullptr;
+
 /// <summary>
 /// Keep global state for a visible spinner to show progress.
 /// </summary>
@@ -87,60 +100,271 @@ int progressMarker = 0;
 BOOL quiet = FALSE;
 
 /// <summary>
-/// Head of source drive specifications (C:\, D:\) for each source file. Linked list structure.
+/// Number of worker threads which copy files concurrently.
+/// </summary>
+unsigned int copyThreads = DEFAULT_COPY_THREADS;
+
+/// <summary>
+/// Whether the thread count was given on the command line, in which case it overrides the INI file.
+/// </summary>
+BOOL copyThreadsFromCommandLine = FALSE;
+
+/// <summary>
+/// Size of each copy block in KiB.
+/// </summary>
+unsigned int blockSizeKiB = DEFAULT_BLOCK_SIZE_KIB;
+
+/// <summary>
+/// How many block reads each copy keeps in flight.
+/// </summary>
+unsigned int queueDepth = DEFAULT_QUEUE_DEPTH;
+
+/// <summary>
+/// The cap on memory for copy buffers across all copy workers, in MiB.
+/// </summary>
+unsigned int bufferMemoryMiB = DEFAULT_BUFFER_MEMORY_MIB;
+
+/// <summary>
+/// Whether each copy engine setting was given on the command line, in which case it overrides the INI file.
+/// </summary>
+BOOL blockSizeFromCommandLine = FALSE;
+BOOL queueDepthFromCommandLine = FALSE;
+BOOL bufferMemoryFromCommandLine = FALSE;
+BOOL fanOutBufferFromCommandLine = FALSE;
+
+/// <summary>
+/// Whether copies bypass the system cache.
+/// </summary>
+BOOL unbufferedCopies = TRUE;
+BOOL sparseCopies = TRUE;
+
+/// <summary>
+/// The aligned block buffers shared by all copy workers.
+/// </summary>
+BufferPool* bufferPool = nullptr;
+
+/// <summary>
+/// Files of at least this many MiB are delta copied, rewriting only the blocks changed since the last run. 0 turns delta copying off.
+/// </summary>
+unsigned int deltaThresholdMiB = 0;
+
+/// <summary>
+/// Whether the delta threshold was given on the command line, in which case it overrides the INI file.
+/// </summary>
+BOOL deltaThresholdFromCommandLine = FALSE;
+
+/// <summary>
+/// Files delta copied, and the bytes they held and actually wrote, for the summary at the end of the run.
+/// </summary>
+std::atomic<unsigned long long> deltaFiles(0);
+std::atomic<unsigned long long> deltaBytes(0);
+std::atomic<unsigned long long> deltaBytesWritten(0);
+
+/// <summary>
+/// Files of at least this many MiB are copied with a progress journal, so that an interrupted copy can resume. 0 turns journalling off.
+/// </summary>
+unsigned int journalThresholdMiB = DEFAULT_JOURNAL_THRESHOLD_MIB;
+
+/// <summary>
+/// Whether the journal threshold was given on the command line, in which case it overrides the INI file.
+/// </summary>
+BOOL journalThresholdFromCommandLine = FALSE;
+
+/// <summary>
+/// Journalled copies which carried on from an earlier, interrupted copy, and the bytes they did not need to copy again.
+/// </summary>
+std::atomic<unsigned long long> resumedFiles(0);
+std::atomic<unsigned long long> resumedBytes(0);
+
+/// <summary>
+/// MiB of blocks which may wait to be written to the destinations of every file set with mirrors, before the reader waits for them to catch up.
+/// </summary>
+unsigned int fanOutBufferMiB = DEFAULT_FANOUT_BUFFER_MIB;
+
+/// <summary>
+/// Whether the destination is a deduplicating chunk store, with a recipe written in place of each file.
+/// </summary>
+BOOL chunkStoreMode = FALSE;
+
+/// <summary>
+/// Chunks and bytes in the files chunked, and how many of them were new to the store, for the summary at the end of the run.
+/// </summary>
+std::atomic<unsigned long long> chunksSeen(0);
+std::atomic<unsigned long long> chunkBytesSeen(0);
+std::atomic<unsigned long long> chunksStored(0);
+std::atomic<unsigned long long> chunkBytesStored(0);
+
+/// <summary>
+/// Whether each file is written as a compressed copy, made of independently compressed frames.
+/// </summary>
+BOOL compressMode = FALSE;
+
+/// <summary>
+/// The threads which compress frames for all of the copy workers, in compress mode.
 /// </summary>
-t_sourceList* sourceDrives = nullptr;
+CompressionWorkers* compressionWorkers = nullptr;
 
 /// <summary>
-/// Head of source filenames in the linked list structure.
+/// Bytes before and after compression, and frames left uncompressed, for the summary at the end of the run.
 /// </summary>
-t_sourceList* sourceFilenames = nullptr;
+std::atomic<unsigned long long> compressedBytesIn(0);
+std::atomic<unsigned long long> compressedBytesOut(0);
+std::atomic<unsigned long long> compressedFrames(0);
+std::atomic<unsigned long long> compressedFramesStored(0);
 
 /// <summary>
-/// Pointer to the current drive we are dealing with.
+/// Whether files unchanged since the previous run, according to its manifest, are skipped.
 /// </summary>
-t_sourceList* currentSourceDrive = sourceDrives;
+BOOL incrementalMode = FALSE;
 
 /// <summary>
-/// Pointer to the current filename we are dealing with.
+/// Whether an incremental run reads what changed since the previous run from a change feed and walks
+/// only that, instead of the whole source. The feed is the USN journal of each source's volume, unless
+/// a change log is given to read in its place.
 /// </summary>
-t_sourceList* currentSourceFilename = sourceFilenames;
+BOOL changeFeedMode = FALSE;
+std::wstring changeLogPath;
 
 /// <summary>
-/// The previous pointer to the drive we were working with. This is so we can update the next pointer.
+/// Whether a CRC32C of each file is computed as it is copied and recorded in the manifest.
 /// </summary>
-t_sourceList* previousSourceDrive = sourceDrives;
+BOOL checksumMode = FALSE;
 
 /// <summary>
-/// The previous pointer to the filename we were working with.
+/// Whether a file which fails to copy is recorded and the run carries on with the rest, instead of the first failure ending the run.
 /// </summary>
-t_sourceList* previousSourceFilename = sourceFilenames;
+BOOL continueOnError = FALSE;
 
 /// <summary>
-/// Head of list of source filenames with the source drive specification sliced off.
+/// How many times a file which failed with a transient error is retried in continue-on-error mode.
 /// </summary>
-t_sourceList* sourceFilenamesWithoutDrives = nullptr;
+unsigned int copyRetries = DEFAULT_COPY_RETRIES;
 
 /// <summary>
-/// Current pointer of where we are in the source filenames with the source drive specification sliced off.
+/// Whether the number of retries was given on the command line, in which case it overrides the INI file.
 /// </summary>
-t_sourceList* currentSourceFilenameWithoutDrive = sourceFilenamesWithoutDrives;
+BOOL copyRetriesFromCommandLine = FALSE;
 
 /// <summary>
-/// The previous pointer to the source filenames with the source drive specification sliced off.
+/// In continue-on-error mode, the files which failed with a transient error and will be retried once the
+/// rest have been copied, and those which have failed for good, for the report at the end of the run.
 /// </summary>
-t_sourceList* previousSourceFilenameWithoutDrive = sourceFilenamesWithoutDrives;
+std::vector<t_copyFailure> copyRetryJobs;
+std::vector<t_copyFailure> copyFailures;
+std::mutex copyFailuresLock;
 
+/// <summary>
+/// Whether each file is read back and compared with its source once the copy is done, while the snapshot is still held.
+/// </summary>
+BOOL verifyMode = FALSE;
+
+/// <summary>
+/// How many blocks of each file the verify compares, spread across the file. 0 compares every block.
+/// </summary>
+unsigned int verifySampleBlocks = 0;
+
+/// <summary>
+/// Files verified and the bytes compared, and the files which did not match, for the report at the end of the run.
+/// </summary>
+std::atomic<unsigned long long> verifiedFiles(0);
+std::atomic<unsigned long long> verifiedBytes(0);
+std::vector<t_verifyFailure> verifyFailures;
+std::mutex verifyFailuresLock;
+
+/// <summary>
+/// The file sets copied by this run, each from its own source to its own destination, with the
+/// manifests and chunk store that belong to that destination. Copy jobs refer to their set by index.
+/// </summary>
+std::vector<t_fileSet> fileSets;
+
+/// <summary>
+/// How many earlier generations of the index are kept beside the latest.
+/// </summary>
+unsigned int indexGenerations = DEFAULT_INDEX_GENERATIONS;
+
+/// <summary>
+/// Whether the number of index generations was given on the command line, in which case it overrides the INI file.
+/// </summary>
+BOOL indexGenerationsFromCommandLine = FALSE;
+
+/// <summary>
+/// How long each VSS operation, and the copy itself, took.
+/// </summary>
+PhaseTimings phaseTimings;
+
+/// <summary>
+/// Where to write the metrics of the run as JSON and for the Prometheus textfile collector. Empty for none.
+/// </summary>
+std::wstring metricsJsonPath;
+std::wstring metricsPrometheusPath;
+
+/// <summary>
+/// The time and size of each file copied, if metrics are to be written.
+/// </summary>
+RunMetrics* runMetrics = nullptr;
+
+/// <summary>
+/// Limits on the copy's reads and writes outside any schedule window, the schedule, and a file whose
+/// limits override both while it exists. No limits, schedule or control file means no throttle.
+/// </summary>
+t_throttleLimits throttleLimits{};
+
+/// <summary>
+/// Whether each throttle limit was given on the command line, in which case it overrides the INI file, even with 0 for no limit.
+/// </summary>
+BOOL readLimitFromCommandLine = FALSE;
+BOOL writeLimitFromCommandLine = FALSE;
+BOOL readIopsFromCommandLine = FALSE;
+BOOL writeIopsFromCommandLine = FALSE;
+std::vector<t_throttleWindow> throttleSchedule;
+std::wstring throttleControlPath;
+
+/// <summary>
+/// Paces the reads and writes of every copy worker, if any limit applies, except for file sets with throttle settings of their own.
+/// </summary>
+IoThrottle* ioThrottle = nullptr;
+
+/// <summary>
+/// The totals of the run for the metrics, filled in as the run goes.
+/// </summary>
+t_runSummary runSummary{};
+std::chrono::steady_clock::time_point runStart;
+
+/// <summary>
+/// Files and bytes copied, and files and bytes skipped as unchanged, for the summary at the end of the run.
+/// </summary>
+std::atomic<unsigned long long> copiedBytes(0);
+std::atomic<unsigned long long> skippedFiles(0);
+std::atomic<unsigned long long> skippedBytes(0);
+
+/// <summary>
+/// Every source path of the run, with the volume of each. In whole folder mode there is one for each
+/// file set, at the same index as the set.
+/// </summary>
+PathTable sourcePaths;
+
+/// <summary>
+/// The directory of the last source path added and the volume it was found on, so that a long list of
+/// files in the same directories needs only one volume lookup for each directory.
+/// </summary>
+std::wstring lastSourceDirectory;
+std::wstring lastSourceVolume;
+
+/// <summary>
+/// A list of source files to read, one to a line, in selected files mode. "-" is standard input.
+/// </summary>
+std::wstring filesFromPath;
 
-#define SHORT_SLEEP 500
-#define LONG_SLEEP 1500
 
 // exit codes
 #define SDEXIT_NO_DEST_DIR_SPECIFIED 1 | 0x20000000 // customer bit in HRESULT
 #define SDEXIT_NO_FIRST_FILE_IN_SOURCE 2 | 0x20000000
 #define SDEXIT_NO_SOURCE_SPECIFIED 3 | 0x20000000
-#define SDEXIT_SOURCE_FILES_ON_DIFFERENT_VOLUMES 4 | 0x20000000
+#define SDEXIT_SOURCE_FILES_ON_DIFFERENT_VOLUMES 4 | 0x20000000 // no longer returned -- each volume now has its own snapshot in the set
 #define SDEXIT_INVALID_ARGS 5 | 0x20000000
+#define SDEXIT_SELF_TEST_FAILED 6 | 0x20000000
+#define SDEXIT_PARTIAL_SUCCESS 7 | 0x20000000 // continue-on-error mode -- the snapshot was copied, but some files could not be
+#define SDEXIT_VERIFY_FAILED 8 | 0x20000000
 
 
 /// <summary>
@@ -150,35 +374,76 @@ t_sourceList* previousSourceFilenameWithoutDrive = sourceFilenamesWithoutDrives;
 /// <param name="argv"></param>
 /// <returns></returns>
 int wmain(int argc, WCHAR** argv)
+{
+    if (argc < 2) {
+        usage();
+        exit(SDEXIT_INVALID_ARGS);
+    }
+
+    // restoring a file from a chunk store needs no snapshot, so it is handled before everything else
+    if (wcscmp(argv[1], L"--restore") == 0) {
+        if (argc != 4) {
+            usage();
+            exit(SDEXIT_INVALID_ARGS);
+        }
+        exit(RestoreFromRecipe(argv[2], argv[3]));
+    }
+    if (wcscmp(argv[1], L"--selftest") == 0) {
+        exit(RunSelfTests() ? SDEXIT_SELF_TEST_FAILED : 0);
+    }
+    if (wcscmp(argv[1], L"--decompress") == 0) {
+        if (argc != 4) {
+            usage();
+            exit(SDEXIT_INVALID_ARGS);
+        }
+        exit(RestoreFromCompressed(argv[2], argv[3]));
+    }
+    if (wcscmp(argv[1], L"--index") == 0) {
+        exit(QueryIndex(argc - 2, argv + 2));
+    }
+    if (wcscmp(argv[1], L"--service") == 0) {
+        if (argc != 3) {
+            usage();
+            exit(SDEXIT_INVALID_ARGS);
+        }
+        exit(RunService(argv[2]));
+    }
+    if (wcscmp(argv[1], L"--control") == 0) {
+        exit(SendControlRequest(argc - 2, argv + 2));
+    }
+
+    RunBackup(argc, argv);
+    return 0; // not reached -- RunBackup always finishes with bail
+}
+
+/// <summary>
+/// Run one backup as the command line describes -- snapshot the sources, copy them and tell VSS the
+/// backup is complete. Used for the single run of a normal invocation and for each job in service mode.
+/// </summary>
+/// <param name="argc"></param>
+/// <param name="argv"></param>
+/// <returns>Does not return. Finishes with bail, which exits or, in service mode, unwinds to the scheduler.</returns>
+void RunBackup(int argc, WCHAR** argv)
 {
     HRESULT result = E_FAIL;
-    HRESULT asyncResult = E_FAIL;
-    VSS_SNAPSHOT_PROP snapshotProp{};
-    
     DWORD fileAttributes = INVALID_FILE_ATTRIBUTES;
     DWORD error = 0;
     DWORD copyError = 0;
     BOOL selectedFilesMode = FALSE;
 
-    WIN32_FIND_DATA findData{};
-
     int lastSwitchArgument = 1; // the index of the last command line arg that was a switch
     BOOL switchArgumentsComplete = FALSE;
 
-
+    ResetRunState();
+    runStart = std::chrono::steady_clock::now();
+    runSummary.startTime = (long long)time(nullptr);
 
     // loop over command line options -- _very_ simple parsing
-    if (argc < 2) {
-        usage();
-        exit(SDEXIT_INVALID_ARGS);
-    }
-
-
     for (int i = 1; i < argc; i++) {
 
         if (wcscmp(argv[i], L"/?") == 0) {
             usage();
-            exit(0);
+            bail(0);
         }
         // handle switches
         if (argv[i][0] == L'-') {
@@ -188,11 +453,133 @@ int wmain(int argc, WCHAR** argv)
             }
             if (wcscmp(argv[i], L"-h") == 0 || wcscmp(argv[i], L"--help") == 0 || wcscmp(argv[i], L"-?") == 0 || wcscmp(argv[i], L"--usage") == 0) {
                 usage();
-                exit(0);
+                bail(0);
             }
             if (wcscmp(argv[i], L"--singlefile") == 0 || wcscmp(argv[i], L"-s") == 0 || wcscmp(argv[i], L"--selected") == 0) {
                 selectedFilesMode = TRUE;
             }
+            if (wcsncmp(argv[i], L"--files-from=", 13) == 0) {
+                filesFromPath = &argv[i][13];
+                selectedFilesMode = TRUE;
+            }
+            if (wcsncmp(argv[i], L"--threads=", 10) == 0) {
+                copyThreads = (unsigned int)_wtoi(&argv[i][10]);
+                if (copyThreads < 1 || copyThreads > MAX_COPY_THREADS) {
+                    printf("The number of threads must be between 1 and %d.\n", MAX_COPY_THREADS);
+                    bail(SDEXIT_INVALID_ARGS);
+                }
+                copyThreadsFromCommandLine = TRUE;
+            }
+            if (wcsncmp(argv[i], L"--block-size=", 13) == 0) {
+                blockSizeKiB = (unsigned int)_wtoi(&argv[i][13]);
+                blockSizeFromCommandLine = TRUE;
+            }
+            if (wcsncmp(argv[i], L"--queue-depth=", 14) == 0) {
+                queueDepth = (unsigned int)_wtoi(&argv[i][14]);
+                queueDepthFromCommandLine = TRUE;
+            }
+            if (wcsncmp(argv[i], L"--buffer-memory=", 16) == 0) {
+                bufferMemoryMiB = (unsigned int)_wtoi(&argv[i][16]);
+                bufferMemoryFromCommandLine = TRUE;
+            }
+            if (wcsncmp(argv[i], L"--fanout-buffer=", 16) == 0) {
+                fanOutBufferMiB = (unsigned int)_wtoi(&argv[i][16]);
+                fanOutBufferFromCommandLine = TRUE;
+            }
+            if (wcscmp(argv[i], L"--buffered") == 0) {
+                unbufferedCopies = FALSE;
+            }
+            if (wcscmp(argv[i], L"--no-sparse") == 0) {
+                sparseCopies = FALSE;
+            }
+            if (wcscmp(argv[i], L"--incremental") == 0) {
+                incrementalMode = TRUE;
+            }
+            if (wcscmp(argv[i], L"--change-feed") == 0) {
+                incrementalMode = TRUE;
+                changeFeedMode = TRUE;
+            }
+            if (wcsncmp(argv[i], L"--change-log=", 13) == 0) {
+                incrementalMode = TRUE;
+                changeFeedMode = TRUE;
+                changeLogPath = &argv[i][13];
+            }
+            if (wcscmp(argv[i], L"--checksums") == 0) {
+                checksumMode = TRUE;
+            }
+            if (wcscmp(argv[i], L"--verify") == 0) {
+                verifyMode = TRUE;
+            }
+            if (wcscmp(argv[i], L"--verify-sample") == 0) {
+                verifyMode = TRUE;
+                verifySampleBlocks = DEFAULT_VERIFY_SAMPLE_BLOCKS;
+            }
+            if (wcsncmp(argv[i], L"--verify-sample=", 16) == 0) {
+                verifyMode = TRUE;
+                verifySampleBlocks = (unsigned int)_wtoi(&argv[i][16]);
+                if (verifySampleBlocks < 2) {
+                    printf("A sampling verify must compare at least 2 blocks of each file.\n");
+                    bail(SDEXIT_INVALID_ARGS);
+                }
+            }
+            if (wcscmp(argv[i], L"--continue-on-error") == 0) {
+                continueOnError = TRUE;
+            }
+            if (wcsncmp(argv[i], L"--retries=", 10) == 0) {
+                copyRetries = (unsigned int)_wtoi(&argv[i][10]);
+                if (copyRetries > MAX_COPY_RETRIES) {
+                    printf("The number of retries must be at most %d.\n", MAX_COPY_RETRIES);
+                    bail(SDEXIT_INVALID_ARGS);
+                }
+                copyRetriesFromCommandLine = TRUE;
+            }
+            if (wcsncmp(argv[i], L"--delta-threshold=", 18) == 0) {
+                deltaThresholdMiB = (unsigned int)_wtoi(&argv[i][18]);
+                deltaThresholdFromCommandLine = TRUE;
+            }
+            if (wcsncmp(argv[i], L"--journal-threshold=", 20) == 0) {
+                journalThresholdMiB = (unsigned int)_wtoi(&argv[i][20]);
+                journalThresholdFromCommandLine = TRUE;
+            }
+            if (wcscmp(argv[i], L"--chunk-store") == 0) {
+                chunkStoreMode = TRUE;
+            }
+            if (wcscmp(argv[i], L"--compress") == 0) {
+                compressMode = TRUE;
+            }
+            if (wcsncmp(argv[i], L"--read-limit=", 13) == 0) {
+                throttleLimits.readMBps = _wtof(&argv[i][13]);
+                readLimitFromCommandLine = TRUE;
+            }
+            if (wcsncmp(argv[i], L"--write-limit=", 14) == 0) {
+                throttleLimits.writeMBps = _wtof(&argv[i][14]);
+                writeLimitFromCommandLine = TRUE;
+            }
+            if (wcsncmp(argv[i], L"--read-iops=", 12) == 0) {
+                throttleLimits.readIops = _wtof(&argv[i][12]);
+                readIopsFromCommandLine = TRUE;
+            }
+            if (wcsncmp(argv[i], L"--write-iops=", 13) == 0) {
+                throttleLimits.writeIops = _wtof(&argv[i][13]);
+                writeIopsFromCommandLine = TRUE;
+            }
+            if (wcsncmp(argv[i], L"--throttle-control=", 19) == 0) {
+                throttleControlPath = &argv[i][19];
+            }
+            if (wcsncmp(argv[i], L"--index-generations=", 20) == 0) {
+                indexGenerations = (unsigned int)_wtoi(&argv[i][20]);
+                if (indexGenerations > MAX_INDEX_GENERATIONS) {
+                    printf("The number of index generations must be at most %d.\n", MAX_INDEX_GENERATIONS);
+                    bail(SDEXIT_INVALID_ARGS);
+                }
+                indexGenerationsFromCommandLine = TRUE;
+            }
+            if (wcsncmp(argv[i], L"--metrics-json=", 15) == 0) {
+                metricsJsonPath = &argv[i][15];
+            }
+            if (wcsncmp(argv[i], L"--metrics-prom=", 15) == 0) {
+                metricsPrometheusPath = &argv[i][15];
+            }
             ++lastSwitchArgument;
         }
         
@@ -213,60 +600,23 @@ int wmain(int argc, WCHAR** argv)
 
                 // usage: ShadowDuplicator -s [source] [source] [source] [dest]
                 if (i != (argc - 1)) {
-                    // allocate a new source directory and filename
-                    currentSourceDrive = (t_sourceList*)malloc(sizeof(t_sourceList));
-                    assert(currentSourceDrive != nullptr);
-                    ZeroMemory(currentSourceDrive, sizeof(t_sourceList));
-                    if (sourceDrives == nullptr) { // if the head of the list is not yet set, set it
-                        sourceDrives = currentSourceDrive;
-                    }
-
-                    currentSourceFilename = (t_sourceList*)malloc(sizeof(t_sourceList));
-                    assert(currentSourceFilename != nullptr);
-                    ZeroMemory(currentSourceFilename, sizeof(t_sourceList));
-                    if (sourceFilenames == nullptr) { // if the head of the list is not yet set, set it
-                        sourceFilenames = currentSourceFilename;
-                    }
-
-                    // get source drive from source directory
-                    currentSourceDrive->source = (LPWSTR)malloc(MAX_PATH * sizeof(WCHAR));
-                    assert(currentSourceDrive->source != nullptr);
-
-                    if (!GetVolumePathNameW(argv[i], currentSourceDrive->source, MAX_PATH)) {
-                        error = GetLastError();
-                        friendlyError(L"Failed to get Source Drive from Source Directory", error);
-                    }
-
-                    // copy filename into filename buffer
-                    currentSourceFilename->source = (LPWSTR)malloc(MAX_PATH * sizeof(WCHAR));
-                    assert(currentSourceFilename->source != nullptr);
-                    if (!GetFullPathNameW(argv[i], MAX_PATH, currentSourceFilename->source, nullptr)) {
-                        error = GetLastError();
-                        friendlyError(L"Failed to get source path from source file", error);
-                    }
-
-                    // now set the previous item's pointer to point to these items
-                    if (previousSourceDrive != nullptr) {
-                        previousSourceDrive->next = currentSourceDrive;
-                    }
-                    if (previousSourceFilename != nullptr) {
-                        previousSourceFilename->next = currentSourceFilename;
+                    error = AddSourcePath(argv[i]);
+                    if (error) {
+                        friendlyCopyError(L"Failed to find the volume of the source file", argv[i], error);
+                        bail(error);
                     }
-                    previousSourceDrive = currentSourceDrive;
-                    previousSourceFilename = currentSourceFilename;
-
                 }
                 else { // last argument is dest
                     StringCbPrintfW(destDirectory, MAX_PATH, L"%s", argv[i]);
                 }
             }
-            else { // directory mode -- check INI file
+            else { // directory mode -- read the INI file, once, for its options and file sets
                 fileAttributes = GetFileAttributesW(argv[i]);
 
                 if (fileAttributes == INVALID_FILE_ATTRIBUTES) {
                     error = GetLastError();
                     friendlyError(L"Failed to check INI file", error);
-                    exit(error);
+                    bail(error);
                 }
 
                 canonicalINIPath = (LPWSTR)malloc(MAX_PATH * sizeof(WCHAR));
@@ -275,126 +625,330 @@ int wmain(int argc, WCHAR** argv)
                 if (!(GetFullPathNameW(argv[i], MAX_PATH, canonicalINIPath, NULL))) {
                     error = GetLastError();
                     friendlyError(L"Failed to get full path name of specified INI file", error);
-                    exit(error);
+                    bail(error);
                 }
 
-                // allocate space for source and destination paths
-                destDirectory = (LPWSTR)malloc(MAX_PATH * sizeof(WCHAR));
-
-                assert(destDirectory != nullptr);
-
-                // allocate source 
-                currentSourceDrive = (t_sourceList*)malloc(sizeof(t_sourceList));
-                assert(currentSourceDrive != nullptr);
-                ZeroMemory(currentSourceDrive, sizeof(t_sourceList));
-                if (sourceDrives == nullptr) { // if the head of the list is not yet set, set it
-                    sourceDrives = currentSourceDrive;
+                IniFile ini;
+                error = ini.Load(canonicalINIPath);
+                if (error) {
+                    friendlyError(L"Failed to read the INI file", error);
                 }
 
-                currentSourceFilename = (t_sourceList*)malloc(sizeof(t_sourceList));
-                assert(currentSourceFilename != nullptr);
-                ZeroMemory(currentSourceFilename, sizeof(t_sourceList));
-                if (sourceFilenames == nullptr) { // if the head of the list is not yet set, set it
-                    sourceFilenames = currentSourceFilename;
+                // get thread count from INI, unless the command line has already set it
+                if (!copyThreadsFromCommandLine) {
+                    copyThreads = (unsigned int)OptionInt(ini, L"Threads", DEFAULT_COPY_THREADS);
+                    if (copyThreads < 1 || copyThreads > MAX_COPY_THREADS) {
+                        printf("Threads in the INI file must be between 1 and %d.\n", MAX_COPY_THREADS);
+                        bail(SDEXIT_INVALID_ARGS);
+                    }
                 }
-            
-                // get source from INI
-                currentSourceFilename->source = (LPWSTR)malloc(MAX_PATH * sizeof(WCHAR));
-                assert(currentSourceFilename->source != nullptr);
-                GetPrivateProfileStringW(
-                    L"FileSet",
-                    L"Source",
-                    L"",
-                    currentSourceFilename->source,
-                    MAX_PATH,
-                    canonicalINIPath
-                );
 
-                error = GetLastError();
-                if (error) {
-                    friendlyError(L"Failed to import Source from INI file", error);
-                    exit(error);
+                // copy engine settings from INI, unless the command line has already set them
+                if (!blockSizeFromCommandLine) {
+                    blockSizeKiB = (unsigned int)OptionInt(ini, L"BlockSize", DEFAULT_BLOCK_SIZE_KIB);
                 }
-
-                // get dest from INI
-                GetPrivateProfileStringW(
-                    L"FileSet",
-                    L"Destination",
-                    L"",
-                    destDirectory,
-                    MAX_PATH,
-                    canonicalINIPath
-                );
-
-                error = GetLastError();
-                if (error) {
-                    friendlyError(L"Failed to import Destination from INI file", error);
+                if (!queueDepthFromCommandLine) {
+                    queueDepth = (unsigned int)OptionInt(ini, L"QueueDepth", DEFAULT_QUEUE_DEPTH);
+                }
+                if (!bufferMemoryFromCommandLine) {
+                    bufferMemoryMiB = (unsigned int)OptionInt(ini, L"BufferMemory", DEFAULT_BUFFER_MEMORY_MIB);
+                }
+                if (!fanOutBufferFromCommandLine) {
+                    fanOutBufferMiB = (unsigned int)OptionInt(ini, L"FanOutBuffer", DEFAULT_FANOUT_BUFFER_MIB);
+                }
+                if (unbufferedCopies) {
+                    unbufferedCopies = OptionInt(ini, L"Unbuffered", TRUE) ? TRUE : FALSE;
+                }
+                if (sparseCopies) {
+                    sparseCopies = OptionInt(ini, L"Sparse", TRUE) ? TRUE : FALSE;
+                }
+                if (!incrementalMode) {
+                    incrementalMode = OptionInt(ini, L"Incremental", FALSE) ? TRUE : FALSE;
+                }
+                if (!changeFeedMode) {
+                    changeLogPath = OptionString(ini, L"ChangeLog", L"");
+                    changeFeedMode = OptionInt(ini, L"ChangeFeed", FALSE) || !changeLogPath.empty() ? TRUE : FALSE;
+                    incrementalMode = incrementalMode || changeFeedMode ? TRUE : FALSE;
+                }
+                if (!checksumMode) {
+                    checksumMode = OptionInt(ini, L"Checksums", FALSE) ? TRUE : FALSE;
+                }
+                if (!verifyMode) {
+                    verifyMode = OptionInt(ini, L"Verify", FALSE) ? TRUE : FALSE;
+                    verifySampleBlocks = (unsigned int)OptionInt(ini, L"VerifySample", 0);
+                    if (verifySampleBlocks == 1) {
+                        printf("VerifySample in the INI file must be 0, to compare every block, or at least 2.\n");
+                        bail(SDEXIT_INVALID_ARGS);
+                    }
+                    if (verifySampleBlocks > 0) {
+                        verifyMode = TRUE;
+                    }
+                }
+                if (!continueOnError) {
+                    continueOnError = OptionInt(ini, L"ContinueOnError", FALSE) ? TRUE : FALSE;
+                }
+                if (!copyRetriesFromCommandLine) {
+                    copyRetries = (unsigned int)OptionInt(ini, L"Retries", DEFAULT_COPY_RETRIES);
+                    if (copyRetries > MAX_COPY_RETRIES) {
+                        printf("Retries in the INI file must be at most %d.\n", MAX_COPY_RETRIES);
+                        bail(SDEXIT_INVALID_ARGS);
+                    }
+                }
+                if (!deltaThresholdFromCommandLine) {
+                    deltaThresholdMiB = (unsigned int)OptionInt(ini, L"DeltaThreshold", 0);
+                }
+                if (!journalThresholdFromCommandLine) {
+                    journalThresholdMiB = (unsigned int)OptionInt(ini, L"JournalThreshold", DEFAULT_JOURNAL_THRESHOLD_MIB);
+                }
+                if (!chunkStoreMode) {
+                    chunkStoreMode = OptionInt(ini, L"ChunkStore", FALSE) ? TRUE : FALSE;
+                }
+                if (!compressMode) {
+                    compressMode = OptionInt(ini, L"Compress", FALSE) ? TRUE : FALSE;
+                }
+                if (!readLimitFromCommandLine) {
+                    throttleLimits.readMBps = OptionDouble(ini, L"ReadLimit", 0);
+                }
+                if (!writeLimitFromCommandLine) {
+                    throttleLimits.writeMBps = OptionDouble(ini, L"WriteLimit", 0);
+                }
+                if (!readIopsFromCommandLine) {
+                    throttleLimits.readIops = OptionDouble(ini, L"ReadIops", 0);
+                }
+                if (!writeIopsFromCommandLine) {
+                    throttleLimits.writeIops = OptionDouble(ini, L"WriteIops", 0);
+                }
+                {
+                    std::wstring scheduleText = OptionString(ini, L"ThrottleSchedule", L"");
+                    if (!ThrottleParseSchedule(PlatformToUtf8(scheduleText), &throttleSchedule)) {
+                        wprintf(L"ThrottleSchedule in the INI file could not be understood: \"%s\"\n", scheduleText.c_str());
+                        bail(SDEXIT_INVALID_ARGS);
+                    }
+                }
+                if (throttleControlPath.empty()) {
+                    throttleControlPath = OptionString(ini, L"ThrottleControl", L"");
+                }
+                if (!indexGenerationsFromCommandLine) {
+                    indexGenerations = (unsigned int)OptionInt(ini, L"IndexGenerations", DEFAULT_INDEX_GENERATIONS);
+                    if (indexGenerations > MAX_INDEX_GENERATIONS) {
+                        printf("IndexGenerations in the INI file must be at most %d.\n", MAX_INDEX_GENERATIONS);
+                        bail(SDEXIT_INVALID_ARGS);
+                    }
+                }
+                if (metricsJsonPath.empty()) {
+                    metricsJsonPath = OptionString(ini, L"MetricsJson", L"");
+                }
+                if (metricsPrometheusPath.empty()) {
+                    metricsPrometheusPath = OptionString(ini, L"MetricsPrometheus", L"");
                 }
 
-
-                // get source drive from source directory
-                currentSourceDrive->source = (LPWSTR)malloc(MAX_PATH * sizeof(WCHAR));
-                assert(currentSourceDrive->source != nullptr);
-
-                if (!GetVolumePathNameW(currentSourceFilename->source, currentSourceDrive->source, MAX_PATH)) {
-                    error = GetLastError();
-                    if (error) {
-                        friendlyError(L"Failed to get Source Drive from Source Directory", error);
+                // each [FileSet] or [FileSet.NAME] section with a Source is a file set -- all of them are copied from the one snapshot set
+                for (const std::wstring& section : ini.Sections()) {
+                    if (!IniNameEquals(section, L"FileSet") && !IniNameHasPrefix(section, L"FileSet.")) {
+                        continue;
+                    }
+                    if (IniNameEquals(section, L"FileSet") && !ini.HasKey(section, L"Source")) {
+                        continue; // options only
                     }
+                    AddFileSet(section, ini.GetString(section, L"Source", L""), ini.GetStrings(section, L"Destination"));
+                    fileSets.back().filter = LoadFileSetFilter(ini, section, &fileSets.back().filterSettings);
+                    fileSets.back().ownThrottle = LoadFileSetThrottle(ini, section, &fileSets.back().throttle);
                 }
                 break;
             }
         }
     }
 
+    // the list of source files is streamed straight into the path table, so that even a very long list is never held in memory twice
+    if (!filesFromPath.empty()) {
+        DWORD listError = 0;
+        error = ReadPathList(filesFromPath, &FilesFromRoutine, &listError);
+        if (error) {
+            friendlyCopyError(L"Unable to read the list of source files", filesFromPath.c_str(), error);
+            bail(error);
+        }
+        if (listError) {
+            bail(listError); // FilesFromRoutine has said which path could not be added
+        }
+    }
+
     if (!quiet) {
         banner();
     }
 
-    // check the dest directory existence before we bother to set up VSS
-    if (sourceFilenames == nullptr) {
-        printf("No source files were specified.\n"); // friendlyError is not appropriate as this looks up Win32 error codes
-        bail(SDEXIT_NO_SOURCE_SPECIFIED);
+    if (blockSizeKiB < MIN_BLOCK_SIZE_KIB || blockSizeKiB > MAX_BLOCK_SIZE_KIB || (blockSizeKiB * 1024) % PLATFORM_IO_ALIGNMENT != 0) {
+        printf("The block size must be a multiple of %d KiB between %d and %d KiB.\n", PLATFORM_IO_ALIGNMENT / 1024, MIN_BLOCK_SIZE_KIB, MAX_BLOCK_SIZE_KIB);
+        bail(SDEXIT_INVALID_ARGS);
     }
-    if (sourceDrives == nullptr) {
-        printf("No source drives were specified.\n"); // friendlyError is not appropriate as this looks up Win32 error codes
-        bail(SDEXIT_NO_SOURCE_SPECIFIED);
+    if (queueDepth < 1 || queueDepth > MAX_QUEUE_DEPTH) {
+        printf("The queue depth must be between 1 and %d.\n", MAX_QUEUE_DEPTH);
+        bail(SDEXIT_INVALID_ARGS);
     }
-    if (destDirectory == nullptr) {
-        printf("No destination directory was specified.\n"); // friendlyError is not appropriate as this looks up Win32 error codes
-        bail(SDEXIT_NO_DEST_DIR_SPECIFIED);
+    if ((unsigned long long)bufferMemoryMiB * 1024 < blockSizeKiB) {
+        printf("The buffer memory must hold at least one block.\n");
+        bail(SDEXIT_INVALID_ARGS);
     }
-    if (!selectedFilesMode && !PathFileExistsW(destDirectory)) { //TODO: can we add to this checking dest dir in selected file mode?
-        error = GetLastError();
-        if (error) {
-            friendlyError(L"The destination directory does not seem to exist.", error); //friendlyError will bail
-        }
+    if (fanOutBufferMiB < 1) {
+        printf("The fan-out buffer must be at least 1 MiB.\n");
+        bail(SDEXIT_INVALID_ARGS);
     }
 
-    currentSourceFilename = sourceFilenames;
-    do {
-        assert(currentSourceFilename->source != nullptr);
-        if (!PathFileExistsW(currentSourceFilename->source)) {
-            wprintf(L"The source file \"%s\" does not seem to exist. 0x%x\n", currentSourceFilename->source, GetLastError());
-            bail(GetLastError());
-        }
-        currentSourceFilename = currentSourceFilename->next;
-    } while (currentSourceFilename != nullptr);
-
-    // initialize COM (must do before InitializeForBackup works)
-    result = CoInitializeEx(NULL, COINIT_APARTMENTTHREADED);
-
-    if (result != S_OK) {
-        printf("Unable to initialize COM -- 0x%x\n", result);
-        exit(result);
+    bufferPool = new BufferPool(blockSizeKiB * 1024, (unsigned long long)bufferMemoryMiB * 1024 * 1024);
+    if (bufferPool->BufferCount() == 0) {
+        printf("Unable to allocate copy buffers.\n");
+        bail(ERROR_NOT_ENOUGH_MEMORY);
+    }
+
+    // check the dest directory existence before we bother to set up VSS
+    if (sourcePaths.Count() == 0) {
+        printf("No source files were specified.\n"); // friendlyError is not appropriate as this looks up Win32 error codes
+        bail(SDEXIT_NO_SOURCE_SPECIFIED);
+    }
+    if (selectedFilesMode) {
+        if (destDirectory == nullptr) {
+            printf("No destination directory was specified.\n"); // friendlyError is not appropriate as this looks up Win32 error codes
+            bail(SDEXIT_NO_DEST_DIR_SPECIFIED);
+        }
+        // the selected files are all copied to the one destination, as a single file set
+        fileSets.push_back(t_fileSet{});
+        fileSets.back().destination = destDirectory;
+    }
+    for (t_fileSet& fileSet : fileSets) {
+        if (fileSet.destination.empty()) {
+            wprintf(L"No destination directory was specified for %s.\n", fileSet.name.c_str());
+            bail(SDEXIT_NO_DEST_DIR_SPECIFIED);
+        }
+        if (!selectedFilesMode && !PathFileExistsW(fileSet.destination.c_str())) { //TODO: can we add to this checking dest dir in selected file mode?
+            error = GetLastError();
+            if (error) {
+                friendlyCopyError(L"The destination directory does not seem to exist", fileSet.destination.c_str(), error);
+                bail(error);
+            }
+        }
+        for (const std::wstring& mirror : fileSet.mirrors) {
+            if (!PathFileExistsW(mirror.c_str())) {
+                error = GetLastError();
+                if (error) {
+                    friendlyCopyError(L"The destination directory does not seem to exist", mirror.c_str(), error);
+                    bail(error);
+                }
+            }
+        }
+        if (!fileSet.mirrors.empty() && (chunkStoreMode || compressMode)) {
+            wprintf(L"%s has more than one Destination, which cannot be combined with a chunk store or compression.\n", fileSet.name.c_str());
+            bail(SDEXIT_INVALID_ARGS);
+        }
+    }
+
+    for (size_t index = 0; index < sourcePaths.Count(); index++) {
+        std::wstring sourcePath = sourcePaths.FullPath(index);
+        if (!PathFileExistsW(sourcePath.c_str())) {
+            wprintf(L"The source file \"%s\" does not seem to exist. 0x%x\n", sourcePath.c_str(), GetLastError());
+            bail(GetLastError());
+        }
+    }
+
+    // load the manifest of each destination's previous run, to find which files are unchanged
+    for (t_fileSet& fileSet : fileSets) {
+        fileSet.previousManifest = new Manifest();
+        fileSet.currentManifest = new Manifest();
+        if (incrementalMode) {
+            error = fileSet.previousManifest->Load(ManifestPathForDestination(fileSet.destination));
+            if (error == ERROR_FILE_NOT_FOUND || error == ERROR_PATH_NOT_FOUND) {
+                if (!quiet) {
+                    wprintf(L"No manifest from a previous run was found in %s, so all files will be copied.\n", fileSet.destination.c_str());
+                }
+            }
+            else if (error) {
+                friendlyCopyError(L"Unable to load the manifest of the previous run", ManifestPathForDestination(fileSet.destination).c_str(), error);
+                printf("All files will be copied.\n");
+            }
+            else if (!quiet) {
+                wprintf(L"Loaded the manifest of %zu files from the previous run to %s.\n", fileSet.previousManifest->Count(), fileSet.destination.c_str());
+            }
+            error = 0;
+        }
+
+        // open the chunk store, creating it on the first run
+        if (chunkStoreMode) {
+            fileSet.chunkStore = new ChunkStore(PlatformJoinPath(fileSet.destination, CHUNK_STORE_DIRECTORY));
+            error = fileSet.chunkStore->Open();
+            if (error) {
+                friendlyCopyError(L"Unable to create the chunk store in", fileSet.destination.c_str(), error);
+                bail(error);
+            }
+        }
+    }
+
+    // note where each source's change feed is before the snapshot is taken. A change made between now and
+    // the snapshot is read again by the next run, which does no harm, whereas one missed would be lost.
+    if (changeFeedMode) {
+        if (selectedFilesMode) {
+            printf("A change feed is only used in whole folder mode. The selected files will be checked against the manifest as usual.\n");
+        }
+        else {
+            for (unsigned int set = 0; set < fileSets.size(); set++) {
+                OpenChangeFeed(set);
+            }
+        }
+    }
+
+    if (!metricsJsonPath.empty() || !metricsPrometheusPath.empty()) {
+        runMetrics = new RunMetrics();
+    }
+
+    if (ThrottleLimitsActive(throttleLimits) || !throttleSchedule.empty() || !throttleControlPath.empty()) {
+        ioThrottle = new IoThrottle(throttleLimits, throttleSchedule, throttleControlPath);
+        if (!quiet) {
+            printf("Throttling copies to %s.\n", ThrottleDescribeLimits(ioThrottle->Limits()).c_str());
+            if (!throttleSchedule.empty() || !throttleControlPath.empty()) {
+                printf("The limits will follow the schedule or control file while the copy runs.\n");
+            }
+        }
+    }
+    for (const t_fileSet& fileSet : fileSets) {
+        if (fileSet.ownThrottle && !quiet) {
+            std::wstring described = fileSet.throttle != nullptr ? PlatformFromUtf8(ThrottleDescribeLimits(fileSet.throttle->Limits())) : L"no limit";
+            wprintf(L"Throttling copies of file set %s to %s, apart from the others.\n", fileSet.name.c_str(), described.c_str());
+        }
+    }
+
+    // one compression thread per core, shared by all of the copy workers
+    if (compressMode && !chunkStoreMode) {
+        compressionWorkers = new CompressionWorkers(PlatformProcessorCount());
+    }
+
+    // a file set with mirrors gets writer threads for each of its destinations, as many as there are copy workers
+    // up to MAX_FANOUT_WRITERS, and an even share of the fan-out buffer memory
+    size_t mirroredFileSets = 0;
+    for (const t_fileSet& fileSet : fileSets) {
+        if (!fileSet.mirrors.empty()) {
+            mirroredFileSets++;
+        }
+    }
+    for (t_fileSet& fileSet : fileSets) {
+        if (!fileSet.mirrors.empty()) {
+            std::vector<std::wstring> destinations{ fileSet.destination };
+            destinations.insert(destinations.end(), fileSet.mirrors.begin(), fileSet.mirrors.end());
+            fileSet.fanOut = new FanOutWriter(destinations, copyThreads, (unsigned long long)fanOutBufferMiB * 1024 * 1024 / mirroredFileSets, bufferPool->BufferSize());
+        }
+    }
+
+    // initialize COM (must do before InitializeForBackup works). In service mode it stays initialized from one job to the next.
+    if (!comInitialized) {
+        result = CoInitializeEx(NULL, COINIT_APARTMENTTHREADED);
+
+        if (result != S_OK) {
+            printf("Unable to initialize COM -- 0x%x\n", result);
+            bail(result);
+        }
+        comInitialized = TRUE;
     }
-    comInitialized = TRUE;
 
     result = CreateVssBackupComponents(&backupComponents);
     if (result == E_ACCESSDENIED) {
         printf("Failed to create the VSS backup components as access was denied. Is this being run with elevated permissions?\n");
-        CoUninitialize();
-        exit(E_ACCESSDENIED);
+        bail(E_ACCESSDENIED);
     }
     genericFailCheck("CreateVssBackupComponents", result);
 
@@ -415,32 +969,7 @@ int wmain(int argc, WCHAR** argv)
     if (!quiet) {
         printf("Waiting for VSS writers to provide metadata...\n");
     }
-    while (asyncResult != VSS_S_ASYNC_CANCELLED && asyncResult != VSS_S_ASYNC_FINISHED) {
-        Sleep(SHORT_SLEEP);
-        result = vssAsync->QueryStatus(&asyncResult, NULL);
-        if (result != S_OK) {
-            printf("Unable to query vss async status -- %x\n", result);
-            vssAsync->Release();
-            vssAsync = nullptr;
-            bail(result);
-        }
-        OutputDebugString(L"Waiting for async VSS status...");
-        if (!quiet) {
-            spinProgress();
-        }
-    }
-
-    if (asyncResult == VSS_S_ASYNC_CANCELLED) {
-        printf("Operation was cancelled.");
-        vssAsync->Release();
-        vssAsync = nullptr;
-        bail(result);
-    }
-
-    vssAsync->Release();
-    vssAsync = nullptr;
-
-    asyncResult = E_FAIL;
+    AwaitVssAsync("GatherWriterMetadata");
 
     // completion of setup
     result = backupComponents->SetBackupState(false, false, VSS_BT_FULL, false);
@@ -456,38 +985,34 @@ int wmain(int argc, WCHAR** argv)
     // from StartSnapshotSet until backup completion, if we fail, we must call AbortBackup inside bail
     shouldAbortBackupOnBail = TRUE;
 
-    snapshotId = (VSS_ID*)malloc(sizeof(VSS_ID));
-    assert(snapshotId != nullptr);
-
-    // add volumes to snapshot set AddToSnapshotSet -- we will only add the first drive spec -- all source files must be on the same volume
-    currentSourceDrive = sourceDrives;
-    currentSourceFilename = sourceFilenames;
-    WCHAR volumeAddedToSnapshot[4]{};
-    do {
-        assert(currentSourceDrive->source != nullptr);
+    // add each distinct volume holding a source to the snapshot set, so that the writers are frozen once for all of them
+    t_snapshotVolume* lastSnapshotVolume = nullptr;
+    for (unsigned int volume = 0; volume < sourcePaths.VolumeCount(); volume++) {
+        if (FindSnapshotVolume(sourcePaths.Volume(volume).c_str()) == nullptr) {
+            t_snapshotVolume* snapshotVolume = (t_snapshotVolume*)malloc(sizeof(t_snapshotVolume));
+            assert(snapshotVolume != nullptr);
+            ZeroMemory(snapshotVolume, sizeof(t_snapshotVolume));
+            snapshotVolume->volume = _wcsdup(sourcePaths.Volume(volume).c_str());
+            assert(snapshotVolume->volume != nullptr);
+            snapshotVolume->index = snapshotVolumeCount++;
+
+            // add to the tail, so that the volumes stay in the order they were given
+            if (lastSnapshotVolume == nullptr) {
+                snapshotVolumes = snapshotVolume;
+            }
+            else {
+                lastSnapshotVolume->next = snapshotVolume;
+            }
+            lastSnapshotVolume = snapshotVolume;
 
-        if (wcslen(volumeAddedToSnapshot) < 1) {
-            // this is the volume we will add to the snapshot -- make a note
-            StringCbPrintfW(volumeAddedToSnapshot, 4 * sizeof(WCHAR), L"%s", currentSourceDrive->source);
-        }
-        else if (wcscmp(volumeAddedToSnapshot, currentSourceDrive->source) == 0) {
-            // on the same volume, skip
-            currentSourceDrive = currentSourceDrive->next;
-            currentSourceFilename = currentSourceFilename->next;
-            continue;
+            result = backupComponents->AddToSnapshotSet(snapshotVolume->volume, GUID_NULL, &snapshotVolume->snapshotId);
+            genericFailCheck("AddToSnapshotSet", result);
         }
-        else {
-            // it is not the same volume, bail
-            backupComponents->AbortBackup();
-            wprintf(L"All source files must be on the same volume. The following file is not on the same volume as previous source files:\n%s\n", currentSourceFilename->source);  
+    }
 
-            bail(SDEXIT_SOURCE_FILES_ON_DIFFERENT_VOLUMES);
-        }
-        result = backupComponents->AddToSnapshotSet(currentSourceDrive->source, GUID_NULL, snapshotId);
-        genericFailCheck("AddToSnapshotSet", result);
-        currentSourceDrive = currentSourceDrive->next;
-        currentSourceFilename = currentSourceFilename->next;
-    } while (currentSourceDrive != nullptr && currentSourceFilename != nullptr);
+    if (!quiet && snapshotVolumeCount > 1) {
+        printf("Snapshotting %u volumes together.\n", snapshotVolumeCount);
+    }
   
 
     // notify writers of impending backup
@@ -498,31 +1023,7 @@ int wmain(int argc, WCHAR** argv)
     if (!quiet) {
         printf("Waiting for VSS writers to be ready for impending backup...\n");
     }
-    while (asyncResult != VSS_S_ASYNC_CANCELLED && asyncResult != VSS_S_ASYNC_FINISHED) {
-        Sleep(SHORT_SLEEP);
-        result = vssAsync->QueryStatus(&asyncResult, NULL);
-        if (result != S_OK) {
-            printf("Unable to query vss async status -- %x\n", result);
-            vssAsync->Release();
-            vssAsync = nullptr;
-            bail(result);
-        }
-        if (!quiet) {
-            OutputDebugString(L"Waiting for PrepareForBackup VSS status...\n");
-            spinProgress();
-        }
-    }
-
-    if (asyncResult == VSS_S_ASYNC_CANCELLED) {
-        printf("Operation was cancelled.");
-        vssAsync->Release();
-        vssAsync = nullptr;
-        bail(asyncResult);
-    }
-
-    asyncResult = E_FAIL;
-    vssAsync->Release();
-    vssAsync = nullptr;
+    AwaitVssAsync("PrepareForBackup");
 
     // verify all VSS writers are in the correct state
     VerifyWriterStatus();
@@ -535,241 +1036,1083 @@ int wmain(int argc, WCHAR** argv)
 
     result = backupComponents->DoSnapshotSet(&vssAsync);
     genericFailCheck("DoSnapshotSet", result);
+    assert(vssAsync != nullptr);
 
-    while (asyncResult != VSS_S_ASYNC_CANCELLED && asyncResult != VSS_S_ASYNC_FINISHED) {
-        Sleep(LONG_SLEEP);
-        result = vssAsync->QueryStatus(&asyncResult, NULL);
-        if (result != S_OK) {
-            printf("Unable to query vss async status -- %x\n", result);
-            vssAsync->Release();
-            vssAsync = nullptr;
-            bail(result);
-        }
-        
-        if (!quiet) {
-            OutputDebugString(L"Waiting for DoSnapshotSet status...\n");
-            spinProgress();
-        }        
-    }
-
-    if (asyncResult == VSS_S_ASYNC_CANCELLED) {
-        printf("Operation was cancelled.");
-        vssAsync->Release();
-        vssAsync = nullptr;
-        bail(asyncResult);
-    }
-
-    asyncResult = E_FAIL;
-    vssAsync->Release();
-    vssAsync = nullptr;
+    AwaitVssAsync("DoSnapshotSet");
 
     // verify all VSS writers are in the correct state
     VerifyWriterStatus();
 
-    // GetSnapshotProperties to get device to copy from
-    result = backupComponents->GetSnapshotProperties(*snapshotId, &snapshotProp);
-    genericFailCheck("GetSnapshotProperties", result);
+    // GetSnapshotProperties to get the device to copy from for each volume
+    for (t_snapshotVolume* snapshotVolume = snapshotVolumes; snapshotVolume != nullptr; snapshotVolume = snapshotVolume->next) {
+        result = backupComponents->GetSnapshotProperties(snapshotVolume->snapshotId, &snapshotVolume->snapshotProp);
+        genericFailCheck("GetSnapshotProperties", result);
+        snapshotVolume->hasSnapshotProp = TRUE;
 
-    OutputDebugString(snapshotProp.m_pwszSnapshotDeviceObject);
+        OutputDebugString(snapshotVolume->snapshotProp.m_pwszSnapshotDeviceObject);
+    }
 
 
-    // remove the device specification (C:\) from each source file, so that it concats properly into the VSS device object specification
-    currentSourceFilename = sourceFilenames; // point to the beginnings of the list
-    currentSourceDrive = sourceDrives;
-    do {
-        // allocate a new sourceWithoutDrive
-        if (sourceFilenamesWithoutDrives == nullptr) {
-            sourceFilenamesWithoutDrives = (t_sourceList *)malloc(sizeof(t_sourceList));
-            assert(sourceFilenamesWithoutDrives != nullptr);
-            ZeroMemory(sourceFilenamesWithoutDrives, sizeof(t_sourceList));
-            currentSourceFilenameWithoutDrive = sourceFilenamesWithoutDrives;
-        }
-        else {
-            currentSourceFilenameWithoutDrive = (t_sourceList*)malloc(sizeof(t_sourceList));
-            assert(currentSourceFilenameWithoutDrive != nullptr);
-            ZeroMemory(currentSourceFilenameWithoutDrive, sizeof(t_sourceList));
-        }
-
-        currentSourceFilenameWithoutDrive->source = (LPWSTR)malloc(wcslen(currentSourceFilename->source) * sizeof(WCHAR));
-        assert(currentSourceFilenameWithoutDrive->source != nullptr);
-        // pull into new string starting at sourceDrive position in the filename string -- slice off the drive spec
-        wcsncpy_s(currentSourceFilenameWithoutDrive->source,
-            wcslen(currentSourceFilename->source),
-            &currentSourceFilename->source[wcslen(currentSourceDrive->source)],
-            wcslen(currentSourceFilename->source) - wcslen(currentSourceDrive->source)
-        );
-
-        // update tail pointer
-        if (previousSourceFilenameWithoutDrive != nullptr) {
-            previousSourceFilenameWithoutDrive->next = currentSourceFilenameWithoutDrive;
-        }
-        previousSourceFilenameWithoutDrive = currentSourceFilenameWithoutDrive;
-
-        // loop to next item
-        currentSourceDrive = currentSourceDrive->next;
-        currentSourceFilename = currentSourceFilename->next;
-    } while (currentSourceDrive != nullptr && currentSourceFilename != nullptr);
-    
+    // the copy workers start now and pull jobs as the loops below submit them. In continue-on-error mode
+    // a failure does not stop them, and the context tells CopyJobRoutine this is each file's first attempt.
+    std::chrono::steady_clock::time_point copyStart = std::chrono::steady_clock::now();
+    unsigned int firstAttempt = 1;
+    CopyWorkerPool copyPool(copyThreads, &CopyJobRoutine, &CopyResultRoutine, &firstAttempt, !continueOnError);
+    activeCopyPool = &copyPool;
   
     if (selectedFilesMode)
     {
-        currentSourceFilename = sourceFilenames; // point to the beginnings of the lists
-        currentSourceDrive = sourceDrives;
-        currentSourceFilenameWithoutDrive = sourceFilenamesWithoutDrives;
-
-        // expect the lists to not be empty
-        assert(currentSourceDrive != nullptr && currentSourceFilename != nullptr && currentSourceFilenameWithoutDrive != nullptr);
-
-        // loop over each source drive/filename/filename without drive triplet and copy
-        do {
-            WCHAR sourcePathFile[MAX_PATH]{};
-            WCHAR destinationPathFile[MAX_PATH]{};
-            WCHAR baseNameAndExt[MAX_PATH]{};
-
-            // build source and dest path
-            StringCbPrintf((WCHAR*)&(sourcePathFile), MAX_PATH * sizeof(WCHAR), L"%s\\%s", snapshotProp.m_pwszSnapshotDeviceObject, currentSourceFilenameWithoutDrive->source);
-
-
-            // get basename&ext of source file to make its final destination path from dir + basename
-            WCHAR* lastBackslash = wcsrchr(sourcePathFile, L'\\');
-            wcsncpy_s(
-                baseNameAndExt,
-                MAX_PATH * sizeof(WCHAR),
-                lastBackslash,
-                wcslen(sourcePathFile)
-            );
-
+        // the snapshot of each volume in the path table, and the paths on each volume in the order they were given
+        std::vector<t_snapshotVolume*> volumeSnapshots(sourcePaths.VolumeCount());
+        std::vector<std::vector<size_t>> volumePaths(sourcePaths.VolumeCount());
+        for (unsigned int volume = 0; volume < sourcePaths.VolumeCount(); volume++) {
+            volumeSnapshots[volume] = FindSnapshotVolume(sourcePaths.Volume(volume).c_str());
+            assert(volumeSnapshots[volume] != nullptr);
+        }
+        for (size_t index = 0; index < sourcePaths.Count(); index++) {
+            volumePaths[sourcePaths.VolumeOf(index)].push_back(index);
+        }
 
-            StringCbPrintf((WCHAR*)&*(destinationPathFile), MAX_PATH * sizeof(WCHAR), L"%s\%s", destDirectory, baseNameAndExt);
+        // queue a file from each volume in turn, so that the copy workers read from all of the volumes at once.
+        // Each job is built only as it is queued, so the jobs waiting in the pool are the only ones in memory.
+        BOOL queuedAny = TRUE;
+        BOOL copyFailed = FALSE;
+        for (size_t position = 0; queuedAny && !copyFailed; position++) {
+            queuedAny = FALSE;
+            for (unsigned int volume = 0; volume < sourcePaths.VolumeCount(); volume++) {
+                if (position >= volumePaths[volume].size()) {
+                    continue;
+                }
+                queuedAny = TRUE;
+
+                // the source is read from the volume's snapshot, and copied to the destination under its own name
+                LPCWSTR tail = sourcePaths.Tail(volumePaths[volume][position]);
+                LPCWSTR baseName = wcsrchr(tail, L'\\') != nullptr ? wcsrchr(tail, L'\\') + 1 : tail;
+
+                t_copyJob job{};
+                job.source = PlatformJoinPath(volumeSnapshots[volume]->snapshotProp.m_pwszSnapshotDeviceObject, tail);
+                job.destination = PlatformJoinPath(destDirectory, baseName);
+                job.relativePath = baseName;
+
+                WIN32_FILE_ATTRIBUTE_DATA attributeData{};
+                if (GetFileAttributesExW(job.source.c_str(), GetFileExInfoStandard, &attributeData)) {
+                    job.size = ((unsigned long long)attributeData.nFileSizeHigh << 32) | attributeData.nFileSizeLow;
+                    job.lastWriteTime = ((unsigned long long)attributeData.ftLastWriteTime.dwHighDateTime << 32) | attributeData.ftLastWriteTime.dwLowDateTime;
+                    job.attributes = attributeData.dwFileAttributes;
+                }
 
-            copyError = ShadowCopyFile(sourcePathFile, destinationPathFile);
-            if (copyError) {
-                bail(copyError);
+                if (!QueueCopyJob(&copyPool, job)) {
+                    copyFailed = TRUE; // a copy has failed -- Finish() will give us its error
+                    break;
+                }
             }
-
-            // loop to next items
-            currentSourceDrive = currentSourceDrive->next;
-            currentSourceFilename = currentSourceFilename->next;
-            currentSourceFilenameWithoutDrive = currentSourceFilenameWithoutDrive->next;
-        } while (currentSourceDrive != nullptr && currentSourceFilename != nullptr && currentSourceFilenameWithoutDrive != nullptr);
+        }
     }
     else
     {
-        // multi-file mode
+        // whole folder mode -- walk every file set's source tree recursively at once, streaming files to the copy workers as they are found
+        std::vector<t_fileSetWalk> walks(fileSets.size());
+        unsigned int walkerThreads = std::max(1U, copyThreads / (unsigned int)fileSets.size());
+
+        // each file set's source is the path at the same index in the path table
+        assert(sourcePaths.Count() == fileSets.size());
+        std::chrono::steady_clock::time_point changesStart = std::chrono::steady_clock::now();
+        for (unsigned int set = 0; set < fileSets.size(); set++) {
+            t_snapshotVolume* snapshotVolume = FindSnapshotVolume(sourcePaths.Volume(sourcePaths.VolumeOf(set)).c_str());
+            assert(snapshotVolume != nullptr);
+
+            walks[set].copyPool = &copyPool;
+            walks[set].fileSet = set;
+            walks[set].sourceShadowPath = PlatformJoinPath(snapshotVolume->snapshotProp.m_pwszSnapshotDeviceObject, sourcePaths.Tail(set));
+            walks[set].walker.reset(new TreeWalker(walkerThreads, &WalkFileRoutine, &walks[set]));
+            walks[set].walker->SetMirrors(fileSets[set].mirrors);
+            walks[set].walker->SetFilter(fileSets[set].filter);
+            if (continueOnError) {
+                walks[set].walker->SetDirectoryFailureRoutine(&WalkDirectoryFailureRoutine);
+            }
+            if (fileSets[set].hasChangesSince) {
+                ReadChanges(walks[set], snapshotVolume->snapshotProp.m_pwszSnapshotDeviceObject);
+            }
+        }
+        if (changeFeedMode) {
+            phaseTimings.Record("Changes", PhaseTimings::MillisecondsSince(changesStart));
+        }
 
-        WCHAR sourcePathFile[MAX_PATH]{};
-        WCHAR destinationPathFile[MAX_PATH]{};
-        currentSourceFilenameWithoutDrive = sourceFilenamesWithoutDrives;
-        assert(currentSourceFilenameWithoutDrive != nullptr);
+        std::chrono::steady_clock::time_point walkStart = std::chrono::steady_clock::now();
+        std::vector<std::thread> walkThreads;
+        for (t_fileSetWalk& walk : walks) {
+            walkThreads.emplace_back([&walks, &walk] {
+                if (walk.changes) {
+                    walk.error = walk.walker->WalkChanges(walk.sourceShadowPath, fileSets[walk.fileSet].destination, walk.changes->Directories(), walk.changes->Trees());
+                }
+                else {
+                    walk.error = walk.walker->Walk(walk.sourceShadowPath, fileSets[walk.fileSet].destination);
+                }
+                if (walk.error) {
+                    for (t_fileSetWalk& other : walks) {
+                        other.walker->Cancel();
+                    }
+                }
+            });
+        }
+        for (std::thread& walkThread : walkThreads) {
+            walkThread.join();
+        }
+        phaseTimings.Record("Enumerate", PhaseTimings::MillisecondsSince(walkStart));
+
+        unsigned long long fileCount = 0;
+        unsigned long long directoryCount = 0;
+        unsigned long long excludedFiles = 0;
+        unsigned long long excludedDirectories = 0;
+        for (t_fileSetWalk& walk : walks) {
+            fileCount += walk.walker->FileCount();
+            directoryCount += walk.walker->DirectoryCount();
+            excludedFiles += walk.walker->ExcludedFileCount();
+            excludedDirectories += walk.walker->ExcludedDirectoryCount();
+            if (walk.error && walk.error != ERROR_OPERATION_ABORTED) {
+                copyPool.Cancel();
+                copyPool.Finish();
+                if (walk.walker->FileCount() == 0 && walk.walker->DirectoryCount() <= 1) {
+                    wprintf(L"Unable to find the first file in the source of %s.\n", fileSets[walk.fileSet].name.c_str());
+                    bail(SDEXIT_NO_FIRST_FILE_IN_SOURCE);
+                }
+                friendlyError(L"Failed to walk the source directory tree", walk.error); // friendlyError will bail
+            }
+        }
 
-        // calculate file paths
-        WCHAR sourceShadowPathWithWildcard[MAX_PATH] = L"";
-        WCHAR directorySpec[3] = L"";
-        StringCbPrintf(directorySpec, (3 * sizeof(WCHAR)) /* turns out this in bytes */, L"\\*"); // this adds the "*" wildcard to copy all items
+        if (!quiet) {
+            printf("Found %llu files in %llu directories in %zu file sets.\n", fileCount, directoryCount, fileSets.size());
+            if (excludedFiles > 0 || excludedDirectories > 0) {
+                printf("The filters left out %llu files and %llu directories, with everything below them.\n", excludedFiles, excludedDirectories);
+            }
+        }
+    }
 
-        StringCbPrintf(sourceShadowPathWithWildcard, MAX_PATH * sizeof(WCHAR), L"%s\\%s%s", snapshotProp.m_pwszSnapshotDeviceObject, currentSourceFilenameWithoutDrive->source, directorySpec);
+    // wait for the workers to drain the queue
+    copyError = copyPool.Finish();
+    activeCopyPool = nullptr;
+    runSummary.filesCopied = copyPool.CopiedCount();
+    runSummary.filesFailed = copyPool.FailedCount();
+    runSummary.peakQueueDepth = copyPool.PeakQueueDepth();
+    if (continueOnError) {
+        // the failures are in copyFailures, and the transient ones are retried while we still have the snapshot
+        runSummary.filesCopied += RetryFailedCopies();
+        runSummary.filesFailed = copyFailures.size();
+        copyError = 0;
+    }
+    phaseTimings.Record("Copy", PhaseTimings::MillisecondsSince(copyStart));
+    runSummary.copyMilliseconds = phaseTimings.Phases().back().milliseconds;
+    if (copyError) {
+        WriteRunMetrics(copyError);
+        bail(copyError);
+    }
 
-         
-        // find files in directory
-        HANDLE findHandle = INVALID_HANDLE_VALUE;
-        findHandle = FindFirstFile(sourceShadowPathWithWildcard, &findData);
+    // read everything back while the snapshot is still there to compare against, before the manifests vouch for it
+    if (verifyMode) {
+        VerifyBackup(selectedFilesMode);
+    }
 
-        if (findHandle == INVALID_HANDLE_VALUE) {
-            printf("Unable to find the first file in the source.\n");
-            bail(SDEXIT_NO_FIRST_FILE_IN_SOURCE);
+    for (t_fileSet& fileSet : fileSets) {
+        BOOL manifestSaved = FALSE;
+        if (incrementalMode || checksumMode) {
+            error = fileSet.currentManifest->Save(ManifestPathForDestination(fileSet.destination));
+            if (error) {
+                // the copies themselves succeeded -- the next run will just copy everything again
+                friendlyCopyError(L"Unable to save the manifest", ManifestPathForDestination(fileSet.destination).c_str(), error);
+                error = 0;
+            }
+            manifestSaved = error == 0;
         }
 
-        do {
-            if (wcscmp(findData.cFileName, L".") == 0 || wcscmp(findData.cFileName, L"..") == 0) {
-                continue;
+        // the change feed position vouches for the manifest, so it is only moved on once every file is safely in the
+        // destination. Otherwise the next run reads on from the older position, and looks at the failed files again.
+        if (fileSet.changeFeed != nullptr && manifestSaved && copyFailures.empty() && verifyFailures.empty()) {
+            error = SaveChangePosition(ChangePositionPathForDestination(fileSet.destination), fileSet.changesUntil, fileSet.filterSettings);
+            if (error) {
+                friendlyCopyError(L"Unable to save the change feed position", ChangePositionPathForDestination(fileSet.destination).c_str(), error);
+                printf("The next run will read on from the position before this one.\n");
+                error = 0;
             }
+        }
 
-            if (findData.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) {
-                // does not currently back up sub directories
-                if (!quiet) {
-                    printf("WARNING: ShadowDuplicator does not presently back up subdirectories.\n");
-                }
+        // every run leaves an index of what the destination holds, for --index to query
+        error = WriteManifestIndex(IndexPathForDestination(fileSet.destination), *fileSet.currentManifest, indexGenerations);
+        if (error) {
+            friendlyCopyError(L"Unable to write the index", IndexPathForDestination(fileSet.destination).c_str(), error);
+            error = 0;
+        }
+    }
+
+    if (!quiet) {
+        printf("Copied %llu files (%llu MiB) using %u threads.\n", runSummary.filesCopied, copiedBytes.load() / (1024 * 1024), copyThreads);
+        if (incrementalMode) {
+            printf("Skipped %llu unchanged files, saving %llu MiB of copying.\n", skippedFiles.load(), skippedBytes.load() / (1024 * 1024));
+        }
+        if (chunkStoreMode) {
+            printf("Stored %llu new chunks (%llu MiB) of the %llu chunks (%llu MiB) read. The rest were already in the chunk store.\n",
+                chunksStored.load(), chunkBytesStored.load() / (1024 * 1024), chunksSeen.load(), chunkBytesSeen.load() / (1024 * 1024));
+        }
+        if (compressionWorkers != nullptr && compressedBytesIn > 0) {
+            printf("Compressed %llu MiB to %llu MiB (%llu%%). %llu of %llu frames did not compress and were stored as they were.\n",
+                compressedBytesIn.load() / (1024 * 1024), compressedBytesOut.load() / (1024 * 1024), compressedBytesOut.load() * 100 / compressedBytesIn.load(),
+                compressedFramesStored.load(), compressedFrames.load());
+        }
+        if (deltaFiles > 0) {
+            printf("Delta copied %llu large files, writing %llu MiB of their %llu MiB.\n", deltaFiles.load(), deltaBytesWritten.load() / (1024 * 1024), deltaBytes.load() / (1024 * 1024));
+        }
+        if (resumedFiles > 0) {
+            printf("Resumed %llu interrupted copies, skipping %llu MiB already verified in the destination.\n", resumedFiles.load(), resumedBytes.load() / (1024 * 1024));
+        }
+        for (t_fileSet& fileSet : fileSets) {
+            if (fileSet.fanOut == nullptr) {
                 continue;
             }
-
-            // build source and destination path for files
-            StringCbPrintf((WCHAR*)&(sourcePathFile), MAX_PATH * sizeof(WCHAR), L"%s\\%s\\%s", snapshotProp.m_pwszSnapshotDeviceObject, currentSourceFilenameWithoutDrive->source, findData.cFileName);
-            StringCbPrintf((WCHAR*)&(destinationPathFile), MAX_PATH * sizeof(WCHAR), L"%s\\%s", destDirectory, findData.cFileName);
-
-            copyError = ShadowCopyFile(sourcePathFile, destinationPathFile);
-            if (copyError) {
-                bail(copyError);
+            for (size_t destination = 0; destination < fileSet.fanOut->DestinationCount(); destination++) {
+                t_fanOutStatistics statistics = fileSet.fanOut->Statistics(destination);
+                wprintf(L"Wrote %llu files (%llu MiB) to %s, %llu failed. The reader waited for it %llu times.\n", statistics.filesWritten, statistics.bytesWritten / (1024 * 1024),
+                    fileSet.fanOut->DestinationRoot(destination).c_str(), statistics.filesFailed, statistics.stalls);
             }
-
-        } while (FindNextFile(findHandle, &findData) != 0);
+        }
+        if (verifyMode && !chunkStoreMode && !compressMode) {
+            printf("Verified %llu files, comparing %llu MiB%s. %zu did not match.\n", verifiedFiles.load(), verifiedBytes.load() / (1024 * 1024),
+                verifySampleBlocks > 0 ? " of sampled blocks" : "", verifyFailures.size());
+        }
     }
     
     // free writer metadata
     result = backupComponents->FreeWriterMetadata();
     genericFailCheck("FreeWriterMetadata", result);
 
-    VssFreeSnapshotProperties(&snapshotProp);
+    FreeSnapshotVolumes();
 
-    if (!quiet) {
+    if (!verifyFailures.empty()) {
+        PrintVerifyFailures(); // even when quiet -- these files are in the backup but cannot be trusted
+    }
+    if (!copyFailures.empty()) {
+        PrintCopyFailures(); // even when quiet -- these are the files missing from the backup
+    }
+    else if (!quiet && verifyFailures.empty()) {
         printf("Completed all copy operations successfully.\n\n");
+    }
+    if (!quiet) {
         printf("Notifying VSS components of the completion of the backup...\n");
     }
 
     // set backup succeeded
 
-    asyncResult = E_FAIL;
     result = backupComponents->BackupComplete(&vssAsync);
     genericFailCheck("BackupComplete", result);
 
     shouldAbortBackupOnBail = FALSE;
 
-    while (asyncResult != VSS_S_ASYNC_CANCELLED && asyncResult != VSS_S_ASYNC_FINISHED) {
-        Sleep(SHORT_SLEEP);
-        result = vssAsync->QueryStatus(&asyncResult, NULL);
-        if (result != S_OK) {
-            printf("Unable to query vss async status -- %x\n", result);
-            bail(result);
-        }
+    assert(vssAsync != nullptr);
+    AwaitVssAsync("BackupComplete");
+
+    // final verification of writer status
+    VerifyWriterStatus();
+
+    if (!quiet) {
+        phaseTimings.Print();
+        printf("All operations completed.\n");
+    }
+
+    HRESULT exitCode = !verifyFailures.empty() ? SDEXIT_VERIFY_FAILED : !copyFailures.empty() ? SDEXIT_PARTIAL_SUCCESS : 0;
+    WriteRunMetrics(exitCode);
+    bail(exitCode);
+}
+
+/// <summary>
+/// Put the options and totals of a run back as they were when the process started, so that each job
+/// in service mode starts afresh.
+/// </summary>
+/// <param name=""></param>
+void ResetRunState(void)
+{
+    progressMarker = 0;
+    quiet = FALSE;
+    copyThreads = DEFAULT_COPY_THREADS;
+    copyThreadsFromCommandLine = FALSE;
+    blockSizeKiB = DEFAULT_BLOCK_SIZE_KIB;
+    queueDepth = DEFAULT_QUEUE_DEPTH;
+    bufferMemoryMiB = DEFAULT_BUFFER_MEMORY_MIB;
+    fanOutBufferMiB = DEFAULT_FANOUT_BUFFER_MIB;
+    blockSizeFromCommandLine = FALSE;
+    queueDepthFromCommandLine = FALSE;
+    bufferMemoryFromCommandLine = FALSE;
+    fanOutBufferFromCommandLine = FALSE;
+    unbufferedCopies = TRUE;
+    sparseCopies = TRUE;
+    deltaThresholdMiB = 0;
+    deltaThresholdFromCommandLine = FALSE;
+    deltaFiles = 0;
+    deltaBytes = 0;
+    deltaBytesWritten = 0;
+    journalThresholdMiB = DEFAULT_JOURNAL_THRESHOLD_MIB;
+    journalThresholdFromCommandLine = FALSE;
+    resumedFiles = 0;
+    resumedBytes = 0;
+    chunkStoreMode = FALSE;
+    chunksSeen = 0;
+    chunkBytesSeen = 0;
+    chunksStored = 0;
+    chunkBytesStored = 0;
+    compressMode = FALSE;
+    compressedBytesIn = 0;
+    compressedBytesOut = 0;
+    compressedFrames = 0;
+    compressedFramesStored = 0;
+    incrementalMode = FALSE;
+    changeFeedMode = FALSE;
+    changeLogPath.clear();
+    checksumMode = FALSE;
+    continueOnError = FALSE;
+    copyRetries = DEFAULT_COPY_RETRIES;
+    copyRetriesFromCommandLine = FALSE;
+    copyRetryJobs.clear();
+    copyFailures.clear();
+    verifyMode = FALSE;
+    verifySampleBlocks = 0;
+    verifiedFiles = 0;
+    verifiedBytes = 0;
+    verifyFailures.clear();
+    indexGenerations = DEFAULT_INDEX_GENERATIONS;
+    indexGenerationsFromCommandLine = FALSE;
+    phaseTimings = PhaseTimings();
+    metricsJsonPath.clear();
+    metricsPrometheusPath.clear();
+    throttleLimits = t_throttleLimits{};
+    readLimitFromCommandLine = FALSE;
+    writeLimitFromCommandLine = FALSE;
+    readIopsFromCommandLine = FALSE;
+    writeIopsFromCommandLine = FALSE;
+    throttleSchedule.clear();
+    throttleControlPath.clear();
+    runSummary = t_runSummary{};
+    copiedBytes = 0;
+    skippedFiles = 0;
+    skippedBytes = 0;
+}
+
+/// <summary>
+/// Run as a resident service -- run the jobs in the service INI file on their schedules, one at a time,
+/// and answer status, run and stop requests on the control pipe until asked to stop. The process, COM
+/// and the VSS libraries stay loaded from one job to the next. Each backup still needs its own backup
+/// components, as VSS allows only one backup per IVssBackupComponents.
+/// </summary>
+/// <param name="serviceINIPath">The service INI file, with a [Job.NAME] section for each job</param>
+/// <returns>0 once stopped, otherwise an error if the jobs could not be read or the control pipe could not be served</returns>
+HRESULT RunService(LPCWSTR serviceINIPath)
+{
+    WCHAR servicePath[MAX_PATH]{};
+    IniFile ini;
+    JobScheduler scheduler(&ServiceJobRoutine, nullptr);
+    DWORD serveError = ERROR_SUCCESS;
+
+    if (!GetFullPathNameW(serviceINIPath, MAX_PATH, servicePath, NULL) || !PathFileExistsW(servicePath)) {
+        DWORD error = GetLastError();
+        friendlyError(L"Failed to find the service INI file", error);
+    }
+    DWORD error = ini.Load(servicePath);
+    if (error) {
+        friendlyError(L"Failed to read the service INI file", error);
+    }
+
+    // job INI files are found relative to the service INI file
+    std::wstring serviceDirectory = servicePath;
+    serviceDirectory.resize(serviceDirectory.find_last_of(L'\\'));
+
+    std::wstring pipeName = ini.GetString(L"Service", L"Pipe", SERVICE_DEFAULT_PIPE);
+    for (const std::wstring& section : ini.Sections()) {
+        if (!IniNameHasPrefix(section, L"Job.")) {
+            continue;
+        }
+
+        std::wstring name = section.substr(wcslen(L"Job."));
+        std::wstring config = ini.GetString(section, L"Config", L"");
+        std::wstring schedule = ini.GetString(section, L"Schedule", L"");
+
+        std::wstring configPath = PathIsRelativeW(config.c_str()) ? PlatformJoinPath(serviceDirectory, config) : config;
+        if (config.empty() || !PathFileExistsW(configPath.c_str())) {
+            wprintf(L"The INI file of job %s, \"%s\", does not seem to exist.\n", name.c_str(), configPath.c_str());
+            return SDEXIT_INVALID_ARGS;
+        }
+        if (!scheduler.AddJob(name, configPath, PlatformToUtf8(schedule))) {
+            wprintf(L"The schedule of job %s, \"%s\", could not be understood, or there is another job of that name.\n", name.c_str(), schedule.c_str());
+            return SDEXIT_INVALID_ARGS;
+        }
+    }
+    if (scheduler.JobCount() == 0) {
+        printf("The service INI file has no [Job.NAME] sections.\n");
+        return SDEXIT_INVALID_ARGS;
+    }
+
+    HRESULT result = CoInitializeEx(NULL, COINIT_APARTMENTTHREADED);
+    if (result != S_OK) {
+        printf("Unable to initialize COM -- 0x%x\n", result);
+        return result;
+    }
+    comInitialized = TRUE;
+    serviceMode = TRUE;
+    serviceThreadId = std::this_thread::get_id();
+
+    std::thread controlThread([&] {
+        serveError = PlatformServeControl(pipeName, &ServiceControlRoutine, &scheduler);
+        if (serveError) {
+            friendlyCopyError(L"Unable to serve the control pipe", pipeName.c_str(), serveError);
+            scheduler.Stop();
+        }
+    });
+
+    wprintf(L"Running %zu jobs. Control pipe: %s\n", scheduler.JobCount(), pipeName.c_str());
+    scheduler.Run();
+    controlThread.join();
+
+    serviceMode = FALSE;
+    comInitialized = FALSE;
+    CoUninitialize();
+    return serveError;
+}
+
+/// <summary>
+/// Scheduler callback -- run one backup job, as if ShadowDuplicator had been run quietly with the job's INI file.
+/// </summary>
+/// <param name="job">The job</param>
+/// <param name="timings">Receives how long each phase of the backup took</param>
+/// <param name="context">Unused</param>
+/// <returns>The exit code the backup would have had</returns>
+HRESULT ServiceJobRoutine(const t_scheduledJob& job, std::string* timings, void* context)
+{
+    WCHAR program[] = L"ShadowDuplicator";
+    WCHAR quietSwitch[] = L"-q";
+    std::wstring config = job.config;
+    WCHAR* jobArgv[] = { program, quietSwitch, &config[0] };
+    HRESULT exitCode = S_OK;
+
+    wprintf(L"Starting job %s.\n", job.name.c_str());
+    try {
+        RunBackup(3, jobArgv);
+    }
+    catch (const t_backupExit& backupExit) {
+        exitCode = backupExit.exitCode;
+    }
+
+    for (const t_phaseTiming& timing : phaseTimings.Phases()) {
+        char phase[128];
+        snprintf(phase, sizeof(phase), "%s%s %.0f ms", timings->empty() ? "" : ", ", timing.phase.c_str(), timing.milliseconds);
+        *timings += phase;
+    }
+    wprintf(L"Job %s finished with exit code 0x%x.\n", job.name.c_str(), (unsigned int)exitCode);
+    return exitCode;
+}
+
+/// <summary>
+/// Control pipe callback -- answer a status, run or stop request.
+/// </summary>
+/// <param name="request">The request</param>
+/// <param name="reply">Receives the reply</param>
+/// <param name="context">The JobScheduler</param>
+/// <returns>FALSE once asked to stop</returns>
+BOOL ServiceControlRoutine(const std::string& request, std::string* reply, void* context)
+{
+    JobScheduler* scheduler = (JobScheduler*)context;
+    std::string command = request;
+
+    while (!command.empty() && (command.back() == '\r' || command.back() == ' ')) {
+        command.pop_back();
+    }
+
+    if (command == "status") {
+        *reply = scheduler->Status();
+    }
+    else if (command.compare(0, 4, "run ") == 0) {
+        *reply = scheduler->Trigger(PlatformFromUtf8(command.substr(4))) ? "Queued.\n" : "There is no job of that name.\n";
+    }
+    else if (command == "stop") {
+        scheduler->Stop();
+        *reply = "Stopping once the running job, if any, has finished.\n";
+        return FALSE;
+    }
+    else {
+        *reply = "Requests are status, run JOB and stop.\n";
+    }
+    return TRUE;
+}
+
+/// <summary>
+/// Send a request to a service running with --service and print its reply.
+/// </summary>
+/// <param name="argc">Number of arguments after --control</param>
+/// <param name="argv">Optionally --pipe=NAME, then the request -- status, run JOB or stop</param>
+/// <returns>0 on success, otherwise an error</returns>
+DWORD SendControlRequest(int argc, WCHAR** argv)
+{
+    std::wstring pipeName = SERVICE_DEFAULT_PIPE;
+    std::wstring request;
+    std::string reply;
+
+    if (argc > 0 && wcsncmp(argv[0], L"--pipe=", 7) == 0) {
+        pipeName = &argv[0][7];
+        argc--;
+        argv++;
+    }
+    for (int i = 0; i < argc; i++) {
+        request += (i > 0 ? L" " : L"") + std::wstring(argv[i]);
+    }
+    if (request.empty()) {
+        usage();
+        return SDEXIT_INVALID_ARGS;
+    }
+
+    DWORD error = PlatformControlRequest(pipeName, PlatformToUtf8(request), &reply);
+    if (error) {
+        friendlyCopyError(L"Unable to reach the service on the control pipe", pipeName.c_str(), error);
+        return error;
+    }
+    printf("%s", reply.c_str());
+    return ERROR_SUCCESS;
+}
+
+/// <summary>
+/// Write the metrics of the run, if they were asked for. A failure to write them is reported but does not fail the run.
+/// </summary>
+/// <param name="exitCode">The exit code the run is about to finish with</param>
+void WriteRunMetrics(HRESULT exitCode)
+{
+    DWORD error = ERROR_SUCCESS;
+
+    if (runMetrics == nullptr) {
+        return;
+    }
+
+    runSummary.milliseconds = PhaseTimings::MillisecondsSince(runStart);
+    runSummary.exitCode = exitCode;
+    runSummary.copyThreads = copyThreads;
+    runSummary.filesSkipped = skippedFiles;
+    runSummary.bytesCopied = copiedBytes;
+    runSummary.bytesSkipped = skippedBytes;
+
+    if (!metricsJsonPath.empty()) {
+        error = runMetrics->WriteJson(metricsJsonPath, runSummary, phaseTimings);
+        if (error) {
+            friendlyCopyError(L"Unable to write the metrics to", metricsJsonPath.c_str(), error);
+        }
+    }
+    if (!metricsPrometheusPath.empty()) {
+        error = runMetrics->WritePrometheus(metricsPrometheusPath, runSummary, phaseTimings);
+        if (error) {
+            friendlyCopyError(L"Unable to write the metrics to", metricsPrometheusPath.c_str(), error);
+        }
+    }
+}
+
+/// <summary>
+/// Copy worker pool callback -- copy one job with ShadowCopyFile and record it in this run's manifest.
+/// In continue-on-error mode a failure is recorded instead, to be retried later if it may be transient.
+/// </summary>
+/// <param name="job">The source and destination paths</param>
+/// <param name="context">The attempt at copying the file which this is, counting from 1</param>
+/// <returns>0 on success, or the DWORD from GetLastError() upon failure</returns>
+DWORD CopyJobRoutine(const t_copyJob& job, void* context)
+{
+    unsigned int attempt = *(const unsigned int*)context;
+    BOOL deltaCopy = deltaThresholdMiB > 0 && job.size >= (unsigned long long)deltaThresholdMiB * 1024 * 1024;
+    BOOL journalCopy = journalThresholdMiB > 0 && job.size >= (unsigned long long)journalThresholdMiB * 1024 * 1024;
+    DWORD checksum = 0;
+    t_fileSet& fileSet = fileSets[job.fileSet];
+    std::vector<std::wstring> mirrorPathFiles;
+
+    for (const std::wstring& mirror : fileSet.mirrors) {
+        mirrorPathFiles.push_back(PlatformJoinPath(mirror, job.relativePath));
+    }
+
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    DWORD error = ShadowCopyFile(job.source.c_str(), job.destination.c_str(), deltaCopy, journalCopy, fileSet.chunkStore, fileSet.fanOut, mirrorPathFiles, FileSetThrottle(job.fileSet), checksumMode ? &checksum : nullptr);
+    BOOL retry = continueOnError && error && attempt <= copyRetries && IsTransientCopyError(error);
+
+    // a file to be retried is recorded in the metrics only once we know how it ends
+    if (runMetrics != nullptr && !retry) {
+        runMetrics->RecordFile(fileSets.size() > 1 ? PlatformJoinPath(fileSet.name, job.relativePath) : job.relativePath, job.size, PhaseTimings::MillisecondsSince(start), error);
+    }
+    if (!error) {
+        fileSet.currentManifest->Record(job.relativePath, t_manifestEntry{ job.size, job.lastWriteTime, job.attributes, checksumMode, checksum });
+    }
+    else if (continueOnError) {
+        // left out of the manifest, so that an incremental run copies it again
+        std::lock_guard<std::mutex> lock(copyFailuresLock);
+        (retry ? copyRetryJobs : copyFailures).push_back(t_copyFailure{ job, error, attempt });
+    }
+    return error;
+}
+
+/// <summary>
+/// In continue-on-error mode, a directory below a file set's source which cannot be listed is recorded as a
+/// failure and passed over with everything below it, and the rest of the source is copied from the same snapshot.
+/// </summary>
+/// <param name="relativePath">The directory relative to the source</param>
+/// <param name="error">The error listing the directory or creating it in the destination</param>
+/// <param name="context">The t_fileSetWalk of the file set</param>
+/// <returns>TRUE, so that the walk carries on</returns>
+BOOL WalkDirectoryFailureRoutine(const std::wstring& relativePath, DWORD error, void* context)
+{
+    t_fileSetWalk* walk = (t_fileSetWalk*)context;
+    t_copyJob job{};
+
+    job.source = PlatformJoinPath(walk->sourceShadowPath, relativePath);
+    job.destination = PlatformJoinPath(fileSets[walk->fileSet].destination, relativePath);
+    job.relativePath = relativePath + PATH_SEPARATOR; // listed with a trailing separator, as a directory
+    job.fileSet = walk->fileSet;
+
+    // not retried -- the files below it were never found, so an incremental run copies them once it can be listed
+    if (runMetrics != nullptr) {
+        runMetrics->RecordFile(fileSets.size() > 1 ? PlatformJoinPath(fileSets[walk->fileSet].name, job.relativePath) : job.relativePath, 0, 0, error);
+    }
+    std::lock_guard<std::mutex> lock(copyFailuresLock);
+    copyFailures.push_back(t_copyFailure{ job, error, 1 });
+    return TRUE;
+}
+
+/// <summary>
+/// Whether a copy which failed with this error might succeed if tried again a little later -- a file
+/// locked for a moment, or a network destination which dropped out.
+/// </summary>
+/// <param name="error">The error from ShadowCopyFile</param>
+/// <returns>TRUE if the copy is worth retrying</returns>
+BOOL IsTransientCopyError(DWORD error)
+{
+    switch (error) {
+    case ERROR_SHARING_VIOLATION:
+    case ERROR_LOCK_VIOLATION:
+    case ERROR_NOT_READY:
+    case ERROR_SEM_TIMEOUT:
+    case ERROR_NETNAME_DELETED:
+    case ERROR_NETWORK_BUSY:
+    case ERROR_UNEXP_NET_ERR:
+    case ERROR_BAD_NET_RESP:
+    case ERROR_DEV_NOT_EXIST:
+    case ERROR_NO_SYSTEM_RESOURCES:
+    case ERROR_WORKING_SET_QUOTA:
+    case ERROR_TIMEOUT:
+        return TRUE;
+    default:
+        return FALSE;
+    }
+}
+
+/// <summary>
+/// In continue-on-error mode, copy again the files which failed with a transient error, in rounds, once
+/// every other file has been copied. The workers never wait out a backoff while other files are waiting
+/// to be copied; each round waits once, twice as long as the round before, and then copies its files in
+/// parallel. A large file copied with a journal carries on from where its failed attempt stopped.
+/// </summary>
+/// <param name=""></param>
+/// <returns>The number of files the retries copied</returns>
+unsigned long long RetryFailedCopies(void)
+{
+    unsigned long long copied = 0;
+
+    for (unsigned int attempt = 2; attempt <= copyRetries + 1; attempt++) {
+        std::vector<t_copyFailure> retries;
+        {
+            std::lock_guard<std::mutex> lock(copyFailuresLock);
+            retries.swap(copyRetryJobs);
+        }
+        if (retries.empty()) {
+            break;
+        }
+
+        DWORD backoff = std::min<DWORD>(COPY_RETRY_BACKOFF_MS << (attempt - 2), COPY_RETRY_MAX_BACKOFF_MS);
+        if (!quiet) {
+            printf("Retrying %zu files which failed with a transient error in %lu seconds (attempt %u of %u)...\n", retries.size(), backoff / 1000, attempt, copyRetries + 1);
+        }
+        Sleep(backoff);
+
+        CopyWorkerPool retryPool(copyThreads, &CopyJobRoutine, &CopyResultRoutine, &attempt, FALSE);
+        activeCopyPool = &retryPool;
+        for (t_copyFailure& failure : retries) {
+            retryPool.Submit(std::move(failure.job));
+        }
+        retryPool.Finish();
+        activeCopyPool = nullptr;
+        copied += retryPool.CopiedCount();
+    }
+    return copied;
+}
+
+/// <summary>
+/// Print the files which could not be copied in continue-on-error mode, in path order, with the error which stopped each.
+/// </summary>
+/// <param name=""></param>
+void PrintCopyFailures(void)
+{
+    std::sort(copyFailures.begin(), copyFailures.end(), [](const t_copyFailure& a, const t_copyFailure& b) {
+        return a.job.fileSet != b.job.fileSet ? a.job.fileSet < b.job.fileSet : a.job.relativePath < b.job.relativePath;
+    });
+
+    printf("\n%zu files or directories could not be copied. The rest of the backup is complete.\n", copyFailures.size());
+    for (const t_copyFailure& failure : copyFailures) {
+        LPCWSTR setName = fileSets.size() > 1 ? fileSets[failure.job.fileSet].name.c_str() : L"";
+        wprintf(L"  %s%s%s: 0x%x after %u attempt%s\n", setName, *setName ? L": " : L"", failure.job.relativePath.c_str(),
+            failure.error, failure.attempts, failure.attempts == 1 ? L"" : L"s");
+    }
+    printf("\n");
+}
+
+/// <summary>
+/// Read back every file in the destinations alongside its source in the snapshot and compare them, on the
+/// copy threads, before the manifests are saved. Every file in each manifest is verified, including those
+/// an incremental run found unchanged, so a clean verify vouches for the whole destination.
+/// </summary>
+/// <param name="selectedFilesMode">Whether the sources are the files in the path table, rather than one tree per file set</param>
+void VerifyBackup(BOOL selectedFilesMode)
+{
+    if (chunkStoreMode || compressMode) {
+        printf("--verify has no effect in chunk store mode or with --compress, which do not leave a copy of each file.\n");
+        return;
+    }
+    if (!quiet) {
+        printf("Verifying the copies against the shadow copy...\n");
+    }
+
+    std::chrono::steady_clock::time_point verifyStart = std::chrono::steady_clock::now();
+
+    // the jobs are all gathered before the pool starts, since its workers drop files from the manifests
+    std::vector<t_copyJob> jobs;
+    if (selectedFilesMode) {
+        // as in the copy, each file is read from its volume's snapshot and was copied under its own name
+        for (size_t index = 0; index < sourcePaths.Count(); index++) {
+            t_snapshotVolume* snapshotVolume = FindSnapshotVolume(sourcePaths.Volume(sourcePaths.VolumeOf(index)).c_str());
+            LPCWSTR tail = sourcePaths.Tail(index);
+            LPCWSTR baseName = wcsrchr(tail, L'\\') != nullptr ? wcsrchr(tail, L'\\') + 1 : tail;
+            t_manifestEntry entry{};
+            if (snapshotVolume == nullptr || !fileSets[0].currentManifest->Lookup(baseName, &entry)) {
+                continue; // the copy failed, and has been reported already
+            }
+
+            t_copyJob job{};
+            job.source = PlatformJoinPath(snapshotVolume->snapshotProp.m_pwszSnapshotDeviceObject, tail);
+            job.destination = PlatformJoinPath(destDirectory, baseName);
+            job.relativePath = baseName;
+            job.size = entry.size;
+            jobs.push_back(std::move(job));
+        }
+    }
+    else {
+        std::vector<std::pair<std::wstring, t_manifestEntry>> entries;
+        for (unsigned int set = 0; set < fileSets.size(); set++) {
+            t_snapshotVolume* snapshotVolume = FindSnapshotVolume(sourcePaths.Volume(sourcePaths.VolumeOf(set)).c_str());
+            std::wstring sourceShadowPath = PlatformJoinPath(snapshotVolume->snapshotProp.m_pwszSnapshotDeviceObject, sourcePaths.Tail(set));
+
+            // every mirror was written from the same read as the destination, and each copy is read back on its own
+            std::vector<std::wstring> destinations{ fileSets[set].destination };
+            destinations.insert(destinations.end(), fileSets[set].mirrors.begin(), fileSets[set].mirrors.end());
+
+            fileSets[set].currentManifest->Entries(&entries);
+            for (std::pair<std::wstring, t_manifestEntry>& entry : entries) {
+                for (const std::wstring& destination : destinations) {
+                    t_copyJob job{};
+                    job.source = PlatformJoinPath(sourceShadowPath, entry.first);
+                    job.destination = PlatformJoinPath(destination, entry.first);
+                    job.relativePath = entry.first;
+                    job.size = entry.second.size;
+                    job.fileSet = set;
+                    jobs.push_back(std::move(job));
+                }
+            }
+        }
+    }
+
+    CopyWorkerPool verifyPool(copyThreads, &VerifyJobRoutine, nullptr, nullptr, FALSE);
+    activeCopyPool = &verifyPool;
+    for (t_copyJob& job : jobs) {
+        verifyPool.Submit(std::move(job));
+    }
+    verifyPool.Finish();
+    activeCopyPool = nullptr;
+    phaseTimings.Record("Verify", PhaseTimings::MillisecondsSince(verifyStart));
+}
+
+/// <summary>
+/// Copy worker pool callback for the verify -- compare one file with its source. A file which does not
+/// match, or cannot be read back, is recorded and dropped from the manifest so the next run copies it again.
+/// </summary>
+/// <param name="job">The source and destination paths</param>
+/// <param name="context">Unused</param>
+/// <returns>0 if the file could be compared, otherwise the error reading it</returns>
+DWORD VerifyJobRoutine(const t_copyJob& job, void* context)
+{
+    t_verifyOptions options{};
+    options.queueDepth = queueDepth;
+    options.unbuffered = unbufferedCopies; // bypasses the cache, so the destination is read back from the disk
+    options.sampleBlocks = verifySampleBlocks;
+    options.throttle = FileSetThrottle(job.fileSet);
+
+    t_verifyResult result{};
+    DWORD error = VerifyFile(job.source, job.destination, options, *bufferPool, &result);
+    if (!error) {
+        verifiedFiles++;
+        verifiedBytes += result.bytesCompared;
+    }
+    if (error || result.mismatchCount > 0) {
+        // dropped from the manifest, so that an incremental run copies it to the destination and every mirror again
+        fileSets[job.fileSet].currentManifest->Remove(job.relativePath);
+        std::wstring mirror;
+        for (const std::wstring& mirrorRoot : fileSets[job.fileSet].mirrors) {
+            if (job.destination == PlatformJoinPath(mirrorRoot, job.relativePath)) {
+                mirror = mirrorRoot;
+            }
+        }
+        std::lock_guard<std::mutex> lock(verifyFailuresLock);
+        verifyFailures.push_back(t_verifyFailure{ job.fileSet, job.relativePath, std::move(mirror), error, std::move(result) });
+    }
+    return error;
+}
+
+/// <summary>
+/// Print the files which the verify found did not match their source, in path order, with the byte ranges which differ.
+/// </summary>
+/// <param name=""></param>
+void PrintVerifyFailures(void)
+{
+    std::sort(verifyFailures.begin(), verifyFailures.end(), [](const t_verifyFailure& a, const t_verifyFailure& b) {
+        return a.fileSet != b.fileSet ? a.fileSet < b.fileSet : a.relativePath < b.relativePath;
+    });
+
+    printf("\n%zu files did not match the shadow copy when read back.\n", verifyFailures.size());
+    for (const t_verifyFailure& failure : verifyFailures) {
+        LPCWSTR setName = fileSets.size() > 1 ? fileSets[failure.fileSet].name.c_str() : L"";
+        wprintf(L"  %s%s%s%s%s: ", setName, *setName ? L": " : L"", failure.relativePath.c_str(), failure.mirror.empty() ? L"" : L" in the mirror ", failure.mirror.c_str());
+        if (failure.error) {
+            wprintf(L"could not be read back, 0x%x\n", failure.error);
+            continue;
+        }
+        if (failure.result.sourceSize != failure.result.destinationSize) {
+            wprintf(L"%llu bytes, but the source is %llu; ", failure.result.destinationSize, failure.result.sourceSize);
+        }
+        wprintf(L"%llu range%s differ%s", failure.result.mismatchCount, failure.result.mismatchCount == 1 ? L"" : L"s", failure.result.mismatchCount == 1 ? L"s" : L"");
+        for (const t_fileRange& range : failure.result.mismatches) {
+            wprintf(L" [%llu, +%llu)", range.offset, range.length);
+        }
+        if (failure.result.mismatchCount > failure.result.mismatches.size()) {
+            wprintf(L" and %llu more", failure.result.mismatchCount - failure.result.mismatches.size());
+        }
+        wprintf(L"\n");
+    }
+    printf("\n");
+}
+
+/// <summary>
+/// Copy worker pool callback -- count the bytes of each file copied.
+/// </summary>
+/// <param name="result">The job and its outcome</param>
+/// <param name="context">Unused</param>
+void CopyResultRoutine(const t_copyResult& result, void* context)
+{
+    if (result.error) {
+        return;
+    }
+    copiedBytes += result.job->size;
+}
+
+/// <summary>
+/// Queue a file for copying, unless incremental mode finds it unchanged since the previous run.
+/// May be called from several walker threads at once.
+/// </summary>
+/// <param name="copyPool">The copy workers</param>
+/// <param name="job">The file, with the metadata found when it was enumerated</param>
+/// <returns>FALSE if the copy workers have stopped</returns>
+BOOL QueueCopyJob(CopyWorkerPool* copyPool, t_copyJob& job)
+{
+    if (incrementalMode) {
+        t_fileSet& fileSet = fileSets[job.fileSet];
+        t_manifestEntry entry{ job.size, job.lastWriteTime, job.attributes };
+        if (fileSet.previousManifest->Matches(job.relativePath, entry)) {
+            fileSet.previousManifest->Lookup(job.relativePath, &entry); // the file is unchanged, so its checksum carries over
+            fileSet.currentManifest->Record(job.relativePath, entry);
+            skippedFiles++;
+            skippedBytes += job.size;
+            return TRUE;
+        }
+    }
+    return copyPool->Submit(std::move(job));
+}
+
+/// <summary>
+/// Tree walker callback -- queue each file found in the source tree for copying.
+/// </summary>
+/// <param name="job">The source and destination paths of the file</param>
+/// <param name="entry">The directory entry for the file</param>
+/// <param name="context">The t_fileSetWalk of the file set being walked</param>
+/// <returns>FALSE if the copy workers have stopped, so the walk should stop too</returns>
+BOOL WalkFileRoutine(t_copyJob& job, const t_directoryEntry& entry, void* context)
+{
+    t_fileSetWalk* walk = (t_fileSetWalk*)context;
+    job.fileSet = walk->fileSet;
+    return QueueCopyJob(walk->copyPool, job);
+}
+
+/// <summary>
+/// Rebuild a file from its recipe in a chunk store.
+/// </summary>
+/// <param name="recipePath">The recipe, somewhere below the destination directory which holds the chunk store</param>
+/// <param name="outputPathFile">The file to write</param>
+/// <returns>0 on success, or the DWORD error upon failure</returns>
+DWORD RestoreFromRecipe(LPCWSTR recipePath, LPCWSTR outputPathFile)
+{
+    WCHAR fullRecipePath[MAX_PATH]{};
+    DWORD error = 0;
+
+    if (!GetFullPathNameW(recipePath, MAX_PATH, fullRecipePath, nullptr)) {
+        error = GetLastError();
+        friendlyCopyError(L"Failed to get the full path of the recipe", recipePath, error);
+        return error;
+    }
 
-        if (!quiet) {
-            OutputDebugString(L"Waiting for BackupComplete status...\n");
-            spinProgress();
-        }
+    error = ChunkRestoreFile(fullRecipePath, outputPathFile);
+    if (error == ERROR_PATH_NOT_FOUND) {
+        wprintf(L"No chunk store was found above the recipe \"%s\".\n", fullRecipePath);
+    }
+    else if (error) {
+        friendlyCopyError(L"Failed to restore", outputPathFile, error);
     }
+    return error;
+}
 
-    // final verification of writer status
-    VerifyWriterStatus();
+/// <summary>
+/// Rebuild a file from its compressed copy, decompressing on every core.
+/// </summary>
+/// <param name="compressedPathFile">The compressed copy</param>
+/// <param name="outputPathFile">The file to write</param>
+/// <returns>0 on success, or the DWORD error upon failure</returns>
+DWORD RestoreFromCompressed(LPCWSTR compressedPathFile, LPCWSTR outputPathFile)
+{
+    CompressionWorkers workers(PlatformProcessorCount());
 
-    if (!quiet) {
-        printf("All operations completed.\n");
+    DWORD error = DecompressFile(compressedPathFile, outputPathFile, workers);
+    if (error) {
+        friendlyCopyError(L"Failed to decompress to", outputPathFile, error);
     }
+    return error;
+}
 
-    bail(0);
+/// <summary>
+/// Run one of the index queries -- list INDEX [PATH_PREFIX], lookup INDEX PATH [PATH ...] or diff OLDER_INDEX NEWER_INDEX.
+/// </summary>
+/// <param name="argc">The number of arguments after --index</param>
+/// <param name="argv">The arguments after --index</param>
+/// <returns>0 on success, ERROR_FILE_NOT_FOUND if a lookup found nothing, SDEXIT_INVALID_ARGS, or another error</returns>
+DWORD QueryIndex(int argc, WCHAR** argv)
+{
+    if ((argc == 2 || argc == 3) && wcscmp(argv[0], L"list") == 0) {
+        return IndexList(argv[1], argc == 3 ? argv[2] : L"");
+    }
+    if (argc >= 3 && wcscmp(argv[0], L"lookup") == 0) {
+        return IndexLookup(argv[1], std::vector<std::wstring>(argv + 2, argv + argc));
+    }
+    if (argc == 3 && wcscmp(argv[0], L"diff") == 0) {
+        return IndexDiff(argv[1], argv[2]);
+    }
+    usage();
+    return SDEXIT_INVALID_ARGS;
 }
 
 /// <summary>
-/// Perform the copy of a file from the source path to the destination.
+/// Perform the copy of a file from the source path to the destination. May be called from several
+/// copy worker threads at once.
 /// </summary>
 /// <param name="sourcePathFile">The source path, with the VSS snapshot device object already substituted in</param>
 /// <param name="destinationPathFile">The destination path</param>
+/// <param name="deltaCopy">Rewrite only the blocks of the destination which have changed since the last run</param>
+/// <param name="journalCopy">Keep a progress journal, and resume from it if an earlier copy was interrupted</param>
+/// <param name="chunkStore">Optional. The chunk store of the file's destination, to write a recipe in place of the file.</param>
+/// <param name="fanOut">Optional. Writes the file to the destination and its mirrors at once, in place of every other kind of copy.</param>
+/// <param name="mirrorPathFiles">The paths in each mirror to write alongside destinationPathFile, when fanOut is given</param>
+/// <param name="throttle">Optional. Paces the copy's reads and writes.</param>
+/// <param name="checksum">Optional. Receives the CRC32C of the file, computed as it is copied.</param>
 /// <returns>0 on success, or the DWORD from GetLastError() upon failure</returns>
-DWORD ShadowCopyFile(WCHAR  sourcePathFile[MAX_PATH], WCHAR  destinationPathFile[MAX_PATH])
+DWORD ShadowCopyFile(LPCWSTR sourcePathFile, LPCWSTR destinationPathFile, BOOL deltaCopy, BOOL journalCopy, ChunkStore* chunkStore, FanOutWriter* fanOut, const std::vector<std::wstring>& mirrorPathFiles, IoThrottle* throttle, DWORD* checksum)
 {
     DWORD error = 0;
 
     if (!quiet) {
-        wprintf(L"%s -> %s\n", sourcePathFile, destinationPathFile);
+        if (fanOut != nullptr) {
+            wprintf(L"%s -> %s (mirrored to %zu more)\n", sourcePathFile, destinationPathFile, mirrorPathFiles.size());
+        }
+        else {
+            wprintf(L"%s -> %s\n", sourcePathFile, destinationPathFile);
+        }
     }
 
-    BOOL copyResult = CopyFileEx(sourcePathFile, destinationPathFile, (LPPROGRESS_ROUTINE)&copyProgress, NULL, FALSE, 0);
-
-    if (!copyResult) {
-        error = GetLastError();
-        if (error) {
-            friendlyCopyError(L"Failed to copy to ", destinationPathFile, error); // friendlyCopyError does not bail for us
+    t_blockCopyOptions options{};
+    options.queueDepth = queueDepth;
+    options.unbuffered = unbufferedCopies;
+    options.sparse = sparseCopies;
+    options.throttle = throttle;
+
+    // the determinate progress line is only readable when one file is copied at a time
+    BOOL showProgress = !quiet && copyThreads == 1;
+
+    if (fanOut != nullptr) {
+        std::vector<std::wstring> destinations{ destinationPathFile };
+        std::vector<DWORD> errors;
+        destinations.insert(destinations.end(), mirrorPathFiles.begin(), mirrorPathFiles.end());
+        error = fanOut->CopyFile(sourcePathFile, destinations, options, *bufferPool, checksum, &errors, showProgress ? &copyProgress : nullptr, nullptr);
+
+        // each destination which failed is named, since the others may well have been written
+        BOOL reported = FALSE;
+        for (size_t destination = 0; destination < errors.size(); destination++) {
+            if (errors[destination]) {
+                friendlyCopyError(L"Failed to copy to ", destinations[destination].c_str(), errors[destination]);
+                reported = TRUE;
+            }
+        }
+        if (reported) {
             return error;
         }
     }
+    else if (chunkStore != nullptr) {
+        t_chunkStatistics statistics{};
+        error = ChunkCopyFile(sourcePathFile, std::wstring(destinationPathFile) + CHUNK_RECIPE_EXTENSION, options, *bufferPool, *chunkStore, &statistics, checksum, showProgress ? &copyProgress : nullptr, nullptr);
+        if (!error) {
+            chunksSeen += statistics.chunks;
+            chunkBytesSeen += statistics.bytes;
+            chunksStored += statistics.chunksStored;
+            chunkBytesStored += statistics.bytesStored;
+        }
+    }
+    else if (compressionWorkers != nullptr) {
+        t_compressionStatistics statistics{};
+        error = CompressCopyFile(sourcePathFile, std::wstring(destinationPathFile) + COMPRESSED_EXTENSION, options, *bufferPool, *compressionWorkers, &statistics, checksum, showProgress ? &copyProgress : nullptr, nullptr);
+        if (!error) {
+            compressedBytesIn += statistics.bytesIn;
+            compressedBytesOut += statistics.bytesOut;
+            compressedFrames += statistics.frames;
+            compressedFramesStored += statistics.framesStored;
+        }
+    }
+    else if (deltaCopy) {
+        t_deltaStatistics statistics{};
+        error = DeltaCopyFile(sourcePathFile, destinationPathFile, options, *bufferPool, &statistics, checksum, showProgress ? &copyProgress : nullptr, nullptr);
+        if (!error) {
+            deltaFiles++;
+            deltaBytes += statistics.bytes;
+            deltaBytesWritten += statistics.bytesWritten;
+        }
+    }
+    else if (journalCopy) {
+        t_journalStatistics statistics{};
+        error = JournalCopyFile(sourcePathFile, destinationPathFile, options, *bufferPool, &statistics, checksum, showProgress ? &copyProgress : nullptr, nullptr);
+        if (!error && statistics.resumedBytes > 0) {
+            resumedFiles++;
+            resumedBytes += statistics.resumedBytes;
+        }
+    }
+    else {
+        error = BlockCopyFile(sourcePathFile, destinationPathFile, options, *bufferPool, checksum, showProgress ? &copyProgress : nullptr, nullptr);
+    }
+
+    if (error) {
+        friendlyCopyError(L"Failed to copy to ", destinationPathFile, error); // friendlyCopyError does not bail for us
+    }
 
     return error;
 }
@@ -792,9 +2135,8 @@ void friendlyError(LPCWSTR ourErrorDescription, const DWORD error)
         MAX_PATH,
         NULL);
 
-    assert(errorBuffer != nullptr);
-
-    wprintf(L"%s: 0x%x %s", ourErrorDescription, error, errorBuffer);
+    // with no explanation for the code, the code alone is shown
+    wprintf(L"%s: 0x%x %s", ourErrorDescription, error, errorBuffer ? errorBuffer : L"\n");
     LocalFree(errorBuffer);
     errorBuffer = nullptr;
 
@@ -807,7 +2149,7 @@ void friendlyError(LPCWSTR ourErrorDescription, const DWORD error)
 /// </summary>
 /// <param name="ourErrorDescription">The ShadowDuplicator error description</param>
 /// <param name="error">The error code as returned from GetLastError()</param>
-void friendlyCopyError(LPCWSTR ourErrorDescription, LPWSTR destinationFile, const DWORD error)
+void friendlyCopyError(LPCWSTR ourErrorDescription, LPCWSTR destinationFile, const DWORD error)
 {
     LPTSTR errorBuffer = nullptr;
 
@@ -819,9 +2161,9 @@ void friendlyCopyError(LPCWSTR ourErrorDescription, LPWSTR destinationFile, cons
         MAX_PATH,
         NULL);
 
-    assert(errorBuffer != nullptr);
-
-    wprintf(L"%s \"%s\": 0x%x %s", ourErrorDescription, destinationFile, error, errorBuffer);
+    // called from the copy workers too, so a code with no explanation must not assert (which bails) --
+    // the code alone is shown
+    wprintf(L"%s \"%s\": 0x%x %s", ourErrorDescription, destinationFile, error, errorBuffer ? errorBuffer : L"\n");
     LocalFree(errorBuffer);
     errorBuffer = nullptr;
 }
@@ -843,44 +2185,446 @@ void genericFailCheck(const char* operationName, HRESULT result) {
 /// </summary>
 /// <param name=""></param>
 void FreeSourceStructures(void) {
-    t_sourceList* tempNextItem;
-
-    currentSourceDrive = sourceDrives;
-    currentSourceFilename = sourceFilenames;
-    currentSourceFilenameWithoutDrive = sourceFilenamesWithoutDrives;
-
-    while (currentSourceDrive != nullptr) {
-        tempNextItem = currentSourceDrive->next;
-        free(currentSourceDrive->source);
-        currentSourceDrive->source = nullptr;
-        free(currentSourceDrive);
-        currentSourceDrive = tempNextItem;
-    }
-
-    while (currentSourceFilename != nullptr) {
-        tempNextItem = currentSourceFilename->next;
-        free(currentSourceFilename->source);
-        currentSourceFilename->source = nullptr;
-        free(currentSourceFilename);
-        currentSourceFilename = tempNextItem;
-    }
-    while (currentSourceFilenameWithoutDrive != nullptr) {
-        tempNextItem = currentSourceFilenameWithoutDrive->next;
-        free(currentSourceFilenameWithoutDrive->source);
-        currentSourceFilenameWithoutDrive->source = nullptr;
-        free(currentSourceFilenameWithoutDrive);
-        currentSourceFilenameWithoutDrive = tempNextItem;
-    }
-
-    sourceDrives = nullptr;
-    sourceFilenames = nullptr;
-    sourceFilenamesWithoutDrives = nullptr;
-    currentSourceDrive = nullptr;
-    currentSourceFilename = nullptr;
-    currentSourceFilenameWithoutDrive = nullptr;
-    previousSourceDrive = nullptr;
-    previousSourceFilename = nullptr;
-    previousSourceFilenameWithoutDrive = nullptr;
+    sourcePaths.Clear();
+    lastSourceDirectory.clear();
+    lastSourceVolume.clear();
+    filesFromPath.clear();
+}
+
+/// <summary>
+/// Add a source path to the path table, with the volume it is on. The path need not fit in MAX_PATH.
+/// </summary>
+/// <param name="path">The source path, which may be relative to the current directory</param>
+/// <returns>0 on success, or the DWORD from GetLastError() upon failure</returns>
+DWORD AddSourcePath(LPCWSTR path)
+{
+    DWORD length = GetFullPathNameW(path, 0, nullptr, nullptr);
+    if (length == 0) {
+        return GetLastError();
+    }
+    std::wstring fullPath(length, L'\0');
+    length = GetFullPathNameW(path, length, &fullPath[0], nullptr);
+    if (length == 0) {
+        return GetLastError();
+    }
+    fullPath.resize(length);
+
+    // files listed together are usually in the same directories, which are on the same volume
+    std::wstring directory = fullPath.substr(0, fullPath.find_last_of(L'\\'));
+    if (directory != lastSourceDirectory || lastSourceVolume.empty()) {
+        std::wstring volume(fullPath.size() + 2, L'\0'); // room for the trailing backslash the volume path is given
+        if (!GetVolumePathNameW(fullPath.c_str(), &volume[0], (DWORD)volume.size())) {
+            return GetLastError();
+        }
+        volume.resize(wcslen(volume.c_str()));
+        lastSourceDirectory = directory;
+        lastSourceVolume = volume;
+    }
+
+    sourcePaths.Add(lastSourceVolume, fullPath);
+    return ERROR_SUCCESS;
+}
+
+/// <summary>
+/// Path list callback -- add each source file named by --files-from.
+/// </summary>
+/// <param name="path">The path of a source file</param>
+/// <param name="context">A DWORD which receives the error, if the path could not be added</param>
+/// <returns>FALSE if the path could not be added, so the list should not be read any further</returns>
+BOOL FilesFromRoutine(const std::wstring& path, void* context)
+{
+    DWORD error = AddSourcePath(path.c_str());
+    if (error) {
+        friendlyCopyError(L"Failed to find the volume of the source file", path.c_str(), error);
+        *(DWORD*)context = error;
+        return FALSE;
+    }
+    return TRUE;
+}
+
+/// <summary>
+/// Find the entry for a volume in the snapshot set.
+/// </summary>
+/// <param name="volume">The volume path, as from GetVolumePathNameW</param>
+/// <returns>The volume's entry, or nullptr if it has not been added to the set</returns>
+t_snapshotVolume* FindSnapshotVolume(LPCWSTR volume) {
+    for (t_snapshotVolume* snapshotVolume = snapshotVolumes; snapshotVolume != nullptr; snapshotVolume = snapshotVolume->next) {
+        if (_wcsicmp(snapshotVolume->volume, volume) == 0) {
+            return snapshotVolume;
+        }
+    }
+    return nullptr;
+}
+
+/// <summary>
+/// Free the volumes of the snapshot set and their snapshot properties.
+/// </summary>
+/// <param name=""></param>
+void FreeSnapshotVolumes(void) {
+    t_snapshotVolume* tempNextItem;
+
+    while (snapshotVolumes != nullptr) {
+        tempNextItem = snapshotVolumes->next;
+        if (snapshotVolumes->hasSnapshotProp) {
+            VssFreeSnapshotProperties(&snapshotVolumes->snapshotProp);
+        }
+        free(snapshotVolumes->volume);
+        free(snapshotVolumes);
+        snapshotVolumes = tempNextItem;
+    }
+    snapshotVolumeCount = 0;
+}
+
+/// <summary>
+/// Add a file set read from the INI file, adding its source to the path table so that its volume
+/// joins the snapshot set along with those of the other file sets.
+/// </summary>
+/// <param name="section">The INI section of the file set, [FileSet] or [FileSet.NAME]</param>
+/// <param name="source">The source directory</param>
+/// <param name="destinations">The destination directory, then any mirrors of it</param>
+void AddFileSet(const std::wstring& section, const std::wstring& source, const std::vector<std::wstring>& destinations)
+{
+    DWORD error = 0;
+
+    if (source.empty()) {
+        wprintf(L"No source directory was specified in [%s].\n", section.c_str());
+        bail(SDEXIT_NO_SOURCE_SPECIFIED);
+    }
+
+    error = AddSourcePath(source.c_str());
+    if (error) {
+        friendlyCopyError(L"Failed to find the volume of the source directory", source.c_str(), error);
+        bail(error);
+    }
+
+    t_fileSet fileSet{};
+    fileSet.name = IniNameHasPrefix(section, L"FileSet.") ? section.substr(wcslen(L"FileSet.")) : section;
+    if (destinations.size() > MAX_FANOUT_DESTINATIONS) {
+        wprintf(L"[%s] may have at most %d Destination entries.\n", section.c_str(), MAX_FANOUT_DESTINATIONS);
+        bail(SDEXIT_INVALID_ARGS);
+    }
+    if (!destinations.empty()) {
+        fileSet.destination = destinations[0]; // the manifest, index and chunk store live in the first
+        fileSet.mirrors.assign(destinations.begin() + 1, destinations.end());
+    }
+    fileSets.push_back(fileSet);
+}
+
+/// <summary>
+/// Read a whole number option from the [Options] section of the INI file, or from [FileSet] where
+/// older INI files keep their options.
+/// </summary>
+/// <param name="ini">The loaded INI file</param>
+/// <param name="key">The option name</param>
+/// <param name="defaultValue">Returned if neither section has the option</param>
+/// <returns>The option's value</returns>
+long OptionInt(const IniFile& ini, LPCWSTR key, long defaultValue)
+{
+    return ini.GetInt(ini.HasKey(L"Options", key) ? L"Options" : L"FileSet", key, defaultValue);
+}
+
+/// <summary>
+/// Read a decimal option from [Options], or from [FileSet].
+/// </summary>
+/// <param name="ini">The loaded INI file</param>
+/// <param name="key">The option name</param>
+/// <param name="defaultValue">Returned if neither section has the option</param>
+/// <returns>The option's value</returns>
+double OptionDouble(const IniFile& ini, LPCWSTR key, double defaultValue)
+{
+    return ini.GetDouble(ini.HasKey(L"Options", key) ? L"Options" : L"FileSet", key, defaultValue);
+}
+
+/// <summary>
+/// Read a text option from [Options], or from [FileSet].
+/// </summary>
+/// <param name="ini">The loaded INI file</param>
+/// <param name="key">The option name</param>
+/// <param name="defaultValue">Returned if neither section has the option</param>
+/// <returns>The option's value</returns>
+std::wstring OptionString(const IniFile& ini, LPCWSTR key, LPCWSTR defaultValue)
+{
+    return ini.GetString(ini.HasKey(L"Options", key) ? L"Options" : L"FileSet", key, defaultValue);
+}
+
+/// <summary>
+/// Open the change feed of a file set and note where it is now, then decide whether the position saved
+/// by the previous run can be read on from. If it cannot, the whole source is walked this time, and
+/// the position noted now is saved for the next run.
+/// </summary>
+/// <param name="set">The file set, which is also the index of its source in the path table</param>
+void OpenChangeFeed(unsigned int set)
+{
+    t_fileSet& fileSet = fileSets[set];
+    std::wstring source = sourcePaths.FullPath(set);
+    LPCWSTR reason = nullptr;
+    DWORD settings = 0;
+    DWORD error = 0;
+
+    // a file can age past MinAge or MaxAge without changing, so no change feed would say so
+    if (fileSet.filter != nullptr && (fileSet.filter->Limits().oldestWriteTime != 0 || fileSet.filter->Limits().newestWriteTime != 0)) {
+        if (!quiet) {
+            wprintf(L"All of %s will be walked, as MinAge and MaxAge cannot be used with a change feed.\n", source.c_str());
+        }
+        return;
+    }
+
+    fileSet.changeFeed = new ChangeFeed();
+    error = changeLogPath.empty() ? fileSet.changeFeed->OpenJournal(sourcePaths.Volume(sourcePaths.VolumeOf(set))) : fileSet.changeFeed->OpenLog(changeLogPath);
+    if (!error) {
+        error = fileSet.changeFeed->QueryPosition(&fileSet.changesUntil);
+    }
+    if (error) {
+        delete fileSet.changeFeed;
+        fileSet.changeFeed = nullptr;
+        if (error == ERROR_JOURNAL_NOT_ACTIVE) {
+            wprintf(L"The volume %s has no USN journal. It can be started with: fsutil usn createjournal m=0x20000000 a=0x4000000 %.2s\n",
+                sourcePaths.Volume(sourcePaths.VolumeOf(set)).c_str(), sourcePaths.Volume(sourcePaths.VolumeOf(set)).c_str());
+        }
+        else {
+            friendlyCopyError(L"Unable to open the change feed for", source.c_str(), error);
+        }
+        wprintf(L"All of %s will be walked.\n", source.c_str());
+        return;
+    }
+
+    error = LoadChangePosition(ChangePositionPathForDestination(fileSet.destination), &fileSet.changesSince, &settings);
+    if (error == ERROR_FILE_NOT_FOUND || error == ERROR_PATH_NOT_FOUND) {
+        reason = L"no change feed position was saved by a previous run";
+    }
+    else if (error) {
+        reason = L"the change feed position saved by the previous run could not be read";
+    }
+    else if (fileSet.previousManifest->Count() == 0) {
+        reason = L"there is no manifest from the previous run to carry over";
+    }
+    else if (settings != fileSet.filterSettings) {
+        reason = L"the Include and Exclude patterns or size limits have changed since the previous run";
+    }
+    else if (fileSet.changesSince.feedId != fileSet.changesUntil.feedId) {
+        reason = L"the change feed is not the one the previous run read";
+    }
+
+    if (reason != nullptr) {
+        if (!quiet) {
+            wprintf(L"All of %s will be walked, as %s.\n", source.c_str(), reason);
+        }
+        return;
+    }
+    fileSet.hasChangesSince = TRUE;
+}
+
+/// <summary>
+/// Carry-over routine for ReadChanges -- a file is carried over unless its directory is to be walked again.
+/// </summary>
+BOOL CarryOverRoutine(const std::wstring& relativePath, void* context)
+{
+    return !((const ChangeSet*)context)->Covers(relativePath);
+}
+
+/// <summary>
+/// Read what has changed in a file set's source since the previous run, and carry the files of the previous
+/// manifest which none of it touches over into this run's. The walk is left with the changes, so that only
+/// those directories are walked. If the changes cannot be read, the whole source is walked as usual.
+/// </summary>
+/// <param name="walk">The walk of the file set</param>
+/// <param name="snapshotDeviceObject">The snapshot of the source's volume, in which the USN journal's file IDs are looked up</param>
+void ReadChanges(t_fileSetWalk& walk, LPCWSTR snapshotDeviceObject)
+{
+    t_fileSet& fileSet = fileSets[walk.fileSet];
+    std::wstring source = sourcePaths.FullPath(walk.fileSet);
+    std::unique_ptr<ChangeSet> changes(new ChangeSet(fileSet.changeFeed->IsJournal() ? std::wstring(sourcePaths.Tail(walk.fileSet)) : source));
+
+    DWORD error = fileSet.changeFeed->Read(fileSet.changesSince, std::wstring(snapshotDeviceObject) + L"\\", changes.get());
+    if (error == ERROR_JOURNAL_ENTRY_DELETED) {
+        if (!quiet) {
+            wprintf(L"All of %s will be walked, as the change feed no longer holds every change since the previous run.\n", source.c_str());
+        }
+        return;
+    }
+    if (error) {
+        friendlyCopyError(L"Unable to read the changes to", source.c_str(), error);
+        wprintf(L"All of %s will be walked.\n", source.c_str());
+        return;
+    }
+    changes->Finish();
+    if (changes->Everything()) {
+        if (!quiet) {
+            wprintf(L"All of %s will be walked, as the source itself has moved since the previous run.\n", source.c_str());
+        }
+        return;
+    }
+
+    size_t carried = fileSet.currentManifest->CarryOver(*fileSet.previousManifest, &CarryOverRoutine, changes.get());
+    if (!quiet) {
+        wprintf(L"Read %llu changes to %s since the previous run. Listing %zu directories and walking %zu trees, and carrying over %zu unchanged files.\n",
+            changes->ChangeCount(), source.c_str(), changes->Directories().size(), changes->Trees().size(), carried);
+    }
+    walk.changes = std::move(changes);
+}
+
+/// <summary>
+/// Compile the Include and Exclude patterns of a file set, those in [Options] followed by its own, along
+/// with its size and age limits. A limit in the file set's section takes the place of one in [Options].
+/// </summary>
+/// <param name="ini">The loaded INI file</param>
+/// <param name="section">The INI section of the file set</param>
+/// <param name="settings">Receives a checksum of the patterns and size limits, which changes whenever they do</param>
+/// <returns>The filter, or nullptr if the file set has no patterns or limits</returns>
+PathFilter* LoadFileSetFilter(const IniFile& ini, const std::wstring& section, DWORD* settings)
+{
+    std::vector<std::wstring> includes;
+    std::vector<std::wstring> excludes;
+    t_filterLimits limits{};
+    const unsigned long long fileTimePerDay = 24ULL * 60 * 60 * 10000000;
+
+    for (const std::wstring& source : { std::wstring(L"Options"), section }) {
+        std::vector<std::wstring> values = ini.GetStrings(source, L"Include");
+        includes.insert(includes.end(), values.begin(), values.end());
+        values = ini.GetStrings(source, L"Exclude");
+        excludes.insert(excludes.end(), values.begin(), values.end());
+    }
+
+    LPCWSTR sizeKeys[] = { L"MinSize", L"MaxSize" };
+    unsigned long long* sizeLimits[] = { &limits.minSize, &limits.maxSize };
+    for (size_t i = 0; i < 2; i++) {
+        std::wstring text = ini.HasKey(section, sizeKeys[i]) ? ini.GetString(section, sizeKeys[i], L"") : ini.GetString(L"Options", sizeKeys[i], L"");
+        if (!text.empty() && !FilterParseSize(text, sizeLimits[i])) {
+            wprintf(L"%s = %s for [%s] is not a size, such as 4096, 64K or 2G.\n", sizeKeys[i], text.c_str(), section.c_str());
+            bail(SDEXIT_INVALID_ARGS);
+        }
+    }
+
+    // ages are in days before now -- MaxAge leaves out older files and MinAge newer ones
+    double maxAge = ini.GetDouble(ini.HasKey(section, L"MaxAge") ? section.c_str() : L"Options", L"MaxAge", 0);
+    double minAge = ini.GetDouble(ini.HasKey(section, L"MinAge") ? section.c_str() : L"Options", L"MinAge", 0);
+    unsigned long long now = PlatformCurrentFileTime();
+    if (maxAge > 0) {
+        limits.oldestWriteTime = now - std::min(now, (unsigned long long)(maxAge * fileTimePerDay));
+    }
+    if (minAge > 0) {
+        limits.newestWriteTime = now - std::min(now - 1, (unsigned long long)(minAge * fileTimePerDay));
+    }
+
+    // the ages are left out, since a filter with them is never used with a change feed
+    std::wstring described;
+    for (const std::wstring& include : includes) {
+        described += L"Include\t" + include + L"\n";
+    }
+    for (const std::wstring& exclude : excludes) {
+        described += L"Exclude\t" + exclude + L"\n";
+    }
+    described += std::to_wstring(limits.minSize) + L"\t" + std::to_wstring(limits.maxSize);
+    *settings = ChecksumUpdate(0, described.data(), described.size() * sizeof(wchar_t));
+
+    if (includes.empty() && excludes.empty() && limits.minSize == 0 && limits.maxSize == 0 && limits.oldestWriteTime == 0 && limits.newestWriteTime == 0) {
+        return nullptr;
+    }
+
+    PathFilter* filter = new PathFilter();
+    DWORD error = filter->Compile(includes, excludes);
+    if (error) {
+        delete filter;
+        wprintf(L"The Include and Exclude patterns for [%s] are too complex to compile together. Try fewer patterns with * in the middle.\n", section.c_str());
+        bail(SDEXIT_INVALID_ARGS);
+    }
+    filter->SetLimits(limits);
+    return filter;
+}
+
+/// <summary>
+/// Make the throttle of a file set whose section has its own ReadLimit, WriteLimit, ReadIops, WriteIops,
+/// ThrottleSchedule or ThrottleControl, so that it is paced apart from the other file sets. Each of those it
+/// does not have is the run's, and a limit given on the command line applies to every file set.
+/// </summary>
+/// <param name="ini">The loaded INI file</param>
+/// <param name="section">The INI section of the file set</param>
+/// <param name="throttle">Receives the file set's throttle, or nullptr if its settings leave it unthrottled</param>
+/// <returns>TRUE if the file set has throttle settings of its own, FALSE if it shares the run's throttle</returns>
+BOOL LoadFileSetThrottle(const IniFile& ini, const std::wstring& section, IoThrottle** throttle)
+{
+    LPCWSTR limitKeys[] = { L"ReadLimit", L"WriteLimit", L"ReadIops", L"WriteIops" };
+    BOOL limitsFromCommandLine[] = { readLimitFromCommandLine, writeLimitFromCommandLine, readIopsFromCommandLine, writeIopsFromCommandLine };
+    t_throttleLimits limits = throttleLimits;
+    double* limitValues[] = { &limits.readMBps, &limits.writeMBps, &limits.readIops, &limits.writeIops };
+    BOOL own = FALSE;
+
+    *throttle = nullptr;
+    if (IniNameEquals(section, L"FileSet")) {
+        return FALSE; // the settings in a plain [FileSet] are already the run's
+    }
+
+    for (size_t i = 0; i < 4; i++) {
+        if (ini.HasKey(section, limitKeys[i])) {
+            own = TRUE;
+            if (!limitsFromCommandLine[i]) {
+                *limitValues[i] = ini.GetDouble(section, limitKeys[i], 0);
+            }
+        }
+    }
+
+    std::vector<t_throttleWindow> schedule = throttleSchedule;
+    if (ini.HasKey(section, L"ThrottleSchedule")) {
+        own = TRUE;
+        std::wstring scheduleText = ini.GetString(section, L"ThrottleSchedule", L"");
+        if (!ThrottleParseSchedule(PlatformToUtf8(scheduleText), &schedule)) {
+            wprintf(L"ThrottleSchedule for [%s] could not be understood: \"%s\"\n", section.c_str(), scheduleText.c_str());
+            bail(SDEXIT_INVALID_ARGS);
+        }
+    }
+
+    std::wstring controlPath = throttleControlPath;
+    if (ini.HasKey(section, L"ThrottleControl")) {
+        own = TRUE;
+        controlPath = ini.GetString(section, L"ThrottleControl", L"");
+    }
+
+    if (own && (ThrottleLimitsActive(limits) || !schedule.empty() || !controlPath.empty())) {
+        *throttle = new IoThrottle(limits, schedule, controlPath);
+    }
+    return own;
+}
+
+/// <summary>
+/// The throttle which paces the copy and verify of a file set's files -- its own if it has one, otherwise the run's.
+/// </summary>
+/// <param name="set">The index of the file set</param>
+/// <returns>The throttle, or nullptr if the file set's copies are not throttled</returns>
+IoThrottle* FileSetThrottle(unsigned int set)
+{
+    return fileSets[set].ownThrottle ? fileSets[set].throttle : ioThrottle;
+}
+
+/// <summary>
+/// Free the manifests and chunk stores of the file sets and forget the sets.
+/// </summary>
+/// <param name=""></param>
+void FreeFileSets(void)
+{
+    for (t_fileSet& fileSet : fileSets) {
+        if (fileSet.previousManifest != nullptr) {
+            delete fileSet.previousManifest;
+        }
+        if (fileSet.currentManifest != nullptr) {
+            delete fileSet.currentManifest;
+        }
+        if (fileSet.chunkStore != nullptr) {
+            delete fileSet.chunkStore;
+        }
+        if (fileSet.fanOut != nullptr) {
+            delete fileSet.fanOut;
+        }
+        if (fileSet.filter != nullptr) {
+            delete fileSet.filter;
+        }
+        if (fileSet.changeFeed != nullptr) {
+            delete fileSet.changeFeed;
+        }
+        if (fileSet.throttle != nullptr) {
+            delete fileSet.throttle;
+        }
+    }
+    fileSets.clear();
 }
 
 /// <summary>
@@ -888,6 +2632,12 @@ void FreeSourceStructures(void) {
 /// </summary>
 /// <param name="exitCode">The exit code to provide to the OS.</param>
 void bail(HRESULT exitCode) {
+    if (activeCopyPool != nullptr) {
+        activeCopyPool->Cancel();
+        activeCopyPool->Finish();
+        activeCopyPool = nullptr;
+    }
+
     FreeSourceStructures();
     if (destDirectory != nullptr) {
         free(destDirectory);
@@ -903,9 +2653,28 @@ void bail(HRESULT exitCode) {
         snapshotSetId = nullptr;
     }
 
-    if (snapshotId != nullptr) {
-        free(snapshotId);
-        snapshotId = nullptr;
+    FreeSnapshotVolumes();
+
+    if (bufferPool != nullptr) {
+        delete bufferPool;
+        bufferPool = nullptr;
+    }
+
+    FreeFileSets();
+
+    if (compressionWorkers != nullptr) {
+        delete compressionWorkers;
+        compressionWorkers = nullptr;
+    }
+
+    if (runMetrics != nullptr) {
+        delete runMetrics;
+        runMetrics = nullptr;
+    }
+
+    if (ioThrottle != nullptr) {
+        delete ioThrottle;
+        ioThrottle = nullptr;
     }
 
     if (vssAsync != nullptr) {
@@ -920,6 +2689,7 @@ void bail(HRESULT exitCode) {
             if (abortResult != S_OK) {
                 wprintf(L"Failed to abort the backup with error 0x%x\n", abortResult);
             }
+            shouldAbortBackupOnBail = FALSE;
         }
 
         // free writer metadata
@@ -929,45 +2699,63 @@ void bail(HRESULT exitCode) {
         backupComponents = nullptr;
     }
     
+    if (serviceMode && std::this_thread::get_id() == serviceThreadId) {
+        throw t_backupExit{ exitCode }; // caught by ServiceJobRoutine, which keeps COM initialized for the next job
+    }
+
     if (comInitialized) {
         CoUninitialize();
     }
     exit(exitCode);
 }
 
+/// <summary>
+/// Wait for the VSS asynchronous operation in vssAsync to complete, keeping the spinner turning, then
+/// release it. Bails if the operation failed, was cancelled or did not complete before the deadline.
+/// </summary>
+/// <param name="phase">The name of the operation, for messages and the phase timings</param>
+void AwaitVssAsync(const char* phase) {
+    OutputDebugStringA(phase);
+    OutputDebugStringA(" -- waiting for VSS status...\n");
+
+    HRESULT result = AwaitAsync(vssAsync, phase, &phaseTimings, ASYNC_DEFAULT_DEADLINE_MS, quiet ? nullptr : &AsyncWaitProgress, nullptr);
+    vssAsync->Release();
+    vssAsync = nullptr;
+
+    if (result == VSS_S_ASYNC_CANCELLED) {
+        printf("Operation was cancelled.\n");
+        bail(result);
+    }
+    if (result == ASYNC_E_TIMEOUT) {
+        printf("%s did not complete within %d minutes, so was cancelled.\n", phase, ASYNC_DEFAULT_DEADLINE_MS / 60000);
+        bail(result);
+    }
+    if (FAILED(result)) {
+        printf("%s failed -- %x\n", phase, result);
+        bail(result);
+    }
+}
+
+/// <summary>
+/// Called by AwaitAsync while a VSS operation is in progress.
+/// </summary>
+/// <param name="context">Unused</param>
+void AsyncWaitProgress(void* context) {
+    spinProgress();
+}
+
 /// <summary>
 /// Verify the VSS writers are all in the correct state.
 /// </summary>
 /// <param name=""></param>
 void VerifyWriterStatus(void) {
     HRESULT result = E_FAIL;
-    HRESULT asyncResult = E_FAIL;
 
     // verify writer status
     result = backupComponents->GatherWriterStatus(&vssAsync);
     genericFailCheck("GatherWriterStatus", result);
     assert(vssAsync != nullptr);
-    while (asyncResult != VSS_S_ASYNC_CANCELLED && asyncResult != VSS_S_ASYNC_FINISHED) {
-        Sleep(SHORT_SLEEP);
-        result = vssAsync->QueryStatus(&asyncResult, NULL);
-        if (result != S_OK) {
-            printf("Unable to query vss async status -- %x\n", result);
-            vssAsync->Release();
-            vssAsync = nullptr;
-            bail(result);
-        }
-        if (!quiet) {
-            OutputDebugString(L"Waiting for GatherWriterStatus VSS status...\n");
-            spinProgress();
-        }
-    }
-
-    if (asyncResult == VSS_S_ASYNC_CANCELLED) {
-        printf("Operation was cancelled.");
-        vssAsync->Release();
-        vssAsync = nullptr;
-        bail(asyncResult);
-    }
+    AwaitVssAsync("GatherWriterStatus");
 
     // get count of writers
     UINT writerCount = 0;
@@ -975,8 +2763,6 @@ void VerifyWriterStatus(void) {
     if (result != S_OK) {
         printf("Unable to get count of writers -- %x\n", result);
         backupComponents->FreeWriterStatus();
-        vssAsync->Release();
-        vssAsync = nullptr;
         bail(result);
     }
 
@@ -993,8 +2779,6 @@ void VerifyWriterStatus(void) {
             printf("Unable to get status of VSS writer %i -- %x\n", i, result);
             SysFreeString(nameOfWriter); //safe even if nameOfWriter == nullptr
             backupComponents->FreeWriterStatus();
-            vssAsync->Release();
-            vssAsync = nullptr;
             bail(result);
         }
 
@@ -1015,8 +2799,6 @@ void VerifyWriterStatus(void) {
 
         SysFreeString(nameOfWriter);
         backupComponents->FreeWriterStatus();
-        vssAsync->Release();
-        vssAsync = nullptr;
         bail(vssFailure);
     }
 
@@ -1056,9 +2838,25 @@ void usage(void) {
     printf("Usage: ShadowDuplicator.exe [OPTIONS] INI-FILE\n");
     printf(" or selected files mode:\n");
     printf("Usage: ShadowDuplicator.exe -s SOURCE [SOURCE2 [SOURCE3] ...] DEST_DIRECTORY\n");
+    printf("       ShadowDuplicator.exe --files-from=LIST [SOURCE ...] DEST_DIRECTORY\n");
+    printf(" or to restore a file from a chunk store:\n");
+    printf("Usage: ShadowDuplicator.exe --restore RECIPE OUTPUT_FILE\n");
+    printf(" or to restore a compressed file:\n");
+    printf("Usage: ShadowDuplicator.exe --decompress COMPRESSED_FILE OUTPUT_FILE\n");
+    printf(" or to list, look up or compare the files recorded in indexes:\n");
+    printf("Usage: ShadowDuplicator.exe --index list INDEX [PATH_PREFIX]\n");
+    printf("       ShadowDuplicator.exe --index lookup INDEX PATH [PATH ...]\n");
+    printf("       ShadowDuplicator.exe --index diff OLDER_INDEX NEWER_INDEX\n");
+    printf(" or to check the checksum, hash and compression code against known answers:\n");
+    printf("Usage: ShadowDuplicator.exe --selftest\n");
+    printf(" or to run as a resident service, running the jobs in SERVICE-INI-FILE on their schedules:\n");
+    printf("Usage: ShadowDuplicator.exe --service SERVICE-INI-FILE\n");
+    printf(" or to ask a running service for the status of its jobs, to run a job now or to stop:\n");
+    printf("Usage: ShadowDuplicator.exe --control [--pipe=NAME] status|run JOB|stop\n");
     printf("\n");
     printf("Whole Folder Mode Example:  ShadowDuplicator.exe -q BackupConfig.ini\n");
     printf("Selected Files Example: ShadowDuplicator.exe -q -s SourceFile.txt SourceFile2.txt D:\\DestDirectory\n");
+    printf("File List Example: dir /s /b C:\\Data\\*.mdb | ShadowDuplicator.exe -q --files-from=- D:\\DestDirectory\n");
     printf("\n");
     printf("\n");
     printf("\n");
@@ -1066,11 +2864,59 @@ void usage(void) {
     printf("-h, --help, -?, /?, --usage     Print this help message\n");
     printf("-q                              Silence the banner and any progress messages\n");
     printf("-s, --selected                  Selected files mode -- copy source files to the destination directory (the last command line argument)\n");
+    printf("--files-from=LIST               Selected files mode, with the source files read from LIST, one to a line (- for standard input)\n");
+    printf("--threads=N                     Copy N files at once (default %d, maximum %d)\n", DEFAULT_COPY_THREADS, MAX_COPY_THREADS);
+    printf("--block-size=KIB                Size of each copy block in KiB (default %d)\n", DEFAULT_BLOCK_SIZE_KIB);
+    printf("--queue-depth=N                 Keep N block reads in flight per file (default %d)\n", DEFAULT_QUEUE_DEPTH);
+    printf("--buffer-memory=MIB             Cap on memory for copy buffers across all threads (default %d)\n", DEFAULT_BUFFER_MEMORY_MIB);
+    printf("--fanout-buffer=MIB             Cap on memory for blocks waiting to be written to mirrored destinations, on top of --buffer-memory (default %d)\n", DEFAULT_FANOUT_BUFFER_MIB);
+    printf("--buffered                      Copy through the system cache instead of bypassing it\n");
+    printf("--no-sparse                     Read holes and write zeros in full instead of leaving the destination sparse\n");
+    printf("--incremental                   Skip files unchanged since the previous run, using its manifest\n");
+    printf("--change-feed                   Incremental, walking only what the USN journal says changed since the previous run\n");
+    printf("--change-log=FILE               As --change-feed, with the changes read from the change log FILE instead\n");
+    printf("--checksums                     Record a CRC32C of each file, computed as it is copied, in the manifest\n");
+    printf("--verify                        Read every file back from each destination and compare it with the shadow copy before finishing\n");
+    printf("--verify-sample[=N]             Verify only N blocks spread across each file (default %d)\n", DEFAULT_VERIFY_SAMPLE_BLOCKS);
+    printf("--continue-on-error             Carry on past files which fail to copy, and list them at the end (exit code 0x20000007)\n");
+    printf("--retries=N                     With --continue-on-error, retry transient failures N times (default %d)\n", DEFAULT_COPY_RETRIES);
+    printf("--delta-threshold=MIB           Rewrite only the changed blocks of files of at least MIB MiB (default 0, off)\n");
+    printf("--journal-threshold=MIB         Journal the progress of files of at least MIB MiB so an interrupted copy resumes (default %d, 0 off)\n", DEFAULT_JOURNAL_THRESHOLD_MIB);
+    printf("--chunk-store                   Store files as deduplicated chunks, with a recipe in place of each file\n");
+    printf("--compress                      Write a compressed copy of each file, compressed on every core\n");
+    printf("--read-limit=MB, --write-limit=MB  Limit the copy's reads or writes to MB (10^6 bytes) per second\n");
+    printf("--read-iops=N, --write-iops=N   Limit the copy's reads or writes to N operations per second\n");
+    printf("--throttle-control=FILE         Take the limits from FILE, e.g. \"read=50 write=50\", whenever it exists\n");
+    printf("--index-generations=N           Keep N earlier indexes of the destination beside the latest (default %d)\n", DEFAULT_INDEX_GENERATIONS);
+    printf("--metrics-json=FILE             Write the timings, totals and every file copied to FILE as JSON\n");
+    printf("--metrics-prom=FILE             Write the timings and totals to FILE for the Prometheus textfile collector\n");
     printf("\n");
     printf("The path to the INI file or any source file must not begin with '-'.\n");
     printf("The INI file should be as follows:\n\n");
-    printf("[FileSet]\nSource = C:\\Users\\Public\\Documents\nDestination = D:\\test\n");
+    printf("[FileSet.Documents]\nSource = C:\\Users\\Public\\Documents\nDestination = D:\\test\n\n");
+    printf("[FileSet.Projects] (optional -- any number of file sets, all copied from the one snapshot set)\nSource = E:\\Projects\nDestination = D:\\projects\nDestination = F:\\projects (optional -- repeat Destination to write mirrors from the one read)\n\n");
+    printf("[Options]\n");
+    printf("Threads = 4 (optional -- the number of files to copy at once)\n");
+    printf("BlockSize, QueueDepth, BufferMemory, Unbuffered = 0 or 1 and Sparse = 0 or 1 are also optional, as for the command line.\n");
+    printf("Incremental = 1 (optional -- skip files unchanged since the previous run)\n");
+    printf("ChangeFeed = 1 and ChangeLog = FILE (optional -- as --change-feed and --change-log)\n");
+    printf("Checksums = 1 (optional -- as --checksums)\n");
+    printf("Verify = 1 and VerifySample = 16 (optional -- as --verify and --verify-sample)\n");
+    printf("ContinueOnError = 1 and Retries = 3 (optional -- as --continue-on-error and --retries)\n");
+    printf("DeltaThreshold = 1024 (optional -- as --delta-threshold)\n");
+    printf("JournalThreshold = 4096 (optional -- as --journal-threshold)\n");
+    printf("FanOutBuffer = 256 (optional -- as --fanout-buffer)\n");
+    printf("ChunkStore = 1 (optional -- as --chunk-store)\n");
+    printf("Compress = 1 (optional -- as --compress)\n");
+    printf("ReadLimit, WriteLimit (MB/s), ReadIops, WriteIops and ThrottleControl = FILE (optional -- as the command line)\n");
+    printf("ThrottleSchedule = 07:00-19:00 read=20 write=20; 19:00-07:00 read=200 (optional -- limits by local time of day)\n");
+    printf("The throttle settings may also be given in one file set's section, to pace that file set apart from the others.\n");
+    printf("IndexGenerations = 7 (optional -- as --index-generations)\n");
+    printf("MetricsJson = D:\\metrics\\backup.json and MetricsPrometheus = D:\\metrics\\backup.prom (optional -- as --metrics-json and --metrics-prom)\n");
+    printf("Include = *.docx and Exclude = node_modules\\ (optional -- repeat either; in [Options] for every file set, or in one file set's section)\n");
+    printf("MinSize = 1K, MaxSize = 2G, MinAge = 1 and MaxAge = 30 days (optional -- copy only files within these limits)\n");
     printf("Do not include trailing slashes in paths.\n");
+    printf("A single [FileSet] section, with the options in it instead of [Options], also works.\n");
     printf("\n");
     printf("In selected-files mode, you must provide the destination directory path only.\n");
     printf("\n");
@@ -1087,9 +2933,11 @@ void usage(void) {
     printf("0x20000001 | 536870913 | No destination directory specified on command line.\n");
     printf("0x20000002 | 536870914 | Could not find any files in the source directory.\n");
     printf("0x20000003 | 536870915 | No source file or directory specified on command line.\n");
-    printf("0x20000004 | 536870916 | All source files must be on the same volume. This error\n");
-    printf("           |           | is returned if this constraint is violated.\n");
+    printf("0x20000004 | 536870916 | No longer returned. Sources may be on different volumes.\n");
     printf("0x20000005 | 536870917 | The command line arguments were not understood.\n");
+    printf("0x20000006 | 536870918 | --selftest found a wrong answer.\n");
+    printf("0x20000007 | 536870919 | --continue-on-error copied the snapshot, but some files could not be copied.\n");
+    printf("0x20000008 | 536870920 | --verify found files which did not match the shadow copy.\n");
 }
 
 /// <summary>
@@ -1123,41 +2971,18 @@ void spinProgress(void) {
 /// </summary>
 /// <param name="total">Total number of bytes</param>
 /// <param name="transferred">Number of bytes transferred</param>
-void determinateProgress(LARGE_INTEGER total, LARGE_INTEGER transferred) {
-    LONGLONG totalLong = total.QuadPart;
-    totalLong /= 1024 * 1024;
-    LONGLONG transferredLong = transferred.QuadPart;
-    transferredLong /= 1024 * 1024;
-
-    printf("%lld/%lld MiB copied... \r", transferredLong, totalLong);
+void determinateProgress(unsigned long long total, unsigned long long transferred) {
+    printf("%llu/%llu MiB copied... \r", transferred / (1024 * 1024), total / (1024 * 1024));
 }
 
 /// <summary>
 /// Callback for the file copy progress.
 /// </summary>
-/// <param name="TotalFileSize"></param>
-/// <param name="TotalBytesTransferred"></param>
-/// <param name="StreamSize"></param>
-/// <param name="StreamBytesTransferred"></param>
-/// <param name="dwStreamNumber"></param>
-/// <param name="dwCallbackReason"></param>
-/// <param name="hSourceFile"></param>
-/// <param name="hDestinationFile"></param>
-/// <param name="lpData"></param>
-/// <returns></returns>
-LPPROGRESS_ROUTINE copyProgress(
-    LARGE_INTEGER TotalFileSize,
-    LARGE_INTEGER TotalBytesTransferred,
-    LARGE_INTEGER StreamSize,
-    LARGE_INTEGER StreamBytesTransferred,
-    DWORD dwStreamNumber,
-    DWORD dwCallbackReason,
-    HANDLE hSourceFile,
-    HANDLE hDestinationFile,
-    LPVOID lpData
-) {
+/// <param name="totalBytes">Size of the file being copied</param>
+/// <param name="transferredBytes">Bytes copied so far</param>
+/// <param name="context">Unused</param>
+void copyProgress(unsigned long long totalBytes, unsigned long long transferredBytes, void* context) {
     if (!quiet) {
-        determinateProgress(TotalFileSize, TotalBytesTransferred);
+        determinateProgress(totalBytes, transferredBytes);
     }
-    return PROGRESS_CONTINUE;
 }
\ No newline at end of file
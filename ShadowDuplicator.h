@@ -16,25 +16,150 @@ is no warranty.
 #include <vswriter.h>
 #include <vsbackup.h>
 #include <cassert>
+#include <atomic>
+#include <memory>
+#include "AsyncWait.h"
+#include "BlockCopy.h"
+#include "ChangeFeed.h"
+#include "Checksum.h"
+#include "ChunkStore.h"
+#include "CopyEngine.h"
+#include "Compression.h"
+#include "Delta.h"
+#include "FanOut.h"
+#include "IniFile.h"
+#include "Journal.h"
+#include "Manifest.h"
+#include "ManifestIndex.h"
+#include "Metrics.h"
+#include "PathFilter.h"
+#include "PathTable.h"
+#include "Scheduler.h"
+#include "SelfTest.h"
+#include "Throttle.h"
+#include "TreeWalker.h"
+#include "Verify.h"
 
+// A volume in the snapshot set, with the snapshot taken of it. Linked list structure.
+typedef struct snapshotVolume {
+    LPWSTR volume; // as from GetVolumePathNameW, with its trailing backslash
+    unsigned int index;
+    VSS_ID snapshotId;
+    VSS_SNAPSHOT_PROP snapshotProp;
+    BOOL hasSnapshotProp;
+    struct snapshotVolume* next;
+} t_snapshotVolume;
+
+// One source directory copied to its own destination. Each destination keeps its own manifest, index
+// and chunk store, but every file set is copied from the one snapshot set. A file set with mirrors has
+// each file read once and written to the destination and every mirror at the same time.
+typedef struct fileSet {
+    std::wstring name; // the INI section name after "FileSet.", or the section name itself
+    std::wstring destination;
+    std::vector<std::wstring> mirrors; // the further destinations, given by repeating Destination
+    FanOutWriter* fanOut; // writes the destination and the mirrors together, if there are mirrors
+    PathFilter* filter; // the Include and Exclude patterns and limits, if there are any
+    DWORD filterSettings; // a checksum of the patterns and size limits, saved with the change feed position
+    BOOL ownThrottle; // the section has throttle limits, a schedule or a control file of its own
+    IoThrottle* throttle; // with its own settings, paces this file set alone -- nullptr if they leave it unthrottled
+    Manifest* previousManifest;
+    Manifest* currentManifest;
+    ChunkStore* chunkStore;
+    ChangeFeed* changeFeed; // in change feed mode, the USN journal of the source's volume or the change log
+    BOOL hasChangesSince; // the position saved with the previous manifest can be read on from
+    t_changePosition changesSince;
+    t_changePosition changesUntil; // taken before the snapshot, and saved for the next run if this one succeeds
+} t_fileSet;
+
+// In continue-on-error mode, a file whose copy fails with a transient error is tried again up to this many
+// times once everything else has been copied. The wait before the first retry doubles for each one after,
+// up to COPY_RETRY_MAX_BACKOFF_MS, so that the most retries cannot keep the snapshot for long.
+#define DEFAULT_COPY_RETRIES 3
+#define MAX_COPY_RETRIES 10
+#define COPY_RETRY_BACKOFF_MS 2000
+#define COPY_RETRY_MAX_BACKOFF_MS 30000
+
+// A file which failed to copy in continue-on-error mode, waiting to be retried or given up on
+typedef struct copyFailure {
+    t_copyJob job;
+    DWORD error;
+    unsigned int attempts;
+} t_copyFailure;
+
+// A file which --verify found did not match its source, or could not read back
+typedef struct verifyFailure {
+    unsigned int fileSet;
+    std::wstring relativePath;
+    std::wstring mirror; // the mirror whose copy did not match, or empty for the destination
+    DWORD error;
+    t_verifyResult result;
+} t_verifyFailure;
+
+// The walk of one file set's source tree, which runs alongside the walks of the others
+typedef struct fileSetWalk {
+    CopyWorkerPool* copyPool;
+    unsigned int fileSet;
+    std::wstring sourceShadowPath;
+    std::unique_ptr<TreeWalker> walker;
+    std::unique_ptr<ChangeSet> changes; // what changed since the previous run, when only that is walked
+    DWORD error;
+} t_fileSetWalk;
+
+// The control pipe a service listens on unless its INI file names another
+#define SERVICE_DEFAULT_PIPE L"ShadowDuplicator"
+
+// Thrown by bail in service mode to end the job which is running, instead of exiting the process
+typedef struct backupExit {
+    HRESULT exitCode;
+} t_backupExit;
+
+void RunBackup(int argc, WCHAR** argv);
+void ResetRunState(void);
+HRESULT RunService(LPCWSTR serviceINIPath);
+HRESULT ServiceJobRoutine(const t_scheduledJob& job, std::string* timings, void* context);
+BOOL ServiceControlRoutine(const std::string& request, std::string* reply, void* context);
+DWORD SendControlRequest(int argc, WCHAR** argv);
+DWORD CopyJobRoutine(const t_copyJob& job, void* context);
+void CopyResultRoutine(const t_copyResult& result, void* context);
+BOOL IsTransientCopyError(DWORD error);
+unsigned long long RetryFailedCopies(void);
+void PrintCopyFailures(void);
+void VerifyBackup(BOOL selectedFilesMode);
+DWORD VerifyJobRoutine(const t_copyJob& job, void* context);
+void PrintVerifyFailures(void);
+BOOL QueueCopyJob(CopyWorkerPool* copyPool, t_copyJob& job);
+BOOL WalkFileRoutine(t_copyJob& job, const t_directoryEntry& entry, void* context);
+BOOL WalkDirectoryFailureRoutine(const std::wstring& relativePath, DWORD error, void* context);
 void genericFailCheck(const char* operationName, HRESULT result);
 void friendlyError(LPCWSTR ourErrorDescription, const DWORD error);
-DWORD ShadowCopyFile(WCHAR  sourcePathFile[260], WCHAR  destinationPathFile[260]);
-void friendlyCopyError(LPCWSTR ourErrorDescription, LPWSTR destinationFile, const DWORD error);
+DWORD ShadowCopyFile(LPCWSTR sourcePathFile, LPCWSTR destinationPathFile, BOOL deltaCopy, BOOL journalCopy, ChunkStore* chunkStore, FanOutWriter* fanOut, const std::vector<std::wstring>& mirrorPathFiles, IoThrottle* throttle, DWORD* checksum);
+DWORD RestoreFromRecipe(LPCWSTR recipePath, LPCWSTR outputPathFile);
+DWORD RestoreFromCompressed(LPCWSTR compressedPathFile, LPCWSTR outputPathFile);
+DWORD QueryIndex(int argc, WCHAR** argv);
+void friendlyCopyError(LPCWSTR ourErrorDescription, LPCWSTR destinationFile, const DWORD error);
 void bail(HRESULT exitCode);
 void banner(void);
 void usage(void);
 void spinProgress(void);
-LPPROGRESS_ROUTINE copyProgress(
-	LARGE_INTEGER TotalFileSize,
-	LARGE_INTEGER TotalBytesTransferred,
-	LARGE_INTEGER StreamSize,
-	LARGE_INTEGER StreamBytesTransferred,
-	DWORD dwStreamNumber,
-	DWORD dwCallbackReason,
-	HANDLE hSourceFile,
-	HANDLE hDestinationFile,
-	LPVOID lpData
-);
+void determinateProgress(unsigned long long total, unsigned long long transferred);
+void copyProgress(unsigned long long totalBytes, unsigned long long transferredBytes, void* context);
 void VerifyWriterStatus(void);
-void FreeSourceStructures(void);
\ No newline at end of file
+void AwaitVssAsync(const char* phase);
+void AsyncWaitProgress(void* context);
+void WriteRunMetrics(HRESULT exitCode);
+void FreeSourceStructures(void);
+DWORD AddSourcePath(LPCWSTR path);
+BOOL FilesFromRoutine(const std::wstring& path, void* context);
+t_snapshotVolume* FindSnapshotVolume(LPCWSTR volume);
+void FreeSnapshotVolumes(void);
+void AddFileSet(const std::wstring& section, const std::wstring& source, const std::vector<std::wstring>& destinations);
+long OptionInt(const IniFile& ini, LPCWSTR key, long defaultValue);
+double OptionDouble(const IniFile& ini, LPCWSTR key, double defaultValue);
+std::wstring OptionString(const IniFile& ini, LPCWSTR key, LPCWSTR defaultValue);
+PathFilter* LoadFileSetFilter(const IniFile& ini, const std::wstring& section, DWORD* settings);
+BOOL LoadFileSetThrottle(const IniFile& ini, const std::wstring& section, IoThrottle** throttle);
+IoThrottle* FileSetThrottle(unsigned int set);
+void FreeFileSets(void);
+void OpenChangeFeed(unsigned int set);
+BOOL CarryOverRoutine(const std::wstring& relativePath, void* context);
+void ReadChanges(t_fileSetWalk& walk, LPCWSTR snapshotDeviceObject);
\ No newline at end of file
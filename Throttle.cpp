@@ -0,0 +1,397 @@
+/* ShadowDuplicator -- a simple VC++ Volume Shadow Copy requestor for backing up
+locked files
+
+Copyright (C) 2021-2023 Peter Upfold.
+
+Licensed under the Apache 2.0 Licence. See the LICENSE file in the project root for details.
+
+This code is **not** production quality. There is certainly plenty of potential for improvement of this code,
+but beyond that, it may even be insecure, destructive or cause you other serious problems. There
+is no warranty.
+*/
+
+#include "Throttle.h"
+#include <algorithm>
+#include <cctype>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+
+// a control file larger than this is not a list of limits
+#define THROTTLE_CONTROL_MAX_SIZE 4096
+
+TokenBucket::TokenBucket()
+    : rate(0), tokens(0), lastRefill(std::chrono::steady_clock::now())
+{
+}
+
+/// <summary>
+/// Add the tokens earned since the last refill, up to the burst allowance.
+/// </summary>
+/// <param name="now">The time now</param>
+void TokenBucket::Refill(std::chrono::steady_clock::time_point now)
+{
+    if (rate > 0) {
+        tokens = std::min(tokens + rate * std::chrono::duration<double>(now - lastRefill).count(), rate * THROTTLE_BURST_SECONDS);
+    }
+    lastRefill = now;
+}
+
+/// <summary>
+/// Change the rate. Threads already waiting see the new rate within THROTTLE_MAX_SLEEP_MS.
+/// </summary>
+/// <param name="rate">Tokens per second, or 0 for no limit</param>
+void TokenBucket::SetRate(double rate)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    Refill(std::chrono::steady_clock::now());
+    if (rate <= 0) {
+        tokens = 0; // start afresh if a limit is set again later
+    }
+    this->rate = rate > 0 ? rate : 0;
+    rateChanged.notify_all();
+}
+
+/// <summary>
+/// The current rate, 0 if there is no limit.
+/// </summary>
+double TokenBucket::Rate(void)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    return rate;
+}
+
+/// <summary>
+/// Take tokens, waiting first until any debt left by earlier takers has been paid off.
+/// </summary>
+/// <param name="amount">How many tokens -- bytes or operations</param>
+void TokenBucket::Take(double amount)
+{
+    std::unique_lock<std::mutex> guard(lock);
+
+    for (;;) {
+        if (rate <= 0) {
+            return;
+        }
+        Refill(std::chrono::steady_clock::now());
+        if (tokens >= 0) {
+            tokens -= amount;
+            return;
+        }
+
+        double waitMilliseconds = std::min(-tokens / rate * 1000.0, (double)THROTTLE_MAX_SLEEP_MS);
+        rateChanged.wait_for(guard, std::chrono::duration<double, std::milli>(waitMilliseconds));
+    }
+}
+
+/// <summary>
+/// Set up the limits of a copy, and start watching the clock and the control file if there is a
+/// schedule or a control file.
+/// </summary>
+/// <param name="baseLimits">The limits outside any schedule window</param>
+/// <param name="schedule">Limits for times of day. May be empty.</param>
+/// <param name="controlPath">A file whose limits, while it exists, override the others. May be empty.</param>
+IoThrottle::IoThrottle(const t_throttleLimits& baseLimits, const std::vector<t_throttleWindow>& schedule, const std::wstring& controlPath)
+    : baseLimits(baseLimits), schedule(schedule), controlPath(controlPath), limits{}, stopping(false)
+{
+    Apply();
+    if (!schedule.empty() || !controlPath.empty()) {
+        watcher = std::thread(&IoThrottle::WatcherMain, this);
+    }
+}
+
+IoThrottle::~IoThrottle()
+{
+    {
+        std::lock_guard<std::mutex> guard(watcherLock);
+        stopping = true;
+    }
+    watcherWake.notify_all();
+    if (watcher.joinable()) {
+        watcher.join();
+    }
+}
+
+/// <summary>
+/// Wait until a read of this size is allowed.
+/// </summary>
+/// <param name="bytes">The length of the read</param>
+void IoThrottle::Read(DWORD bytes)
+{
+    readOperations.Take(1);
+    readBytes.Take(bytes);
+}
+
+/// <summary>
+/// Wait until a write of this size is allowed.
+/// </summary>
+/// <param name="bytes">The length of the write</param>
+void IoThrottle::Write(DWORD bytes)
+{
+    writeOperations.Take(1);
+    writeBytes.Take(bytes);
+}
+
+/// <summary>
+/// Put new limits into force straight away. The watcher replaces them at its next look if the schedule or
+/// control file say otherwise.
+/// </summary>
+/// <param name="limits">The new limits</param>
+void IoThrottle::SetLimits(const t_throttleLimits& limits)
+{
+    std::lock_guard<std::mutex> guard(limitsLock);
+    this->limits = limits;
+    readBytes.SetRate(limits.readMBps * 1e6);
+    writeBytes.SetRate(limits.writeMBps * 1e6);
+    readOperations.SetRate(limits.readIops);
+    writeOperations.SetRate(limits.writeIops);
+}
+
+/// <summary>
+/// The limits in force.
+/// </summary>
+t_throttleLimits IoThrottle::Limits(void)
+{
+    std::lock_guard<std::mutex> guard(limitsLock);
+    return limits;
+}
+
+/// <summary>
+/// Work out which limits should be in force now, and put them in force if they have changed.
+/// </summary>
+void IoThrottle::Apply(void)
+{
+    t_throttleLimits wanted{};
+    BOOL fromControlFile = FALSE;
+
+    if (!controlPath.empty()) {
+        t_fileHandle handle = INVALID_FILE_HANDLE;
+        if (PlatformOpenForRead(controlPath, FALSE, &handle) == ERROR_SUCCESS) {
+            t_fileInformation information{};
+            char text[THROTTLE_CONTROL_MAX_SIZE + 1]{};
+            DWORD bytesRead = 0;
+            if (PlatformGetFileInformation(handle, &information) == ERROR_SUCCESS && information.size <= THROTTLE_CONTROL_MAX_SIZE
+                && PlatformReadAt(handle, 0, text, (DWORD)information.size, &bytesRead) == ERROR_SUCCESS) {
+                // a file which does not parse, perhaps because it is being written, leaves the limits as they were
+                fromControlFile = ThrottleParseLimits(std::string(text, bytesRead), &wanted);
+                if (!fromControlFile) {
+                    PlatformCloseFile(handle);
+                    return;
+                }
+            }
+            PlatformCloseFile(handle);
+        }
+    }
+
+    if (!fromControlFile) {
+        time_t now = time(nullptr);
+        struct tm local {};
+        PlatformLocalTime(now, &local);
+        wanted = ThrottleLimitsAt(schedule, baseLimits, (unsigned int)(local.tm_hour * 60 + local.tm_min));
+    }
+
+    t_throttleLimits current = Limits();
+    if (memcmp(&current, &wanted, sizeof(wanted)) != 0) {
+        SetLimits(wanted);
+    }
+}
+
+/// <summary>
+/// Watcher thread body -- look at the clock and the control file once a second until stopped.
+/// </summary>
+void IoThrottle::WatcherMain(void)
+{
+    std::unique_lock<std::mutex> guard(watcherLock);
+    while (!watcherWake.wait_for(guard, std::chrono::milliseconds(THROTTLE_WATCH_INTERVAL_MS), [this] { return stopping; })) {
+        guard.unlock();
+        Apply();
+        guard.lock();
+    }
+}
+
+/// <summary>
+/// Whether any limit is set.
+/// </summary>
+BOOL ThrottleLimitsActive(const t_throttleLimits& limits)
+{
+    return limits.readMBps > 0 || limits.writeMBps > 0 || limits.readIops > 0 || limits.writeIops > 0;
+}
+
+/// <summary>
+/// Parse limits written as "read=50 write=20 readiops=500 writeiops=500", separated by spaces or commas.
+/// Limits which are left out are unlimited, so "" or "unlimited" lifts every limit.
+/// </summary>
+/// <param name="text">The limits</param>
+/// <param name="limits">Receives the limits</param>
+/// <returns>FALSE if the text is not a list of limits</returns>
+BOOL ThrottleParseLimits(const std::string& text, t_throttleLimits* limits)
+{
+    t_throttleLimits parsed{};
+    size_t position = 0;
+
+    while (position < text.size()) {
+        if (isspace((unsigned char)text[position]) || text[position] == ',') {
+            position++;
+            continue;
+        }
+
+        size_t end = position;
+        while (end < text.size() && !isspace((unsigned char)text[end]) && text[end] != ',') {
+            end++;
+        }
+        std::string item = text.substr(position, end - position);
+        std::transform(item.begin(), item.end(), item.begin(), [](unsigned char c) { return (char)tolower(c); });
+        position = end;
+
+        if (item == "unlimited") {
+            continue;
+        }
+
+        size_t equals = item.find('=');
+        if (equals == std::string::npos || equals + 1 == item.size()) {
+            return FALSE;
+        }
+        char* valueEnd = nullptr;
+        double value = strtod(item.c_str() + equals + 1, &valueEnd);
+        if (*valueEnd != '\0' || !(value >= 0)) {
+            return FALSE;
+        }
+
+        std::string key = item.substr(0, equals);
+        if (key == "read") {
+            parsed.readMBps = value;
+        }
+        else if (key == "write") {
+            parsed.writeMBps = value;
+        }
+        else if (key == "readiops") {
+            parsed.readIops = value;
+        }
+        else if (key == "writeiops") {
+            parsed.writeIops = value;
+        }
+        else {
+            return FALSE;
+        }
+    }
+
+    *limits = parsed;
+    return TRUE;
+}
+
+/// <summary>
+/// Parse a time of day written as H:MM or HH:MM.
+/// </summary>
+/// <returns>FALSE if it is not a time of day</returns>
+static BOOL ParseTimeOfDay(const std::string& text, unsigned int* minuteOfDay)
+{
+    unsigned int hours = 0;
+    unsigned int minutes = 0;
+    char extra = 0;
+
+    if (sscanf(text.c_str(), "%u:%u%c", &hours, &minutes, &extra) != 2 || hours > 24 || minutes > 59 || (hours == 24 && minutes != 0)) {
+        return FALSE;
+    }
+    *minuteOfDay = (hours * 60 + minutes) % (24 * 60);
+    return TRUE;
+}
+
+/// <summary>
+/// Parse a schedule written as windows separated by semicolons, each a range of local times followed by
+/// its limits, for example "07:00-19:00 read=20 write=20; 19:00-07:00 read=200".
+/// </summary>
+/// <param name="text">The schedule</param>
+/// <param name="schedule">Receives the windows, in the order given</param>
+/// <returns>FALSE if the text is not a schedule</returns>
+BOOL ThrottleParseSchedule(const std::string& text, std::vector<t_throttleWindow>* schedule)
+{
+    std::vector<t_throttleWindow> parsed;
+    size_t start = 0;
+
+    while (start <= text.size()) {
+        size_t end = text.find(';', start);
+        if (end == std::string::npos) {
+            end = text.size();
+        }
+        std::string window = text.substr(start, end - start);
+        start = end + 1;
+
+        size_t first = window.find_first_not_of(" \t");
+        if (first == std::string::npos) {
+            continue;
+        }
+        size_t rangeEnd = window.find_first_of(" \t", first);
+        std::string range = window.substr(first, rangeEnd == std::string::npos ? std::string::npos : rangeEnd - first);
+        size_t dash = range.find('-');
+
+        t_throttleWindow parsedWindow{};
+        if (dash == std::string::npos
+            || !ParseTimeOfDay(range.substr(0, dash), &parsedWindow.startMinute)
+            || !ParseTimeOfDay(range.substr(dash + 1), &parsedWindow.endMinute)
+            || !ThrottleParseLimits(rangeEnd == std::string::npos ? std::string() : window.substr(rangeEnd), &parsedWindow.limits)) {
+            return FALSE;
+        }
+        parsed.push_back(parsedWindow);
+    }
+
+    *schedule = parsed;
+    return TRUE;
+}
+
+/// <summary>
+/// The limits in force at a time of day -- those of the first window the time falls in, otherwise the base limits.
+/// </summary>
+/// <param name="schedule">The windows</param>
+/// <param name="baseLimits">The limits outside every window</param>
+/// <param name="minuteOfDay">Minutes since local midnight</param>
+/// <returns>The limits</returns>
+t_throttleLimits ThrottleLimitsAt(const std::vector<t_throttleWindow>& schedule, const t_throttleLimits& baseLimits, unsigned int minuteOfDay)
+{
+    for (const t_throttleWindow& window : schedule) {
+        BOOL inside;
+        if (window.startMinute == window.endMinute) {
+            inside = TRUE; // the whole day
+        }
+        else if (window.startMinute < window.endMinute) {
+            inside = minuteOfDay >= window.startMinute && minuteOfDay < window.endMinute;
+        }
+        else {
+            inside = minuteOfDay >= window.startMinute || minuteOfDay < window.endMinute; // past midnight
+        }
+        if (inside) {
+            return window.limits;
+        }
+    }
+    return baseLimits;
+}
+
+/// <summary>
+/// Describe one direction's limits, for example "50 MB/s, 500 IOPS" or "unlimited".
+/// </summary>
+static std::string DescribeDirection(double megabytesPerSecond, double operationsPerSecond)
+{
+    char text[64];
+
+    if (megabytesPerSecond > 0 && operationsPerSecond > 0) {
+        snprintf(text, sizeof(text), "%g MB/s, %g IOPS", megabytesPerSecond, operationsPerSecond);
+    }
+    else if (megabytesPerSecond > 0) {
+        snprintf(text, sizeof(text), "%g MB/s", megabytesPerSecond);
+    }
+    else if (operationsPerSecond > 0) {
+        snprintf(text, sizeof(text), "%g IOPS", operationsPerSecond);
+    }
+    else {
+        snprintf(text, sizeof(text), "unlimited");
+    }
+    return text;
+}
+
+/// <summary>
+/// Describe limits for the console, for example "read 50 MB/s, 500 IOPS; write unlimited".
+/// </summary>
+std::string ThrottleDescribeLimits(const t_throttleLimits& limits)
+{
+    return "read " + DescribeDirection(limits.readMBps, limits.readIops) + "; write " + DescribeDirection(limits.writeMBps, limits.writeIops);
+}
@@ -0,0 +1,109 @@
+/* ShadowDuplicator -- a simple VC++ Volume Shadow Copy requestor for backing up
+locked files
+
+Copyright (C) 2021-2023 Peter Upfold.
+
+Licensed under the Apache 2.0 Licence. See the LICENSE file in the project root for details.
+
+This code is **not** production quality. There is certainly plenty of potential for improvement of this code,
+but beyond that, it may even be insecure, destructive or cause you other serious problems. There
+is no warranty.
+*/
+#pragma once
+#include "Platform.h"
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// how much a bucket may save up while the copy is idle, in seconds of its rate
+#define THROTTLE_BURST_SECONDS 0.05
+// the longest a throttled thread sleeps before looking at the rate again, so a raised limit takes effect promptly
+#define THROTTLE_MAX_SLEEP_MS 100
+// how often the schedule and the control file are looked at
+#define THROTTLE_WATCH_INTERVAL_MS 1000
+
+// Limits on the copy's I/O. MB are 10^6 bytes. 0 means unlimited.
+typedef struct throttleLimits {
+    double readMBps;
+    double writeMBps;
+    double readIops;
+    double writeIops;
+} t_throttleLimits;
+
+// Limits which apply between two times of day, local time. A window may wrap past midnight.
+typedef struct throttleWindow {
+    unsigned int startMinute;
+    unsigned int endMinute;
+    t_throttleLimits limits;
+} t_throttleWindow;
+
+/// <summary>
+/// A token bucket shared by any number of threads. A taker may run the bucket into debt by one
+/// request, and later takers wait until the debt is paid off, so requests larger than the burst still
+/// pass and the long run rate is exact however many threads take at once.
+/// </summary>
+class TokenBucket {
+public:
+    TokenBucket();
+
+    void SetRate(double rate);
+    double Rate(void);
+    void Take(double amount);
+
+private:
+    void Refill(std::chrono::steady_clock::time_point now);
+
+    std::mutex lock;
+    std::condition_variable rateChanged;
+    double rate;
+    double tokens;
+    std::chrono::steady_clock::time_point lastRefill;
+};
+
+/// <summary>
+/// The read and write limits of a copy, each as bytes per second and operations per second. The
+/// limits in force are those of the control file if it exists, otherwise of the schedule window the
+/// time of day falls in, otherwise the base limits. A watcher thread looks at the control file and
+/// the clock once a second, so limits can be changed while the copy runs.
+/// </summary>
+class IoThrottle {
+public:
+    IoThrottle(const t_throttleLimits& baseLimits, const std::vector<t_throttleWindow>& schedule, const std::wstring& controlPath);
+    ~IoThrottle();
+
+    void Read(DWORD bytes);
+    void Write(DWORD bytes);
+    void SetLimits(const t_throttleLimits& limits);
+    t_throttleLimits Limits(void);
+
+private:
+    void Apply(void);
+    void WatcherMain(void);
+
+    t_throttleLimits baseLimits;
+    std::vector<t_throttleWindow> schedule;
+    std::wstring controlPath;
+
+    TokenBucket readBytes;
+    TokenBucket readOperations;
+    TokenBucket writeBytes;
+    TokenBucket writeOperations;
+
+    std::mutex limitsLock;
+    t_throttleLimits limits;
+
+    std::thread watcher;
+    std::mutex watcherLock;
+    std::condition_variable watcherWake;
+    bool stopping;
+};
+
+BOOL ThrottleLimitsActive(const t_throttleLimits& limits);
+BOOL ThrottleParseLimits(const std::string& text, t_throttleLimits* limits);
+BOOL ThrottleParseSchedule(const std::string& text, std::vector<t_throttleWindow>* schedule);
+t_throttleLimits ThrottleLimitsAt(const std::vector<t_throttleWindow>& schedule, const t_throttleLimits& baseLimits, unsigned int minuteOfDay);
+std::string ThrottleDescribeLimits(const t_throttleLimits& limits);
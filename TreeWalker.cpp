@@ -0,0 +1,446 @@
+/* ShadowDuplicator -- a simple VC++ Volume Shadow Copy requestor for backing up
+locked files
+
+Copyright (C) 2021-2023 Peter Upfold.
+
+Licensed under the Apache 2.0 Licence. See the LICENSE file in the project root for details.
+
+This code is **not** production quality. There is certainly plenty of potential for improvement of this code,
+but beyond that, it may even be insecure, destructive or cause you other serious problems. There
+is no warranty.
+*/
+
+#include "TreeWalker.h"
+#include <chrono>
+
+/// <summary>
+/// How long an idle walker thread sleeps before looking for work to steal again, if it is not woken sooner.
+/// </summary>
+#define WALKER_IDLE_WAIT_MS 10
+
+// State for the directory entry callback while one directory is listed
+typedef struct walkDirectoryState {
+    TreeWalker* walker;
+    unsigned int index;
+    const std::wstring* relativePath;
+    std::wstring sourceDirectory;
+    std::wstring destinationDirectory;
+    BOOL listOnly;
+} t_walkDirectoryState;
+
+/// <summary>
+/// Create a directory below a destination root, and any of the directories above it which are missing.
+/// </summary>
+/// <param name="root">The destination root, which exists</param>
+/// <param name="relativePath">The directory relative to the root</param>
+/// <returns>0 on success, or the platform error code upon failure</returns>
+static DWORD CreateDestinationDirectory(const std::wstring& root, const std::wstring& relativePath)
+{
+    std::wstring directory = PlatformJoinPath(root, relativePath);
+    DWORD error = PlatformCreateDirectory(directory);
+    if (error != ERROR_PATH_NOT_FOUND) {
+        return error;
+    }
+
+    for (size_t separator = relativePath.find(PATH_SEPARATOR); separator != std::wstring::npos; separator = relativePath.find(PATH_SEPARATOR, separator + 1)) {
+        error = PlatformCreateDirectory(PlatformJoinPath(root, relativePath.substr(0, separator)));
+        if (error) {
+            return error;
+        }
+    }
+    return PlatformCreateDirectory(directory);
+}
+
+/// <summary>
+/// Prepare a walker. No threads are started until Walk is called.
+/// </summary>
+/// <param name="threadCount">Number of walker threads, clamped to 1..MAX_COPY_THREADS</param>
+/// <param name="fileRoutine">Receives each file found</param>
+/// <param name="context">Passed through to fileRoutine</param>
+TreeWalker::TreeWalker(unsigned int threadCount, t_walkFileRoutine fileRoutine, void* context)
+    : threadCount(threadCount), fileRoutine(fileRoutine), directoryFailureRoutine(nullptr), context(context), filter(nullptr),
+    outstanding(0), stopped(false), lastError(ERROR_SUCCESS), directoryCount(0), fileCount(0),
+    excludedDirectoryCount(0), excludedFileCount(0), failedDirectoryCount(0)
+{
+    if (this->threadCount < 1) {
+        this->threadCount = 1;
+    }
+    if (this->threadCount > MAX_COPY_THREADS) {
+        this->threadCount = MAX_COPY_THREADS;
+    }
+    for (unsigned int i = 0; i < this->threadCount; i++) {
+        deques.emplace_back(new t_walkerDeque());
+    }
+}
+
+/// <summary>
+/// Create each directory below these further destinations as well, so that a fan-out copy finds the
+/// whole tree in place in every one of them. Call before Walk.
+/// </summary>
+/// <param name="mirrorRoots">The existing directories which mirror sourceRoot alongside destinationRoot</param>
+void TreeWalker::SetMirrors(const std::vector<std::wstring>& mirrorRoots)
+{
+    this->mirrorRoots = mirrorRoots;
+}
+
+/// <summary>
+/// Leave out the files and directories which the filter excludes. An excluded directory is never
+/// listed, so nothing below it is visited. Call before Walk.
+/// </summary>
+/// <param name="filter">The compiled filter, which must outlive the walk, or nullptr to walk everything</param>
+void TreeWalker::SetFilter(const PathFilter* filter)
+{
+    this->filter = filter;
+}
+
+/// <summary>
+/// Pass a directory below the root which cannot be walked to this routine, which may let the walk carry on
+/// without it, instead of the walk failing. The root itself always fails the walk. Call before Walk.
+/// </summary>
+/// <param name="directoryFailureRoutine">Receives each directory which could not be walked, with the context given to the constructor</param>
+void TreeWalker::SetDirectoryFailureRoutine(t_walkDirectoryFailureRoutine directoryFailureRoutine)
+{
+    this->directoryFailureRoutine = directoryFailureRoutine;
+}
+
+/// <summary>
+/// Walk the whole tree below sourceRoot, creating the matching directories below destinationRoot and
+/// passing each file to the file routine. Blocks until the walk is complete, has failed or was cancelled.
+/// </summary>
+/// <param name="sourceRoot">The top of the source tree, without a trailing separator</param>
+/// <param name="destinationRoot">The existing destination directory which mirrors sourceRoot</param>
+/// <returns>0 on success, otherwise the error of the directory which could not be walked</returns>
+DWORD TreeWalker::Walk(const std::wstring& sourceRoot, const std::wstring& destinationRoot)
+{
+    this->sourceRoot = sourceRoot;
+    this->destinationRoot = destinationRoot;
+    listOnly.clear();
+
+    // the root is the only directory at the start -- the first worker takes it and the others steal from there
+    std::wstring root;
+    PushDirectory(0, root, FALSE);
+    return Run();
+}
+
+/// <summary>
+/// Walk just the parts of the tree below sourceRoot which a change feed says have changed. Each of the
+/// directories is listed without going below it, and each of the trees is walked in full. Any of them
+/// which is no longer in the source, or which the filter leaves out, is passed over.
+/// </summary>
+/// <param name="sourceRoot">The top of the source tree, without a trailing separator</param>
+/// <param name="destinationRoot">The existing destination directory which mirrors sourceRoot</param>
+/// <param name="directories">The directories to list, relative to sourceRoot, none of them inside one of the trees</param>
+/// <param name="trees">The directories to walk, relative to sourceRoot, none of them inside another</param>
+/// <returns>0 on success, otherwise the error of the directory which could not be walked</returns>
+DWORD TreeWalker::WalkChanges(const std::wstring& sourceRoot, const std::wstring& destinationRoot, const std::vector<std::wstring>& directories, const std::vector<std::wstring>& trees)
+{
+    unsigned int next = 0;
+
+    this->sourceRoot = sourceRoot;
+    this->destinationRoot = destinationRoot;
+    listOnly.clear();
+    listOnly.insert(directories.begin(), directories.end());
+
+    // deal the starting directories out to every worker, as there may be many which are each quick to list
+    for (const std::vector<std::wstring>* relativePaths : { &directories, &trees }) {
+        for (std::wstring relativePath : *relativePaths) {
+            if (IncludeChanged(relativePath)) {
+                PushDirectory(next++ % threadCount, relativePath, FALSE);
+            }
+        }
+    }
+    return Run();
+}
+
+/// <summary>
+/// Start the workers on the directories already pushed and wait for them to finish the walk.
+/// </summary>
+/// <returns>0 on success, otherwise the error of the directory which could not be walked</returns>
+DWORD TreeWalker::Run(void)
+{
+    std::vector<std::thread> workers;
+
+    for (unsigned int i = 0; i < threadCount; i++) {
+        workers.emplace_back(&TreeWalker::WorkerMain, this, i);
+    }
+    for (std::thread& worker : workers) {
+        worker.join();
+    }
+
+    for (std::unique_ptr<t_walkerDeque>& walkerDeque : deques) {
+        walkerDeque->directories.clear();
+    }
+    return lastError;
+}
+
+/// <summary>
+/// Stop the walk. Directories already being listed will stop at their next entry.
+/// </summary>
+/// <param name=""></param>
+void TreeWalker::Cancel(void)
+{
+    stopped = true;
+    idleWake.notify_all();
+}
+
+/// <summary>
+/// Number of directories listed so far, including the root.
+/// </summary>
+unsigned long long TreeWalker::DirectoryCount(void)
+{
+    return directoryCount;
+}
+
+/// <summary>
+/// Number of files passed to the file routine so far.
+/// </summary>
+unsigned long long TreeWalker::FileCount(void)
+{
+    return fileCount;
+}
+
+/// <summary>
+/// Number of directories the filter has left out, not counting any below them, which are never listed.
+/// </summary>
+unsigned long long TreeWalker::ExcludedDirectoryCount(void)
+{
+    return excludedDirectoryCount;
+}
+
+/// <summary>
+/// Number of files the filter has left out of the directories which were listed.
+/// </summary>
+unsigned long long TreeWalker::ExcludedFileCount(void)
+{
+    return excludedFileCount;
+}
+
+/// <summary>
+/// Number of directories which could not be walked and were passed over by the directory failure routine.
+/// </summary>
+unsigned long long TreeWalker::FailedDirectoryCount(void)
+{
+    return failedDirectoryCount;
+}
+
+/// <summary>
+/// Whether a directory a change walk starts from is still in the source and is not left out by the filter,
+/// either itself or by a directory above it, which a full walk would never have gone below.
+/// </summary>
+/// <param name="relativePath">The directory relative to the source root</param>
+/// <returns>TRUE if the directory should be walked</returns>
+BOOL TreeWalker::IncludeChanged(const std::wstring& relativePath)
+{
+    if (relativePath.empty()) {
+        return TRUE;
+    }
+    if (filter != nullptr) {
+        for (size_t separator = relativePath.find(PATH_SEPARATOR); separator != std::wstring::npos; separator = relativePath.find(PATH_SEPARATOR, separator + 1)) {
+            if (!filter->IncludeDirectory(relativePath.substr(0, separator))) {
+                return FALSE;
+            }
+        }
+        if (!filter->IncludeDirectory(relativePath)) {
+            return FALSE;
+        }
+    }
+    return PlatformPathExists(PlatformJoinPath(sourceRoot, relativePath));
+}
+
+/// <summary>
+/// Walker thread body -- list directories from our own deque, or stolen from others, until there are none left anywhere.
+/// </summary>
+/// <param name="index">This worker's index, which is also the index of the deque it owns</param>
+void TreeWalker::WorkerMain(unsigned int index)
+{
+    std::wstring relativePath;
+
+    while (!stopped) {
+        if (TakeDirectory(index, relativePath)) {
+            ListDirectory(index, relativePath);
+            if (--outstanding == 0) {
+                idleWake.notify_all(); // that was the last directory -- release the idle workers
+            }
+            continue;
+        }
+
+        if (outstanding == 0) {
+            return;
+        }
+
+        // nothing to take or steal, but another worker is still listing and may push more
+        std::unique_lock<std::mutex> lock(idleLock);
+        idleWake.wait_for(lock, std::chrono::milliseconds(WALKER_IDLE_WAIT_MS));
+    }
+}
+
+/// <summary>
+/// Take the next directory to list -- the newest from our own deque, otherwise the oldest from another worker's deque.
+/// </summary>
+/// <param name="index">The index of the calling worker</param>
+/// <param name="relativePath">Receives the relative path of the directory</param>
+/// <returns>TRUE if a directory was taken</returns>
+BOOL TreeWalker::TakeDirectory(unsigned int index, std::wstring& relativePath)
+{
+    {
+        t_walkerDeque& own = *deques[index];
+        std::lock_guard<std::mutex> lock(own.lock);
+        if (!own.directories.empty()) {
+            relativePath = std::move(own.directories.back());
+            own.directories.pop_back();
+            return TRUE;
+        }
+    }
+
+    // steal -- the oldest entries are nearest the root, so are likely the largest subtrees
+    for (unsigned int offset = 1; offset < threadCount; offset++) {
+        t_walkerDeque& victim = *deques[(index + offset) % threadCount];
+        std::lock_guard<std::mutex> lock(victim.lock);
+        if (!victim.directories.empty()) {
+            relativePath = std::move(victim.directories.front());
+            victim.directories.pop_front();
+            return TRUE;
+        }
+    }
+
+    return FALSE;
+}
+
+/// <summary>
+/// Queue a directory on a worker's own deque and wake an idle worker to steal it.
+/// </summary>
+/// <param name="index">The index of the worker which found the directory</param>
+/// <param name="relativePath">The path of the directory relative to the source root, moved from if it is queued</param>
+/// <param name="bounded">Whether to refuse the directory if the deque already holds WALKER_DEQUE_LIMIT</param>
+/// <returns>FALSE if the deque was full, and the caller must list the directory itself</returns>
+BOOL TreeWalker::PushDirectory(unsigned int index, std::wstring& relativePath, BOOL bounded)
+{
+    {
+        t_walkerDeque& own = *deques[index];
+        std::lock_guard<std::mutex> lock(own.lock);
+        if (bounded && own.directories.size() >= WALKER_DEQUE_LIMIT) {
+            return FALSE;
+        }
+        outstanding++;
+        own.directories.push_back(std::move(relativePath));
+    }
+    idleWake.notify_one();
+    return TRUE;
+}
+
+/// <summary>
+/// Walk one directory, passing it to the directory failure routine or failing the walk if it cannot be.
+/// </summary>
+/// <param name="index">The index of the calling worker</param>
+/// <param name="relativePath">The path of the directory relative to the source root, empty for the root itself</param>
+void TreeWalker::ListDirectory(unsigned int index, const std::wstring& relativePath)
+{
+    DWORD error = WalkDirectory(index, relativePath);
+    if (error && !stopped && !relativePath.empty() && directoryFailureRoutine != nullptr && directoryFailureRoutine(relativePath, error, context)) {
+        failedDirectoryCount++;
+    }
+    else if (error) {
+        Fail(error);
+    }
+}
+
+/// <summary>
+/// List one directory. Subdirectories are pushed on to our deque, or listed straight away if it is full,
+/// and files go straight to the file routine.
+/// </summary>
+/// <param name="index">The index of the calling worker</param>
+/// <param name="relativePath">The path of the directory relative to the source root, empty for the root itself</param>
+/// <returns>0 on success, or the error listing the directory or creating its destination</returns>
+DWORD TreeWalker::WalkDirectory(unsigned int index, const std::wstring& relativePath)
+{
+    t_walkDirectoryState state{};
+    DWORD error = ERROR_SUCCESS;
+
+    state.walker = this;
+    state.index = index;
+    state.relativePath = &relativePath;
+    state.sourceDirectory = relativePath.empty() ? sourceRoot : PlatformJoinPath(sourceRoot, relativePath);
+    state.destinationDirectory = relativePath.empty() ? destinationRoot : PlatformJoinPath(destinationRoot, relativePath);
+    state.listOnly = !listOnly.empty() && listOnly.count(relativePath) > 0;
+
+    // the parent was listed before this directory was queued, so its destination already exists -- except
+    // where a walk of changes starts, which may be below a directory no earlier run has created
+    if (!relativePath.empty()) {
+        error = CreateDestinationDirectory(destinationRoot, relativePath);
+        if (error) {
+            return error;
+        }
+        for (const std::wstring& mirrorRoot : mirrorRoots) {
+            error = CreateDestinationDirectory(mirrorRoot, relativePath);
+            if (error) {
+                return error;
+            }
+        }
+    }
+
+    directoryCount++;
+    return PlatformEnumerateDirectory(state.sourceDirectory, &TreeWalker::EntryRoutine, &state);
+}
+
+/// <summary>
+/// Record a failure and stop the walk.
+/// </summary>
+/// <param name="error">The platform error code</param>
+void TreeWalker::Fail(DWORD error)
+{
+    lastError = error;
+    Cancel();
+}
+
+/// <summary>
+/// Directory entry callback for WalkDirectory.
+/// </summary>
+/// <param name="entry">The entry found</param>
+/// <param name="context">The t_walkDirectoryState for the directory being listed</param>
+/// <returns>FALSE if the walk has been stopped</returns>
+BOOL TreeWalker::EntryRoutine(const t_directoryEntry& entry, void* context)
+{
+    t_walkDirectoryState* state = (t_walkDirectoryState*)context;
+    TreeWalker* walker = state->walker;
+
+    if (walker->stopped) {
+        return FALSE;
+    }
+
+    std::wstring relativePath = state->relativePath->empty() ? std::wstring(entry.name) : PlatformJoinPath(*state->relativePath, entry.name);
+
+    if (entry.isDirectory) {
+        if (state->listOnly) {
+            return TRUE;
+        }
+        if (walker->filter != nullptr && !walker->filter->IncludeDirectory(relativePath)) {
+            walker->excludedDirectoryCount++;
+            return TRUE;
+        }
+        // with our deque full, list the directory now rather than queue it, going depth-first
+        if (!walker->PushDirectory(state->index, relativePath, TRUE)) {
+            walker->ListDirectory(state->index, relativePath);
+        }
+        return TRUE;
+    }
+
+    if (walker->filter != nullptr && !walker->filter->IncludeFile(relativePath, entry.size, entry.lastWriteTime)) {
+        walker->excludedFileCount++;
+        return TRUE;
+    }
+
+    t_copyJob job;
+    job.source = PlatformJoinPath(state->sourceDirectory, entry.name);
+    job.destination = PlatformJoinPath(state->destinationDirectory, entry.name);
+    job.relativePath = relativePath;
+    job.size = entry.size;
+    job.lastWriteTime = entry.lastWriteTime;
+    job.attributes = entry.attributes;
+    walker->fileCount++;
+
+    if (!walker->fileRoutine(job, entry, walker->context)) {
+        walker->Cancel();
+        return FALSE;
+    }
+    return TRUE;
+}
@@ -0,0 +1,107 @@
+/* ShadowDuplicator -- a simple VC++ Volume Shadow Copy requestor for backing up
+locked files
+
+Copyright (C) 2021-2023 Peter Upfold.
+
+Licensed under the Apache 2.0 Licence. See the LICENSE file in the project root for details.
+
+This code is **not** production quality. There is certainly plenty of potential for improvement of this code,
+but beyond that, it may even be insecure, destructive or cause you other serious problems. There
+is no warranty.
+*/
+#pragma once
+#include "Platform.h"
+#include "CopyEngine.h"
+#include "PathFilter.h"
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_set>
+#include <vector>
+
+// Receives each file found by the walk, with its source and destination paths already built.
+// Called concurrently from the walker threads. Return FALSE to stop the walk.
+typedef BOOL (*t_walkFileRoutine)(t_copyJob& job, const t_directoryEntry& entry, void* context);
+
+// Receives each directory below the root which could not be listed, or created in the destination, with the error.
+// Return TRUE to pass over it and everything below it and carry on with the rest of the walk, FALSE to stop the walk.
+typedef BOOL (*t_walkDirectoryFailureRoutine)(const std::wstring& relativePath, DWORD error, void* context);
+
+// each walker thread queues at most this many directories -- beyond that it goes down into them itself
+#define WALKER_DEQUE_LIMIT 4096
+
+/// <summary>
+/// Walks a source tree recursively with several threads. Each thread owns a deque of directories still
+/// to be listed, works depth-first from the back of its own deque and steals from the front of
+/// another thread's deque when its own is empty. A thread whose deque is full lists a subdirectory as
+/// soon as it finds it instead of queueing it. Files are handed to the file routine as they are
+/// found, so no listing of the whole tree is ever built, and the directories waiting to be listed are
+/// bounded by the number of threads and the depth of the tree rather than its size.
+/// </summary>
+class TreeWalker {
+public:
+    TreeWalker(unsigned int threadCount, t_walkFileRoutine fileRoutine, void* context);
+
+    void SetMirrors(const std::vector<std::wstring>& mirrorRoots);
+    void SetFilter(const PathFilter* filter);
+    void SetDirectoryFailureRoutine(t_walkDirectoryFailureRoutine directoryFailureRoutine);
+    DWORD Walk(const std::wstring& sourceRoot, const std::wstring& destinationRoot);
+    DWORD WalkChanges(const std::wstring& sourceRoot, const std::wstring& destinationRoot, const std::vector<std::wstring>& directories, const std::vector<std::wstring>& trees);
+    void Cancel(void);
+
+    unsigned long long DirectoryCount(void);
+    unsigned long long FileCount(void);
+    unsigned long long ExcludedDirectoryCount(void);
+    unsigned long long ExcludedFileCount(void);
+    unsigned long long FailedDirectoryCount(void);
+
+private:
+    // A worker's own deque of relative directory paths still to be listed
+    typedef struct walkerDeque {
+        std::mutex lock;
+        std::deque<std::wstring> directories;
+    } t_walkerDeque;
+
+    DWORD Run(void);
+    BOOL IncludeChanged(const std::wstring& relativePath);
+    void WorkerMain(unsigned int index);
+    BOOL TakeDirectory(unsigned int index, std::wstring& relativePath);
+    BOOL PushDirectory(unsigned int index, std::wstring& relativePath, BOOL bounded);
+    void ListDirectory(unsigned int index, const std::wstring& relativePath);
+    DWORD WalkDirectory(unsigned int index, const std::wstring& relativePath);
+    void Fail(DWORD error);
+
+    static BOOL EntryRoutine(const t_directoryEntry& entry, void* context);
+
+    unsigned int threadCount;
+    t_walkFileRoutine fileRoutine;
+    t_walkDirectoryFailureRoutine directoryFailureRoutine;
+    void* context;
+
+    std::wstring sourceRoot;
+    std::wstring destinationRoot;
+    std::vector<std::wstring> mirrorRoots;
+    const PathFilter* filter;
+
+    // in a walk of changes, the directories which are listed without going below them
+    std::unordered_set<std::wstring> listOnly;
+
+    std::vector<std::unique_ptr<t_walkerDeque>> deques;
+
+    // directories which are queued or being listed -- the walk is complete when this reaches zero
+    std::atomic<unsigned long long> outstanding;
+    std::mutex idleLock;
+    std::condition_variable idleWake;
+
+    std::atomic<bool> stopped;
+    std::atomic<DWORD> lastError;
+    std::atomic<unsigned long long> directoryCount;
+    std::atomic<unsigned long long> fileCount;
+    std::atomic<unsigned long long> excludedDirectoryCount;
+    std::atomic<unsigned long long> excludedFileCount;
+    std::atomic<unsigned long long> failedDirectoryCount;
+};
@@ -0,0 +1,249 @@
+/* ShadowDuplicator -- a simple VC++ Volume Shadow Copy requestor for backing up
+locked files
+
+Copyright (C) 2021-2023 Peter Upfold.
+
+Licensed under the Apache 2.0 Licence. See the LICENSE file in the project root for details.
+
+This code is **not** production quality. There is certainly plenty of potential for improvement of this code,
+but beyond that, it may even be insecure, destructive or cause you other serious problems. There
+is no warranty.
+*/
+
+#include "Verify.h"
+#include <chrono>
+#include <cstring>
+
+/*
+A verify reads a destination file back alongside its source and compares the two block by block. Each
+buffer from the pool holds a block of the source in its first half and the same block of the destination
+in its second, so a verify holds one pool buffer per block in flight, just as a copy does, and the
+pool's rule against deadlock carries over unchanged. Each file is read through its own
+PlatformAsyncReader, so reads of both are in flight at once while earlier blocks are compared.
+*/
+
+/// <summary>
+/// Round a length up to the unbuffered I/O alignment.
+/// </summary>
+static DWORD AlignUp(DWORD length)
+{
+    return (length + (PLATFORM_IO_ALIGNMENT - 1)) & ~(DWORD)(PLATFORM_IO_ALIGNMENT - 1);
+}
+
+/// <summary>
+/// Compare a block of the source with the same block of the destination. The comparison itself is
+/// memcmp, which the C runtime vectorises; only a block which differs is scanned for where.
+/// </summary>
+/// <param name="source">The block of the source</param>
+/// <param name="destination">The block of the destination</param>
+/// <param name="length">The length of both blocks</param>
+/// <param name="first">Receives the offset in the block of the first byte which differs</param>
+/// <param name="last">Receives the offset in the block of the last byte which differs</param>
+/// <returns>TRUE if the blocks are the same</returns>
+BOOL VerifyCompareBlock(const void* source, const void* destination, size_t length, size_t* first, size_t* last)
+{
+    const unsigned char* sourceBytes = (const unsigned char*)source;
+    const unsigned char* destinationBytes = (const unsigned char*)destination;
+    size_t position = 0;
+
+    if (memcmp(source, destination, length) == 0) {
+        return TRUE;
+    }
+
+    // there is a difference, so both scans stop inside the block
+    while (position + sizeof(unsigned long long) <= length && memcmp(sourceBytes + position, destinationBytes + position, sizeof(unsigned long long)) == 0) {
+        position += sizeof(unsigned long long);
+    }
+    while (sourceBytes[position] == destinationBytes[position]) {
+        position++;
+    }
+    *first = position;
+
+    position = length;
+    while (position >= *first + sizeof(unsigned long long) &&
+        memcmp(sourceBytes + position - sizeof(unsigned long long), destinationBytes + position - sizeof(unsigned long long), sizeof(unsigned long long)) == 0) {
+        position -= sizeof(unsigned long long);
+    }
+    while (sourceBytes[position - 1] == destinationBytes[position - 1]) {
+        position--;
+    }
+    *last = position - 1;
+    return FALSE;
+}
+
+/// <summary>
+/// Record a range which differs. A range in the block after the last one which differed is merged into
+/// it, so that a run of bad blocks is reported once.
+/// </summary>
+/// <param name="result">The result for the file</param>
+/// <param name="offset">The first byte which differs</param>
+/// <param name="end">One past the last byte which differs</param>
+/// <param name="adjoinsPrevious">The previous block compared also differed and is the block before this one</param>
+static void RecordMismatch(t_verifyResult* result, unsigned long long offset, unsigned long long end, BOOL adjoinsPrevious)
+{
+    if (adjoinsPrevious && result->mismatchCount > 0) {
+        if (result->mismatchCount <= VERIFY_MAX_RANGES) {
+            t_fileRange& previous = result->mismatches.back();
+            previous.length = end - previous.offset;
+        }
+        return;
+    }
+
+    result->mismatchCount++;
+    if (result->mismatches.size() < VERIFY_MAX_RANGES) {
+        result->mismatches.push_back(t_fileRange{ offset, end - offset });
+    }
+}
+
+/// <summary>
+/// Choose which blocks of a file a sampling verify compares -- the first and the last, where headers and
+/// a truncated tail show up, and one at a random place in each of the equal stretches between them, so
+/// that successive runs look at different parts of the file.
+/// </summary>
+/// <param name="blockCount">The number of blocks in the file</param>
+/// <param name="sampleBlocks">How many blocks to compare, at least 2</param>
+/// <param name="blocks">Receives the block indexes in ascending order</param>
+static void ChooseSampleBlocks(unsigned long long blockCount, unsigned int sampleBlocks, std::vector<unsigned long long>& blocks)
+{
+    unsigned long long interior = blockCount - 2;
+    unsigned int stretches = sampleBlocks - 2;
+    unsigned long long random = (unsigned long long)std::chrono::steady_clock::now().time_since_epoch().count() ^ (blockCount * 0x9E3779B97F4A7C15ULL);
+
+    blocks.clear();
+    blocks.push_back(0);
+    for (unsigned int stretch = 0; stretch < stretches; stretch++) {
+        unsigned long long low = 1 + stretch * interior / stretches;
+        unsigned long long high = 1 + (stretch + 1) * interior / stretches;
+
+        // xorshift64 -- only needs to spread the samples, not to be unpredictable
+        random ^= random << 13;
+        random ^= random >> 7;
+        random ^= random << 17;
+        blocks.push_back(low + random % (high - low));
+    }
+    blocks.push_back(blockCount - 1);
+}
+
+/// <summary>
+/// Read a destination file back alongside its source and compare them, recording the ranges which differ.
+/// A difference in size is recorded as a range covering the part only the longer file has.
+/// </summary>
+/// <param name="sourcePathFile">The source path, with the snapshot device object already substituted in</param>
+/// <param name="destinationPathFile">The destination path</param>
+/// <param name="options">Queue depth, buffering, sampling and throttle</param>
+/// <param name="bufferPool">Where the buffers come from. Each holds a block of both files, so the block size is half the buffer size.</param>
+/// <param name="result">Receives what was compared and the ranges which differ</param>
+/// <returns>0 if the files could be compared, whether or not they match, or the platform error code if they could not be read</returns>
+DWORD VerifyFile(const std::wstring& sourcePathFile, const std::wstring& destinationPathFile, const t_verifyOptions& options, BufferPool& bufferPool, t_verifyResult* result)
+{
+    t_fileHandle source = INVALID_FILE_HANDLE;
+    t_fileHandle destination = INVALID_FILE_HANDLE;
+    t_fileInformation sourceInformation{};
+    t_fileInformation destinationInformation{};
+    DWORD blockSize = bufferPool.BufferSize() / 2;
+    std::vector<unsigned long long> sampled;
+    DWORD error = ERROR_SUCCESS;
+
+    *result = t_verifyResult{};
+
+    error = PlatformOpenForRead(sourcePathFile, options.unbuffered, &source);
+    if (!error) {
+        error = PlatformOpenForRead(destinationPathFile, options.unbuffered, &destination);
+    }
+    if (!error) {
+        error = PlatformGetFileInformation(source, &sourceInformation);
+    }
+    if (!error) {
+        error = PlatformGetFileInformation(destination, &destinationInformation);
+    }
+    if (error) {
+        PlatformCloseFile(destination);
+        PlatformCloseFile(source);
+        return error;
+    }
+
+    result->sourceSize = sourceInformation.size;
+    result->destinationSize = destinationInformation.size;
+    unsigned long long compareSize = (sourceInformation.size < destinationInformation.size) ? sourceInformation.size : destinationInformation.size;
+    unsigned long long blockCount = (compareSize + blockSize - 1) / blockSize;
+
+    BOOL sampling = options.sampleBlocks > 0 && blockCount > options.sampleBlocks && blockCount > 2;
+    if (sampling) {
+        ChooseSampleBlocks(blockCount, (options.sampleBlocks < 2) ? 2 : options.sampleBlocks, sampled);
+    }
+    unsigned long long count = sampling ? sampled.size() : blockCount;
+
+    {
+        PlatformAsyncReader sourceReader(source, options.queueDepth);
+        PlatformAsyncReader destinationReader(destination, options.queueDepth);
+        unsigned long long issued = 0;
+        unsigned long long completed = 0;
+        unsigned long long previousMismatch = ~0ULL;
+        t_asyncRead sourceRead{};
+        t_asyncRead destinationRead{};
+
+        while (completed < count && !error) {
+            // keep both read queues full, waiting for a buffer only when nothing is in flight, as CopyBlocks does
+            while (issued < count && sourceReader.InFlight() < options.queueDepth) {
+                void* buffer = (sourceReader.InFlight() == 0) ? bufferPool.Acquire() : bufferPool.TryAcquire();
+                if (buffer == nullptr) {
+                    break;
+                }
+
+                unsigned long long offset = (sampling ? sampled[issued] : issued) * blockSize;
+                DWORD length = (DWORD)((compareSize - offset < blockSize) ? compareSize - offset : blockSize);
+                if (options.unbuffered) {
+                    length = AlignUp(length);
+                }
+                if (options.throttle != nullptr) {
+                    options.throttle->Read(length);
+                    options.throttle->Read(length);
+                }
+                sourceReader.Issue(offset, buffer, length);
+                destinationReader.Issue(offset, (char*)buffer + blockSize, length);
+                issued++;
+            }
+
+            sourceReader.Complete(&sourceRead);
+            destinationReader.Complete(&destinationRead);
+
+            unsigned long long block = sampling ? sampled[completed] : completed;
+            unsigned long long offset = block * blockSize;
+            DWORD expected = (DWORD)((compareSize - offset < blockSize) ? compareSize - offset : blockSize);
+
+            error = sourceRead.error ? sourceRead.error : destinationRead.error;
+            if (!error && (sourceRead.bytesRead < expected || destinationRead.bytesRead < expected)) {
+                error = ERROR_HANDLE_EOF; // a file is shorter than it was when we opened it
+            }
+
+            size_t first = 0;
+            size_t last = 0;
+            if (!error && !VerifyCompareBlock(sourceRead.buffer, destinationRead.buffer, expected, &first, &last)) {
+                RecordMismatch(result, offset + first, offset + last + 1, previousMismatch != ~0ULL && previousMismatch + 1 == block);
+                previousMismatch = block;
+            }
+            if (!error) {
+                result->bytesCompared += expected;
+            }
+
+            bufferPool.Release(sourceRead.buffer);
+            completed++;
+        }
+
+        // after a failure, wait for the reads still in flight and give their buffers back
+        while (sourceReader.InFlight() > 0) {
+            sourceReader.Complete(&sourceRead);
+            destinationReader.Complete(&destinationRead);
+            bufferPool.Release(sourceRead.buffer);
+        }
+    }
+
+    PlatformCloseFile(destination);
+    PlatformCloseFile(source);
+
+    if (!error && sourceInformation.size != destinationInformation.size) {
+        unsigned long long longer = (sourceInformation.size > destinationInformation.size) ? sourceInformation.size : destinationInformation.size;
+        RecordMismatch(result, compareSize, longer, FALSE);
+    }
+    return error;
+}
@@ -0,0 +1,44 @@
+/* ShadowDuplicator -- a simple VC++ Volume Shadow Copy requestor for backing up
+locked files
+
+Copyright (C) 2021-2023 Peter Upfold.
+
+Licensed under the Apache 2.0 Licence. See the LICENSE file in the project root for details.
+
+This code is **not** production quality. There is certainly plenty of potential for improvement of this code,
+but beyond that, it may even be insecure, destructive or cause you other serious problems. There
+is no warranty.
+*/
+#pragma once
+#include "Platform.h"
+#include "BlockCopy.h"
+#include "Throttle.h"
+#include <string>
+#include <vector>
+
+// how many blocks of each file a sampling verify compares, unless told otherwise
+#define DEFAULT_VERIFY_SAMPLE_BLOCKS 16
+
+// the mismatching ranges kept for each file -- any more are only counted
+#define VERIFY_MAX_RANGES 16
+
+// How a file is verified. With sampleBlocks set, only that many blocks spread across the file are
+// compared, always including the first and the last; otherwise every block is.
+typedef struct verifyOptions {
+    unsigned int queueDepth;
+    BOOL unbuffered;
+    unsigned int sampleBlocks;
+    IoThrottle* throttle;
+} t_verifyOptions;
+
+// What verifying one file found. The file matches if mismatchCount is zero.
+typedef struct verifyResult {
+    unsigned long long sourceSize;
+    unsigned long long destinationSize;
+    unsigned long long bytesCompared;
+    unsigned long long mismatchCount;
+    std::vector<t_fileRange> mismatches; // the first VERIFY_MAX_RANGES, in file order
+} t_verifyResult;
+
+BOOL VerifyCompareBlock(const void* source, const void* destination, size_t length, size_t* first, size_t* last);
+DWORD VerifyFile(const std::wstring& sourcePathFile, const std::wstring& destinationPathFile, const t_verifyOptions& options, BufferPool& bufferPool, t_verifyResult* result);